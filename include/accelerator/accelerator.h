@@ -30,6 +30,9 @@ class Rgb;
 class Bound;
 class ParamMap;
 class Ray;
+class RayPacket;
+class Material;
+class TriangleObjectInstance;
 
 template<class T> class Accelerator
 {
@@ -38,7 +41,23 @@ template<class T> class Accelerator
 		virtual ~Accelerator() { };
 		virtual bool intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const = 0;
 		virtual bool intersectS(const Ray &ray, float dist, T **tr, float shadow_bias) const = 0;
-		virtual bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias) const = 0;
+		bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias) const { int depth = 0; return intersectTs(render_data, ray, max_depth, dist, tr, filt, shadow_bias, depth, nullptr); }
+		/*! Transparent shadows continuing from "depth" transparent hits already found, so several
+			accelerators crossed by the same ray share the "max_depth" budget. "instance" is the object
+			instance whose base object is traversed with the ray in object space, if any */
+		virtual bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const = 0;
+		/*! Closest hit of each ray of the packet, tr[i] is nullptr when ray "i" hits nothing.
+			The default implementation intersects the rays one by one */
+		virtual void intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const;
+		/*! Any hit of each ray of the packet, for shadow rays.
+			The default implementation intersects the rays one by one */
+		virtual void intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const;
+		/*! Any hit test against a single primitive, with the same criteria as intersectS().
+			Used to test first the primitive that occluded the previous shadow ray of a light */
+		static bool primitiveOccludes(const T &primitive, const Ray &ray, float dist);
+		/*! Transparency of a primitive hit at "t_hit" by a transparent shadow ray. The hits in the base
+			object of an instance are evaluated on the instance in world space, as if it was flattened */
+		static Rgb primitiveTransparency(RenderData &render_data, const T &primitive, const Material &material, const Ray &ray, float t_hit, IntersectData &data, const TriangleObjectInstance *instance);
 		virtual Bound getBound() const = 0;
 };
 
@@ -0,0 +1,113 @@
+#pragma once
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef YAFARAY_ACCELERATOR_BVH_H
+#define YAFARAY_ACCELERATOR_BVH_H
+
+#include "accelerator/accelerator.h"
+#include "geometry/bound.h"
+#include "geometry/ray_packet.h"
+#include <vector>
+#include <array>
+
+BEGIN_YAFARAY
+
+/*! BVH nodes, stored in depth-first order so the first child of an
+	interior node is always the next node in the array. 32 bytes. */
+class BvhNode
+{
+	public:
+		void createLeaf(const Bound &bound, uint32_t first_primitive, uint32_t n_primitives) { bound_ = bound; offset_ = first_primitive; flags_ = n_primitives << 2; }
+		void createInterior(const Bound &bound, int axis) { bound_ = bound; flags_ = axis; }
+		int 	splitAxis() const { return flags_ & 3; }
+		uint32_t	nPrimitives() const { return flags_ >> 2; }
+		bool 	isLeaf() const { return nPrimitives() > 0; }
+		uint32_t	getFirstPrimitive() const { return offset_; }
+		uint32_t	getRightChild() const { return offset_; }
+		void 	setRightChild(uint32_t i) { offset_ = i; }
+
+		Bound bound_;
+	private:
+		uint32_t offset_;	//!< leaf: index of the first primitive; interior: index of the second child
+		uint32_t flags_;	//!< 2bits: split axis; 30bits: nprims (leaf) or 0 (interior)
+};
+
+struct BvhStats
+{
+	int inodes_ = 0;
+	int leaves_ = 0;
+	int depth_limit_reached_ = 0;
+	int median_splits_ = 0;
+};
+
+// ============================================================
+/*! Bounding volume hierarchy built with the binned Surface Area
+	Heuristic. Unlike the kd-tree, each primitive is referenced
+	exactly once, so there is no triangle clipping during the build
+	and no need to deduplicate hits during the traversal.
+*/
+template<class T> class AcceleratorBvh final : public Accelerator<T>
+{
+	public:
+		static Accelerator<T> *factory(const T **primitives_list, ParamMap &params);
+
+	private:
+		struct BuildPrimitive
+		{
+			Bound bound_;
+			Point3 centroid_;
+			uint32_t index_;
+		};
+		struct BuildBin
+		{
+			Bound bound_;
+			uint32_t n_primitives_ = 0;
+		};
+
+		AcceleratorBvh(const T **primitives, uint32_t n_primitives, int max_leaf_size = 4, float traversal_cost = 0.5f, int num_bins = 16);
+		virtual bool intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const override;
+		virtual bool intersectS(const Ray &ray, float dist, T **tr, float shadow_bias) const override;
+		virtual bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const override;
+		virtual void intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const override;
+		virtual void intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const override;
+		virtual Bound getBound() const override { return tree_bound_; }
+
+		uint32_t buildTree(const T **primitives, std::vector<BuildPrimitive> &build_primitives, uint32_t start, uint32_t end, int depth);
+		bool findBestSplit(const std::vector<BuildPrimitive> &build_primitives, uint32_t start, uint32_t end, const Bound &node_bound, const Bound &centroid_bound, int &best_axis, int &best_bin) const;
+		int binIndex(const Point3 &centroid, const Bound &centroid_bound, int axis) const;
+		static float surfaceArea(const Bound &bound);
+		static Vec3 inverseDirection(const Vec3 &dir);
+		static bool crossBound(const Bound &bound, const Ray &ray, const Vec3 &inv_dir, const std::array<int, 3> &dir_is_neg, float dist);
+		static bool crossBound(const Bound &bound, const RayPacket &packet, const float *dist, const bool *active, bool *crossed);
+		uint32_t packetTraverseInterior(const RayPacket &packet, uint32_t node_index, uint32_t *stack, int &stack_size) const;
+
+		int max_leaf_size_;
+		float traversal_cost_; //!< node traversal cost divided by primitive intersection cost
+		int num_bins_;
+		Bound tree_bound_;
+		std::vector<BvhNode> nodes_;
+		std::vector<T *> primitives_; //!< primitives reordered so that each leaf references a contiguous range
+		BvhStats stats_;
+
+		static constexpr int max_num_bins_ = 64;
+		static constexpr int bvh_max_stack_ = 64;
+};
+
+END_YAFARAY
+#endif    //YAFARAY_ACCELERATOR_BVH_H
@@ -0,0 +1,77 @@
+#pragma once
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef YAFARAY_ACCELERATOR_INSTANCES_H
+#define YAFARAY_ACCELERATOR_INSTANCES_H
+
+#include "accelerator/accelerator_bvh.h"
+#include "geometry/matrix4.h"
+#include <vector>
+
+BEGIN_YAFARAY
+
+class Triangle;
+class TriangleObjectInstance;
+
+/*! An object instance as seen by the two-level acceleration structure */
+struct AcceleratorInstance
+{
+	const TriangleObjectInstance *object_; //!< the instance itself
+	const Accelerator<Triangle> *base_accelerator_; //!< accelerator of the base object, in object space. Not owned, it is shared by all the instances of the base object
+	Matrix4 world_to_obj_; //!< transformation of the rays into the object space of the base object
+	Bound bound_; //!< world space bound of the instance
+};
+
+// ============================================================
+/*! Two-level acceleration structure for object instances. The top
+	level is a BVH over the world space bounds of the instances. The
+	bottom level is the accelerator of each base object, built only
+	once in object space and shared by all its instances, so memory and
+	build time scale with the unique geometry instead of the number of
+	instances. The rays are transformed into object space when entering
+	an instance, without normalizing their direction, so the hit
+	distances remain valid in world space.
+*/
+class AcceleratorInstances final
+{
+	public:
+		AcceleratorInstances(std::vector<AcceleratorInstance> instances, int max_leaf_size = 2);
+		//! Closest hit. "tr" is the triangle of the base object hit, and "instance" the instance it was hit in
+		bool intersect(const Ray &ray, float dist, Triangle **tr, const TriangleObjectInstance **instance, float &z, IntersectData &data) const;
+		bool intersectS(const Ray &ray, float dist, Triangle **tr, const TriangleObjectInstance **instance, float shadow_bias) const;
+		bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, Triangle **tr, const TriangleObjectInstance **instance, Rgb &filt, float shadow_bias, int &depth) const;
+		Bound getBound() const { return tree_bound_; }
+		size_t size() const { return instances_.size(); }
+
+	private:
+		uint32_t buildTree(uint32_t start, uint32_t end, int depth);
+		static Ray toObjectSpace(const Ray &ray, const AcceleratorInstance &instance);
+
+		int max_leaf_size_;
+		Bound tree_bound_;
+		std::vector<BvhNode> nodes_;
+		std::vector<AcceleratorInstance> instances_; //!< instances reordered so that each leaf references a contiguous range
+		BvhStats stats_;
+
+		static constexpr int max_depth_ = 60;
+		static constexpr int max_stack_ = 64;
+};
+
+END_YAFARAY
+#endif    //YAFARAY_ACCELERATOR_INSTANCES_H
@@ -24,11 +24,18 @@
 #include "common/memory_arena.h"
 #include "geometry/bound.h"
 #include "geometry/object_geom.h"
+#include "geometry/ray_packet.h"
+#include "geometry/triangle_block.h"
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
 
 BEGIN_YAFARAY
 
 class RenderData;
 class IntersectData;
+class Primitive;
 
 // ============================================================
 /*! kd-tree nodes, kept as small as possible
@@ -60,6 +67,7 @@ template<class T> class KdTreeNode
 		bool 	isLeaf() const { return (flags_ & 3) == 3; }
 		uint32_t	getRightChild() const { return (flags_ >> 2); }
 		void 	setRightChild(uint32_t i) { flags_ = (flags_ & 3) | (i << 2); }
+		const TriangleBlock *triangleBlocks() const; //!< leaf with several triangles: their precomputed triangle blocks
 
 		union
 		{
@@ -79,6 +87,14 @@ template<class T> struct KdStack
 	int	 prev_; 		//!< the pointer to the previous stack item
 };
 
+/*! Stack elements for the traversal of ray packets, with the entry/exit distances of every ray of the packet */
+template<class T> struct KdPacketStack
+{
+	const KdTreeNode<T> *node_; //!< pointer to far child
+	alignas(32) float t_near_[RayPacket::max_size_];
+	alignas(32) float t_far_[RayPacket::max_size_];
+};
+
 /*! Serves to store the lower and upper bound edges of the primitives
 	for the cost funtion */
 
@@ -120,6 +136,26 @@ class TreeBin
 		float 	t_;
 };
 
+/*! Nodes, leaf primitive memory, clipping working memory and statistics
+	of a (sub)tree under construction. The first levels of the kd-tree are
+	built in parallel, each thread building its subtree into its own
+	build data, which is then merged into the parent one. */
+template<class T> struct KdTreeBuildData
+{
+	KdTreeBuildData(int max_depth, int tri_clip_thresh, int clip_data_size);
+	~KdTreeBuildData();
+	void merge(KdTreeBuildData &child);
+	KdTreeNode<T> *nodes_;
+	uint32_t next_free_node_ = 0;
+	uint32_t allocated_nodes_count_ = 256;
+	std::vector<std::unique_ptr<MemoryArena>> prims_arenas_; //!< all the arenas holding the leaf primitive lists of this (sub)tree
+	Bound *clip_bounds_; //!< bounds of the clipped primitives of the current node
+	int *clip_; //!< indicate clip plane(s) for current level
+	char *cdata_; //!< clipping data...
+	BoundEdge *edges_[3];
+	KdStats kd_stats_;
+};
+
 // ============================================================
 /*! This class holds a complete kd-tree with building and
 	traversal funtions
@@ -131,21 +167,30 @@ template<class T> class AcceleratorKdTree : public Accelerator<T>
 
 	private:
 		AcceleratorKdTree(const T **v, int np, int depth = -1, int leaf_size = 2,
-						  float cost_ratio = 0.35, float empty_bonus = 0.33);
+						  float cost_ratio = 0.35, float empty_bonus = 0.33, int num_threads = 1, const std::string &cache_dir = "", int cache_max_size = 1024);
 		virtual ~AcceleratorKdTree() override;
 		virtual bool intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const override;
+		virtual void intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const override;
 		//	bool IntersectDBG(const ray_t &ray, float dist, triangle_t **tr, float &Z) const;
 		virtual bool intersectS(const Ray &ray, float dist, T **tr, float shadow_bias) const override;
-		virtual bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias) const override;
+		virtual void intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const override;
+		bool packetInitialInterval(const RayPacket &packet, float *t_near, float *t_far) const;
+		const KdTreeNode<T> *packetTraverseInterior(const RayPacket &packet, const KdTreeNode<T> *node, float *t_near, float *t_far, KdPacketStack<T> *stack, int &stack_size) const;
+		static const KdTreeNode<T> *packetPop(float *t_near, float *t_far, const float *t_max, const KdPacketStack<T> *stack, int &stack_size);
+		virtual bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const override;
 		//	bool IntersectO(const point3d_t &from, const vector3d_t &ray, float dist, T **tr, float &Z) const;
 		Bound getBound() const override { return tree_bound_; }
 
-		void pigeonMinCost(uint32_t n_prims, Bound &node_bound, uint32_t *prim_idx, SplitCost &split);
+		void pigeonMinCost(uint32_t n_prims, Bound &node_bound, uint32_t *prim_idx, float e_bonus, SplitCost &split) const;
 		void minimalCost(uint32_t n_prims, Bound &node_bound, uint32_t *prim_idx,
-						 const Bound *all_bounds, BoundEdge *edges[3], SplitCost &split);
+						 const Bound *all_bounds, BoundEdge *edges[3], float e_bonus, SplitCost &split, KdStats &kd_stats) const;
 		int buildTree(uint32_t n_prims, Bound &node_bound, uint32_t *prim_nums,
-					  uint32_t *left_prims, uint32_t *right_prims, BoundEdge *edges[3],
-					  uint32_t right_mem_size, int depth, int bad_refines);
+					  uint32_t *left_prims, uint32_t *right_prims,
+					  uint32_t right_mem_size, int depth, int bad_refines, KdTreeBuildData<T> &build_data);
+		void buildChildTreeWorker(uint32_t n_prims, Bound &node_bound, uint32_t *prim_nums, int depth, int bad_refines, KdTreeBuildData<T> &build_data);
+		uint64_t cacheHash(const T **v) const;
+		bool loadCache(const std::string &path, const T **v, uint64_t hash);
+		bool saveCache(const std::string &path, const T **v, uint64_t hash) const;
 
 		float 		cost_ratio_; 	//!< node traversal cost divided by primitive intersection cost
 		float 		e_bonus_; 	//!< empty bonus
@@ -153,14 +198,13 @@ template<class T> class AcceleratorKdTree : public Accelerator<T>
 		int 		max_depth_;
 		unsigned int max_leaf_size_;
 		Bound 	tree_bound_; 	//!< overall space the tree encloses
-		MemoryArena prims_arena_;
+		std::vector<std::unique_ptr<MemoryArena>> prims_arenas_;
 		KdTreeNode<T> 	*nodes_;
+		int max_level_threads_ = 0; //!< max level where we will launch threads to build the subtrees in parallel
 
 		// those are temporary actually, to keep argument counts bearable
 		const T **prims_;
 		Bound *all_bounds_;
-		int *clip_; // indicate clip plane(s) for current level
-		char *cdata_; // clipping data...
 
 		// some statistics:
 		KdStats kd_stats_;
@@ -169,12 +213,40 @@ template<class T> class AcceleratorKdTree : public Accelerator<T>
 		static constexpr int clip_data_size_ = 3 * 12 * sizeof(double);
 		static constexpr int kd_bins_ = 1024;
 		static constexpr int kd_max_stack_ = 64;
+		static constexpr uint32_t kd_min_prims_thread_ = 4096; //!< minimum amount of primitives in a node to build its subtrees in parallel
 		static constexpr int lower_b_ = 0;
 		static constexpr int upper_b_ = 2;
 		static constexpr int both_b_ = 1;
 };
 
 
+/*! Leaves with several plain triangles store the precomputed triangle blocks
+	of their triangles right after the list of primitives. Other kinds of
+	primitives do not use them. */
+inline int kdLeafTriangleBlocks__(const Triangle *, int np) { return TriangleBlock::blocksCount(np); }
+inline int kdLeafTriangleBlocks__(const Primitive *, int) { return 0; }
+
+inline void kdFillTriangleBlocks__(TriangleBlock *blocks, Triangle *const *triangles, int np)
+{
+	for(int i = 0; i < np; ++i)
+	{
+		if(i % TriangleBlock::size_ == 0) blocks[i / TriangleBlock::size_].clear();
+		blocks[i / TriangleBlock::size_].set(i % TriangleBlock::size_, *triangles[i]);
+	}
+}
+inline void kdFillTriangleBlocks__(TriangleBlock *, Primitive *const *, int) { }
+
+inline TriangleBlock *kdAlignTriangleBlocks__(void *list_end)
+{
+	return reinterpret_cast<TriangleBlock *>((reinterpret_cast<uintptr_t>(list_end) + alignof(TriangleBlock) - 1) & ~(uintptr_t)(alignof(TriangleBlock) - 1));
+}
+
+template<class T>
+inline const TriangleBlock *KdTreeNode<T>::triangleBlocks() const
+{
+	return kdAlignTriangleBlocks__(primitives_ + nPrimitives());
+}
+
 template<class T>
 inline void KdTreeNode<T>::createLeaf(uint32_t *prim_idx, int np, const T **prims, MemoryArena &arena, KdStats &kd_stats) {
 	primitives_ = nullptr;
@@ -182,8 +254,12 @@ inline void KdTreeNode<T>::createLeaf(uint32_t *prim_idx, int np, const T **prim
 	flags_ |= 3;
 	if(np > 1)
 	{
-		primitives_ = (T **) arena.alloc(np * sizeof(T *));
+		const int n_blocks = kdLeafTriangleBlocks__(prims[prim_idx[0]], np);
+		uint32_t size = np * sizeof(T *);
+		if(n_blocks > 0) size += n_blocks * sizeof(TriangleBlock) + alignof(TriangleBlock);
+		primitives_ = (T **) arena.alloc(size);
 		for(int i = 0; i < np; i++) primitives_[i] = (T *)prims[prim_idx[i]];
+		if(n_blocks > 0) kdFillTriangleBlocks__(kdAlignTriangleBlocks__(primitives_ + np), primitives_, np);
 		kd_stats.kd_prims_ += np; //stat
 	}
 	else if(np == 1)
@@ -203,5 +279,61 @@ inline void KdTreeNode<T>::createInterior(int axis, float d, KdStats &kd_stats)
 	kd_stats.kd_inodes_++;
 }
 
+template<class T>
+inline KdTreeBuildData<T>::KdTreeBuildData(int max_depth, int tri_clip_thresh, int clip_data_size)
+{
+	nodes_ = (KdTreeNode<T> *) malloc(allocated_nodes_count_ * sizeof(KdTreeNode<T>));
+	prims_arenas_.emplace_back(new MemoryArena());
+	clip_bounds_ = new Bound[tri_clip_thresh + 1];
+	clip_ = new int[max_depth + 2];
+	for(int i = 0; i < max_depth + 2; i++) clip_[i] = -1;
+	cdata_ = (char *) malloc((max_depth + 2) * tri_clip_thresh * clip_data_size);
+	for(int i = 0; i < 3; ++i) edges_[i] = new BoundEdge[514/*2*totalPrims*/];
+}
+
+template<class T>
+inline KdTreeBuildData<T>::~KdTreeBuildData()
+{
+	free(nodes_);
+	delete[] clip_bounds_;
+	delete[] clip_;
+	free(cdata_);
+	for(int i = 0; i < 3; ++i) delete[] edges_[i];
+}
+
+/*! Appends the nodes of a subtree built separately, fixing the right child indices of its interior nodes */
+template<class T>
+inline void KdTreeBuildData<T>::merge(KdTreeBuildData &child)
+{
+	const uint32_t needed_nodes_count = next_free_node_ + child.next_free_node_;
+	if(needed_nodes_count > allocated_nodes_count_)
+	{
+		KdTreeNode<T> *n = (KdTreeNode<T> *) malloc(needed_nodes_count * sizeof(KdTreeNode<T>));
+		memcpy(n, nodes_, next_free_node_ * sizeof(KdTreeNode<T>));
+		free(nodes_);
+		nodes_ = n;
+		allocated_nodes_count_ = needed_nodes_count;
+	}
+	for(uint32_t i = 0; i < child.next_free_node_; ++i)
+	{
+		KdTreeNode<T> &node = nodes_[next_free_node_ + i];
+		node = child.nodes_[i];
+		if(!node.isLeaf()) node.setRightChild(node.getRightChild() + next_free_node_);
+	}
+	next_free_node_ = needed_nodes_count;
+	for(auto &arena : child.prims_arenas_) prims_arenas_.push_back(std::move(arena));
+	child.prims_arenas_.clear();
+	kd_stats_.kd_inodes_ += child.kd_stats_.kd_inodes_;
+	kd_stats_.kd_leaves_ += child.kd_stats_.kd_leaves_;
+	kd_stats_.empty_kd_leaves_ += child.kd_stats_.empty_kd_leaves_;
+	kd_stats_.kd_prims_ += child.kd_stats_.kd_prims_;
+	kd_stats_.clip_ += child.kd_stats_.clip_;
+	kd_stats_.bad_clip_ += child.kd_stats_.bad_clip_;
+	kd_stats_.null_clip_ += child.kd_stats_.null_clip_;
+	kd_stats_.early_out_ += child.kd_stats_.early_out_;
+	kd_stats_.depth_limit_reached_ += child.kd_stats_.depth_limit_reached_;
+	kd_stats_.num_bad_splits_ += child.kd_stats_.num_bad_splits_;
+}
+
 END_YAFARAY
 #endif    //YAFARAY_ACCELERATOR_KDTREE_H
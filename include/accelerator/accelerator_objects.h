@@ -0,0 +1,82 @@
+#pragma once
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef YAFARAY_ACCELERATOR_OBJECTS_H
+#define YAFARAY_ACCELERATOR_OBJECTS_H
+
+#include "accelerator/accelerator_bvh.h"
+#include <vector>
+
+BEGIN_YAFARAY
+
+// ============================================================
+/*! Top level of the scene acceleration structure: a BVH over the
+	world space bounds of the objects, with an accelerator for each
+	of its leaves. Objects overlapping so much that the top level
+	cannot separate them are grouped in the same leaf, so rays don't
+	have to enter many accelerators in the same place. The leaf
+	accelerators are built separately, for the primitives of all the
+	objects of each group, and are not owned, so when an object
+	changes only the accelerator of its group and this top level,
+	which is cheap to build, have to be updated.
+*/
+template<class T> class AcceleratorObjects final : public Accelerator<T>
+{
+	public:
+		explicit AcceleratorObjects(const std::vector<Bound> &object_bounds);
+		//! Objects of each group, as indices of the bounds given to the constructor
+		const std::vector<std::vector<uint32_t>> &getGroups() const { return groups_; }
+		//! Accelerator of the primitives of all the objects of a group. It must be set for all the groups before intersecting
+		void setGroupAccelerator(size_t group, const Accelerator<T> *accelerator) { accelerators_[group] = accelerator; }
+
+	private:
+		struct BuildObject
+		{
+			Bound bound_;
+			uint32_t index_;
+		};
+
+		virtual bool intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const override;
+		virtual bool intersectS(const Ray &ray, float dist, T **tr, float shadow_bias) const override;
+		virtual bool intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const override;
+		virtual void intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const override;
+		virtual void intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const override;
+		virtual Bound getBound() const override { return tree_bound_; }
+
+		uint32_t buildTree(std::vector<BuildObject> &build_objects, uint32_t start, uint32_t end, int depth);
+		bool findBestSplit(const std::vector<BuildObject> &build_objects, uint32_t start, uint32_t end, const Bound &node_bound, const Bound &centroid_bound, int &best_axis, int &best_bin) const;
+		static int binIndex(const Point3 &centroid, const Bound &centroid_bound, int axis);
+		static float surfaceArea(const Bound &bound);
+		static bool crossBound(const Bound &bound, const Ray &ray, const Vec3 &inv_dir, float dist);
+		static bool crossBound(const Bound &bound, const RayPacket &packet, const float *dist, const bool *active, bool *crossed);
+
+		Bound tree_bound_;
+		std::vector<BvhNode> nodes_; //!< the first "primitive" of each leaf is the index of its group
+		std::vector<std::vector<uint32_t>> groups_;
+		std::vector<const Accelerator<T> *> accelerators_; //!< accelerator of each group
+		BvhStats stats_;
+
+		static constexpr int max_depth_ = 60;
+		static constexpr int max_stack_ = 64;
+		static constexpr int num_bins_ = 16;
+		static constexpr float max_split_entries_ = 0.8f; //!< objects are split only if rays would then enter less than this fraction of them
+};
+
+END_YAFARAY
+#endif    //YAFARAY_ACCELERATOR_OBJECTS_H
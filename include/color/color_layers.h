@@ -23,6 +23,9 @@
 
 #include "common/layers.h"
 #include "color/color.h"
+#include <array>
+#include <initializer_list>
+#include <vector>
 
 BEGIN_YAFARAY
 
@@ -34,18 +37,71 @@ struct ColorLayer final
 	Layer::Type layer_type_;
 };
 
-class ColorLayers final : public Collection<Layer::Type, ColorLayer>  //Actual buffer of colors in the rendering process, one entry for each enabled layer.
+/*! Actual buffer of colors in the rendering process, one entry for each enabled layer.
+	The entries are stored contiguously in the order of the layer types, and the slot of
+	each layer type is precomputed, so accessing a layer does not need any search */
+class ColorLayers final
 {
 	public:
 		ColorLayers(const Layers &layers);
 		void setDefaultColors();
-		bool isDefinedAny(const std::vector<Layer::Type> &types) const;
+		bool isDefinedAny(std::initializer_list<Layer::Type> types) const;
 		MaskParams getMaskParams() const { return mask_params_; }
+		size_t size() const { return items_.size(); }
+		std::vector<ColorLayer>::iterator begin() { return items_.begin(); }
+		std::vector<ColorLayer>::iterator end() { return items_.end(); }
+		std::vector<ColorLayer>::const_iterator begin() const { return items_.begin(); }
+		std::vector<ColorLayer>::const_iterator end() const { return items_.end(); }
+		//! Index of the layer type in the buffer, -1 if the layer is not enabled
+		int getSlot(const Layer::Type &type) const { return (type >= 0 && type < Layer::Size) ? slots_[type] : -1; }
+		//! Layer that must be enabled, exits with an error otherwise. Use find() for the layers that may be disabled
+		ColorLayer &operator()(const Layer::Type &type) { return items_[checkedSlot(type)]; }
+		const ColorLayer &operator()(const Layer::Type &type) const { return items_[checkedSlot(type)]; }
+		ColorLayer *find(const Layer::Type &type) { const int slot = getSlot(type); return slot >= 0 ? &items_[slot] : nullptr; }
+		const ColorLayer *find(const Layer::Type &type) const { const int slot = getSlot(type); return slot >= 0 ? &items_[slot] : nullptr; }
 
 	private:
+		int checkedSlot(const Layer::Type &type) const { const int slot = getSlot(type); if(slot < 0) disabledLayerError(type); return slot; }
+		[[noreturn]] static void disabledLayerError(const Layer::Type &type);
+		std::vector<ColorLayer> items_;
+		std::vector<Rgba> default_colors_;
+		std::array<int, Layer::Size> slots_;
 		const MaskParams &mask_params_;
 };
 
+/*! Colors of a rectangular area of the image for each enabled layer. The colors of each
+	layer are stored contiguously row by row, so they can be processed and handed to the
+	outputs in row spans instead of pixel by pixel. The layers without an image keep
+	their default color */
+class ColorLayersArea final
+{
+	public:
+		ColorLayersArea(const Layers &layers);
+		//! Resizes the buffers for a new area and sets all the colors to the layers default colors
+		void setArea(int x_0, int y_0, int width, int height);
+		int getX0() const { return x_0_; }
+		int getY0() const { return y_0_; }
+		int getWidth() const { return width_; }
+		int getHeight() const { return height_; }
+		size_t size() const { return layer_types_.size(); }
+		Layer::Type getLayerType(size_t index) const { return layer_types_[index]; }
+		//! Index of the layer type in the buffer, -1 if the layer is not enabled
+		int getSlot(const Layer::Type &type) const { return (type >= 0 && type < Layer::Size) ? slots_[type] : -1; }
+		//! Colors of the row "y" of the area, in image coordinates
+		Rgba *getRow(size_t index, int y) { return colors_[index].data() + (y - y_0_) * width_; }
+		const Rgba *getRow(size_t index, int y) const { return colors_[index].data() + (y - y_0_) * width_; }
+
+	private:
+		std::vector<Layer::Type> layer_types_;
+		std::vector<Rgba> default_colors_;
+		std::vector<std::vector<Rgba>> colors_;
+		std::array<int, Layer::Size> slots_;
+		int x_0_ = 0;
+		int y_0_ = 0;
+		int width_ = 0;
+		int height_ = 0;
+};
+
 END_YAFARAY
 
 #endif //YAFARAY_COLOR_LAYERS_H
@@ -23,6 +23,7 @@
 struct AaNoiseParams
 {
 	enum class DarkDetectionType : int { None, Linear, Curve };
+	enum class ResampleMode : int { ColorDifference, Convergence };
 
 	int samples_ = 1;
 	int passes_ = 1;
@@ -39,6 +40,8 @@ struct AaNoiseParams
 	int variance_pixels_ = 0;
 	float clamp_samples_ = 0.f;
 	float clamp_indirect_ = 0.f;
+	ResampleMode resample_mode_ = ResampleMode::ColorDifference; //!< ColorDifference: resample pixels that differ from their neighbours more than the threshold. Convergence: resample pixels whose estimated relative error is above convergence_target_
+	float convergence_target_ = 0.02f; //!< relative standard error of the pixel brightness below which a pixel is considered converged, in the Convergence resample mode
 };
 
 #endif //YAFARAY_AA_NOISE_PARAMS_H
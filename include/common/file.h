@@ -25,6 +25,8 @@
 #define YAFARAY_FILE_H
 
 #include "constants.h"
+#include <ctime>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -63,6 +65,7 @@ class File final
 		static std::FILE *open(const Path &path, const std::string &access_mode);
 		static int close(std::FILE *fp);
 		static bool exists(const std::string &path, bool files_only);
+		static bool getSizeAndTime(const std::string &path, uint64_t &size, std::time_t &modification_time);
 		static bool remove(const std::string &path, bool files_only);
 		static bool rename(const std::string &path_old, const std::string &path_new, bool overwrite, bool files_only);
 		static std::vector<std::string> listFiles(const std::string &directory);
@@ -70,17 +73,38 @@ class File final
 		int close();
 		bool read(std::string &str) const;
 		template <typename T> bool read(T &value) const;
+		bool read(char *buffer, size_t size) const;
 		bool append(const std::string &str);
 		template <typename T> bool append(const T &value);
+		bool append(const char *buffer, size_t size);
 
 	private:
 		bool save(const char *buffer, size_t size, bool with_temp);
-		bool read(char *buffer, size_t size) const;
-		bool append(const char *buffer, size_t size);
 		Path path_;
 		std::FILE *fp_ = nullptr;
 };
 
+/*! Read-only memory mapping of a whole file, unmapped on destruction */
+class MappedFile final
+{
+	public:
+		MappedFile(const std::string &path);
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+		~MappedFile();
+		bool isMapped() const { return data_ != nullptr; }
+		const char *data() const { return data_; }
+		size_t size() const { return size_; }
+
+	private:
+		const char *data_ = nullptr;
+		size_t size_ = 0;
+#if defined(_WIN32)
+		void *file_handle_ = nullptr;
+		void *mapping_handle_ = nullptr;
+#endif //defined(_WIN32)
+};
+
 template <typename T> bool File::read(T &value) const
 {
 	static_assert(std::is_pod<T>::value, "T must be a plain old data (POD) type like char, int32_t, float, etc");
@@ -111,6 +111,7 @@ class LIBYAFARAY_EXPORT Layer final
 			DebugDudxDvdx,
 			DebugDudyDvdy,
 			DebugDudxyDvdxy,
+			Size //!< number of layer types, it must always be the last one
 		};
 		Layer() = default;
 		Layer(const Type &type, const Image::Type &image_type = Image::Type::None, const Image::Type &exported_image_type = Image::Type::None, const std::string &exported_image_name = "");
@@ -63,6 +63,8 @@ class TriangleObject: public ObjectGeometric
 		bool smoothMesh(float angle);
 
 	private:
+		void smoothMeshByAngle(float angle);
+
 		std::vector<Triangle> triangles_;
 		std::vector<Point3> points_;
 		std::vector<Vec3> normals_;
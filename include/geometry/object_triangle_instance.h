@@ -37,7 +37,6 @@ class TriangleObjectInstance final: public TriangleObject
 		const Matrix4 &getObjToWorldMatrix() const { return obj_to_world_; }
 		virtual Point3 getVertex(int index) const override { return obj_to_world_ * triangle_object_->getPoints()[index]; }
 		virtual Vec3 getVertexNormal(int index) const override { return obj_to_world_ * triangle_object_->getNormals()[index]; }
-		const std::vector<TriangleInstance> &getTriangleInstances() const { return triangle_instances_; }
 		virtual const Light *getLight() const override { if(triangle_object_) return triangle_object_->getLight(); else return nullptr; }
 		virtual bool hasOrco() const override { return triangle_object_->hasOrco(); }
 		virtual bool hasUv() const override { return triangle_object_->hasUv(); }
@@ -47,11 +46,11 @@ class TriangleObjectInstance final: public TriangleObject
 	private:
 		/*! the number of primitives the object holds. Primitive is an element
 			that by definition can perform ray-triangle intersection */
-		virtual int numPrimitives() const override { return triangle_instances_.size(); }
+		virtual int numPrimitives() const override { return triangle_object_->getTriangles().size(); }
 		virtual int getPrimitives(const Triangle **prims) const override;
 		virtual void finish() override;
 
-		std::vector<TriangleInstance> triangle_instances_;
+		mutable std::vector<TriangleInstance> triangle_instances_; //!< only created on demand, the accelerators work directly with the triangles of the base object
 		Matrix4 obj_to_world_;
 		const TriangleObject *triangle_object_ = nullptr;
 };
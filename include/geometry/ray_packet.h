@@ -0,0 +1,99 @@
+#pragma once
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef YAFARAY_RAY_PACKET_H
+#define YAFARAY_RAY_PACKET_H
+
+#include "geometry/ray.h"
+#include <limits>
+
+BEGIN_YAFARAY
+
+/*! A small group of rays stored in SoA (structure of arrays) layout, so the
+	accelerators can test all of them against a node with the same instructions.
+	Unused lanes are kept as degenerate rays that never cross anything.
+	A packet is "coherent" when all its rays have the same direction signs,
+	which allows taking the same near/far traversal decisions for all of them. */
+class RayPacket final
+{
+	public:
+		static constexpr int max_size_ = 8;
+		RayPacket() { clear(); }
+		void clear();
+		void add(const Ray &ray, float dist); //!< Adds a ray that will be intersected up to distance "dist". The ray is referenced, not copied.
+		int size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+		bool full() const { return size_ == max_size_; }
+		bool coherent() const { return coherent_; }
+		int dirIsNeg(int axis) const { return dir_is_neg_[axis]; } //!< direction sign of the rays of a coherent packet
+		const Ray &ray(int i) const { return *rays_[i]; }
+
+		alignas(32) float from_[3][max_size_];
+		alignas(32) float dir_[3][max_size_];
+		alignas(32) float inv_dir_[3][max_size_];
+		alignas(32) float dist_[max_size_];
+
+	private:
+		const Ray *rays_[max_size_];
+		int dir_is_neg_[3];
+		int size_;
+		bool coherent_;
+};
+
+inline void RayPacket::clear()
+{
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		for(int i = 0; i < max_size_; ++i)
+		{
+			from_[axis][i] = 0.f;
+			dir_[axis][i] = 0.f;
+			inv_dir_[axis][i] = std::numeric_limits<float>::max();
+		}
+		dir_is_neg_[axis] = 0;
+	}
+	for(int i = 0; i < max_size_; ++i)
+	{
+		dist_[i] = -1.f;
+		rays_[i] = nullptr;
+	}
+	size_ = 0;
+	coherent_ = true;
+}
+
+inline void RayPacket::add(const Ray &ray, float dist)
+{
+	const int i = size_++;
+	rays_[i] = &ray;
+	dist_[i] = dist;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		from_[axis][i] = ray.from_[axis];
+		dir_[axis][i] = ray.dir_[axis];
+		//To avoid division by zero
+		inv_dir_[axis][i] = (ray.dir_[axis] == 0.f) ? std::numeric_limits<float>::max() : 1.f / ray.dir_[axis];
+		const int dir_is_neg = inv_dir_[axis][i] < 0.f;
+		if(i == 0) dir_is_neg_[axis] = dir_is_neg;
+		else if(dir_is_neg != dir_is_neg_[axis]) coherent_ = false;
+	}
+}
+
+END_YAFARAY
+
+#endif //YAFARAY_RAY_PACKET_H
@@ -80,6 +80,9 @@ class Triangle
 		virtual Uv getVertexUv(size_t index) const; //!< Get triangle vertex Uv (index is the vertex number in the triangle: 0, 1 or 2
 		int getPointId(size_t index) const { return point_id_[index]; }  //!< Get triangle Point Id (index is the vertex number in the triangle: 0, 1 or 2
 		int getNormalId(size_t index) const { return normal_id_[index]; }  //!< Get triangle Normal Id (index is the vertex number in the triangle: 0, 1 or 2
+		const Vec3 &getVec01() const { return vec_0_1_; } //!< Get the cached edge from vertex 0 to vertex 1
+		const Vec3 &getVec02() const { return vec_0_2_; } //!< Get the cached edge from vertex 0 to vertex 2
+		float getIntersectBiasFactor() const { return intersect_bias_factor_; }
 
 		static int triBoxClip(const double b_min[3], const double b_max[3], const double triverts[3][3], Bound &box, void *n_dat);
 		static int triPlaneClip(double pos, int axis, bool lower, Bound &box, const void *o_dat, void *n_dat);
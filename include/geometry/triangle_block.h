@@ -0,0 +1,108 @@
+#pragma once
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef YAFARAY_TRIANGLE_BLOCK_H
+#define YAFARAY_TRIANGLE_BLOCK_H
+
+#include "geometry/triangle.h"
+#include "geometry/ray.h"
+
+BEGIN_YAFARAY
+
+/*! Precomputed intersection data of a small group of triangles in SoA
+	(structure of arrays) layout. It allows the accelerators to test a ray
+	against all the triangles of the block in the same loop, without
+	dereferencing the triangles themselves until one of them is hit.
+	Unused slots are kept as degenerate triangles that are never hit. */
+class TriangleBlock final
+{
+	public:
+		static constexpr int size_ = 4;
+		static int blocksCount(int num_triangles) { return (num_triangles + size_ - 1) / size_; }
+		void clear();
+		void set(int i, const Triangle &triangle);
+		//! Returns a bit mask of the triangles hit at a distance in [t_min, t_max), with their distances and the "u, v" values of the Möller-Trumbore test
+		int intersect(const Ray &ray, float t_min, float t_max, float *t, float *u, float *v) const;
+
+	private:
+		alignas(16) float p_0_[3][size_];
+		alignas(16) float vec_0_1_[3][size_];
+		alignas(16) float vec_0_2_[3][size_];
+		alignas(16) float epsilon_[size_];
+};
+
+inline void TriangleBlock::clear()
+{
+	for(int i = 0; i < size_; ++i)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			p_0_[axis][i] = 0.f;
+			vec_0_1_[axis][i] = 0.f;
+			vec_0_2_[axis][i] = 0.f;
+		}
+		epsilon_[i] = 1.f; //the determinant of an empty slot is 0, so it will never be hit
+	}
+}
+
+inline void TriangleBlock::set(int i, const Triangle &triangle)
+{
+	const Point3 p_0 = triangle.getVertex(0);
+	const Vec3 &vec_0_1 = triangle.getVec01();
+	const Vec3 &vec_0_2 = triangle.getVec02();
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		p_0_[axis][i] = p_0[axis];
+		vec_0_1_[axis][i] = vec_0_1[axis];
+		vec_0_2_[axis][i] = vec_0_2[axis];
+	}
+	epsilon_[i] = triangle.getIntersectBiasFactor();
+}
+
+inline int TriangleBlock::intersect(const Ray &ray, float t_min, float t_max, float *t, float *u, float *v) const
+{
+	// Same Tomas Möller and Ben Trumbore scheme as Triangle::intersect, for all the triangles of the block at once
+	int hit_mask = 0;
+	for(int i = 0; i < size_; ++i)
+	{
+		const float pvec_x = ray.dir_.y_ * vec_0_2_[2][i] - ray.dir_.z_ * vec_0_2_[1][i];
+		const float pvec_y = ray.dir_.z_ * vec_0_2_[0][i] - ray.dir_.x_ * vec_0_2_[2][i];
+		const float pvec_z = ray.dir_.x_ * vec_0_2_[1][i] - ray.dir_.y_ * vec_0_2_[0][i];
+		const float det = vec_0_1_[0][i] * pvec_x + vec_0_1_[1][i] * pvec_y + vec_0_1_[2][i] * pvec_z;
+		const float inv_det = 1.f / det;
+		const float tvec_x = ray.from_.x_ - p_0_[0][i];
+		const float tvec_y = ray.from_.y_ - p_0_[1][i];
+		const float tvec_z = ray.from_.z_ - p_0_[2][i];
+		u[i] = (tvec_x * pvec_x + tvec_y * pvec_y + tvec_z * pvec_z) * inv_det;
+		const float qvec_x = tvec_y * vec_0_1_[2][i] - tvec_z * vec_0_1_[1][i];
+		const float qvec_y = tvec_z * vec_0_1_[0][i] - tvec_x * vec_0_1_[2][i];
+		const float qvec_z = tvec_x * vec_0_1_[1][i] - tvec_y * vec_0_1_[0][i];
+		v[i] = (ray.dir_.x_ * qvec_x + ray.dir_.y_ * qvec_y + ray.dir_.z_ * qvec_z) * inv_det;
+		t[i] = (vec_0_2_[0][i] * qvec_x + vec_0_2_[1][i] * qvec_y + vec_0_2_[2][i] * qvec_z) * inv_det;
+		const bool hit = (det <= -epsilon_[i] || det >= epsilon_[i]) &&
+						 u[i] >= 0.f && u[i] <= 1.f && v[i] >= 0.f && (u[i] + v[i]) <= 1.f &&
+						 t[i] >= epsilon_[i] && t[i] >= t_min && t[i] < t_max;
+		hit_mask |= hit << i;
+	}
+	return hit_mask;
+}
+
+END_YAFARAY
+
+#endif //YAFARAY_TRIANGLE_BLOCK_H
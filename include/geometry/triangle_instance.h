@@ -30,7 +30,7 @@ class TriangleInstance final : public Triangle
 {
 	public:
 		TriangleInstance() = default;
-		TriangleInstance(const Triangle *base, TriangleObjectInstance *m): triangle_(base), triangle_object_instance_(m) { updateIntersectCachedValues(); }
+		TriangleInstance(const Triangle *base, const TriangleObjectInstance *m): triangle_(base), triangle_object_instance_(m) { updateIntersectCachedValues(); }
 		virtual bool clippingSupport() const override { return true; }
 		// return: false:=doesn't overlap bound; true:=valid clip exists
 		virtual const Material *getMaterial() const override { return triangle_->getMaterial(); }
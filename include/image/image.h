@@ -67,6 +67,7 @@ class LIBYAFARAY_EXPORT Image final
 		void setWeight(int x, int y, float val);
 		void setInt(int x, int y, int val);
 		void clear();
+		const void *getBuffer() const { return buffer_; } //!< buffer of the pixels, of the ImageBuffer2D type that corresponds to the image type and optimization
 
 		static Type imageTypeWithAlpha(Type image_type);
 		static Type imageTypeWithWeight(Type image_type);
@@ -27,6 +27,7 @@
 
 #include "color/color.h"
 #include "math/buffer.h"
+#include <limits>
 
 BEGIN_YAFARAY
 
@@ -103,6 +104,53 @@ class PixelGrayAlpha final : public GrayAlpha
 		float weight_ = 0.f;
 };
 
+/*! Running weighted mean and second central moment of the brightness of
+	the samples of a pixel. They are updated one sample at a time with the
+	weighted version of Welford's algorithm, which is numerically stable in
+	single precision, and partial moments can be merged together. */
+class PixelMoments final
+{
+	public:
+		void addSample(float value, float weight)
+		{
+			if(weight <= 0.f) return;
+			weight_ += weight;
+			weight_2_ += weight * weight;
+			const float delta = value - mean_;
+			mean_ += delta * weight / weight_;
+			m_2_ += weight * delta * (value - mean_);
+		}
+		void merge(const PixelMoments &moments)
+		{
+			if(moments.weight_ <= 0.f) return;
+			const float weight = weight_ + moments.weight_;
+			const float delta = moments.mean_ - mean_;
+			mean_ += delta * moments.weight_ / weight;
+			m_2_ += moments.m_2_ + delta * delta * weight_ * moments.weight_ / weight;
+			weight_ = weight;
+			weight_2_ += moments.weight_2_;
+		}
+		float getMean() const { return mean_; }
+		//! Effective number of samples, taking into account their different filter weights
+		float effectiveSamples() const { return weight_2_ > 0.f ? weight_ * weight_ / weight_2_ : 0.f; }
+		/*! Standard error of the mean relative to the mean. The mean is limited to "min_mean",
+			so almost black pixels are not required an endless amount of samples. The error
+			cannot be estimated with less than two effective samples, and then it is infinite */
+		float relativeError(float min_mean) const
+		{
+			const float effective_samples = effectiveSamples();
+			if(effective_samples < 2.f) return std::numeric_limits<float>::infinity();
+			const float variance = m_2_ / (weight_ - weight_2_ / weight_);
+			return std::sqrt(std::max(0.f, variance) / effective_samples) / std::max(std::abs(mean_), min_mean);
+		}
+
+	private:
+		float weight_ = 0.f;
+		float weight_2_ = 0.f;
+		float mean_ = 0.f;
+		float m_2_ = 0.f;
+};
+
 class RgbAlpha final
 {
 	public:
@@ -309,6 +357,35 @@ class ImageBuffer2D final : public Buffer<T, 2>
 		int getHeight() const { return static_cast<int>(Buffer<T, 2>::getDimensions().at(1)); }
 };
 
+/*! 2D image buffer for textures, stored in square tiles of about one cache
+	line. The texels of each tile are contiguous, so the neighbourhoods read
+	by the texture filters touch fewer cache lines than with the column by
+	column layout of ImageBuffer2D. The buffer is padded to whole tiles */
+template <class T>
+class TiledImageBuffer2D final
+{
+	public:
+		TiledImageBuffer2D(int width, int height) : width_(width), height_(height), tiles_x_((width + tile_side_ - 1) / tile_side_), data_(static_cast<size_t>(tiles_x_) * ((height + tile_side_ - 1) / tile_side_) * tile_side_ * tile_side_) { }
+		T &operator()(int x, int y) { return data_[calculateDataPosition(x, y)]; }
+		const T &operator()(int x, int y) const { return data_[calculateDataPosition(x, y)]; }
+		int getWidth() const { return width_; }
+		int getHeight() const { return height_; }
+
+	private:
+		size_t calculateDataPosition(int x, int y) const
+		{
+			const size_t tile = static_cast<size_t>(y >> tile_side_log_2_) * tiles_x_ + (x >> tile_side_log_2_);
+			return (tile << (2 * tile_side_log_2_)) + ((y & (tile_side_ - 1)) << tile_side_log_2_) + (x & (tile_side_ - 1));
+		}
+
+		static constexpr int tile_side_log_2_ = sizeof(T) <= 1 ? 3 : (sizeof(T) <= 4 ? 2 : 1); //!< 8x8 tiles of 1 byte texels, 4x4 tiles up to 4 bytes and 2x2 tiles for bigger texels
+		static constexpr int tile_side_ = 1 << tile_side_log_2_;
+		int width_;
+		int height_;
+		int tiles_x_;
+		std::vector<T> data_;
+};
+
 typedef ImageBuffer2D<Pixel> 		Rgba2DImageWeighed_t; //!< Weighted RGBA image buffer typedef
 typedef ImageBuffer2D<PixelGray> 	Gray2DImageWeighed_t; //!< Weighted monochromatic image buffer typedef
 typedef ImageBuffer2D<PixelGrayAlpha> 	GrayAlpha2DImageWeighed_t; //!< Weighted monochromatic with alpha (96 bit / pixel) image buffer typedef
@@ -321,7 +398,8 @@ typedef ImageBuffer2D<Rgb565>		RgbCompressedImage_t; //!< Non-weighted compresse
 typedef ImageBuffer2D<Rgba1010108>	RgbaOptimizedImage_t; //!< Non-weighted optimized (40bit/pixel) with alpha buffer typedef
 typedef ImageBuffer2D<Rgba7773>	RgbaCompressedImage_t; //!< Non-weighted compressed (24bit/pixel) LOSSY with alpha buffer typedef
 typedef ImageBuffer2D<Gray8>		GrayOptimizedImage_t; //!< Non-weighted gray scale (8bit/gray pixel) image buffer typedef
-typedef ImageBuffer2D<bool>		FlagsBuffer_t; //!< boolean buffer, for example for flags, typedef
+typedef ImageBuffer2D<PixelMoments>		MomentsBuffer_t; //!< Brightness moments of the samples of each pixel, used to estimate their convergence, typedef
+typedef ImageBuffer2D<unsigned char>		FlagsBuffer_t; //!< flags buffer, one byte per flag so that flags of neighbouring pixels can be set by different threads, typedef
 
 END_YAFARAY
 
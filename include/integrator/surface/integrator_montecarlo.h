@@ -24,6 +24,8 @@
 
 #include "integrator_tiled.h"
 #include "color/color.h"
+#include "light/light_tree.h"
+#include <memory>
 
 
 BEGIN_YAFARAY
@@ -52,8 +54,10 @@ class MonteCarloIntegrator: public TiledIntegrator
 		Rgb estimateAllDirectLight(RenderData &render_data, const SurfacePoint &sp, const Vec3 &wo, ColorLayers *color_layers = nullptr) const;
 		/*! Like previous but for only one random light source for a given surface point */
 		Rgb estimateOneDirectLight(RenderData &render_data, const SurfacePoint &sp, Vec3 wo, int n) const;
-		/*! Does the actual light estimation on a specific light for the given surface point */
-		Rgb doLightEstimation(RenderData &render_data, Light *light, const SurfacePoint &sp, const Vec3 &wo, const unsigned int &loffs, ColorLayers *color_layers = nullptr) const;
+		/*! Does the actual light estimation on a specific light for the given surface point. The light and the color layers with light are multiplied by light_weight, when the light was selected among others */
+		Rgb doLightEstimation(RenderData &render_data, Light *light, const SurfacePoint &sp, const Vec3 &wo, const unsigned int &loffs, ColorLayers *color_layers = nullptr, float light_weight = 1.f) const;
+		/*! Prepares the selection of the lights for the direct lighting, once lights_ has been set */
+		void initLightSampling();
 		/*! Does recursive mc raytracing with MIS (Multiple Importance Sampling) for a given surface point */
 		void recursiveRaytrace(RenderData &render_data, DiffRay &ray, BsdfFlags bsdfs, SurfacePoint &sp, Vec3 &wo, Rgb &col, float &alpha, int additional_depth, ColorLayers *color_layers = nullptr) const;
 		/*! Creates and prepares the caustic photon map */
@@ -74,6 +78,7 @@ class MonteCarloIntegrator: public TiledIntegrator
 		int n_caus_search_; //! Amount of caustic photons to be gathered in estimation
 		float caus_radius_; //! Caustic search radius for estimation
 		int caus_depth_; //! Caustic photons max path depth
+		bool compact_caustic_photons_ = false; //! Store the caustic photons with the compact photon layout
 		Pdf1D *light_power_d_;
 
 		bool use_ambient_occlusion_; //! Use ambient occlusion
@@ -86,6 +91,10 @@ class MonteCarloIntegrator: public TiledIntegrator
 		int n_paths_; //! Number of samples for mc raytracing
 		int max_bounces_; //! Max. path depth for mc raytracing
 		std::vector<Light *> lights_; //! An array containing all the scene lights
+		enum class LightSampling { All, Tree };
+		LightSampling light_sampling_ = LightSampling::All; //! All: the direct light is estimated from all the lights, or from one uniformly selected light. Tree: the lights are selected with a light tree by their estimated contribution
+		int light_tree_samples_ = 1; //! Number of lights selected with the light tree for the direct light of each surface point
+		std::unique_ptr<LightTree> light_tree_;
 		bool transp_background_; //! Render background as transparent
 		bool transp_refracted_background_; //! Render refractions of background as transparent
 		void causticWorker(PhotonMap *caustic_map, int thread_id, const Scene *scene, const RenderView *render_view, const RenderControl &render_control, unsigned int n_caus_photons, Pdf1D *light_power_d, int num_lights, const std::vector<Light *> &caus_lights, int caus_depth, ProgressBar *pb, int pb_step, unsigned int &total_photons_shot);
@@ -61,6 +61,7 @@ class PhotonIntegrator final : public MonteCarloIntegrator
 		bool final_gather_, show_map_;
 		bool prepass_;
 		unsigned int n_diffuse_photons_;
+		bool compact_diffuse_photons_ = false; //!< store the diffuse photons with the compact photon layout
 		int n_diffuse_search_;
 		int gather_bounces_;
 		float ds_radius_; //!< diffuse search radius
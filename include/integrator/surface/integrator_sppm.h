@@ -81,7 +81,7 @@ class SppmIntegrator final : public MonteCarloIntegrator
 		GatherInfo traceGatherRay(RenderData &render_data, DiffRay &ray, HitPoint &hp, ColorLayers *color_layers = nullptr);
 		void photonWorker(PhotonMap *diffuse_map, PhotonMap *caustic_map, int thread_id, const Scene *scene, const RenderView *render_view, const RenderControl &render_control, unsigned int n_photons, const Pdf1D *light_power_d, int num_d_lights, const std::vector<Light *> &tmplights, ProgressBar *pb, int pb_step, unsigned int &total_photons_shot, int max_bounces, Random &prng);
 
-		HashGrid  photon_grid_; // the hashgrid for holding photons
+		HashGrid  photon_grid_, caustic_grid_; // the hashgrids for holding diffuse and caustic photons, used instead of the photon maps if b_hashgrid_
 		PhotonMap diffuse_map_, caustic_map_; // photonmap
 		unsigned int n_photons_; //photon number to scatter
 		float ds_radius_; // used to do initial radius estimate
@@ -91,10 +91,10 @@ class SppmIntegrator final : public MonteCarloIntegrator
 		uint64_t totaln_photons_; // amount of total photons that have been emited, used to normalize photon energy
 		bool pm_ire_; // flag to  say if using PM for initial radius estimate
 		bool b_hashgrid_; // flag to choose using hashgrid or not.
-		Halton hal_1_, hal_2_, hal_3_, hal_4_, hal_10_; // halton sequence to do
+		bool compact_diffuse_photons_ = false; // flag to store the diffuse photons in the photon map with the compact photon layout
+		Halton hal_10_; // halton sequence to do
 		std::vector<HitPoint>hit_points_; // per-pixel refine data
 		unsigned int n_refined_; // Debug info: Refined pixel per pass
-		std::mutex mutex_;
 };
 
 END_YAFARAY
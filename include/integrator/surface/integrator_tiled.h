@@ -39,8 +39,21 @@ class ThreadControl final
 		ThreadControl() : finished_threads_(0) {}
 		std::mutex m_;
 		std::condition_variable c_; //!< condition variable to signal main thread
+		std::vector<RenderArea> started_areas_; //!< areas started, to be highlighted in e.g. blender, if any
 		std::vector<RenderArea> areas_; //!< area to be output to e.g. blender, if any
-		volatile int finished_threads_; //!< number of finished threads, lock countCV when increasing/reading!
+		int finished_threads_; //!< number of finished threads, lock countCV when increasing/reading!
+};
+
+/*! Camera sample waiting to be integrated, see TiledIntegrator::renderTile */
+struct CameraSample
+{
+	int x_, y_, sample_;
+	float dx_, dy_;
+	float wt_;
+	float time_;
+	int pixel_sample_;
+	unsigned int sampling_offs_;
+	int ray_index_; //!< index of the camera ray of this sample, -1 if no ray was generated (weight 0)
 };
 
 class TiledIntegrator : public SurfaceIntegrator
@@ -62,6 +75,8 @@ class TiledIntegrator : public SurfaceIntegrator
 		void generateCommonLayers(RenderData &render_data, const SurfacePoint &sp, const DiffRay &ray, ColorLayers *color_layers = nullptr) const; //!< Generates render passes common to all integrators
 
 	protected:
+		bool intersectCameraRay(RenderData &render_data, const DiffRay &ray, SurfacePoint &sp) const; //!< Intersects the camera ray with the scene, unless renderTile already did it in a ray packet
+
 		float i_aa_passes_; //!< Inverse of AA_passes used for depth map
 		AaNoiseParams aa_noise_params_;
 		float aa_sample_multiplier_ = 1.f;
@@ -70,6 +85,7 @@ class TiledIntegrator : public SurfaceIntegrator
 		float max_depth_; //!< Inverse of max depth from camera within the scene boundaries
 		float min_depth_; //!< Distance between camera and the closest object on the scene
 		bool diff_rays_enabled_;	//!< Differential rays enabled/disabled - for future motion blur / interference features
+		bool camera_ray_packets_ = false; //!< The integrator intersects the camera rays with intersectCameraRay(), so renderTile can intersect them in ray packets
 		static std::vector<int> correlative_sample_number_;  //!< Used to sample lights more uniformly when using estimateOneDirectLight
 };
 
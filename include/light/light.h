@@ -36,6 +36,7 @@ class Scene;
 class Vec3;
 class Point3;
 struct LSample;
+struct LightBounds;
 
 class Light
 {
@@ -79,6 +80,8 @@ class Light
 		virtual void emitPdf(const SurfacePoint &sp, const Vec3 &wo, float &area_pdf, float &dir_pdf, float &cos_wo) const { area_pdf = 0.f; dir_pdf = 0.f; }
 		//! (preferred) number of samples for direct lighting
 		virtual int nSamples() const { return 8; }
+		//! bounds of the emission for the light tree, false if the emission cannot be bounded, as in infinite lights
+		virtual bool emissionBounds(LightBounds &bounds) const { return false; }
 		//! This method must be called right after the factory is called on a background light or the light will fail
 		virtual void setBackground(Background *bg) { background_ = bg; }
 		//! Enable/disable entire light source
@@ -40,6 +40,7 @@ class IesLight final : public Light
 		IesLight(const Point3 &from, const Point3 &to, const Rgb &col, float power, const std::string ies_file, int smpls, bool s_sha, float ang, bool b_light_enabled = true, bool b_cast_shadows = true);
 		virtual Rgb totalEnergy() const override{ return color_ * tot_energy_;};
 		virtual int nSamples() const override { return samples_; };
+		virtual bool emissionBounds(LightBounds &bounds) const override;
 		virtual bool diracLight() const override { return !soft_shadow_; }
 		virtual bool illuminate(const SurfacePoint &sp, Rgb &col, Ray &wi) const override;
 		virtual bool illumSample(const SurfacePoint &sp, LSample &s, Ray &wi) const override;
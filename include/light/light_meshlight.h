@@ -49,6 +49,7 @@ class MeshLight final : public Light
 		virtual bool illumSample(const SurfacePoint &sp, LSample &s, Ray &wi) const override;
 		virtual bool illuminate(const SurfacePoint &sp, Rgb &col, Ray &wi) const override { return false; }
 		virtual int nSamples() const override { return samples_; }
+		virtual bool emissionBounds(LightBounds &bounds) const override;
 		virtual bool canIntersect() const override { return tree_ != 0 /* false */ ; }
 		virtual bool intersect(const Ray &ray, float &t, Rgb &col, float &ipdf) const override;
 		virtual float illumPdf(const SurfacePoint &sp, const SurfacePoint &sp_light) const override;
@@ -44,6 +44,7 @@ class PointLight final : public Light
 		virtual bool illumSample(const SurfacePoint &sp, LSample &s, Ray &wi) const override;
 		virtual bool illuminate(const SurfacePoint &sp, Rgb &col, Ray &wi) const override;
 		virtual void emitPdf(const SurfacePoint &sp, const Vec3 &wo, float &area_pdf, float &dir_pdf, float &cos_wo) const override;
+		virtual bool emissionBounds(LightBounds &bounds) const override;
 
 		Point3 position_;
 		Rgb color_;
@@ -47,6 +47,7 @@ class SpotLight final : public Light
 		virtual bool canIntersect() const override { return soft_shadows_; }
 		virtual bool intersect(const Ray &ray, float &t, Rgb &col, float &ipdf) const override;
 		virtual int nSamples() const override { return samples_; };
+		virtual bool emissionBounds(LightBounds &bounds) const override;
 
 		Point3 position_;
 		Vec3 dir_; //!< orientation of the spot cone
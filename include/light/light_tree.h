@@ -0,0 +1,89 @@
+#pragma once
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef YAFARAY_LIGHT_TREE_H
+#define YAFARAY_LIGHT_TREE_H
+
+#include "geometry/bound.h"
+#include <vector>
+
+BEGIN_YAFARAY
+
+class Light;
+
+/*! Bounds of the emission of a light, or of a group of lights: the positions
+	of the emitters, a cone around "axis_" with the normals of the emitters and
+	the maximum angle of emission around each normal. They must be conservative,
+	as the lights cannot be selected where their bounds say they emit nothing */
+struct LightBounds
+{
+	LightBounds() = default;
+	LightBounds(const Bound &bound, const Vec3 &axis, float theta_o, float theta_e, float power) : bound_(bound), axis_(axis), theta_o_(theta_o), theta_e_(theta_e), power_(power) { }
+	LightBounds(const LightBounds &a, const LightBounds &b);
+	//! Estimation of the light received from the bounded lights at point p, with surface normal n (zero to ignore the orientation of the surface)
+	float importance(const Point3 &p, const Vec3 &n) const;
+	//! Cost of the bounds for the construction of the tree, along a given axis
+	float cost(int axis) const;
+
+	Bound bound_;
+	Vec3 axis_ {0.f, 0.f, 1.f};
+	float theta_o_ = M_PI; //!< maximum angle between the axis and the normals of the emitters
+	float theta_e_ = M_PI_2; //!< maximum angle of emission around each normal
+	float power_ = 0.f;
+};
+
+/*! Hierarchy of the lights used to select a single light for the direct
+	lighting of a surface point, with a probability roughly proportional to
+	the light it receives from it. The lights with bounded emission are
+	arranged in a binary tree of LightBounds, which is traversed choosing
+	each child by its importance for the point, so the cost of the selection
+	grows with the logarithm of the number of lights. The infinite lights
+	(sun, directional, background) cannot be bounded and are selected uniformly
+	among themselves and the tree. */
+class LightTree final
+{
+	public:
+		explicit LightTree(const std::vector<Light *> &lights);
+		/*! Selects a light for point p with surface normal n, using the random number s.
+			Returns the index of the light in the lights vector given to the constructor and
+			the probability of selecting it, or -1 if none of the lights can illuminate the point */
+		int sample(const Point3 &p, const Vec3 &n, float s, float &pdf) const;
+
+	private:
+		struct Node
+		{
+			LightBounds bounds_;
+			uint32_t second_child_; //!< the first child is the next node
+			int light_ = -1; //!< index of the light in the leaves, -1 in the interior nodes
+		};
+		struct BuildLight
+		{
+			LightBounds bounds_;
+			int light_;
+		};
+		uint32_t buildTree(std::vector<BuildLight> &build_lights, int start, int end);
+
+		std::vector<Node> nodes_;
+		std::vector<int> infinite_lights_;
+		static constexpr int num_buckets_ = 12;
+};
+
+END_YAFARAY
+
+#endif // YAFARAY_LIGHT_TREE_H
@@ -27,6 +27,7 @@
 #include "constants.h"
 #include "color/color.h"
 #include "common/badge.h"
+#include "common/layers.h"
 #include <vector>
 #include <map>
 #include <string>
@@ -38,6 +39,7 @@ class Scene;
 class Layers;
 struct ColorLayer;
 class ColorLayers;
+class ColorLayersArea;
 class ParamMap;
 class RenderView;
 
@@ -56,6 +58,8 @@ class LIBYAFARAY_EXPORT ColorOutput
 		virtual bool isPreview() const { return false; }
 		virtual void init(int width, int height, const Layers *layers, const std::map<std::string, RenderView *> *render_views);
 		bool putPixel(int x, int y, const ColorLayers &color_layers);
+		//! Puts all the layers of an area, processing the colors for this output one row span at a time
+		bool putArea(const ColorLayersArea &color_layers_area);
 		void setRenderView(const RenderView *render_view) { current_render_view_ = render_view; }
 		int getWidth() const { return width_; }
 		int getHeight() const { return height_; }
@@ -66,6 +70,11 @@ class LIBYAFARAY_EXPORT ColorOutput
 	protected:
 		LIBYAFARAY_EXPORT ColorOutput(const std::string &name = "out", const ColorSpace color_space = ColorSpace::RawManualGamma, float gamma = 1.f, bool with_alpha = true, bool alpha_premultiply = false);
 		ColorLayer preProcessColor(const ColorLayer &color_layer);
+		//! Same processing as preProcessColor, for a row span of colors of a layer
+		void preProcessColors(const Layer::Type &layer_type, const Rgba *colors, Rgba *result, int n_pixels) const;
+		/*! Puts a row span of colors of a layer, already processed for this output. By default it
+			falls back to putPixel for each pixel, outputs can override it to store the row at once */
+		virtual bool putRow(int x, int y, int n_pixels, const Layer::Type &layer_type, const Rgba *colors);
 		virtual std::string printDenoiseParams() const { return ""; }
 		ColorSpace getColorSpace() const { return color_space_; }
 		float getGamma() const { return gamma_; }
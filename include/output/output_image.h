@@ -26,6 +26,10 @@
 
 #include "output/output.h"
 #include "common/layers.h"
+#include "common/thread.h"
+#include <deque>
+#include <functional>
+#include <memory>
 
 BEGIN_YAFARAY
 
@@ -41,14 +45,26 @@ class ImageOutput final : public ColorOutput
 
 	private:
 		virtual bool putPixel(int x, int y, const ColorLayer &color_layer) override;
+		virtual bool putRow(int x, int y, int n_pixels, const Layer::Type &layer_type, const Rgba *colors) override;
 		virtual void flush(const RenderControl &render_control) override;
 		virtual void flushArea(int x_0, int y_0, int x_1, int y_1) override {} // not used by images... yet
 		virtual bool isImageOutput() const override { return true; }
 		virtual std::string printDenoiseParams() const override;
 		virtual void init(int width, int height, const Layers *layers, const std::map<std::string, RenderView *> *render_views) override;
-		void saveImageFile(const std::string &filename, const Layer::Type &layer_type, Format *format, const RenderControl &render_control);
-		void saveImageFileMultiChannel(const std::string &filename, Format *format, const RenderControl &render_control);
+		//! An image to be written to a file, "owned_" if it is a copy or postprocessed image to be deleted after writing it
+		struct ImageFile
+		{
+			std::string name_;
+			const Image *image_;
+			bool owned_;
+		};
+		ImageFile prepareImageFile(const std::string &filename, const Layer::Type &layer_type, const RenderControl &render_control, bool copy_image) const;
+		ImageLayers *prepareImageLayersMultiChannel(const RenderControl &render_control, bool copy_images, bool &owned) const;
+		void writeImageFile(const ImageFile &image_file, Format *format) const;
 		void clearImageLayers();
+		void enqueueWrite(const std::function<void()> &write);
+		void waitForPendingWrites();
+		void writerWorker();
 		bool denoiseEnabled() const { return denoise_params_.enabled_; }
 		DenoiseParams getDenoiseParams() const { return denoise_params_; }
 
@@ -58,6 +74,16 @@ class ImageOutput final : public ColorOutput
 		bool multi_layer_ = true;
 		DenoiseParams denoise_params_;
 		ImageLayers *image_layers_ = nullptr;
+		/*! Autosaves of partial renders are written by a background thread from snapshots of the
+			images, so the rendering can continue while they are encoded. The queue is bounded, so
+			there are at most max_pending_writes_ snapshots besides the one being written */
+		std::thread writer_thread_;
+		std::mutex writer_mutex_;
+		std::condition_variable writer_condition_;
+		std::deque<std::function<void()>> pending_writes_;
+		bool writing_ = false;
+		bool writer_exit_ = false;
+		static constexpr size_t max_pending_writes_ = 1;
 };
 
 END_YAFARAY
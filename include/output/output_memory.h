@@ -34,6 +34,7 @@ class MemoryInputOutput final : public ColorOutput
 
 	private:
 		virtual bool putPixel(int x, int y, const ColorLayer &color_layer) override;
+		virtual bool putRow(int x, int y, int n_pixels, const Layer::Type &layer_type, const Rgba *colors) override;
 		void flush(const RenderControl &render_control) override;
 
 		float *image_mem_;
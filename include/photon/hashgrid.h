@@ -22,40 +22,53 @@
 
 #include "constants.h"
 #include "geometry/bound.h"
-#include <list>
+#include "photon/photon.h"
 #include <vector>
+#include <mutex>
 
 BEGIN_YAFARAY
 
-class Photon;
-struct FoundPhoton;
-class Bound;
 class Point3;
 
-
+/*! Hashed uniform grid of photons. The photons are sorted by the hash of
+	their cell with a counting sort, so the photons of each cell are
+	contiguous and the grid is only an array of offsets into them. Building
+	it does not allocate anything per photon, and the sort is done in
+	parallel over ranges of cells, which matters as SPPM rebuilds the grid
+	in every pass.
+*/
 class HashGrid final
 {
 	public:
-		HashGrid() { hash_grid_ = nullptr;}
+		HashGrid() = default;
 		HashGrid(double cell_size, unsigned int grid_size, Bound b_box);
 		void setParm(double cell_size, unsigned int grid_size, Bound b_box);
 		void clear(); //remove all the photons in the grid;
-		void updateGrid(); //build the hashgrid
-		void pushPhoton(Photon &p);
-		unsigned int gather(const Point3 &p, FoundPhoton *found, unsigned int k, float sq_radius);
+		void updateGrid(int num_threads = 1); //build the hashgrid
+		void pushPhoton(const Photon &p);
+		//! Adds photons traced by a thread, it can be called from several threads at the same time
+		void appendVector(const std::vector<Photon> &photons);
+		unsigned int gather(const Point3 &p, FoundPhoton *found, unsigned int k, float sq_radius) const;
+		size_t nPhotons() const { return photons_.size(); }
 
 	private:
-		unsigned int hash(const int ix, const int iy, const int iz)
+		unsigned int hash(const int ix, const int iy, const int iz) const
 		{
 			return (unsigned int)((ix * 73856093) ^ (iy * 19349663) ^ (iz * 83492791)) % grid_size_;
 		}
+		unsigned int cellHash(const Point3 &p) const;
 
-	public:
-		double cell_size_, inv_cell_size_;
-		unsigned int grid_size_;
+		double cell_size_ = 1.0, inv_cell_size_ = 1.0;
+		unsigned int grid_size_ = 0;
 		Bound bounding_box_;
-		std::vector<Photon>photons_;
-		std::list<Photon *> **hash_grid_;
+		std::vector<Photon> photons_; //!< photons, sorted by their cell after updateGrid
+		std::vector<unsigned int> cell_start_; //!< index of the first photon of each cell, with the number of photons at the end
+		//Build buffers, kept between rebuilds to avoid reallocating them
+		std::vector<Photon> unsorted_photons_;
+		std::vector<unsigned int> photon_cells_; //!< cell of each unsorted photon
+		std::vector<unsigned int> range_photons_; //!< indices of the unsorted photons, grouped by the range of cells of each build thread
+		std::vector<unsigned int> cell_positions_; //!< photons of each cell, then their write positions
+		std::mutex mutx_;
 };
 
 
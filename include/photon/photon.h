@@ -27,17 +27,15 @@
 
 BEGIN_YAFARAY
 
+class MappedFile;
+
 class Photon
 {
 	public:
 		Photon() {/*theta=255;*/};
 		Photon(const Vec3 &d, const Point3 &p, const Rgb &col)
 		{
-#ifdef SMALL_PHOTONS //FIXME: SMALL_PHOTONS not working at the moment because Rgbe members do not include r_, g_ and b_ as needed in the rest of the code
-			direction(d);
-#else
 			dir_ = d;
-#endif
 			pos_ = p;
 			c_ = col;
 		};
@@ -52,40 +50,35 @@ class Photon
 		const Point3 &position() const {return pos_;};
 		const Rgb color() const {return c_;};
 		void color(const Rgb &col) { c_ = col;};
-		Vec3 direction() const
-		{
-#ifdef SMALL_PHOTONS //FIXME: SMALL_PHOTONS not working at the moment because Rgbe members do not include r_, g_ and b_ as needed in the rest of the code
-			if(theta_ == 255) return Vec3(0, 0, 0);
-			else return dirconverter__.convert(theta_, phi_);
-#else //SMALL_PHOTONS
-			return (Vec3)dir_;
-#endif //SMALL_PHOTONS
-		};
-		void direction(const Vec3 &d)
-		{
-#ifdef SMALL_PHOTONS //FIXME: SMALL_PHOTONS not working at the moment because Rgbe members do not include r_, g_ and b_ as needed in the rest of the code
-			if(d.null()) theta_ = 255;
-			else
-			{
-				std::pair<unsigned char, unsigned char> cd = dirconverter__.convert(d);
-				theta_ = cd.first;
-				phi_ = cd.second;
-			}
-#else //SMALL_PHOTONS
-			dir_ = d;
-#endif //SMALL_PHOTONS
-		}
+		Vec3 direction() const { return (Vec3)dir_; };
+		void direction(const Vec3 &d) { dir_ = d; }
 
 		Point3 pos_;
-
-#ifdef SMALL_PHOTONS //FIXME: SMALL_PHOTONS not working at the moment because Rgbe members do not include r_, g_ and b_ as needed in the rest of the code
-		Rgbe c_;
-		unsigned char theta_, phi_;
-
-#else //SMALL_PHOTONS
 		Rgb c_;
 		Vec3 dir_;
-#endif //SMALL_PHOTONS
+};
+
+/*! Compact photon layout for large photon maps, 20 bytes instead of the
+	36 bytes of Photon, so more photons fit in the caches during the
+	lookups. The position is kept in full precision for the kd-tree, the
+	color is stored with a shared exponent (RGBE) and the direction with
+	16 bit octahedral coordinates, with an angular error below 0.01 degrees */
+class CompactPhoton
+{
+	public:
+		CompactPhoton() = default;
+		CompactPhoton(const Photon &photon): pos_(photon.pos_), c_(photon.c_), dir_(encodeDirection(photon.dir_)) { }
+		const Point3 &position() const { return pos_; }
+		Rgb color() const { return c_; }
+		Vec3 direction() const { return decodeDirection(dir_); }
+
+		Point3 pos_;
+
+	private:
+		static uint32_t encodeDirection(const Vec3 &dir);
+		static Vec3 decodeDirection(uint32_t oct);
+		Rgbe c_;
+		uint32_t dir_; //!< octahedral coordinates, u in the low 16 bits and v in the high 16 bits
 };
 
 struct RadData
@@ -98,15 +91,23 @@ struct RadData
 	mutable bool use_;
 };
 
+/*! Photon found in a lookup, in a map of either photon layout */
 struct FoundPhoton
 {
 	FoundPhoton() {};
 	FoundPhoton(const Photon *p, float d): photon_(p), dist_square_(d) {}
+	FoundPhoton(const CompactPhoton *p, float d): compact_photon_(p), dist_square_(d), compact_(true) {}
 	bool operator<(const FoundPhoton &p_2) const { return dist_square_ < p_2.dist_square_; }
-	const Photon *photon_;
+	bool found() const { return photon_ != nullptr; }
+	Rgb color() const { return compact_ ? compact_photon_->color() : photon_->color(); }
+	Vec3 direction() const { return compact_ ? compact_photon_->direction() : photon_->direction(); }
+	union
+	{
+		const Photon *photon_ = nullptr;
+		const CompactPhoton *compact_photon_;
+	};
 	float dist_square_;
-	//temp!!
-	float dis_;
+	bool compact_ = false;
 };
 
 class PhotonMap
@@ -114,32 +115,44 @@ class PhotonMap
 	public:
 		PhotonMap(): paths_(0), updated_(false), search_radius_(1.f), tree_(nullptr) { }
 		PhotonMap(const std::string &mapname, int threads): paths_(0), updated_(false), search_radius_(1.f), tree_(nullptr), name_(mapname), threads_pkd_tree_(threads) { }
-		~PhotonMap() { if(tree_) delete tree_; }
+		~PhotonMap() { clear(); }
 		void setNumPaths(int n) { paths_ = n; }
 		void setName(const std::string &mapname) { name_ = mapname; }
 		void setNumThreadsPkDtree(int threads) { threads_pkd_tree_ = threads; }
+		//! Selects the CompactPhoton layout for the photons added from now on. It must be set while the map is empty
+		void setCompact(bool compact) { compact_ = compact; }
+		bool isCompact() const { return compact_; }
 		int nPaths() const { return paths_; }
-		int nPhotons() const { return photons_.size(); }
-		void pushPhoton(Photon &p) { photons_.push_back(p); updated_ = false; }
-		void swapVector(std::vector<Photon> &vec) { photons_.swap(vec); updated_ = false; }
-		void appendVector(std::vector<Photon> &vec, unsigned int curr) { photons_.insert(std::end(photons_), std::begin(vec), std::end(vec)); updated_ = false; paths_ += curr;}
-		void reserveMemory(size_t num_photons) { photons_.reserve(num_photons); }
+		int nPhotons() const;
+		void pushPhoton(Photon &p);
+		void swapVector(std::vector<Photon> &vec);
+		void appendVector(std::vector<Photon> &vec, unsigned int curr);
+		void reserveMemory(size_t num_photons);
 		void updateTree();
-		void clear() { photons_.clear(); delete tree_; tree_ = nullptr; updated_ = false; }
+		void clear();
 		bool ready() const { return updated_; }
 		//	void gather(const point3d_t &P, std::vector< foundPhoton_t > &found, unsigned int K, float &sqRadius) const;
 		int gather(const Point3 &p, FoundPhoton *found, unsigned int k, float &sq_radius) const;
-		const Photon *findNearest(const Point3 &p, const Vec3 &n, float dist) const;
+		/*! Gathers the photons for several points at once, sharing the traversal of the tree between points close to each
+			other. The k photons found for each point are stored consecutively in "found", their number in "n_found" */
+		void gather(const Point3 *points, uint32_t n_points, FoundPhoton *found, int *n_found, unsigned int k, float *sq_radius) const;
+		FoundPhoton findNearest(const Point3 &p, const Vec3 &n, float dist) const;
 		bool load(const std::string &filename);
 		bool save(const std::string &filename) const;
 		std::mutex mutx_;
 
 	protected:
+		bool loadLegacy(const std::string &filename);
+
 		std::vector<Photon> photons_;
+		std::vector<CompactPhoton> compact_photons_;
+		bool compact_ = false;
 		int paths_; //!< amount of photon paths that have been traced for generating the map
 		bool updated_;
 		float search_radius_;
 		kdtree::PointKdTree<Photon> *tree_ = nullptr;
+		kdtree::PointKdTree<CompactPhoton> *compact_tree_ = nullptr;
+		MappedFile *mapped_file_ = nullptr; //!< file with the photons and tree nodes used directly by the tree when the map was loaded from a file
 		std::string name_;
 		int threads_pkd_tree_ = 1;
 };
@@ -148,9 +161,8 @@ class PhotonMap
 
 struct PhotonGather
 {
-	PhotonGather(uint32_t mp, const Point3 &p);
-	void operator()(const Photon *photon, float dist_2, float &max_dist_squared) const;
-	const Point3 &p_;
+	PhotonGather(uint32_t mp = 0, FoundPhoton *photons = nullptr): photons_(photons), n_lookup_(mp), found_photons_(0) {}
+	template <class T> void operator()(const T *photon, float dist_2, float &max_dist_squared) const;
 	FoundPhoton *photons_;
 	uint32_t n_lookup_;
 	mutable uint32_t found_photons_;
@@ -158,14 +170,14 @@ struct PhotonGather
 
 struct NearestPhoton
 {
-	NearestPhoton(const Point3 &pos, const Vec3 &norm): p_(pos), n_(norm), nearest_(nullptr) {}
-	void operator()(const Photon *photon, float dist_2, float &max_dist_squared) const
+	NearestPhoton(const Point3 &pos, const Vec3 &norm): p_(pos), n_(norm) {}
+	template <class T> void operator()(const T *photon, float dist_2, float &max_dist_squared) const
 	{
-		if(photon->direction() * n_ > 0.f) { nearest_ = photon; max_dist_squared = dist_2; }
+		if(photon->direction() * n_ > 0.f) { nearest_ = FoundPhoton(photon, dist_2); max_dist_squared = dist_2; }
 	}
 	const Point3 p_; //wth do i need this for actually??
 	const Vec3 n_;
-	mutable const Photon *nearest_;
+	mutable FoundPhoton nearest_;
 };
 
 /*! "eliminates" photons within lookup radius (sets use=false) */
@@ -179,34 +191,6 @@ struct EliminatePhoton
 	const Vec3 n_;
 };
 
-#ifdef SMALL_PHOTONS
-class DirConverter
-{
-	public:
-		DirConverter();
-
-		Vec3 convert(unsigned char theta, unsigned char phi)
-		{
-			return {sintheta_[theta] * cosphi_[phi],
-					sintheta_[theta] * sinphi_[phi],
-					costheta_[theta]};
-		}
-		std::pair<unsigned char, unsigned char> convert(const Vec3 &dir);
-
-	protected:
-		static constexpr double c_255_ratio_ = 81.16902097686662123083;
-		static constexpr double c_256_ratio_ = 40.74366543152520595687;
-		static constexpr double c_inv_255_ratio_ = 0.01231997119054820878;
-		static constexpr double c_inv_256_ratio_ = 0.02454369260617025968;
-		float cosphi_[256];
-		float sinphi_[256];
-		float costheta_[255];
-		float sintheta_[255];
-};
-
-extern DirConverter dirconverter__;
-#endif // SMALL_PHOTONS
-
 END_YAFARAY
 
 #endif // YAFARAY_PHOTON_H
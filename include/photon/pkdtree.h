@@ -36,13 +36,17 @@ namespace kdtree
 
 #define NON_REC_LOOKUP 1
 
+/*! The leaves hold a bucket of elements, referenced by the position of
+	its first element in the leaf arrays of the tree. The nodes do not
+	depend on the address of the elements and can be saved to a file and
+	used again directly from it */
 template <class T>
 struct KdNode
 {
-	void createLeaf(const T *d)
+	void createLeaf(uint32_t first_element, uint32_t n_elements)
 	{
-		flags_ = 3;
-		data_ = d;
+		flags_ = 3 | (n_elements << 2);
+		first_element_ = first_element;
 	}
 	void createInterior(int axis, float d)
 	{
@@ -55,10 +59,11 @@ struct KdNode
 	bool 	isLeaf() const { return (flags_ & 3) == 3; }
 	uint32_t	getRightChild() const { return (flags_ >> 2); }
 	void 	setRightChild(uint32_t i) { flags_ = (flags_ & 3) | (i << 2); }
+	uint32_t	getFirstElement() const { return first_element_; }
 	union
 	{
 		float division_;
-		const T *data_;
+		uint32_t first_element_;
 	};
 	uint32_t	flags_;
 };
@@ -79,10 +84,28 @@ class PointKdTree
 	public:
 		PointKdTree() {};
 		PointKdTree(const std::vector<T> &dat, const std::string &map_name, int num_threads = 1);
-		~PointKdTree() { if(nodes_) free(nodes_); }
+		//! Uses an already built tree, for example mapped from a file. The arrays are not copied and must remain valid during the life of the tree
+		PointKdTree(const T *elements, uint32_t n_elements, const KdNode<T> *nodes, uint32_t n_nodes, const uint32_t *leaf_elements, const float *leaf_positions);
+		~PointKdTree() { if(owns_nodes_) free(const_cast<KdNode<T> *>(nodes_)); }
 		template<class LookupProc> void lookup(const Point3 &p, const LookupProc &proc, float &max_dist_squared) const;
+		/*! Lookup for several points at once, each one with its own process and radius. The upper nodes are traversed
+			once for all the points while they are on the same side of the splits, so points close to each other share
+			that part of the traversal. The nodes are then visited in the same order as in the lookups of single points */
+		template<class LookupProc> void lookup(const Point3 *points, const LookupProc *procs, float *max_dist_squared, uint32_t n_points) const;
+		const T *elements() const { return elements_; }
+		const KdNode<T> *nodes() const { return nodes_; }
+		uint32_t nNodes() const { return next_free_node_; }
+		uint32_t nElements() const { return n_elements_; }
+		const uint32_t *leafElements() const { return leaf_elements_; } //!< index of the elements in the order of the leaves, so consecutive elements are close to each other
+		const float *leafPositions() const { return leaf_positions_; }
+		//! Checks that the nodes and leaves reference only nodes and elements within the arrays, and that the tree fits in the lookup stacks, before using a tree read from a file
+		static bool validTree(const KdNode<T> *nodes, uint32_t n_nodes, const uint32_t *leaf_elements, uint32_t n_elements);
+		static constexpr uint32_t bucket_size_ = 8; //!< maximum number of elements in a leaf
 	protected:
 		template<class LookupProc> void recursiveLookup(const Point3 &p, const LookupProc &proc, float &max_dist_squared, int node_num) const;
+		struct KdStack;
+		template<class LookupProc> void stackLookup(const Point3 &p, const LookupProc &proc, float &max_dist_squared, const KdNode<T> *curr_node, KdStack *stack, int stack_ptr) const;
+		template<class LookupProc> void leafLookup(const KdNode<T> *node, const Point3 &p, const LookupProc &proc, float &max_dist_squared) const;
 		struct KdStack
 		{
 			const KdNode<T> *node_; //!< pointer to far child
@@ -91,8 +114,14 @@ class PointKdTree
 		};
 		void buildTree(uint32_t start, uint32_t end, Bound &node_bound, const T **prims);
 		void buildTreeWorker(uint32_t start, uint32_t end, Bound &node_bound, const T **prims, int level, uint32_t &local_next_free_node, KdNode<T> *local_nodes);
-		KdNode<T> *nodes_;
-		uint32_t n_elements_, next_free_node_;
+		const T *elements_ = nullptr;
+		const KdNode<T> *nodes_ = nullptr;
+		const uint32_t *leaf_elements_ = nullptr;
+		const float *leaf_positions_ = nullptr; //!< positions of the elements in the order of the leaves, as three arrays of x, y and z coordinates, so the elements of a bucket are tested with vector instructions
+		std::vector<uint32_t> leaf_elements_buffer_;
+		std::vector<float> leaf_positions_buffer_;
+		bool owns_nodes_ = false;
+		uint32_t n_elements_ = 0, next_free_node_ = 0;
 		Bound tree_bound_;
 		int max_level_threads_ = 0;  //max level where we will launch threads. We will try to launch at least as many threads as scene threads parameter
 		static constexpr unsigned int kd_max_stack_ = 64;
@@ -111,7 +140,9 @@ PointKdTree<T>::PointKdTree(const std::vector<T> &dat, const std::string &map_na
 		return;
 	}
 
-	nodes_ = (KdNode<T> *) malloc(4 * n_elements_ * sizeof(KdNode<T>)); //actually we could allocate one less...2n-1
+	elements_ = dat.data();
+	nodes_ = (KdNode<T> *) malloc(2 * n_elements_ * sizeof(KdNode<T>)); //enough for leaves of a single element, trimmed after the build
+	owns_nodes_ = true;
 
 	const T **elements = new const T*[n_elements_];
 
@@ -127,25 +158,82 @@ PointKdTree<T>::PointKdTree(const std::vector<T> &dat, const std::string &map_na
 	Y_INFO << "pointKdTree: Starting " << map_name << " recusive tree build for " << n_elements_ << " elements [using " << real_threads << " threads]" << YENDL;
 
 	buildTree(0, n_elements_, tree_bound_, elements);
+	nodes_ = (KdNode<T> *) realloc(const_cast<KdNode<T> *>(nodes_), next_free_node_ * sizeof(KdNode<T>));
+
+	//the build leaves the elements of each leaf contiguous in the elements array, in the order of the leaves
+	leaf_elements_buffer_.resize(n_elements_);
+	leaf_positions_buffer_.resize(3 * n_elements_);
+	for(uint32_t i = 0; i < n_elements_; ++i)
+	{
+		leaf_elements_buffer_[i] = elements[i] - elements_;
+		for(int axis = 0; axis < 3; ++axis) leaf_positions_buffer_[axis * n_elements_ + i] = elements[i]->pos_[axis];
+	}
+	leaf_elements_ = leaf_elements_buffer_.data();
+	leaf_positions_ = leaf_positions_buffer_.data();
 
 	Y_VERBOSE << "pointKdTree: " << map_name << " tree built." << YENDL;
 
 	delete[] elements;
 }
 
+template<class T>
+PointKdTree<T>::PointKdTree(const T *elements, uint32_t n_elements, const KdNode<T> *nodes, uint32_t n_nodes, const uint32_t *leaf_elements, const float *leaf_positions)
+	: elements_(elements), nodes_(nodes), leaf_elements_(leaf_elements), leaf_positions_(leaf_positions), n_elements_(n_elements), next_free_node_(n_nodes)
+{
+}
+
+template<class T>
+bool PointKdTree<T>::validTree(const KdNode<T> *nodes, uint32_t n_nodes, const uint32_t *leaf_elements, uint32_t n_elements)
+{
+	if(n_nodes == 0) return false;
+	for(uint32_t i = 0; i < n_nodes; ++i)
+	{
+		const KdNode<T> &node = nodes[i];
+		if(node.isLeaf())
+		{
+			if(node.nPrimitives() == 0 || static_cast<uint32_t>(node.nPrimitives()) > bucket_size_ || node.getFirstElement() >= n_elements || node.getFirstElement() + node.nPrimitives() > n_elements) return false;
+		}
+		else if(i + 1 >= n_nodes || node.getRightChild() <= i || node.getRightChild() >= n_nodes) return false;
+	}
+	for(uint32_t i = 0; i < n_elements; ++i) if(leaf_elements[i] >= n_elements) return false;
+	//the lookups push the far child of each interior node crossed into a stack of kd_max_stack_ entries, after the
+	//unused first entry and the termination flag, so deeper trees are rejected. A median split never needs more than about 32 levels
+	struct WalkNode
+	{
+		uint32_t node_;
+		uint32_t depth_; //!< interior nodes crossed from the root
+	};
+	std::vector<WalkNode> walk_stack(1, WalkNode{0, 0});
+	uint32_t n_visited = 0; //each node of a valid tree is reached once, so shared children cannot make the walk explode
+	while(!walk_stack.empty())
+	{
+		WalkNode walk_node = walk_stack.back();
+		walk_stack.pop_back();
+		while(true)
+		{
+			if(++n_visited > n_nodes) return false;
+			if(nodes[walk_node.node_].isLeaf()) break;
+			if(walk_node.depth_ + 2 >= kd_max_stack_) return false;
+			walk_stack.push_back(WalkNode{nodes[walk_node.node_].getRightChild(), walk_node.depth_ + 1});
+			walk_node = WalkNode{walk_node.node_ + 1, walk_node.depth_ + 1};
+		}
+	}
+	return true;
+}
+
 template<class T>
 void PointKdTree<T>::buildTree(uint32_t start, uint32_t end, Bound &node_bound, const T **prims)
 {
-	buildTreeWorker(start, end, node_bound, prims, 0, next_free_node_, nodes_);
+	buildTreeWorker(start, end, node_bound, prims, 0, next_free_node_, const_cast<KdNode<T> *>(nodes_));
 }
 
 template<class T>
 void PointKdTree<T>::buildTreeWorker(uint32_t start, uint32_t end, Bound &node_bound, const T **prims, int level, uint32_t &local_next_free_node, KdNode<T> *local_nodes)
 {
 	++level;
-	if(end - start == 1)
+	if(end - start <= bucket_size_)
 	{
-		local_nodes[local_next_free_node].createLeaf(prims[start]);
+		local_nodes[local_next_free_node].createLeaf(start, end - start);
 		local_next_free_node++;
 		--level;
 		return;
@@ -170,12 +258,12 @@ void PointKdTree<T>::buildTreeWorker(uint32_t start, uint32_t end, Bound &node_b
 	{
 		//<< recurse below child >>
 		uint32_t next_free_node_1 = 0;
-		auto *nodes_1 = (KdNode<T> *) malloc(4 * (split_el - start) * sizeof(KdNode<T>));
+		auto *nodes_1 = (KdNode<T> *) malloc(2 * (split_el - start) * sizeof(KdNode<T>));
 		auto below_worker = std::thread( &PointKdTree<T>::buildTreeWorker, this, start, split_el, std::ref(bound_l), prims, level, std::ref(next_free_node_1), nodes_1 );
 
 		//<< recurse above child >>
 		uint32_t next_free_node_2 = 0;
-		auto *nodes_2 = (KdNode<T> *) malloc(4 * (end - split_el) * sizeof(KdNode<T>));
+		auto *nodes_2 = (KdNode<T> *) malloc(2 * (end - split_el) * sizeof(KdNode<T>));
 		auto above_worker = std::thread( &PointKdTree<T>::buildTreeWorker, this, split_el, end, std::ref(bound_r), prims, level, std::ref(next_free_node_2), nodes_2 );
 
 		below_worker.join();
@@ -229,11 +317,24 @@ void PointKdTree<T>::lookup(const Point3 &p, const LookupProc &proc, float &max_
 {
 #if NON_REC_LOOKUP > 0
 	KdStack stack[kd_max_stack_];
-	const KdNode<T> *far_child, *curr_node = nodes_;
-
 	int stack_ptr = 1;
 	stack[stack_ptr].node_ = nullptr; // "nowhere", termination flag
+	stackLookup(p, proc, max_dist_squared, nodes_, stack, stack_ptr);
+#else
+	recursiveLookup(p, proc, maxDistSquared, 0);
+	++Y_LOOKUPS;
+	if(Y_LOOKUPS == 159999)
+	{
+		Y_VERBOSE << "pointKd-Tree:average photons tested per lookup:" << double(Y_PROCS) / double(Y_LOOKUPS) << YENDL;
+	}
+#endif
+}
 
+//! Non recursive lookup from a node, with the stack of the far children of its ancestors still to be checked
+template<class T> template<class LookupProc>
+void PointKdTree<T>::stackLookup(const Point3 &p, const LookupProc &proc, float &max_dist_squared, const KdNode<T> *curr_node, KdStack *stack, int stack_ptr) const
+{
+	const KdNode<T> *far_child;
 	while(true)
 	{
 		while(!curr_node->isLeaf())
@@ -258,18 +359,12 @@ void PointKdTree<T>::lookup(const Point3 &p, const LookupProc &proc, float &max_
 		}
 
 		// Hand leaf-data kd-tree to processing function
-		Vec3 v = curr_node->data_->pos_ - p;
-		float dist_2 = v.lengthSqr();
-
-		if(dist_2 < max_dist_squared)
-		{
-			proc(curr_node->data_, dist_2, max_dist_squared);
-		}
+		leafLookup(curr_node, p, proc, max_dist_squared);
 
 		if(!stack[stack_ptr].node_) return; // stack empty, done.
 		//radius probably lowered so we may pop additional elements:
 		int axis = stack[stack_ptr].axis_;
-		dist_2 = p[axis] - stack[stack_ptr].s_;
+		float dist_2 = p[axis] - stack[stack_ptr].s_;
 		dist_2 *= dist_2;
 
 		while(dist_2 > max_dist_squared)
@@ -283,14 +378,6 @@ void PointKdTree<T>::lookup(const Point3 &p, const LookupProc &proc, float &max_
 		curr_node = stack[stack_ptr].node_;
 		--stack_ptr;
 	}
-#else
-	recursiveLookup(p, proc, maxDistSquared, 0);
-	++Y_LOOKUPS;
-	if(Y_LOOKUPS == 159999)
-	{
-		Y_VERBOSE << "pointKd-Tree:average photons tested per lookup:" << double(Y_PROCS) / double(Y_LOOKUPS) << YENDL;
-	}
-#endif
 }
 
 template<class T> template<class LookupProc>
@@ -299,12 +386,7 @@ void PointKdTree<T>::recursiveLookup(const Point3 &p, const LookupProc &proc, fl
 	const KdNode<T> *curr_node = &nodes_[node_num];
 	if(curr_node->isLeaf())
 	{
-		Vec3 v = curr_node->data_->pos_ - p;
-		float dist_2 = v.lengthSqr();
-		if(dist_2 < max_dist_squared)
-		{
-			proc(curr_node->data_, dist_2, max_dist_squared);
-		}
+		leafLookup(curr_node, p, proc, max_dist_squared);
 		return;
 	}
 	int axis = curr_node->splitAxis();
@@ -324,6 +406,61 @@ void PointKdTree<T>::recursiveLookup(const Point3 &p, const LookupProc &proc, fl
 	}
 }
 
+template<class T> template<class LookupProc>
+inline void PointKdTree<T>::leafLookup(const KdNode<T> *node, const Point3 &p, const LookupProc &proc, float &max_dist_squared) const
+{
+	const uint32_t first = node->getFirstElement();
+	const uint32_t n = node->nPrimitives();
+	const float *x = leaf_positions_ + first;
+	const float *y = x + n_elements_;
+	const float *z = y + n_elements_;
+	//the distances of the whole bucket are computed first in a loop without branches, so it can be vectorized
+	float dist_2[bucket_size_];
+	for(uint32_t i = 0; i < n; ++i)
+	{
+		const float dx = x[i] - p.x_;
+		const float dy = y[i] - p.y_;
+		const float dz = z[i] - p.z_;
+		dist_2[i] = dx * dx + dy * dy + dz * dz;
+	}
+	for(uint32_t i = 0; i < n; ++i)
+	{
+		//max_dist_squared can be lowered by each processed element
+		if(dist_2[i] < max_dist_squared) proc(&elements_[leaf_elements_[first + i]], dist_2[i], max_dist_squared);
+	}
+}
+
+template<class T> template<class LookupProc>
+void PointKdTree<T>::lookup(const Point3 *points, const LookupProc *procs, float *max_dist_squared, uint32_t n_points) const
+{
+	if(n_points == 0) return;
+	//the nodes are descended once for all the points while they are all on the same side of the splits, so they share the same far children in their stacks
+	KdStack shared_stack[kd_max_stack_];
+	int shared_stack_ptr = 1;
+	shared_stack[shared_stack_ptr].node_ = nullptr; // "nowhere", termination flag
+	const KdNode<T> *shared_node = nodes_;
+	while(!shared_node->isLeaf())
+	{
+		const int axis = shared_node->splitAxis();
+		const float split_val = shared_node->splitPos();
+		const bool below = points[0][axis] <= split_val;
+		bool same_side = true;
+		for(uint32_t i = 1; i < n_points && same_side; ++i) same_side = (points[i][axis] <= split_val) == below;
+		if(!same_side) break;
+		++shared_stack_ptr;
+		shared_stack[shared_stack_ptr].node_ = below ? &nodes_[shared_node->getRightChild()] : shared_node + 1;
+		shared_stack[shared_stack_ptr].axis_ = axis;
+		shared_stack[shared_stack_ptr].s_ = split_val;
+		shared_node = below ? shared_node + 1 : &nodes_[shared_node->getRightChild()];
+	}
+	KdStack stack[kd_max_stack_];
+	for(uint32_t i = 0; i < n_points; ++i)
+	{
+		std::copy(shared_stack, shared_stack + shared_stack_ptr + 1, stack);
+		stackLookup(points[i], procs[i], max_dist_squared[i], shared_node, stack, shared_stack_ptr);
+	}
+}
+
 } // namespace::kdtree
 
 END_YAFARAY
@@ -68,6 +68,7 @@ class LIBYAFARAY_EXPORT ImageFilm final
 			enum Mode : int { None, Save, LoadAndSave };
 			Mode mode_ = Mode::None;
 			std::string path_ = "./";
+			bool compression_ = false; //!< compress the saved film files, only if built with ZLib
 			AutoSaveParams auto_save_;
 		};
 
@@ -84,10 +85,15 @@ class LIBYAFARAY_EXPORT ImageFilm final
 			\param adaptive_aa if true, flag pixels to be resampled
 			\param threshold color threshold for adaptive antialiasing */
 		int nextPass(const RenderView *render_view, RenderControl &render_control, bool adaptive_aa, std::string integrator_name, bool skip_nrender_layer = false);
-		/*! Return the next area to be rendered
+		/*! Return the next area to be rendered by the thread "thread_id"
 			CAUTION! This method MUST be threadsafe!
 			\return false if no area is left to be handed out, true otherwise */
-		bool nextArea(RenderArea &a);
+		bool nextArea(int thread_id, RenderArea &a);
+		/*! Highlight in the interactive outputs an area that started rendering */
+		void highlightArea(const RenderArea &a);
+		/*! Add to the image film the samples accumulated by the render thread in the area.
+			It must be called by the thread that rendered the area, before finishArea */
+		void mergeArea(RenderArea &a);
 		/*! Indicate that all pixels inside the area have been sampled for this pass */
 		void finishArea(const RenderView *render_view, RenderControl &render_control, RenderArea &a);
 		/*! Output all pixels to the color output */
@@ -100,8 +106,9 @@ class LIBYAFARAY_EXPORT ImageFilm final
 		/*!	Add image sample; dx and dy describe the position in the pixel (x,y).
 			IMPORTANT: when a is given, all samples within a are assumed to come from the same thread!
 			use a=0 for contributions outside the area associated with current thread!
+			The samples given with an area are only visible in the image film after mergeArea
 		*/
-		void addSample(int x, int y, float dx, float dy, const RenderArea *a = nullptr, int num_sample = 0, int aa_pass_number = 0, float inv_aa_max_possible_samples = 0.1f, ColorLayers *color_layers = nullptr);
+		void addSample(int x, int y, float dx, float dy, RenderArea *a = nullptr, int num_sample = 0, int aa_pass_number = 0, float inv_aa_max_possible_samples = 0.1f, ColorLayers *color_layers = nullptr);
 		/*!	Add light density sample; dx and dy describe the position in the pixel (x,y).
 			IMPORTANT: when a is given, all samples within a are assumed to come from the same thread!
 			use a=0 for contributions outside the area associated with current thread!
@@ -117,7 +124,7 @@ class LIBYAFARAY_EXPORT ImageFilm final
 		void setProgressBar(ProgressBar *pb);
 		/*! The following methods set the strings used for the parameters badge rendering */
 		int getTotalPixels() const { return width_ * height_; };
-		void setAaNoiseParams(const AaNoiseParams &aa_noise_params) { aa_noise_params_ = aa_noise_params; };
+		void setAaNoiseParams(const AaNoiseParams &aa_noise_params);
 		/*! Methods for rendering the parameters badge; Note that FreeType lib is needed to render text */
 		float darkThresholdCurveInterpolate(float pixel_brightness);
 		int getWidth() const { return width_; }
@@ -137,6 +144,8 @@ class LIBYAFARAY_EXPORT ImageFilm final
 
 		std::string getFilmPath() const;
 		bool imageFilmLoad(const std::string &filename);
+		//! Adds the weights and colors of a chunked film file to this film, chunk by chunk. The bands of rows in "rows_mutexes" are locked while adding each chunk, so several files can be added at the same time
+		bool imageFilmAdd(const std::string &filename, std::mutex *rows_mutexes, unsigned int &sampling_offset, unsigned int &base_sampling_offset);
 		void imageFilmLoadAllInFolder(RenderControl &render_control);
 		bool imageFilmSave();
 		void imageFilmFileBackup() const;
@@ -151,6 +160,19 @@ class LIBYAFARAY_EXPORT ImageFilm final
 		const ImageLayers *getImageLayers() const { return &image_layers_; }
 
 	private:
+		//! Buffers used by each thread to detect the AA noise of a band of columns, see detectAaNoise
+		struct AaNoiseBandData
+		{
+			std::vector<float> bri_, threshold_, diff_x_, diff_y_;
+			std::array<std::vector<float>, 4> rgba_;
+			std::vector<unsigned char> sources_, variance_;
+			std::vector<int> count_;
+		};
+		void initAreaSamples(RenderArea &a) const;
+		int detectAaNoise(int x_0, int x_1, AaNoiseBandData &data);
+		int detectUnconvergedPixels();
+		bool convergenceResampling() const { return moments_ && aa_noise_params_.resample_mode_ == AaNoiseParams::ResampleMode::Convergence; }
+
 		int width_, height_, cx_0_, cx_1_, cy_0_, cy_1_;
 		int badge_height_; //!< height of the rendering parameters badge;
 		bool show_mask_;
@@ -160,16 +182,18 @@ class LIBYAFARAY_EXPORT ImageFilm final
 		int n_passes_;
 		unsigned int computer_node_ = 0;	//Computer node in multi-computer render environments/render farms
 		int n_pass_;
-		volatile int next_area_;
+		std::atomic<bool> area_taken_ {false}; //!< whether the single area of a non-split render was already handed out in this pass
 		int area_cnt_, completed_cnt_;
 		bool split_ = true;
+		static constexpr int aa_noise_band_width_ = 64; //!< width of the bands of columns processed by each thread in detectAaNoise
+		static constexpr float convergence_min_brightness_ = 0.01f; //!< pixels darker than this use it instead of their brightness as reference for their relative error
 		bool abort_ = false;
 		bool background_resampling_ = true;   //If false, the background will not be resampled in subsequent adaptative AA passes
 		//Options for Film saving/loading correct sampling, as well as multi computer film saving
 		unsigned int base_sampling_offset_ = 0;	//Base sampling offset, in case of multi-computer rendering each should have a different offset so they don't "repeat" the same samples (user configurable)
 		unsigned int sampling_offset_ = 0;	//To ensure sampling after loading the image film continues and does not repeat already done samples
 		bool estimate_density_ = false;
-		int num_density_samples_ = 0;
+		std::atomic<int> num_density_samples_ {0};
 		AaNoiseParams aa_noise_params_;
 		const Layers &layers_;
 		const std::map<std::string, ColorOutput *> &outputs_;
@@ -184,12 +208,16 @@ class LIBYAFARAY_EXPORT ImageFilm final
 		float filterw_, table_scale_;
 		float *filter_table_ = nullptr;
 		// Thread mutes for shared access
-		std::mutex image_mutex_, splitter_mutex_, out_mutex_, density_image_mutex_;
+		std::mutex image_mutex_, out_mutex_;
+		static constexpr int density_rows_per_mutex_ = 16;
+		static constexpr int film_rows_per_mutex_ = 16; //!< band of rows locked while merging the film files
+		std::unique_ptr<std::mutex[]> density_rows_mutexes_; //!< the density image is locked in bands of rows, as the light samples can land anywhere in the image
 
 		FlagsBuffer_t flags_; //!< flags for adaptive AA sampling;
 		Gray2DImage_t weights_;
 		ImageLayers image_layers_;
 		Rgb2DImage_t *density_image_; //!< storage for z-buffer channel
+		MomentsBuffer_t *moments_ = nullptr; //!< brightness moments of the samples of each pixel, only allocated in the Convergence resample mode
 };
 
 END_YAFARAY
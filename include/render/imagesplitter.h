@@ -21,12 +21,25 @@
 #define YAFARAY_IMAGESPLITTER_H
 
 #include "constants.h"
+#include "image/image_buffers.h"
 
 #include <vector>
+#include <atomic>
+#include <memory>
 #include <cmath>
+#include <cstdint>
 
 BEGIN_YAFARAY
 
+/*! Samples accumulated by a render thread for its current area, see ImageFilm::addSample */
+struct AreaSamples
+{
+	int x_0_ = 0, y_0_ = 0, w_ = 0, h_ = 0; //!< pixels covered: the area plus the filter border around it
+	int stride_ = 0; //!< floats per pixel: the filter weight followed by the RGBA of each image layer
+	std::vector<float> data_;
+	std::vector<PixelMoments> moments_; //!< brightness moments of each pixel, only when the film estimates the convergence of the pixels
+};
+
 struct RenderArea
 {
 	RenderArea(int x, int y, int w, int h): x_(x), y_(y), w_(w), h_(h),
@@ -62,10 +75,15 @@ struct RenderArea
 	//	std::vector<Rgba> image;
 	//	std::vector<float> depth;
 	std::vector<bool> resample_;
+	AreaSamples samples_; //!< samples of this area not yet added to the image film
 };
 
 /*!	Splits the image to be rendered into pieces, e.g. "buckets" for
 	different threads.
+	The areas are dealt to one queue per render thread, so each thread
+	works on its own tiles, and a thread that runs out of tiles steals
+	the smallest remaining tiles from the thread with most work left.
+	Taking tiles is lock-free.
 	CAUTION! Some methods need to be thread save!
 */
 class ImageSplitter final
@@ -83,13 +101,40 @@ class ImageSplitter final
 			\return false if n is out of range, true otherwise
 		*/
 		bool getArea(int n, RenderArea &area);
+		/*! take the next area to be rendered by the thread "thread_id", from its own queue
+			or stolen from the other threads' queues. Thread safe and lock-free.
+			\return false if no area is left in this pass, true otherwise
+		*/
+		bool nextArea(int thread_id, RenderArea &area);
+		/*! make all the areas available again for a new pass.
+			CAUTION! Not thread safe, it must not be called while rendering
+		*/
+		void resetQueues();
 
 		bool empty() const {return regions_.empty();};
 		int size() const {return static_cast<int>(regions_.size());};
 
 	private:
+		/*! Queue of the areas of a render thread. The region indices are fixed
+			during a pass, the owner takes them from the front and the other
+			threads steal them from the back, both packed in a single atomic
+			so they can be updated with one compare and swap */
+		struct TileQueue
+		{
+			std::vector<int> regions_;
+			std::atomic<uint64_t> range_ {0}; //!< front (low 32 bits) and back (high 32 bits) indices of the areas left in regions_
+			char padding_[64 - sizeof(std::atomic<uint64_t>)]; //!< keep the queues of different threads in different cache lines
+		};
+		static uint64_t packRange(uint32_t front, uint32_t back) { return (static_cast<uint64_t>(back) << 32) | front; }
+		static uint32_t rangeFront(uint64_t range) { return static_cast<uint32_t>(range); }
+		static uint32_t rangeBack(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+		bool popFront(TileQueue &queue, int &region_index);
+		bool popBack(TileQueue &queue, int &region_index);
+
 		int width_, height_, blocksize_;
 		std::vector<Region> regions_;
+		std::unique_ptr<TileQueue[]> queues_;
+		int num_queues_ = 0;
 		TilesOrderType tilesorder_;
 };
 
@@ -21,11 +21,25 @@
 #define YAFARAY_RENDER_DATA_H
 
 #include "constants.h"
+#include <unordered_map>
 
 BEGIN_YAFARAY
 
 class Random;
 class Camera;
+class SurfacePoint;
+class Light;
+class Triangle;
+class Primitive;
+
+/*! Last primitive which occluded a shadow ray towards a light. It is tested
+	first by the next shadow ray towards the same light, as neighbouring shadow
+	rays are often blocked by the same primitive */
+struct ShadowCache
+{
+	Triangle *triangle_ = nullptr;
+	Primitive *primitive_ = nullptr;
+};
 
 class RenderData final
 {
@@ -58,6 +72,10 @@ class RenderData final
 		float time_ = 0.f; //!< the current (normalized) frame time
 		const Camera *cam_ = nullptr;
 		Random *const prng_ = nullptr; //!< a pseudorandom number generator
+		bool camera_ray_intersected_ = false; //!< the camera ray was already intersected with the scene in a ray packet, with result camera_ray_sp_
+		const SurfacePoint *camera_ray_sp_ = nullptr; //!< surface point hit by the camera ray when already intersected, nullptr if it hit nothing
+		const Light *shadow_light_ = nullptr; //!< light towards which the shadow rays are being traced, nullptr if unknown (then the shadow cache is not used)
+		std::unordered_map<const Light *, ShadowCache> shadow_cache_; //!< last occluders of the shadow rays of each light in this render thread
 		mutable void *arena_ = nullptr; //!< a fixed amount of memory where materials may keep data to avoid recalculations...really need better memory management :(
 };
 
@@ -101,6 +101,11 @@ class LIBYAFARAY_EXPORT Scene
 		virtual bool intersect(const DiffRay &ray, SurfacePoint &sp) const = 0;
 		virtual bool isShadowed(RenderData &render_data, const Ray &ray, float &obj_index, float &mat_index) const = 0;
 		virtual bool isShadowed(RenderData &render_data, const Ray &ray, int max_depth, Rgb &filt, float &obj_index, float &mat_index) const = 0;
+		/*! Intersects several rays at once using ray packets, equivalent to calling intersect() for each ray */
+		virtual void intersect(const DiffRay *rays, int n_rays, SurfacePoint *sp, bool *hit) const = 0;
+		/*! Shadow test of several rays at once using ray packets, equivalent to calling isShadowed() (without transparent shadows) for each ray in order.
+			obj_index[0] and mat_index[0] hold the indices before the first ray, and each ray gets the indices left by the rays up to it */
+		virtual void isShadowed(RenderData &render_data, const Ray *rays, int n_rays, bool *shadowed, float *obj_index, float *mat_index) const = 0;
 		virtual TriangleObject *getMesh(const std::string &name) const = 0;
 		virtual ObjectGeometric *getObject(const std::string &name) const = 0;
 
@@ -115,6 +120,8 @@ class LIBYAFARAY_EXPORT Scene
 		void setNumThreads(int threads);
 		void setNumThreadsPhotons(int threads_photons);
 		void setMode(int m) { mode_ = m; }
+		void setAcceleratorType(const std::string &accelerator_type);
+		void setAcceleratorCacheDir(const std::string &cache_dir, int cache_max_size);
 		void clearNonGeometry();
 		void clearAll();
 		bool render();
@@ -207,6 +214,9 @@ class LIBYAFARAY_EXPORT Scene
 		int nthreads_ = 1;
 		int nthreads_photons_ = 1;
 		int mode_ = 0; //!< sets the scene mode (0=triangle-only, 1=virtual primitives)
+		std::string accelerator_type_ = "kdtree"; //!< type of the ray intersection accelerator built for the scene geometry ("kdtree" or "bvh")
+		std::string accelerator_cache_dir_; //!< directory where the built kd-trees are cached to be reused by later renders of the same geometry, disabled if empty
+		int accelerator_cache_max_size_ = 1024; //!< maximum size in MB of the accelerator cache directory, the oldest cache files are removed above it. 0 for no limit
 
 		std::map<std::string, Light *> lights_;
 		std::map<std::string, Material *> materials_;
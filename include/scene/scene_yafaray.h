@@ -28,6 +28,9 @@ class MeshObject;
 class Triangle;
 template <typename T> class Accelerator;
 class Primitive;
+class AcceleratorInstances;
+
+typedef std::vector<const ObjectGeometric *> ObjectGroup_t; //!< objects sharing the same accelerator, sorted
 
 struct ObjData
 {
@@ -72,14 +75,26 @@ class YafaRayScene final : public Scene
 		virtual bool intersect(const DiffRay &ray, SurfacePoint &sp) const override;
 		virtual bool isShadowed(RenderData &render_data, const Ray &ray, float &obj_index, float &mat_index) const override;
 		virtual bool isShadowed(RenderData &render_data, const Ray &ray, int max_depth, Rgb &filt, float &obj_index, float &mat_index) const override;
+		virtual void intersect(const DiffRay *rays, int n_rays, SurfacePoint *sp, bool *hit) const override;
+		virtual void isShadowed(RenderData &render_data, const Ray *rays, int n_rays, bool *shadowed, float *obj_index, float *mat_index) const override;
 		virtual TriangleObject *getMesh(const std::string &name) const override;
 		virtual ObjectGeometric *getObject(const std::string &name) const override;
 
 		void clearGeometry();
+		void clearAccelerators();
+		void updateInstances();
+		bool intersectInstances(const Ray &ray, float dist, SurfacePoint &sp, float &z) const;
 
 		GeometryCreationState geometry_creation_state_;
-		Accelerator<Triangle> *tree_ = nullptr; //!< kdTree for triangle-only mode
-		Accelerator<Primitive> *vtree_ = nullptr; //!< kdTree for universal mode
+		Accelerator<Triangle> *tree_ = nullptr; //!< top level over the trees of the meshes for triangle-only mode
+		Accelerator<Primitive> *vtree_ = nullptr; //!< top level over the trees of the objects for universal mode
+		AcceleratorInstances *instances_tree_ = nullptr; //!< two-level accelerator for the object instances in triangle-only mode
+		std::map<ObjectGroup_t, Accelerator<Triangle> *> triangle_trees_; //!< trees of each group of meshes and of each instanced base object in triangle-only mode, kept across geometry updates
+		std::map<ObjectGroup_t, Accelerator<Primitive> *> primitive_trees_; //!< trees of each group of objects in universal mode, kept across geometry updates
+		std::map<const ObjectGeometric *, Bound> object_bounds_; //!< world space bounds of the objects in the top level
+		std::string built_accelerator_type_; //!< accelerator type of the current trees
+		bool tree_changed_ = true; //!< meshes or objects were created since the last build of tree_ / vtree_
+		bool instances_changed_ = true; //!< object instances were created since the last build of instances_tree_
 		std::map<std::string, ObjectGeometric *> objects_;
 		std::map<std::string, ObjData> meshes_;
 };
@@ -26,10 +26,12 @@
 
 #include "texture/texture.h"
 #include "image/image.h"
+#include <memory>
 
 BEGIN_YAFARAY
 
 class Format;
+template <class T> class TiledImageBuffer2D;
 
 class MipMapParams final
 {
@@ -51,25 +53,28 @@ class ImageTexture final : public Texture
 		static Texture *factory(ParamMap &params, const Scene &scene);
 
 	private:
-		ImageTexture(Image &&image);
+		ImageTexture(const Image &image);
 		virtual bool discrete() const override { return true; }
 		virtual bool isThreeD() const override { return false; }
 		virtual bool isNormalmap() const override { return normalmap_; }
 		virtual Rgba getColor(const Point3 &p, const MipMapParams *mipmap_params = nullptr) const override;
 		virtual Rgba getRawColor(const Point3 &p, const MipMapParams *mipmap_params = nullptr) const override;
 		virtual void resolution(int &x, int &y, int &z) const override;
-		virtual void generateMipMaps() override;
+		virtual void generateMipMaps() override { (this->*generate_mipmaps_)(); }
 		void setCrop(float minx, float miny, float maxx, float maxy);
 		void findTextureInterpolationCoordinates(int &coord_0, int &coord_1, int &coord_2, int &coord_3, float &coord_decimal_part, float coord_float, int resolution, bool repeat, bool mirror) const;
-		Rgba noInterpolation(const Point3 &p, int mipmap_level = 0) const;
-		Rgba bilinearInterpolation(const Point3 &p, int mipmap_level = 0) const;
-		Rgba bicubicInterpolation(const Point3 &p, int mipmap_level = 0) const;
-		Rgba mipMapsTrilinearInterpolation(const Point3 &p, const MipMapParams *mipmap_params) const;
-		Rgba mipMapsEwaInterpolation(const Point3 &p, float max_anisotropy, const MipMapParams *mipmap_params) const;
-		Rgba ewaEllipticCalculation(const Point3 &p, float ds_0, float dt_0, float ds_1, float dt_1, int mipmap_level = 0) const;
+		template <class T> void setTexels(const Image &image);
+		template <class T> const TiledImageBuffer2D<T> &getTexels(int mipmap_level) const { return *static_cast<const TiledImageBuffer2D<T> *>(texels_[mipmap_level].get()); }
+		template <class T> void generateMipMaps();
+		template <class T> Rgba noInterpolation(const Point3 &p, int mipmap_level = 0) const;
+		template <class T> Rgba bilinearInterpolation(const Point3 &p, int mipmap_level = 0) const;
+		template <class T> Rgba bicubicInterpolation(const Point3 &p, int mipmap_level = 0) const;
+		template <class T> Rgba mipMapsTrilinearInterpolation(const Point3 &p, const MipMapParams *mipmap_params) const;
+		template <class T> Rgba mipMapsEwaInterpolation(const Point3 &p, float max_anisotropy, const MipMapParams *mipmap_params) const;
+		template <class T> Rgba ewaEllipticCalculation(const Point3 &p, float ds_0, float dt_0, float ds_1, float dt_1, int mipmap_level = 0) const;
 		void generateEwaLookupTable();
 		bool doMapping(Point3 &texp) const;
-		Rgba interpolateImage(const Point3 &p, const MipMapParams *mipmap_params) const;
+		template <class T> Rgba interpolateImage(const Point3 &p, const MipMapParams *mipmap_params) const;
 
 		const int ewa_weight_lut_size_ = 128;
 		bool calc_alpha_, normalmap_;
@@ -79,7 +84,10 @@ class ImageTexture final : public Texture
 		float checker_dist_;
 		int xrepeat_, yrepeat_;
 		ClipMode tex_clip_mode_;
-		std::vector<Image> images_;
+		int width_, height_;
+		std::vector<std::shared_ptr<void>> texels_; //!< Tiled texel buffers of the image and its mipmaps, with the pixel type of the loaded image
+		Rgba (ImageTexture::*interpolate_image_)(const Point3 &p, const MipMapParams *mipmap_params) const; //!< Interpolation bound to the pixel type of the texels
+		void (ImageTexture::*generate_mipmaps_)();
 		ColorSpace original_image_file_color_space_;
 		float original_image_file_gamma_;
 		bool mirror_x_;
@@ -18,14 +18,19 @@
 
 #include "accelerator/accelerator.h"
 #include "accelerator/accelerator_kdtree.h"
+#include "accelerator/accelerator_bvh.h"
 #include "common/logger.h"
 #include "common/param.h"
+#include "geometry/ray_packet.h"
+#include "geometry/surface.h"
+#include "geometry/triangle.h"
+#include "geometry/triangle_instance.h"
+#include "geometry/object_triangle_instance.h"
+#include "geometry/primitive.h"
+#include "material/material.h"
 
 BEGIN_YAFARAY
 
-class Triangle;
-class Primitive;
-
 template class Accelerator<Triangle>;
 template class Accelerator<Primitive>;
 
@@ -40,6 +45,11 @@ Accelerator<T> *Accelerator<T>::factory(const T **primitives_list, ParamMap &par
 		Y_INFO << "Accelerator type '" << type << "' created." << YENDL;
 		return AcceleratorKdTree<T>::factory(primitives_list, params);
 	}
+	else if(type == "bvh")
+	{
+		Y_INFO << "Accelerator type '" << type << "' created." << YENDL;
+		return AcceleratorBvh<T>::factory(primitives_list, params);
+	}
 	else
 	{
 		Y_ERROR << "Accelerator type '" << type << "' could not be created." << YENDL;
@@ -47,4 +57,57 @@ Accelerator<T> *Accelerator<T>::factory(const T **primitives_list, ParamMap &par
 	}
 }
 
+template<class T>
+void Accelerator<T>::intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const
+{
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		tr[i] = nullptr;
+		intersect(packet.ray(i), packet.dist_[i], &tr[i], z[i], data[i]);
+	}
+}
+
+template<class T>
+void Accelerator<T>::intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const
+{
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		tr[i] = nullptr;
+		shadowed[i] = intersectS(packet.ray(i), packet.dist_[i], &tr[i], shadow_bias);
+	}
+}
+
+template<class T>
+bool Accelerator<T>::primitiveOccludes(const T &primitive, const Ray &ray, float dist)
+{
+	IntersectData bary;
+	float t_hit;
+	if(!primitive.intersect(ray, &t_hit, bary) || t_hit >= dist || t_hit < 0.f) return false;
+	const Material *mat = primitive.getMaterial();
+	return mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly;
+}
+
+/*! Surface point of a triangle hit in the object space of an instance, on the instance in world space.
+	The direction of the object space ray is transformed back into the world space direction */
+inline void instanceSurface__(const Triangle &triangle, const TriangleObjectInstance &instance, const Ray &ray, float t_hit, IntersectData &data, SurfacePoint &sp, Vec3 &dir)
+{
+	const Matrix4 &obj_to_world = instance.getObjToWorldMatrix();
+	const TriangleInstance triangle_instance(&triangle, &instance);
+	triangle_instance.getSurface(sp, obj_to_world * (ray.from_ + t_hit * ray.dir_), data);
+	dir = obj_to_world * ray.dir_;
+}
+
+//The instances only reference triangles
+inline void instanceSurface__(const Primitive &primitive, const TriangleObjectInstance &instance, const Ray &ray, float t_hit, IntersectData &data, SurfacePoint &sp, Vec3 &dir) { }
+
+template<class T>
+Rgb Accelerator<T>::primitiveTransparency(RenderData &render_data, const T &primitive, const Material &material, const Ray &ray, float t_hit, IntersectData &data, const TriangleObjectInstance *instance)
+{
+	SurfacePoint sp;
+	Vec3 dir = ray.dir_;
+	if(instance) instanceSurface__(primitive, *instance, ray, t_hit, data, sp, dir);
+	else primitive.getSurface(sp, ray.from_ + t_hit * ray.dir_, data);
+	return material.getTransparency(render_data, sp, dir);
+}
+
 END_YAFARAY
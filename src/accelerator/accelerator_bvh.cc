@@ -0,0 +1,585 @@
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "accelerator/accelerator_bvh.h"
+#include "material/material.h"
+#include "common/logger.h"
+#include "common/param.h"
+#include "geometry/triangle.h"
+#include "geometry/surface.h"
+#include "geometry/primitive.h"
+#include <algorithm>
+#include <limits>
+#include <ctime>
+
+BEGIN_YAFARAY
+
+template<class T>
+Accelerator<T> *AcceleratorBvh<T>::factory(const T **primitives_list, ParamMap &params)
+{
+	int num_primitives = 0;
+	int leaf_size = 4;
+	float traversal_cost = 0.5f;
+	int num_bins = 16;
+
+	params.getParam("num_primitives", num_primitives);
+	params.getParam("leaf_size", leaf_size);
+	params.getParam("traversal_cost", traversal_cost);
+	params.getParam("num_bins", num_bins);
+
+	Accelerator<T> *accelerator = new AcceleratorBvh<T>(primitives_list, num_primitives, leaf_size, traversal_cost, num_bins);
+	return accelerator;
+}
+
+template<class T>
+AcceleratorBvh<T>::AcceleratorBvh(const T **primitives, uint32_t n_primitives, int max_leaf_size, float traversal_cost, int num_bins)
+	: max_leaf_size_(std::max(1, max_leaf_size)), traversal_cost_(traversal_cost), num_bins_(std::min(std::max(2, num_bins), max_num_bins_))
+{
+	Y_INFO << "BVH: Starting build (" << n_primitives << " prims, leaf size:" << max_leaf_size_ << " bins:" << num_bins_ << ")" << YENDL;
+	const clock_t c_start = clock();
+	if(n_primitives == 0)
+	{
+		Y_WARNING << "BVH: No primitives to accelerate, skipping build" << YENDL;
+		return;
+	}
+	std::vector<BuildPrimitive> build_primitives(n_primitives);
+	for(uint32_t i = 0; i < n_primitives; ++i)
+	{
+		build_primitives[i].bound_ = primitives[i]->getBound();
+		build_primitives[i].centroid_ = build_primitives[i].bound_.center();
+		build_primitives[i].index_ = i;
+	}
+	nodes_.reserve(2 * n_primitives);
+	primitives_.reserve(n_primitives);
+	buildTree(primitives, build_primitives, 0, n_primitives, 0);
+	nodes_.shrink_to_fit();
+	tree_bound_ = nodes_.front().bound_;
+
+	const clock_t c_end = clock() - c_start;
+	Y_VERBOSE << "BVH: Stats (" << float(c_end) / (float)CLOCKS_PER_SEC << "s)" << YENDL;
+	Y_VERBOSE << "BVH: Interior nodes: " << stats_.inodes_ << " / " << "leaf nodes: " << stats_.leaves_ << YENDL;
+	Y_VERBOSE << "BVH: => " << float(n_primitives) / stats_.leaves_ << " prims per leaf" << YENDL;
+	Y_VERBOSE << "BVH: Leaves due to depth limit/median splits: " << stats_.depth_limit_reached_ << "/" << stats_.median_splits_ << YENDL;
+}
+
+template<class T>
+float AcceleratorBvh<T>::surfaceArea(const Bound &bound)
+{
+	const float x = bound.longX(), y = bound.longY(), z = bound.longZ();
+	return 2.f * (x * y + x * z + y * z);
+}
+
+template<class T>
+int AcceleratorBvh<T>::binIndex(const Point3 &centroid, const Bound &centroid_bound, int axis) const
+{
+	const float extent = centroid_bound.g_[axis] - centroid_bound.a_[axis];
+	const int bin = static_cast<int>(num_bins_ * (centroid[axis] - centroid_bound.a_[axis]) / extent);
+	return std::min(std::max(bin, 0), num_bins_ - 1);
+}
+
+// ============================================================
+/*!
+	Find the best split with binned SAH along all three axes => O(n)
+	returns false if no split is cheaper than creating a leaf. The SAH
+	cannot be evaluated for a degenerate node without surface area (all
+	its primitives on a line or a point), which is then split at the
+	median if it has too many primitives for a leaf, with best_bin < 0
+*/
+
+template<class T>
+bool AcceleratorBvh<T>::findBestSplit(const std::vector<BuildPrimitive> &build_primitives, uint32_t start, uint32_t end, const Bound &node_bound, const Bound &centroid_bound, int &best_axis, int &best_bin) const
+{
+	const uint32_t n_prims = end - start;
+	const float node_sa = surfaceArea(node_bound);
+	if(node_sa <= 0.f)
+	{
+		best_bin = -1;
+		return n_prims > static_cast<uint32_t>(max_leaf_size_);
+	}
+	const float inv_node_sa = 1.f / node_sa;
+	bool split_found = false;
+	float best_cost = std::numeric_limits<float>::max();
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		if(centroid_bound.g_[axis] <= centroid_bound.a_[axis]) continue;
+		BuildBin bins[max_num_bins_];
+		for(uint32_t i = start; i < end; ++i)
+		{
+			BuildBin &bin = bins[binIndex(build_primitives[i].centroid_, centroid_bound, axis)];
+			bin.bound_ = bin.n_primitives_ ? Bound(bin.bound_, build_primitives[i].bound_) : build_primitives[i].bound_;
+			++bin.n_primitives_;
+		}
+		// sweep from the right storing the area and count of everything above each split
+		float above_sa[max_num_bins_];
+		uint32_t n_above[max_num_bins_];
+		Bound bound_above;
+		uint32_t count_above = 0;
+		for(int i = num_bins_ - 1; i > 0; --i)
+		{
+			if(bins[i].n_primitives_) bound_above = count_above ? Bound(bound_above, bins[i].bound_) : bins[i].bound_;
+			count_above += bins[i].n_primitives_;
+			n_above[i] = count_above;
+			above_sa[i] = count_above ? surfaceArea(bound_above) : 0.f;
+		}
+		// sweep from the left evaluating the cost of splitting after bin i
+		Bound bound_below;
+		uint32_t count_below = 0;
+		for(int i = 0; i < num_bins_ - 1; ++i)
+		{
+			if(bins[i].n_primitives_) bound_below = count_below ? Bound(bound_below, bins[i].bound_) : bins[i].bound_;
+			count_below += bins[i].n_primitives_;
+			if(count_below == 0 || n_above[i + 1] == 0) continue;
+			const float cost = traversal_cost_ + inv_node_sa * (count_below * surfaceArea(bound_below) + n_above[i + 1] * above_sa[i + 1]);
+			if(cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = i;
+				split_found = true;
+			}
+		}
+	}
+	if(!split_found) return false;
+	return n_prims > static_cast<uint32_t>(max_leaf_size_) || best_cost < static_cast<float>(n_prims);
+}
+
+// ============================================================
+/*!
+	recursively build the BVH in depth-first order
+	returns: index of the created node
+*/
+
+template<class T>
+uint32_t AcceleratorBvh<T>::buildTree(const T **primitives, std::vector<BuildPrimitive> &build_primitives, uint32_t start, uint32_t end, int depth)
+{
+	Bound node_bound = build_primitives[start].bound_;
+	Bound centroid_bound(build_primitives[start].centroid_, build_primitives[start].centroid_);
+	for(uint32_t i = start + 1; i < end; ++i)
+	{
+		node_bound = Bound(node_bound, build_primitives[i].bound_);
+		centroid_bound.include(build_primitives[i].centroid_);
+	}
+	const uint32_t n_prims = end - start;
+	const uint32_t cur_node = nodes_.size();
+	nodes_.emplace_back();
+
+	int best_axis = -1, best_bin = -1;
+	const bool depth_limit_reached = (depth >= bvh_max_stack_ - 1);
+	if(n_prims <= 1 || depth_limit_reached || !findBestSplit(build_primitives, start, end, node_bound, centroid_bound, best_axis, best_bin))
+	{
+		nodes_[cur_node].createLeaf(node_bound, primitives_.size(), n_prims);
+		for(uint32_t i = start; i < end; ++i) primitives_.push_back((T *) primitives[build_primitives[i].index_]);
+		++stats_.leaves_;
+		if(depth_limit_reached) ++stats_.depth_limit_reached_;
+		return cur_node;
+	}
+
+	auto first = build_primitives.begin() + start, last = build_primitives.begin() + end;
+	auto middle = first;
+	if(best_bin >= 0) middle = std::partition(first, last, [&](const BuildPrimitive &p) { return binIndex(p.centroid_, centroid_bound, best_axis) <= best_bin; });
+	if(middle == first || middle == last)
+	{
+		//degenerate node, or all centroids ended in the same side due to float rounding, fall back to an object median split
+		best_axis = centroid_bound.largestAxis();
+		middle = first + n_prims / 2;
+		std::nth_element(first, middle, last, [&](const BuildPrimitive &a, const BuildPrimitive &b) { return a.centroid_[best_axis] < b.centroid_[best_axis]; });
+		++stats_.median_splits_;
+	}
+	const uint32_t mid = start + static_cast<uint32_t>(middle - first);
+
+	nodes_[cur_node].createInterior(node_bound, best_axis);
+	++stats_.inodes_;
+	//<< recurse below child >>
+	buildTree(primitives, build_primitives, start, mid, depth + 1);
+	//<< recurse above child >>
+	const uint32_t right_child = buildTree(primitives, build_primitives, mid, end, depth + 1);
+	nodes_[cur_node].setRightChild(right_child);
+	return cur_node;
+}
+
+template<class T>
+Vec3 AcceleratorBvh<T>::inverseDirection(const Vec3 &dir)
+{
+	//To avoid division by zero
+	Vec3 inv_dir;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		if(dir[axis] == 0.f) inv_dir[axis] = std::numeric_limits<float>::max();
+		else inv_dir[axis] = 1.f / dir[axis];
+	}
+	return inv_dir;
+}
+
+template<class T>
+inline bool AcceleratorBvh<T>::crossBound(const Bound &bound, const Ray &ray, const Vec3 &inv_dir, const std::array<int, 3> &dir_is_neg, float dist)
+{
+	const Point3 *corners[2] = { &bound.a_, &bound.g_ };
+	float t_min = ((*corners[dir_is_neg[0]])[0] - ray.from_[0]) * inv_dir[0];
+	float t_max = ((*corners[1 - dir_is_neg[0]])[0] - ray.from_[0]) * inv_dir[0];
+	for(int axis = 1; axis < 3; ++axis)
+	{
+		const float t_axis_min = ((*corners[dir_is_neg[axis]])[axis] - ray.from_[axis]) * inv_dir[axis];
+		const float t_axis_max = ((*corners[1 - dir_is_neg[axis]])[axis] - ray.from_[axis]) * inv_dir[axis];
+		t_min = std::max(t_min, t_axis_min);
+		t_max = std::min(t_max, t_axis_max);
+	}
+	//slightly enlarge the exit distance to be conservative with rounding errors, like the kd-tree does with its bound
+	t_max *= 1.00001f;
+	return t_min <= t_max && t_max >= 0.f && t_min <= dist;
+}
+
+//============================
+/*! The standard intersect function,
+	returns the closest hit within dist
+*/
+template<class T>
+bool AcceleratorBvh<T>::intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const
+{
+	z = dist;
+	if(nodes_.empty()) return false;
+	const Vec3 inv_dir = inverseDirection(ray.dir_);
+	const std::array<int, 3> dir_is_neg {{ inv_dir.x_ < 0.f, inv_dir.y_ < 0.f, inv_dir.z_ < 0.f }};
+	IntersectData current_data, temp_data;
+	bool hit = false;
+	uint32_t stack[bvh_max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, ray, inv_dir, dir_is_neg, z))
+		{
+			if(!node.isLeaf())
+			{
+				//visit the near child first, so the far one can be culled by the closest hit found so far
+				if(dir_is_neg[node.splitAxis()])
+				{
+					stack[stack_size++] = node_index + 1;
+					node_index = node.getRightChild();
+				}
+				else
+				{
+					stack[stack_size++] = node.getRightChild();
+					++node_index;
+				}
+				continue;
+			}
+			const uint32_t first_primitive = node.getFirstPrimitive();
+			const uint32_t n_primitives = node.nPrimitives();
+			for(uint32_t i = first_primitive; i < first_primitive + n_primitives; ++i)
+			{
+				T *mp = primitives_[i];
+				float t_hit;
+				if(mp->intersect(ray, &t_hit, temp_data))
+				{
+					if(t_hit < z && t_hit >= ray.tmin_)
+					{
+						const Material *mat = mp->getMaterial();
+						if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::VisibleNoShadows)
+						{
+							z = t_hit;
+							*tr = mp;
+							current_data = temp_data;
+							hit = true;
+						}
+					}
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	data = current_data;
+	return hit;
+}
+
+template<class T>
+bool AcceleratorBvh<T>::intersectS(const Ray &ray, float dist, T **tr, float shadow_bias) const
+{
+	if(nodes_.empty()) return false;
+	const Vec3 inv_dir = inverseDirection(ray.dir_);
+	const std::array<int, 3> dir_is_neg {{ inv_dir.x_ < 0.f, inv_dir.y_ < 0.f, inv_dir.z_ < 0.f }};
+	IntersectData bary;
+	uint32_t stack[bvh_max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, ray, inv_dir, dir_is_neg, dist))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			const uint32_t first_primitive = node.getFirstPrimitive();
+			const uint32_t n_primitives = node.nPrimitives();
+			for(uint32_t i = first_primitive; i < first_primitive + n_primitives; ++i)
+			{
+				T *mp = primitives_[i];
+				float t_hit;
+				if(mp->intersect(ray, &t_hit, bary))
+				{
+					if(t_hit < dist && t_hit >= 0.f)
+					{
+						const Material *mat = mp->getMaterial();
+						if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly)
+						{
+							*tr = mp;
+							return true;
+						}
+					}
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+/*=============================================================
+	allow for transparent shadows.
+	Each primitive is referenced by one leaf only, so unlike the
+	kd-tree no hit filtering is needed to avoid counting it twice.
+=============================================================*/
+
+template<class T>
+bool AcceleratorBvh<T>::intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const
+{
+	if(nodes_.empty()) return false;
+	const Vec3 inv_dir = inverseDirection(ray.dir_);
+	const std::array<int, 3> dir_is_neg {{ inv_dir.x_ < 0.f, inv_dir.y_ < 0.f, inv_dir.z_ < 0.f }};
+	IntersectData bary;
+	uint32_t stack[bvh_max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, ray, inv_dir, dir_is_neg, dist))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			const uint32_t first_primitive = node.getFirstPrimitive();
+			const uint32_t n_primitives = node.nPrimitives();
+			for(uint32_t i = first_primitive; i < first_primitive + n_primitives; ++i)
+			{
+				T *mp = primitives_[i];
+				float t_hit;
+				if(mp->intersect(ray, &t_hit, bary))
+				{
+					if(t_hit < dist && t_hit >= ray.tmin_)
+					{
+						const Material *mat = mp->getMaterial();
+						if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly)
+						{
+							*tr = mp;
+							if(!mat->isTransparent()) return true;
+							if(depth >= max_depth) return true;
+							filt *= Accelerator<T>::primitiveTransparency(render_data, *mp, *mat, ray, t_hit, bary, instance);
+							++depth;
+						}
+					}
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+/*=============================================================
+	ray packet traversal.
+	A node is visited when at least one ray of the packet crosses
+	it, testing the bound against all the rays at once. The near
+	child is chosen with the direction signs of the first ray of
+	the packet, which is the best order for coherent packets.
+=============================================================*/
+
+template<class T>
+inline bool AcceleratorBvh<T>::crossBound(const Bound &bound, const RayPacket &packet, const float *dist, const bool *active, bool *crossed)
+{
+	bool any_crossed = false;
+	for(int i = 0; i < RayPacket::max_size_; ++i)
+	{
+		float t_min = std::numeric_limits<float>::lowest();
+		float t_max = std::numeric_limits<float>::max();
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			const float t_0 = (bound.a_[axis] - packet.from_[axis][i]) * packet.inv_dir_[axis][i];
+			const float t_1 = (bound.g_[axis] - packet.from_[axis][i]) * packet.inv_dir_[axis][i];
+			t_min = std::max(t_min, std::min(t_0, t_1));
+			t_max = std::min(t_max, std::max(t_0, t_1));
+		}
+		t_max *= 1.00001f;
+		crossed[i] = active[i] && t_min <= t_max && t_max >= 0.f && t_min <= dist[i];
+		any_crossed |= crossed[i];
+	}
+	return any_crossed;
+}
+
+template<class T>
+inline uint32_t AcceleratorBvh<T>::packetTraverseInterior(const RayPacket &packet, uint32_t node_index, uint32_t *stack, int &stack_size) const
+{
+	const BvhNode &node = nodes_[node_index];
+	if(packet.dirIsNeg(node.splitAxis()))
+	{
+		stack[stack_size++] = node_index + 1;
+		return node.getRightChild();
+	}
+	else
+	{
+		stack[stack_size++] = node.getRightChild();
+		return node_index + 1;
+	}
+}
+
+template<class T>
+void AcceleratorBvh<T>::intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const
+{
+	alignas(32) float z_max[RayPacket::max_size_];
+	bool active[RayPacket::max_size_], crossed[RayPacket::max_size_];
+	for(int i = 0; i < RayPacket::max_size_; ++i)
+	{
+		active[i] = i < packet.size();
+		z_max[i] = active[i] ? packet.dist_[i] : -1.f;
+	}
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		tr[i] = nullptr;
+		z[i] = packet.dist_[i];
+	}
+	if(nodes_.empty()) return;
+	IntersectData temp_data;
+	uint32_t stack[bvh_max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, packet, z_max, active, crossed))
+		{
+			if(!node.isLeaf())
+			{
+				node_index = packetTraverseInterior(packet, node_index, stack, stack_size);
+				continue;
+			}
+			const uint32_t first_primitive = node.getFirstPrimitive();
+			const uint32_t n_primitives = node.nPrimitives();
+			for(int i = 0; i < packet.size(); ++i)
+			{
+				if(!crossed[i]) continue;
+				const Ray &ray = packet.ray(i);
+				for(uint32_t j = first_primitive; j < first_primitive + n_primitives; ++j)
+				{
+					T *mp = primitives_[j];
+					float t_hit;
+					if(mp->intersect(ray, &t_hit, temp_data))
+					{
+						if(t_hit < z_max[i] && t_hit >= ray.tmin_)
+						{
+							const Material *mat = mp->getMaterial();
+							if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::VisibleNoShadows)
+							{
+								z_max[i] = t_hit;
+								tr[i] = mp;
+								data[i] = temp_data;
+							}
+						}
+					}
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	for(int i = 0; i < packet.size(); ++i) z[i] = z_max[i];
+}
+
+template<class T>
+void AcceleratorBvh<T>::intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const
+{
+	bool active[RayPacket::max_size_], crossed[RayPacket::max_size_];
+	for(int i = 0; i < RayPacket::max_size_; ++i) active[i] = i < packet.size();
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		tr[i] = nullptr;
+		shadowed[i] = false;
+	}
+	if(nodes_.empty()) return;
+	IntersectData bary;
+	uint32_t stack[bvh_max_stack_];
+	int stack_size = 0;
+	int n_active = packet.size();
+	uint32_t node_index = 0;
+	while(n_active > 0)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, packet, packet.dist_, active, crossed))
+		{
+			if(!node.isLeaf())
+			{
+				node_index = packetTraverseInterior(packet, node_index, stack, stack_size);
+				continue;
+			}
+			const uint32_t first_primitive = node.getFirstPrimitive();
+			const uint32_t n_primitives = node.nPrimitives();
+			for(int i = 0; i < packet.size(); ++i)
+			{
+				if(!crossed[i]) continue;
+				const Ray &ray = packet.ray(i);
+				for(uint32_t j = first_primitive; j < first_primitive + n_primitives; ++j)
+				{
+					T *mp = primitives_[j];
+					float t_hit;
+					if(mp->intersect(ray, &t_hit, bary))
+					{
+						if(t_hit < packet.dist_[i] && t_hit >= 0.f)
+						{
+							const Material *mat = mp->getMaterial();
+							if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly)
+							{
+								tr[i] = mp;
+								shadowed[i] = true;
+								active[i] = false; //no more traversal needed for this ray
+								--n_active;
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+}
+
+// explicit instantiation of template:
+template class AcceleratorBvh<Triangle>;
+template class AcceleratorBvh<Primitive>;
+
+END_YAFARAY
@@ -0,0 +1,214 @@
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "accelerator/accelerator_instances.h"
+#include "common/logger.h"
+#include "geometry/triangle.h"
+#include "geometry/surface.h"
+#include <algorithm>
+#include <ctime>
+
+BEGIN_YAFARAY
+
+AcceleratorInstances::AcceleratorInstances(std::vector<AcceleratorInstance> instances, int max_leaf_size)
+	: max_leaf_size_(std::max(1, max_leaf_size)), instances_(std::move(instances))
+{
+	Y_INFO << "Instances: Starting build (" << instances_.size() << " instances)" << YENDL;
+	const clock_t c_start = clock();
+	if(instances_.empty()) return;
+	nodes_.reserve(2 * instances_.size());
+	buildTree(0, instances_.size(), 0);
+	nodes_.shrink_to_fit();
+	tree_bound_ = nodes_.front().bound_;
+
+	const clock_t c_end = clock() - c_start;
+	Y_VERBOSE << "Instances: Stats (" << float(c_end) / (float)CLOCKS_PER_SEC << "s)" << YENDL;
+	Y_VERBOSE << "Instances: Interior nodes: " << stats_.inodes_ << " / " << "leaf nodes: " << stats_.leaves_ << YENDL;
+}
+
+// ============================================================
+/*!
+	The top level only holds a few bounds per instance, so a
+	median split along the largest axis of the centroids is good
+	enough and keeps the build time negligible
+*/
+
+uint32_t AcceleratorInstances::buildTree(uint32_t start, uint32_t end, int depth)
+{
+	const uint32_t node_index = nodes_.size();
+	nodes_.push_back(BvhNode());
+	Bound node_bound = instances_[start].bound_;
+	Bound centroid_bound(node_bound.center(), node_bound.center());
+	for(uint32_t i = start + 1; i < end; ++i)
+	{
+		node_bound = Bound(node_bound, instances_[i].bound_);
+		centroid_bound.include(instances_[i].bound_.center());
+	}
+	const uint32_t n_instances = end - start;
+	const int axis = centroid_bound.largestAxis();
+	if(n_instances <= static_cast<uint32_t>(max_leaf_size_) || depth >= max_depth_ || centroid_bound.g_[axis] <= centroid_bound.a_[axis])
+	{
+		if(depth >= max_depth_) ++stats_.depth_limit_reached_;
+		nodes_[node_index].createLeaf(node_bound, start, n_instances);
+		++stats_.leaves_;
+		return node_index;
+	}
+	const uint32_t mid = start + n_instances / 2;
+	std::nth_element(instances_.begin() + start, instances_.begin() + mid, instances_.begin() + end,
+					 [axis](const AcceleratorInstance &a, const AcceleratorInstance &b) { return a.bound_.center()[axis] < b.bound_.center()[axis]; });
+	++stats_.inodes_;
+	buildTree(start, mid, depth + 1);
+	const uint32_t right_child = buildTree(mid, end, depth + 1);
+	nodes_[node_index].createInterior(node_bound, axis);
+	nodes_[node_index].setRightChild(right_child);
+	return node_index;
+}
+
+inline Ray AcceleratorInstances::toObjectSpace(const Ray &ray, const AcceleratorInstance &instance)
+{
+	//The direction is not normalized, so the distances along the ray are the same in both spaces
+	Ray object_ray(ray);
+	object_ray.from_ = instance.world_to_obj_ * ray.from_;
+	object_ray.dir_ = instance.world_to_obj_ * ray.dir_;
+	return object_ray;
+}
+
+//============================
+/*! The standard intersect function,
+	returns the closest hit within dist
+*/
+bool AcceleratorInstances::intersect(const Ray &ray, float dist, Triangle **tr, const TriangleObjectInstance **instance, float &z, IntersectData &data) const
+{
+	z = dist;
+	if(nodes_.empty()) return false;
+	bool hit = false;
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		float enter, leave;
+		if(node.bound_.cross(ray, enter, leave, z))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			const uint32_t first_instance = node.getFirstPrimitive();
+			for(uint32_t i = first_instance; i < first_instance + node.nPrimitives(); ++i)
+			{
+				const AcceleratorInstance &acc_instance = instances_[i];
+				Triangle *hit_triangle = nullptr;
+				float hit_z;
+				IntersectData hit_data;
+				if(acc_instance.base_accelerator_->intersect(toObjectSpace(ray, acc_instance), z, &hit_triangle, hit_z, hit_data))
+				{
+					z = hit_z;
+					data = hit_data;
+					*tr = hit_triangle;
+					*instance = acc_instance.object_;
+					hit = true;
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return hit;
+}
+
+bool AcceleratorInstances::intersectS(const Ray &ray, float dist, Triangle **tr, const TriangleObjectInstance **instance, float shadow_bias) const
+{
+	if(nodes_.empty()) return false;
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		float enter, leave;
+		if(node.bound_.cross(ray, enter, leave, dist))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			const uint32_t first_instance = node.getFirstPrimitive();
+			for(uint32_t i = first_instance; i < first_instance + node.nPrimitives(); ++i)
+			{
+				const AcceleratorInstance &acc_instance = instances_[i];
+				if(acc_instance.base_accelerator_->intersectS(toObjectSpace(ray, acc_instance), dist, tr, shadow_bias))
+				{
+					*instance = acc_instance.object_;
+					return true;
+				}
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+/*! Transparent shadows: the filter is accumulated over all the instances crossed.
+	The transparency of the materials is evaluated on each instance in world space.
+	The instances share the "max_depth" budget with "depth". */
+bool AcceleratorInstances::intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, Triangle **tr, const TriangleObjectInstance **instance, Rgb &filt, float shadow_bias, int &depth) const
+{
+	if(nodes_.empty()) return false;
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		float enter, leave;
+		if(node.bound_.cross(ray, enter, leave, dist))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			const uint32_t first_instance = node.getFirstPrimitive();
+			for(uint32_t i = first_instance; i < first_instance + node.nPrimitives(); ++i)
+			{
+				const AcceleratorInstance &acc_instance = instances_[i];
+				Triangle *hit_triangle = nullptr;
+				const bool blocked = acc_instance.base_accelerator_->intersectTs(render_data, toObjectSpace(ray, acc_instance), max_depth, dist, &hit_triangle, filt, shadow_bias, depth, acc_instance.object_);
+				if(hit_triangle)
+				{
+					*tr = hit_triangle;
+					*instance = acc_instance.object_;
+				}
+				if(blocked) return true;
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+END_YAFARAY
@@ -26,12 +26,21 @@
 #include "geometry/surface.h"
 #include "geometry/primitive.h"
 #include "common/param.h"
+#include "common/thread.h"
+#include "common/file.h"
+#include "math/math.h"
+#include <algorithm>
 #include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
 
 BEGIN_YAFARAY
 
 #define TRI_CLIP 1 //tempoarily disabled
 
+static void pruneKdCache__(const std::string &cache_dir, const std::string &kept_path, uint64_t max_size);
+
 template<class T>
 Accelerator<T> *AcceleratorKdTree<T>::factory(const T **primitives_list, ParamMap &params)
 {
@@ -40,29 +49,33 @@ Accelerator<T> *AcceleratorKdTree<T>::factory(const T **primitives_list, ParamMa
 	int leaf_size = 2;
 	float cost_ratio = 0.35;
 	float empty_bonus = 0.33;
+	int num_threads = 1;
+	std::string cache_dir;
+	int cache_max_size = 1024;
 
 	params.getParam("num_primitives", num_primitives);
 	params.getParam("depth", depth);
 	params.getParam("leaf_size", leaf_size);
 	params.getParam("cost_ratio", cost_ratio);
 	params.getParam("empty_bonus", empty_bonus);
+	params.getParam("num_threads", num_threads);
+	params.getParam("cache_dir", cache_dir);
+	params.getParam("cache_max_size", cache_max_size);
 
-	Accelerator<T> *accelerator = new AcceleratorKdTree<T>(primitives_list, num_primitives, depth, leaf_size, cost_ratio, empty_bonus);
+	Accelerator<T> *accelerator = new AcceleratorKdTree<T>(primitives_list, num_primitives, depth, leaf_size, cost_ratio, empty_bonus, num_threads, cache_dir, cache_max_size);
 	return accelerator;
 }
 
 template<class T>
 AcceleratorKdTree<T>::AcceleratorKdTree(const T **v, int np, int depth, int leaf_size,
-										float cost_ratio, float empty_bonus)
+										float cost_ratio, float empty_bonus, int num_threads, const std::string &cache_dir, int cache_max_size)
 	: cost_ratio_(cost_ratio), e_bonus_(empty_bonus), max_depth_(depth)
 {
-	Y_INFO << "Kd-Tree: Starting build (" << np << " prims, cr:" << cost_ratio_ << " eb:" << e_bonus_ << ")" << YENDL;
+	if(num_threads > 1) max_level_threads_ = (int) std::ceil(math::log2((float) num_threads)); //in how many kd-tree levels we will spawn threads, so we create at least as many threads as scene threads parameter
+	Y_INFO << "Kd-Tree: Starting build (" << np << " prims, cr:" << cost_ratio_ << " eb:" << e_bonus_ << ", using up to " << (1 << max_level_threads_) << " threads)" << YENDL;
 	clock_t c_start, c_end;
 	c_start = clock();
 	total_prims_ = np;
-	next_free_node_ = 0;
-	allocated_nodes_count_ = 256;
-	nodes_ = (KdTreeNode<T> *) malloc(256 * sizeof(KdTreeNode<T>));
 	if(max_depth_ <= 0) max_depth_ = int(7.0f + 1.66f * log(float(total_prims_)));
 	const double log_leaves = 1.442695f * log(double(total_prims_)); // = base2 log
 	if(leaf_size <= 0)
@@ -76,7 +89,7 @@ AcceleratorKdTree<T>::AcceleratorKdTree(const T **v, int np, int depth, int leaf
 	if(max_depth_ > kd_max_stack_) max_depth_ = kd_max_stack_; //to prevent our stack to overflow
 	//experiment: add penalty to cost ratio to reduce memory usage on huge scenes
 	if(log_leaves > 16.0) cost_ratio_ += 0.25 * (log_leaves - 16.0);
-	all_bounds_ = new Bound[total_prims_ + tri_clip_thresh_ + 1];
+	all_bounds_ = new Bound[total_prims_];
 	Y_VERBOSE << "Kd-Tree: Getting triangle bounds..." << YENDL;
 	for(uint32_t i = 0; i < total_prims_; i++)
 	{
@@ -93,34 +106,52 @@ AcceleratorKdTree<T>::AcceleratorKdTree(const T **v, int np, int depth, int leaf
 		tree_bound_.a_[i] -= foo, tree_bound_.g_[i] += foo;
 	}
 	Y_VERBOSE << "Kd-Tree: Done." << YENDL;
+	// a tree built before for the same primitives and parameters can be loaded from the cache instead
+	uint64_t cache_hash = 0;
+	std::string cache_path;
+	if(!cache_dir.empty() && total_prims_ > 0)
+	{
+		cache_hash = cacheHash(v);
+		std::stringstream cache_name;
+		cache_name << "kdtree_" << std::hex << std::setw(16) << std::setfill('0') << cache_hash;
+		cache_path = Path(cache_dir, cache_name.str(), "ykd").getFullPath();
+		if(loadCache(cache_path, v, cache_hash))
+		{
+			delete[] all_bounds_;
+			c_end = clock() - c_start;
+			Y_INFO << "Kd-Tree: Loaded from cache file \"" << cache_path << "\" (" << float(c_end) / (float)CLOCKS_PER_SEC << "s, " << next_free_node_ << " nodes)" << YENDL;
+			return;
+		}
+	}
 	// get working memory for tree construction
-	BoundEdge *edges[3];
 	const uint32_t r_mem_size = 3 * total_prims_; // (maxDepth+1)*totalPrims;
 	uint32_t *left_prims = new uint32_t[std::max((uint32_t)2 * tri_clip_thresh_, total_prims_)];
 	uint32_t *right_prims = new uint32_t[r_mem_size]; //just a rough guess, allocating worst case is insane!
 	//	uint32_t *primNums = new uint32_t[totalPrims]; //isn't this like...totaly unnecessary? use leftPrims?
-	for(int i = 0; i < 3; ++i) edges[i] = new BoundEdge[514/*2*totalPrims*/];
-	clip_ = new int[max_depth_ + 2];
-	cdata_ = (char *) malloc((max_depth_ + 2) * tri_clip_thresh_ * clip_data_size_);
+	KdTreeBuildData<T> build_data(max_depth_, tri_clip_thresh_, clip_data_size_);
 
 	// prepare data
 	for(uint32_t i = 0; i < total_prims_; i++) left_prims[i] = i; //primNums[i] = i;
-	for(int i = 0; i < max_depth_ + 2; i++) clip_[i] = -1;
 
 	/* build tree */
 	prims_ = v;
 	Y_VERBOSE << "Kd-Tree: Starting recursive build..." << YENDL;
 	buildTree(total_prims_, tree_bound_, left_prims,
-			  left_prims, right_prims, edges, // <= working memory
-	          r_mem_size, 0, 0);
+			  left_prims, right_prims, // <= working memory
+	          r_mem_size, 0, 0, build_data);
+
+	// take over the built nodes and leaf primitive lists
+	nodes_ = build_data.nodes_;
+	build_data.nodes_ = nullptr;
+	next_free_node_ = build_data.next_free_node_;
+	allocated_nodes_count_ = build_data.allocated_nodes_count_;
+	prims_arenas_ = std::move(build_data.prims_arenas_);
+	kd_stats_ = build_data.kd_stats_;
 
 	// free working memory
 	delete[] left_prims;
 	delete[] right_prims;
 	delete[] all_bounds_;
-	for(int i = 0; i < 3; ++i) delete[] edges[i];
-	delete[] clip_;
-	free(cdata_);
 	//print some stats:
 	c_end = clock() - c_start;
 	Y_VERBOSE << "Kd-Tree: Stats (" << float(c_end) / (float)CLOCKS_PER_SEC << "s)" << YENDL;
@@ -133,6 +164,12 @@ AcceleratorKdTree<T>::AcceleratorKdTree(const T **v, int np, int depth, int leaf
 	Y_VERBOSE << "Kd-Tree: => " << float(kd_stats_.kd_prims_) / (kd_stats_.kd_leaves_ - kd_stats_.empty_kd_leaves_) << " prims per non-empty leaf" << YENDL;
 	Y_VERBOSE << "Kd-Tree: Leaves due to depth limit/bad splits: " << kd_stats_.depth_limit_reached_ << "/" << kd_stats_.num_bad_splits_ << YENDL;
 	Y_VERBOSE << "Kd-Tree: clipped triangles: " << kd_stats_.clip_ << " (" << kd_stats_.bad_clip_ << " bad clips, " << kd_stats_.null_clip_ << " null clips)" << YENDL;
+	if(!cache_path.empty())
+	{
+		if(saveCache(cache_path, v, cache_hash)) Y_VERBOSE << "Kd-Tree: Saved to cache file \"" << cache_path << "\"" << YENDL;
+		else Y_WARNING << "Kd-Tree: Could not save the cache file \"" << cache_path << "\"" << YENDL;
+		if(cache_max_size > 0) pruneKdCache__(cache_dir, cache_path, static_cast<uint64_t>(cache_max_size) << 20);
+	}
 }
 
 template<class T>
@@ -143,6 +180,230 @@ AcceleratorKdTree<T>::~AcceleratorKdTree()
 	Y_VERBOSE << "Kd-Tree: Done" << YENDL;
 }
 
+// ============================================================
+/*!
+	Cache files of built trees. The nodes are stored with the
+	index of their primitives instead of pointers, so the tree
+	can be restored for the same primitives in another process.
+	The file name and header contain a hash of the primitives
+	geometry and of the build parameters. The data is stored in
+	the native byte order, the header allows rejecting files
+	written with a different layout. After saving a tree, the
+	oldest cache files are removed while the directory holds
+	more than the maximum cache size.
+*/
+
+struct KdCacheHeader
+{
+	char magic_[8];
+	uint32_t version_;
+	uint32_t header_size_;
+	uint64_t hash_;
+	uint32_t n_prims_;
+	uint32_t n_nodes_;
+	uint32_t n_leaf_indices_;
+	uint32_t padding_;
+	float bound_[2][3];
+};
+
+struct KdCacheNode
+{
+	uint32_t flags_; //!< same as KdTreeNode::flags_
+	uint32_t data_; //!< interior: bits of the division position; leaf with one primitive: its index; leaf with several primitives: position of their indices in the leaf indices list
+};
+
+static constexpr char kd_cache_magic__[8] = {'Y', 'A', 'F', 'K', 'D', 'T', 'R', 'E'};
+static constexpr uint32_t kd_cache_version__ = 1;
+
+//! Removes the oldest tree cache files in "cache_dir" until their total size is at most "max_size" bytes, keeping the file "kept_path" just saved
+static void pruneKdCache__(const std::string &cache_dir, const std::string &kept_path, uint64_t max_size)
+{
+	struct CacheFile
+	{
+		std::string path_;
+		uint64_t size_;
+		std::time_t time_;
+	};
+	std::vector<CacheFile> cache_files;
+	uint64_t total_size = 0;
+	for(const auto &file_name : File::listFiles(cache_dir))
+	{
+		const Path file_path(file_name);
+		if(file_path.getExtension() != "ykd" || file_path.getBaseName().rfind("kdtree_", 0) != 0) continue;
+		CacheFile cache_file;
+		cache_file.path_ = Path(cache_dir, file_path.getBaseName(), file_path.getExtension()).getFullPath();
+		if(!File::getSizeAndTime(cache_file.path_, cache_file.size_, cache_file.time_)) continue;
+		total_size += cache_file.size_;
+		if(cache_file.path_ != kept_path) cache_files.push_back(cache_file);
+	}
+	if(total_size <= max_size) return;
+	std::sort(cache_files.begin(), cache_files.end(), [](const CacheFile &a, const CacheFile &b) { return a.time_ < b.time_; });
+	for(const auto &cache_file : cache_files)
+	{
+		if(total_size <= max_size) break;
+		if(!File::remove(cache_file.path_, true)) continue;
+		total_size -= cache_file.size_;
+		Y_VERBOSE << "Kd-Tree: Removed old cache file \"" << cache_file.path_ << "\"" << YENDL;
+	}
+}
+
+inline uint64_t fnv1aHash__(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = static_cast<const unsigned char *>(data);
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+//! The triangles are hashed with their vertices, as their clipping during the build depends on them
+inline uint64_t kdCachePrimitiveHash__(uint64_t hash, const Triangle *triangle)
+{
+	const std::array<Point3, 3> vertices = triangle->getVertices();
+	for(const auto &vertex : vertices) hash = fnv1aHash__(hash, &vertex, sizeof(Point3));
+	return hash;
+}
+
+inline uint64_t kdCachePrimitiveHash__(uint64_t hash, const Primitive *primitive)
+{
+	const Bound bound = primitive->getBound();
+	hash = fnv1aHash__(hash, &bound.a_, sizeof(Point3));
+	return fnv1aHash__(hash, &bound.g_, sizeof(Point3));
+}
+
+template<class T>
+uint64_t AcceleratorKdTree<T>::cacheHash(const T **v) const
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const int primitive_type = kdLeafTriangleBlocks__(v[0], 2); //distinguishes the trees of triangles and of generic primitives
+	hash = fnv1aHash__(hash, &primitive_type, sizeof(primitive_type));
+	hash = fnv1aHash__(hash, &total_prims_, sizeof(total_prims_));
+	hash = fnv1aHash__(hash, &max_depth_, sizeof(max_depth_));
+	hash = fnv1aHash__(hash, &max_leaf_size_, sizeof(max_leaf_size_));
+	hash = fnv1aHash__(hash, &cost_ratio_, sizeof(cost_ratio_));
+	hash = fnv1aHash__(hash, &e_bonus_, sizeof(e_bonus_));
+	for(uint32_t i = 0; i < total_prims_; ++i) hash = kdCachePrimitiveHash__(hash, v[i]);
+	return hash;
+}
+
+template<class T>
+bool AcceleratorKdTree<T>::loadCache(const std::string &path, const T **v, uint64_t hash)
+{
+	if(!File::exists(path, true)) return false;
+	const MappedFile file(path);
+	if(!file.isMapped() || file.size() < sizeof(KdCacheHeader)) return false;
+	KdCacheHeader header;
+	std::memcpy(&header, file.data(), sizeof(KdCacheHeader));
+	if(std::memcmp(header.magic_, kd_cache_magic__, sizeof(kd_cache_magic__)) != 0 || header.version_ != kd_cache_version__ || header.header_size_ != sizeof(KdCacheHeader)
+	   || header.hash_ != hash || header.n_prims_ != total_prims_ || header.n_nodes_ == 0
+	   || file.size() != sizeof(KdCacheHeader) + header.n_nodes_ * sizeof(KdCacheNode) + header.n_leaf_indices_ * sizeof(uint32_t))
+	{
+		Y_WARNING << "Kd-Tree: Ignoring invalid or outdated cache file \"" << path << "\"" << YENDL;
+		return false;
+	}
+	const KdCacheNode *cache_nodes = reinterpret_cast<const KdCacheNode *>(file.data() + sizeof(KdCacheHeader));
+	const uint32_t *leaf_indices = reinterpret_cast<const uint32_t *>(cache_nodes + header.n_nodes_);
+	//check all the references before creating any node
+	for(uint32_t i = 0; i < header.n_nodes_; ++i)
+	{
+		const KdCacheNode &cache_node = cache_nodes[i];
+		bool valid = true;
+		if((cache_node.flags_ & 3) != 3) valid = (cache_node.flags_ >> 2) > i && (cache_node.flags_ >> 2) < header.n_nodes_;
+		else if((cache_node.flags_ >> 2) == 1) valid = cache_node.data_ < total_prims_;
+		else if((cache_node.flags_ >> 2) > 1)
+		{
+			valid = static_cast<uint64_t>(cache_node.data_) + (cache_node.flags_ >> 2) <= header.n_leaf_indices_;
+			for(uint32_t j = 0; valid && j < (cache_node.flags_ >> 2); ++j) valid = leaf_indices[cache_node.data_ + j] < total_prims_;
+		}
+		if(!valid)
+		{
+			Y_WARNING << "Kd-Tree: Ignoring corrupted cache file \"" << path << "\"" << YENDL;
+			return false;
+		}
+	}
+	nodes_ = (KdTreeNode<T> *) malloc(header.n_nodes_ * sizeof(KdTreeNode<T>));
+	next_free_node_ = allocated_nodes_count_ = header.n_nodes_;
+	prims_arenas_.emplace_back(new MemoryArena());
+	std::vector<uint32_t> prim_idx;
+	for(uint32_t i = 0; i < header.n_nodes_; ++i)
+	{
+		const KdCacheNode &cache_node = cache_nodes[i];
+		KdTreeNode<T> &node = nodes_[i];
+		node.flags_ = 0;
+		if((cache_node.flags_ & 3) == 3)
+		{
+			const uint32_t n_prims = cache_node.flags_ >> 2;
+			if(n_prims == 1) prim_idx.assign(1, cache_node.data_);
+			else if(n_prims > 1) prim_idx.assign(leaf_indices + cache_node.data_, leaf_indices + cache_node.data_ + n_prims);
+			node.createLeaf(prim_idx.data(), n_prims, v, *prims_arenas_.front(), kd_stats_);
+		}
+		else
+		{
+			float division;
+			std::memcpy(&division, &cache_node.data_, sizeof(float));
+			node.createInterior(cache_node.flags_ & 3, division, kd_stats_);
+			node.setRightChild(cache_node.flags_ >> 2);
+		}
+	}
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		tree_bound_.a_[axis] = header.bound_[0][axis];
+		tree_bound_.g_[axis] = header.bound_[1][axis];
+	}
+	return true;
+}
+
+template<class T>
+bool AcceleratorKdTree<T>::saveCache(const std::string &path, const T **v, uint64_t hash) const
+{
+	std::unordered_map<const T *, uint32_t> prim_index;
+	prim_index.reserve(total_prims_);
+	for(uint32_t i = 0; i < total_prims_; ++i) prim_index.emplace(v[i], i);
+
+	std::vector<KdCacheNode> cache_nodes(next_free_node_);
+	std::vector<uint32_t> leaf_indices;
+	leaf_indices.reserve(kd_stats_.kd_prims_);
+	for(uint32_t i = 0; i < next_free_node_; ++i)
+	{
+		const KdTreeNode<T> &node = nodes_[i];
+		KdCacheNode &cache_node = cache_nodes[i];
+		cache_node.flags_ = node.flags_;
+		cache_node.data_ = 0;
+		if(!node.isLeaf()) std::memcpy(&cache_node.data_, &node.division_, sizeof(float));
+		else if(node.nPrimitives() == 1) cache_node.data_ = prim_index.at(node.one_primitive_);
+		else if(node.nPrimitives() > 1)
+		{
+			cache_node.data_ = leaf_indices.size();
+			for(int j = 0; j < node.nPrimitives(); ++j) leaf_indices.push_back(prim_index.at(node.primitives_[j]));
+		}
+	}
+
+	KdCacheHeader header;
+	std::memset(&header, 0, sizeof(KdCacheHeader));
+	std::memcpy(header.magic_, kd_cache_magic__, sizeof(kd_cache_magic__));
+	header.version_ = kd_cache_version__;
+	header.header_size_ = sizeof(KdCacheHeader);
+	header.hash_ = hash;
+	header.n_prims_ = total_prims_;
+	header.n_nodes_ = next_free_node_;
+	header.n_leaf_indices_ = leaf_indices.size();
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		header.bound_[0][axis] = tree_bound_.a_[axis];
+		header.bound_[1][axis] = tree_bound_.g_[axis];
+	}
+	std::string buffer;
+	buffer.reserve(sizeof(KdCacheHeader) + cache_nodes.size() * sizeof(KdCacheNode) + leaf_indices.size() * sizeof(uint32_t));
+	buffer.append(reinterpret_cast<const char *>(&header), sizeof(KdCacheHeader));
+	buffer.append(reinterpret_cast<const char *>(cache_nodes.data()), cache_nodes.size() * sizeof(KdCacheNode));
+	buffer.append(reinterpret_cast<const char *>(leaf_indices.data()), leaf_indices.size() * sizeof(uint32_t));
+	//saved through a temporary file, so other processes rendering the same scene never load an incomplete file
+	File file(path);
+	return file.save(buffer, true);
+}
+
 // ============================================================
 /*!
 	Faster cost function: Find the optimal split with SAH
@@ -150,7 +411,7 @@ AcceleratorKdTree<T>::~AcceleratorKdTree()
 */
 
 template<class T>
-void AcceleratorKdTree<T>::pigeonMinCost(uint32_t n_prims, Bound &node_bound, uint32_t *prim_idx, SplitCost &split)
+void AcceleratorKdTree<T>::pigeonMinCost(uint32_t n_prims, Bound &node_bound, uint32_t *prim_idx, float e_bonus, SplitCost &split) const
 {
 	TreeBin bin[kd_bins_ + 1 ];
 	float d[3];
@@ -249,8 +510,8 @@ void AcceleratorKdTree<T>::pigeonMinCost(uint32_t n_prims, Bound &node_bound, ui
 					const float raw_costs = (below_sa * n_below + above_sa * n_above);
 					//float eb = (nAbove == 0 || nBelow == 0) ? eBonus*rawCosts : 0.f;
 					float eb;
-					if(n_above == 0) eb = (0.1f + l_2 / d[axis]) * e_bonus_ * raw_costs;
-					else if(n_below == 0) eb = (0.1f + l_1 / d[axis]) * e_bonus_ * raw_costs;
+					if(n_above == 0) eb = (0.1f + l_2 / d[axis]) * e_bonus * raw_costs;
+					else if(n_below == 0) eb = (0.1f + l_1 / d[axis]) * e_bonus * raw_costs;
 					else eb = 0.0f;
 
 					const float cost = cost_ratio_ + inv_total_sa * (raw_costs - eb);
@@ -300,7 +561,7 @@ void AcceleratorKdTree<T>::pigeonMinCost(uint32_t n_prims, Bound &node_bound, ui
 
 template<class T>
 void AcceleratorKdTree<T>::minimalCost(uint32_t n_prims, Bound &node_bound, uint32_t *prim_idx,
-									   const Bound *all_bounds, BoundEdge *edges[3], SplitCost &split)
+									   const Bound *all_bounds, BoundEdge *edges[3], float e_bonus, SplitCost &split, KdStats &kd_stats) const
 {
 	float d[3];
 	d[0] = node_bound.longX();
@@ -360,7 +621,7 @@ void AcceleratorKdTree<T>::minimalCost(uint32_t n_prims, Bound &node_bound, uint
 			if(l_1 > l_2 * float(n_prims) && l_2 > 0.f)
 			{
 				const float raw_costs = (cap_area + l_2 * cap_perim) * n_prims;
-				const float cost = cost_ratio_ + inv_total_sa * (raw_costs - e_bonus_); //todo: use proper ebonus...
+				const float cost = cost_ratio_ + inv_total_sa * (raw_costs - e_bonus); //todo: use proper ebonus...
 				//optimal cost is definitely here, and nowhere else!
 				if(cost < split.best_cost_)
 				{
@@ -368,7 +629,7 @@ void AcceleratorKdTree<T>::minimalCost(uint32_t n_prims, Bound &node_bound, uint
 					split.best_axis_ = axis;
 					split.best_offset_ = 0;
 					split.n_edge_ = n_edge;
-					++kd_stats_.early_out_;
+					++kd_stats.early_out_;
 				}
 				continue;
 			}
@@ -378,14 +639,14 @@ void AcceleratorKdTree<T>::minimalCost(uint32_t n_prims, Bound &node_bound, uint
 			if(l_2 > l_1 * float(n_prims) && l_1 > 0.f)
 			{
 				const float raw_costs = (cap_area + l_1 * cap_perim) * n_prims;
-				const float cost = cost_ratio_ + inv_total_sa * (raw_costs - e_bonus_); //todo: use proper ebonus...
+				const float cost = cost_ratio_ + inv_total_sa * (raw_costs - e_bonus); //todo: use proper ebonus...
 				if(cost < split.best_cost_)
 				{
 					split.best_cost_ = cost;
 					split.best_axis_ = axis;
 					split.best_offset_ = n_edge - 1;
 					split.n_edge_ = n_edge;
-					++kd_stats_.early_out_;
+					++kd_stats.early_out_;
 				}
 				continue;
 			}
@@ -406,8 +667,8 @@ void AcceleratorKdTree<T>::minimalCost(uint32_t n_prims, Bound &node_bound, uint
 				const float raw_costs = (below_sa * n_below + above_sa * n_above);
 				//float eb = (nAbove == 0 || nBelow == 0) ? eBonus*rawCosts : 0.f;
 				float eb;
-				if(n_above == 0) eb = (0.1f + l_2 / d[axis]) * e_bonus_ * raw_costs;
-				else if(n_below == 0) eb = (0.1f + l_1 / d[axis]) * e_bonus_ * raw_costs;
+				if(n_above == 0) eb = (0.1f + l_2 / d[axis]) * e_bonus * raw_costs;
+				else if(n_below == 0) eb = (0.1f + l_1 / d[axis]) * e_bonus * raw_costs;
 				else eb = 0.0f;
 
 				const float cost = cost_ratio_ + inv_total_sa * (raw_costs - eb);
@@ -443,19 +704,21 @@ void AcceleratorKdTree<T>::minimalCost(uint32_t n_prims, Bound &node_bound, uint
 */
 template<class T>
 int AcceleratorKdTree<T>::buildTree(uint32_t n_prims, Bound &node_bound, uint32_t *prim_nums,
-									uint32_t *left_prims, uint32_t *right_prims, BoundEdge *edges[3], //working memory
-                           uint32_t right_mem_size, int depth, int bad_refines)  // status
+									uint32_t *left_prims, uint32_t *right_prims, //working memory
+                           uint32_t right_mem_size, int depth, int bad_refines, KdTreeBuildData<T> &build_data)  // status
 {
 	//	std::cout << "tree level: " << depth << std::endl;
-	if(next_free_node_ == allocated_nodes_count_)
+	KdStats &kd_stats = build_data.kd_stats_;
+	BoundEdge **edges = build_data.edges_;
+	if(build_data.next_free_node_ == build_data.allocated_nodes_count_)
 	{
-		int new_count = 2 * allocated_nodes_count_;
-		new_count = (new_count > 0x100000) ? allocated_nodes_count_ + 0x80000 : new_count;
+		int new_count = 2 * build_data.allocated_nodes_count_;
+		new_count = (new_count > 0x100000) ? build_data.allocated_nodes_count_ + 0x80000 : new_count;
 		KdTreeNode<T> 	*n = (KdTreeNode<T> *) malloc(new_count * sizeof(KdTreeNode<T>));
-		memcpy(n, nodes_, allocated_nodes_count_ * sizeof(KdTreeNode<T>));
-		free(nodes_);
-		nodes_ = n;
-		allocated_nodes_count_ = new_count;
+		memcpy(n, build_data.nodes_, build_data.allocated_nodes_count_ * sizeof(KdTreeNode<T>));
+		free(build_data.nodes_);
+		build_data.nodes_ = n;
+		build_data.allocated_nodes_count_ = new_count;
 	}
 
 #if TRI_CLIP > 0
@@ -474,29 +737,29 @@ int AcceleratorKdTree<T>::buildTree(uint32_t n_prims, Bound &node_bound, uint32_
 			b_ext[1][i] = node_bound.g_[i] + 0.021 * b_half_size[i] + 0.00001 * temp;
 			//			ebound.halfSize[i] *= 1.01;
 		}
-		char *c_old = cdata_ + (tri_clip_thresh_ * clip_data_size_ * depth);
-		char *c_new = cdata_ + (tri_clip_thresh_ * clip_data_size_ * (depth + 1));
+		char *c_old = build_data.cdata_ + (tri_clip_thresh_ * clip_data_size_ * depth);
+		char *c_new = build_data.cdata_ + (tri_clip_thresh_ * clip_data_size_ * (depth + 1));
 		for(unsigned int i = 0; i < n_prims; ++i)
 		{
 			const T *ct = prims_[ prim_nums[i] ];
 			uint32_t old_idx = 0;
-			if(clip_[depth] >= 0) old_idx = prim_nums[i + n_prims];
+			if(build_data.clip_[depth] >= 0) old_idx = prim_nums[i + n_prims];
 			//			if(old_idx > TRI_CLIP_THRESH){ std::cout << "ouch!\n"; }
 			//			std::cout << "parent idx: " << old_idx << std::endl;
 			if(ct->clippingSupport())
 			{
-				if(ct->clipToBound(b_ext, clip_[depth], all_bounds_[total_prims_ + n_overl],
+				if(ct->clipToBound(b_ext, build_data.clip_[depth], build_data.clip_bounds_[n_overl],
 				                   c_old + old_idx * clip_data_size_, c_new + n_overl * clip_data_size_))
 				{
-					++kd_stats_.clip_;
+					++kd_stats.clip_;
 					o_prims[n_overl] = prim_nums[i]; n_overl++;
 				}
-				else ++kd_stats_.null_clip_;
+				else ++kd_stats.null_clip_;
 			}
 			else
 			{
 				// no clipping supported by prim, copy old bound:
-				all_bounds_[total_prims_ + n_overl] = all_bounds_[ prim_nums[i] ]; //really??
+				build_data.clip_bounds_[n_overl] = all_bounds_[ prim_nums[i] ]; //really??
 				o_prims[n_overl] = prim_nums[i]; n_overl++;
 			}
 		}
@@ -509,32 +772,30 @@ int AcceleratorKdTree<T>::buildTree(uint32_t n_prims, Bound &node_bound, uint32_
 	if(n_prims <= max_leaf_size_ || depth >= max_depth_)
 	{
 		//		std::cout << "leaf\n";
-		nodes_[next_free_node_].createLeaf(prim_nums, n_prims, prims_, prims_arena_, kd_stats_);
-		next_free_node_++;
-		if(depth >= max_depth_) kd_stats_.depth_limit_reached_++;   //stat
+		build_data.nodes_[build_data.next_free_node_].createLeaf(prim_nums, n_prims, prims_, *build_data.prims_arenas_.front(), kd_stats);
+		build_data.next_free_node_++;
+		if(depth >= max_depth_) kd_stats.depth_limit_reached_++;   //stat
 		return 0;
 	}
 
 	//<< calculate cost for all axes and chose minimum >>
 	SplitCost split;
-	const float base_bonus = e_bonus_;
-	e_bonus_ *= 1.1 - static_cast<float>(depth) / static_cast<float>(max_depth_);
-	if(n_prims > 128) pigeonMinCost(n_prims, node_bound, prim_nums, split);
+	const float e_bonus = e_bonus_ * (1.1 - static_cast<float>(depth) / static_cast<float>(max_depth_));
+	if(n_prims > 128) pigeonMinCost(n_prims, node_bound, prim_nums, e_bonus, split);
 #if TRI_CLIP > 0
-	else if(n_prims > tri_clip_thresh_) minimalCost(n_prims, node_bound, prim_nums, all_bounds_, edges, split);
-	else minimalCost(n_prims, node_bound, prim_nums, all_bounds_ + total_prims_, edges, split);
+	else if(n_prims > tri_clip_thresh_) minimalCost(n_prims, node_bound, prim_nums, all_bounds_, edges, e_bonus, split, kd_stats);
+	else minimalCost(n_prims, node_bound, prim_nums, build_data.clip_bounds_, edges, e_bonus, split, kd_stats);
 #else
-	else minimalCost(nPrims, nodeBound, primNums, allBounds, edges, split);
+	else minimalCost(n_prims, node_bound, prim_nums, all_bounds_, edges, e_bonus, split, kd_stats);
 #endif
-	e_bonus_ = base_bonus; //restore eBonus
 	//<< if (minimum > leafcost) increase bad refines >>
 	if(split.best_cost_ > split.old_cost_) ++bad_refines;
 	if((split.best_cost_ > 1.6f * split.old_cost_ && n_prims < 16) ||
 	   split.best_axis_ == -1 || bad_refines == 2)
 	{
-		nodes_[next_free_node_].createLeaf(prim_nums, n_prims, prims_, prims_arena_, kd_stats_);
-		next_free_node_++;
-		if(bad_refines == 2) ++kd_stats_.num_bad_splits_;  //stat
+		build_data.nodes_[build_data.next_free_node_].createLeaf(prim_nums, n_prims, prims_, *build_data.prims_arenas_.front(), kd_stats);
+		build_data.next_free_node_++;
+		if(bad_refines == 2) ++kd_stats.num_bad_splits_;  //stat
 		return 0;
 	}
 
@@ -637,9 +898,9 @@ int AcceleratorKdTree<T>::buildTree(uint32_t n_prims, Bound &node_bound, uint32_
 	//advance right prims pointer
 	remaining_mem -= n_1;
 
-	uint32_t cur_node = next_free_node_;
-	nodes_[cur_node].createInterior(split.best_axis_, split_pos, kd_stats_);
-	++next_free_node_;
+	uint32_t cur_node = build_data.next_free_node_;
+	build_data.nodes_[cur_node].createInterior(split.best_axis_, split_pos, kd_stats);
+	++build_data.next_free_node_;
 	Bound bound_l = node_bound, bound_r = node_bound;
 	switch(split.best_axis_)
 	{
@@ -653,22 +914,36 @@ int AcceleratorKdTree<T>::buildTree(uint32_t n_prims, Bound &node_bound, uint32_
 	{
 		remaining_mem -= n_1;
 		//<< recurse below child >>
-		clip_[depth + 1] = split.best_axis_;
-		buildTree(n_0, bound_l, left_prims, left_prims, n_right_prims + 2 * n_1, edges, remaining_mem, depth + 1, bad_refines);
-		clip_[depth + 1] |= 1 << 2;
+		build_data.clip_[depth + 1] = split.best_axis_;
+		buildTree(n_0, bound_l, left_prims, left_prims, n_right_prims + 2 * n_1, remaining_mem, depth + 1, bad_refines, build_data);
+		build_data.clip_[depth + 1] |= 1 << 2;
 		//<< recurse above child >>
-		nodes_[cur_node].setRightChild(next_free_node_);
-		buildTree(n_1, bound_r, n_right_prims, left_prims, n_right_prims + 2 * n_1, edges, remaining_mem, depth + 1, bad_refines);
-		clip_[depth + 1] = -1;
+		build_data.nodes_[cur_node].setRightChild(build_data.next_free_node_);
+		buildTree(n_1, bound_r, n_right_prims, left_prims, n_right_prims + 2 * n_1, remaining_mem, depth + 1, bad_refines, build_data);
+		build_data.clip_[depth + 1] = -1;
+	}
+	else if(depth < max_level_threads_ && n_prims >= kd_min_prims_thread_) //launch threads for the first "x" levels to try to match (at least) the scene threads parameter
+	{
+		//Each subtree is built by its own thread with its own working memory and nodes, merged afterwards in the same order as the sequential build
+		KdTreeBuildData<T> build_data_l(max_depth_, tri_clip_thresh_, clip_data_size_);
+		KdTreeBuildData<T> build_data_r(max_depth_, tri_clip_thresh_, clip_data_size_);
+		//<< recurse below child >>
+		auto below_worker = std::thread(&AcceleratorKdTree<T>::buildChildTreeWorker, this, n_0, std::ref(bound_l), left_prims, depth + 1, bad_refines, std::ref(build_data_l));
+		//<< recurse above child >>
+		buildChildTreeWorker(n_1, bound_r, n_right_prims, depth + 1, bad_refines, build_data_r);
+		below_worker.join();
+		build_data.merge(build_data_l);
+		build_data.nodes_[cur_node].setRightChild(build_data.next_free_node_);
+		build_data.merge(build_data_r);
 	}
 	else
 	{
 #endif
 		//<< recurse below child >>
-		buildTree(n_0, bound_l, left_prims, left_prims, n_right_prims + n_1, edges, remaining_mem, depth + 1, bad_refines);
+		buildTree(n_0, bound_l, left_prims, left_prims, n_right_prims + n_1, remaining_mem, depth + 1, bad_refines, build_data);
 		//<< recurse above child >>
-		nodes_[cur_node].setRightChild(next_free_node_);
-		buildTree(n_1, bound_r, n_right_prims, left_prims, n_right_prims + n_1, edges, remaining_mem, depth + 1, bad_refines);
+		build_data.nodes_[cur_node].setRightChild(build_data.next_free_node_);
+		buildTree(n_1, bound_r, n_right_prims, left_prims, n_right_prims + n_1, remaining_mem, depth + 1, bad_refines, build_data);
 #if TRI_CLIP > 0
 	}
 #endif
@@ -677,12 +952,146 @@ int AcceleratorKdTree<T>::buildTree(uint32_t n_prims, Bound &node_bound, uint32_
 	return 1;
 }
 
+/*! Builds a subtree in its own build data, with its own copy of the primitive
+	indices and working memory so it can run in parallel with its sibling */
+template<class T>
+void AcceleratorKdTree<T>::buildChildTreeWorker(uint32_t n_prims, Bound &node_bound, uint32_t *prim_nums, int depth, int bad_refines, KdTreeBuildData<T> &build_data)
+{
+	const uint32_t r_mem_size = 3 * n_prims;
+	uint32_t *left_prims = new uint32_t[std::max((uint32_t)2 * tri_clip_thresh_, n_prims)];
+	uint32_t *right_prims = new uint32_t[r_mem_size];
+	memcpy(left_prims, prim_nums, n_prims * sizeof(uint32_t));
+	buildTree(n_prims, node_bound, left_prims, left_prims, right_prims, r_mem_size, depth, bad_refines, build_data);
+	delete[] left_prims;
+	delete[] right_prims;
+}
+
 
 
 //============================
 /*! The standard intersect function,
 	returns the closest hit within dist
 */
+/*=============================================================
+	leaf intersection.
+	Leaves with several triangles are tested with their
+	precomputed triangle blocks, so only the triangles actually
+	hit are dereferenced (to check their material visibility).
+=============================================================*/
+
+template<class T>
+inline bool leafIntersect__(const KdTreeNode<T> &node, const Ray &ray, float &z, T **tr, IntersectData &data)
+{
+	const uint32_t n_primitives = node.nPrimitives();
+	T *const *prims = (n_primitives == 1) ? &node.one_primitive_ : node.primitives_;
+	bool hit = false;
+	IntersectData temp_data;
+	for(uint32_t i = 0; i < n_primitives; ++i)
+	{
+		T *mp = prims[i];
+		float t_hit;
+		if(mp->intersect(ray, &t_hit, temp_data))
+		{
+			if(t_hit < z && t_hit >= ray.tmin_)
+			{
+				const Material *mat = mp->getMaterial();
+				if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::VisibleNoShadows)
+				{
+					z = t_hit;
+					*tr = mp;
+					data = temp_data;
+					hit = true;
+				}
+			}
+		}
+	}
+	return hit;
+}
+
+inline bool leafIntersect__(const KdTreeNode<Triangle> &node, const Ray &ray, float &z, Triangle **tr, IntersectData &data)
+{
+	const uint32_t n_primitives = node.nPrimitives();
+	if(n_primitives <= 1) return leafIntersect__<Triangle>(node, ray, z, tr, data);
+	const TriangleBlock *blocks = node.triangleBlocks();
+	bool hit = false;
+	for(uint32_t first = 0; first < n_primitives; first += TriangleBlock::size_)
+	{
+		alignas(16) float t[TriangleBlock::size_], u[TriangleBlock::size_], v[TriangleBlock::size_];
+		const int hit_mask = blocks[first / TriangleBlock::size_].intersect(ray, ray.tmin_, z, t, u, v);
+		if(hit_mask == 0) continue;
+		const uint32_t n_block = std::min(n_primitives - first, (uint32_t) TriangleBlock::size_);
+		for(uint32_t i = 0; i < n_block; ++i)
+		{
+			if(!(hit_mask & (1 << i)) || t[i] >= z) continue;
+			Triangle *mp = node.primitives_[first + i];
+			const Material *mat = mp->getMaterial();
+			if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::VisibleNoShadows)
+			{
+				z = t[i];
+				*tr = mp;
+				data.barycentric_u_ = 1.f - u[i] - v[i];
+				data.barycentric_v_ = u[i];
+				data.barycentric_w_ = v[i];
+				data.time_ = ray.time_;
+				hit = true;
+			}
+		}
+	}
+	return hit;
+}
+
+template<class T>
+inline bool leafIntersectS__(const KdTreeNode<T> &node, const Ray &ray, float dist, T **tr)
+{
+	const uint32_t n_primitives = node.nPrimitives();
+	T *const *prims = (n_primitives == 1) ? &node.one_primitive_ : node.primitives_;
+	IntersectData bary;
+	for(uint32_t i = 0; i < n_primitives; ++i)
+	{
+		T *mp = prims[i];
+		float t_hit;
+		if(mp->intersect(ray, &t_hit, bary))
+		{
+			if(t_hit < dist && t_hit >= 0.f)  // '>=' ?
+			{
+				const Material *mat = mp->getMaterial();
+				if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly)
+				{
+					*tr = mp;
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+inline bool leafIntersectS__(const KdTreeNode<Triangle> &node, const Ray &ray, float dist, Triangle **tr)
+{
+	const uint32_t n_primitives = node.nPrimitives();
+	if(n_primitives <= 1) return leafIntersectS__<Triangle>(node, ray, dist, tr);
+	const TriangleBlock *blocks = node.triangleBlocks();
+	for(uint32_t first = 0; first < n_primitives; first += TriangleBlock::size_)
+	{
+		alignas(16) float t[TriangleBlock::size_], u[TriangleBlock::size_], v[TriangleBlock::size_];
+		const int hit_mask = blocks[first / TriangleBlock::size_].intersect(ray, 0.f, dist, t, u, v);
+		if(hit_mask == 0) continue;
+		const uint32_t n_block = std::min(n_primitives - first, (uint32_t) TriangleBlock::size_);
+		for(uint32_t i = 0; i < n_block; ++i)
+		{
+			if(!(hit_mask & (1 << i))) continue;
+			Triangle *mp = node.primitives_[first + i];
+			const Material *mat = mp->getMaterial();
+			if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly)
+			{
+				*tr = mp;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 template<class T>
 bool AcceleratorKdTree<T>::intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const
 {
@@ -691,7 +1100,7 @@ bool AcceleratorKdTree<T>::intersect(const Ray &ray, float dist, T **tr, float &
 	float a, b; // entry/exit
 	if(!tree_bound_.cross(ray, a, b, dist)) { return false; }
 
-	IntersectData current_data, temp_data;
+	IntersectData current_data;
 	const Vec3 inv_dir(1.f / ray.dir_.x_, 1.f / ray.dir_.y_, 1.f / ray.dir_.z_);
 	//	int rayId = curMailboxId++;
 	bool hit = false;
@@ -774,49 +1183,7 @@ bool AcceleratorKdTree<T>::intersect(const Ray &ray, float dist, T **tr, float &
 		}
 
 		// Check for intersections inside leaf node
-		const uint32_t n_primitives = curr_node->nPrimitives();
-		if(n_primitives == 1)
-		{
-			T *mp = curr_node->one_primitive_;
-			float t_hit;
-			if(mp->intersect(ray, &t_hit, temp_data))
-			{
-				if(t_hit < z && t_hit >= ray.tmin_)
-				{
-					const Material *mat = mp->getMaterial();
-					if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::VisibleNoShadows)
-					{
-						z = t_hit;
-						*tr = mp;
-						current_data = temp_data;
-						hit = true;
-					}
-				}
-			}
-		}
-		else
-		{
-			T **prims = curr_node->primitives_;
-			for(uint32_t i = 0; i < n_primitives; ++i)
-			{
-				T *mp = prims[i];
-				float t_hit;
-				if(mp->intersect(ray, &t_hit, temp_data))
-				{
-					if(t_hit < z && t_hit >= ray.tmin_)
-					{
-						const Material *mat = mp->getMaterial();
-						if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::VisibleNoShadows)
-						{
-							z = t_hit;
-							*tr = mp;
-							current_data = temp_data;
-							hit = true;
-						}
-					}
-				}
-			}
-		}
+		if(leafIntersect__(*curr_node, ray, z, tr, current_data)) hit = true;
 
 		if(hit && z <= stack[ex_pt].t_)
 		{
@@ -839,7 +1206,6 @@ bool AcceleratorKdTree<T>::intersectS(const Ray &ray, float dist, T **tr, float
 	if(!tree_bound_.cross(ray, a, b, dist))
 		return false;
 
-	IntersectData bary;
 	const Vec3 inv_dir(1.f / ray.dir_.x_, 1.f / ray.dir_.y_, 1.f / ray.dir_.z_);
 
 	KdStack<T> stack[kd_max_stack_];
@@ -919,58 +1285,226 @@ bool AcceleratorKdTree<T>::intersectS(const Ray &ray, float dist, T **tr, float
 		}
 
 		// Check for intersections inside leaf node
-		const uint32_t n_primitives = curr_node->nPrimitives();
-		if(n_primitives == 1)
+		if(leafIntersectS__(*curr_node, ray, dist, tr)) return true;
+
+		en_pt = ex_pt;
+		curr_node = stack[ex_pt].node_;
+		ex_pt = stack[en_pt].prev_;
+	} // while
+	return false;
+}
+
+/*=============================================================
+	ray packet traversal.
+	All the rays of a coherent packet share the same near/far
+	child order, so they are traversed together, each one with
+	its own [t_near, t_far] interval. A node is visited when at
+	least one ray of the packet crosses it. Non-coherent packets
+	are intersected ray by ray.
+=============================================================*/
+
+template<class T>
+bool AcceleratorKdTree<T>::packetInitialInterval(const RayPacket &packet, float *t_near, float *t_far) const
+{
+	bool any_crossed = false;
+	for(int i = 0; i < RayPacket::max_size_; ++i)
+	{
+		//rays not crossing the tree (and unused lanes) get an empty interval
+		t_near[i] = 1.f;
+		t_far[i] = 0.f;
+		float a, b; // entry/exit
+		if(i < packet.size() && tree_bound_.cross(packet.ray(i), a, b, packet.dist_[i]))
 		{
-			T *mp = curr_node->one_primitive_;
-			float t_hit;
-			if(mp->intersect(ray, &t_hit, bary))
-			{
-				if(t_hit < dist && t_hit >= 0.f)  // '>=' ?
-				{
-					const Material *mat = mp->getMaterial();
-					if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly) // '>=' ?
-					{
-						*tr = mp;
-						return true;
-					}
-				}
-			}
+			t_near[i] = a;
+			t_far[i] = b;
+			any_crossed = true;
 		}
-		else
+	}
+	return any_crossed;
+}
+
+/*! Splits the packet intervals at the node plane, pushing the far child if needed. Returns the next node to visit or nullptr if none */
+template<class T>
+const KdTreeNode<T> *AcceleratorKdTree<T>::packetTraverseInterior(const RayPacket &packet, const KdTreeNode<T> *node, float *t_near, float *t_far, KdPacketStack<T> *stack, int &stack_size) const
+{
+	const int axis = node->splitAxis();
+	const float split_val = node->splitPos();
+	const KdTreeNode<T> *near_child = node + 1;
+	const KdTreeNode<T> *far_child = &nodes_[node->getRightChild()];
+	if(packet.dirIsNeg(axis)) std::swap(near_child, far_child);
+
+	alignas(32) float near_exit[RayPacket::max_size_], far_entry[RayPacket::max_size_];
+	bool go_near = false, go_far = false;
+	for(int i = 0; i < RayPacket::max_size_; ++i)
+	{
+		const float t = (split_val - packet.from_[axis][i]) * packet.inv_dir_[axis][i]; //splitting plane signed distance
+		//slightly enlarge both child intervals to be conservative with rounding errors
+		const float t_low = std::min(t * 0.99999f, t * 1.00001f);
+		const float t_high = std::max(t * 0.99999f, t * 1.00001f);
+		near_exit[i] = std::min(t_far[i], t_high);
+		far_entry[i] = std::max(t_near[i], t_low);
+		go_near |= t_near[i] <= near_exit[i];
+		go_far |= far_entry[i] <= t_far[i];
+	}
+
+	if(go_near && go_far)
+	{
+		KdPacketStack<T> &far_item = stack[stack_size++];
+		far_item.node_ = far_child;
+		for(int i = 0; i < RayPacket::max_size_; ++i)
 		{
-			T **prims = curr_node->primitives_;
-			for(uint32_t i = 0; i < n_primitives; ++i)
+			far_item.t_near_[i] = far_entry[i];
+			far_item.t_far_[i] = t_far[i];
+			t_far[i] = near_exit[i];
+		}
+		return near_child;
+	}
+	else if(go_near)
+	{
+		for(int i = 0; i < RayPacket::max_size_; ++i) t_far[i] = near_exit[i];
+		return near_child;
+	}
+	else if(go_far)
+	{
+		for(int i = 0; i < RayPacket::max_size_; ++i) t_near[i] = far_entry[i];
+		return far_child;
+	}
+	else return nullptr;
+}
+
+/*! Pops the next node crossed by at least one ray, clipping the intervals with the distances t_max of the hits found so far */
+template<class T>
+const KdTreeNode<T> *AcceleratorKdTree<T>::packetPop(float *t_near, float *t_far, const float *t_max, const KdPacketStack<T> *stack, int &stack_size)
+{
+	while(stack_size > 0)
+	{
+		const KdPacketStack<T> &item = stack[--stack_size];
+		bool any_active = false;
+		for(int i = 0; i < RayPacket::max_size_; ++i)
+		{
+			t_near[i] = item.t_near_[i];
+			t_far[i] = std::min(item.t_far_[i], t_max[i]);
+			any_active |= t_near[i] <= t_far[i];
+		}
+		if(any_active) return item.node_;
+	}
+	return nullptr;
+}
+
+template<class T>
+void AcceleratorKdTree<T>::intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const
+{
+	if(!packet.coherent())
+	{
+		Accelerator<T>::intersect(packet, tr, z, data);
+		return;
+	}
+	alignas(32) float t_near[RayPacket::max_size_], t_far[RayPacket::max_size_], z_max[RayPacket::max_size_];
+	for(int i = 0; i < RayPacket::max_size_; ++i) z_max[i] = (i < packet.size()) ? packet.dist_[i] : -1.f;
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		tr[i] = nullptr;
+		z[i] = packet.dist_[i];
+	}
+	if(!packetInitialInterval(packet, t_near, t_far)) return;
+
+	KdPacketStack<T> stack[kd_max_stack_];
+	int stack_size = 0;
+	const KdTreeNode<T> *curr_node = nodes_;
+	while(curr_node != nullptr)
+	{
+		if(!curr_node->isLeaf())
+		{
+			curr_node = packetTraverseInterior(packet, curr_node, t_near, t_far, stack, stack_size);
+			if(curr_node == nullptr) curr_node = packetPop(t_near, t_far, z_max, stack, stack_size);
+			continue;
+		}
+
+		// Check for intersections inside leaf node, for the rays crossing it
+		for(int i = 0; i < packet.size(); ++i)
+		{
+			if(t_near[i] <= t_far[i]) leafIntersect__(*curr_node, packet.ray(i), z_max[i], &tr[i], data[i]);
+		}
+		curr_node = packetPop(t_near, t_far, z_max, stack, stack_size);
+	}
+	for(int i = 0; i < packet.size(); ++i) z[i] = z_max[i];
+}
+
+template<class T>
+void AcceleratorKdTree<T>::intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const
+{
+	if(!packet.coherent())
+	{
+		Accelerator<T>::intersectS(packet, tr, shadowed, shadow_bias);
+		return;
+	}
+	alignas(32) float t_near[RayPacket::max_size_], t_far[RayPacket::max_size_], t_max[RayPacket::max_size_];
+	for(int i = 0; i < RayPacket::max_size_; ++i) t_max[i] = (i < packet.size()) ? packet.dist_[i] : -1.f;
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		tr[i] = nullptr;
+		shadowed[i] = false;
+	}
+	if(!packetInitialInterval(packet, t_near, t_far)) return;
+
+	KdPacketStack<T> stack[kd_max_stack_];
+	int stack_size = 0;
+	const KdTreeNode<T> *curr_node = nodes_;
+	while(curr_node != nullptr)
+	{
+		if(!curr_node->isLeaf())
+		{
+			curr_node = packetTraverseInterior(packet, curr_node, t_near, t_far, stack, stack_size);
+			if(curr_node == nullptr) curr_node = packetPop(t_near, t_far, t_max, stack, stack_size);
+			continue;
+		}
+
+		// Check for intersections inside leaf node, for the rays crossing it and not shadowed yet
+		for(int i = 0; i < packet.size(); ++i)
+		{
+			if(shadowed[i] || t_near[i] > t_far[i]) continue;
+			if(leafIntersectS__(*curr_node, packet.ray(i), packet.dist_[i], &tr[i]))
 			{
-				T *mp = prims[i];
-				float t_hit;
-				if(mp->intersect(ray, &t_hit, bary))
-				{
-					if(t_hit < dist && t_hit >= 0.f)
-					{
-						const Material *mat = mp->getMaterial();
-						if(mat->getVisibility() == Material::Visibility::NormalVisible || mat->getVisibility() == Material::Visibility::InvisibleShadowsOnly)
-						{
-							*tr = mp;
-							return true;
-						}
-					}
-				}
+				shadowed[i] = true;
+				t_max[i] = std::numeric_limits<float>::lowest(); //no more traversal needed for this ray
 			}
 		}
-		en_pt = ex_pt;
-		curr_node = stack[ex_pt].node_;
-		ex_pt = stack[en_pt].prev_;
-	} // while
-	return false;
+		curr_node = packetPop(t_near, t_far, t_max, stack, stack_size);
+	}
 }
 
+/*! Primitives already filtered by a transparent shadow ray, so that a
+	primitive referenced by several leaves only filters the ray once.
+	The first entries are kept in a fixed array on the stack and only the
+	rays crossing more transparent primitives spill over to the heap, so
+	the common case does no allocations and the search is a short scan. */
+template<class T>
+class KdFilteredPrimitives final
+{
+	public:
+		//! Returns true if the primitive was not in the set yet
+		bool insert(const T *primitive)
+		{
+			for(int i = 0; i < n_local_; ++i) if(local_[i] == primitive) return false;
+			if(std::find(spilled_.begin(), spilled_.end(), primitive) != spilled_.end()) return false;
+			if(n_local_ < max_local_) local_[n_local_++] = primitive;
+			else spilled_.push_back(primitive);
+			return true;
+		}
+
+	private:
+		static constexpr int max_local_ = 16;
+		const T *local_[max_local_];
+		int n_local_ = 0;
+		std::vector<const T *> spilled_;
+};
+
 /*=============================================================
 	allow for transparent shadows.
 =============================================================*/
 
 template<class T>
-bool AcceleratorKdTree<T>::intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias) const
+bool AcceleratorKdTree<T>::intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const
 {
 	float a, b; // entry/exit
 	if(!tree_bound_.cross(ray, a, b, dist))
@@ -991,13 +1525,8 @@ bool AcceleratorKdTree<T>::intersectTs(RenderData &render_data, const Ray &ray,
 	else inv_dir_z = 1.f / ray.dir_.z_;
 
 	Vec3 inv_dir(inv_dir_x, inv_dir_y, inv_dir_z);
-	int depth = 0;
 
-#if ( HAVE_PTHREAD && defined (__GNUC__) && !defined (__clang__) )
-	std::set<const T *, std::less<const T *>, __gnu_cxx::__mt_alloc<const T *>> filtered;
-#else
-	std::set<const T *> filtered;
-#endif
+	KdFilteredPrimitives<T> filtered;
 	KdStack<T> stack[kd_max_stack_];
 	const KdTreeNode<T> *far_child, *curr_node;
 	curr_node = nodes_;
@@ -1088,13 +1617,10 @@ bool AcceleratorKdTree<T>::intersectTs(RenderData &render_data, const Ray &ray,
 					{
 						*tr = mp;
 						if(!mat->isTransparent()) return true;
-						if(filtered.insert(mp).second)
+						if(filtered.insert(mp))
 						{
 							if(depth >= max_depth) return true;
-							const Point3 h = ray.from_ + t_hit * ray.dir_;
-							SurfacePoint sp;
-							mp->getSurface(sp, h, bary);
-							filt *= mat->getTransparency(render_data, sp, ray.dir_);
+							filt *= Accelerator<T>::primitiveTransparency(render_data, *mp, *mat, ray, t_hit, bary, instance);
 							++depth;
 						}
 					}
@@ -1117,13 +1643,10 @@ bool AcceleratorKdTree<T>::intersectTs(RenderData &render_data, const Ray &ray,
 						{
 							*tr = mp;
 							if(!mat->isTransparent()) return true;
-							if(filtered.insert(mp).second)
+							if(filtered.insert(mp))
 							{
 								if(depth >= max_depth) return true;
-								const Point3 h = ray.from_ + t_hit * ray.dir_;
-								SurfacePoint sp;
-								mp->getSurface(sp, h, bary);
-								filt *= mat->getTransparency(render_data, sp, ray.dir_);
+								filt *= Accelerator<T>::primitiveTransparency(render_data, *mp, *mat, ray, t_hit, bary, instance);
 								++depth;
 							}
 						}
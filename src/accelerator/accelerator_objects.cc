@@ -0,0 +1,447 @@
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "accelerator/accelerator_objects.h"
+#include "common/logger.h"
+#include "geometry/triangle.h"
+#include "geometry/primitive.h"
+#include "geometry/surface.h"
+#include <algorithm>
+#include <limits>
+#include <ctime>
+
+BEGIN_YAFARAY
+
+inline Vec3 inverseDirection__(const Vec3 &dir)
+{
+	//To avoid division by zero
+	Vec3 inv_dir;
+	for(int axis = 0; axis < 3; ++axis) inv_dir[axis] = (dir[axis] == 0.f) ? std::numeric_limits<float>::max() : 1.f / dir[axis];
+	return inv_dir;
+}
+
+template<class T>
+AcceleratorObjects<T>::AcceleratorObjects(const std::vector<Bound> &object_bounds)
+{
+	Y_INFO << "Objects: Starting build (" << object_bounds.size() << " objects)" << YENDL;
+	const clock_t c_start = clock();
+	if(object_bounds.empty()) return;
+	std::vector<BuildObject> build_objects(object_bounds.size());
+	for(uint32_t i = 0; i < object_bounds.size(); ++i) build_objects[i] = {object_bounds[i], i};
+	nodes_.reserve(2 * object_bounds.size());
+	buildTree(build_objects, 0, build_objects.size(), 0);
+	nodes_.shrink_to_fit();
+	accelerators_.resize(groups_.size(), nullptr);
+	tree_bound_ = nodes_.front().bound_;
+
+	const clock_t c_end = clock() - c_start;
+	Y_VERBOSE << "Objects: Stats (" << float(c_end) / (float)CLOCKS_PER_SEC << "s)" << YENDL;
+	Y_VERBOSE << "Objects: Interior nodes: " << stats_.inodes_ << " / " << "leaf nodes: " << stats_.leaves_ << YENDL;
+	Y_VERBOSE << "Objects: => " << float(object_bounds.size()) / stats_.leaves_ << " objects per group" << YENDL;
+}
+
+template<class T>
+float AcceleratorObjects<T>::surfaceArea(const Bound &bound)
+{
+	const float x = bound.longX(), y = bound.longY(), z = bound.longZ();
+	return 2.f * (x * y + x * z + y * z);
+}
+
+template<class T>
+int AcceleratorObjects<T>::binIndex(const Point3 &centroid, const Bound &centroid_bound, int axis)
+{
+	const float extent = centroid_bound.g_[axis] - centroid_bound.a_[axis];
+	const int bin = static_cast<int>(num_bins_ * (centroid[axis] - centroid_bound.a_[axis]) / extent);
+	return std::min(std::max(bin, 0), num_bins_ - 1);
+}
+
+// ============================================================
+/*!
+	Find the split with the binned Surface Area Heuristic, with the
+	number of objects entered by a ray as cost. Unlike the primitives
+	of a BVH, the objects can be very large and sparse (e.g. several
+	meshes scattered over the whole scene), so the split is only
+	accepted if it really reduces the number of objects entered.
+	returns false if the objects should be grouped
+*/
+
+template<class T>
+bool AcceleratorObjects<T>::findBestSplit(const std::vector<BuildObject> &build_objects, uint32_t start, uint32_t end, const Bound &node_bound, const Bound &centroid_bound, int &best_axis, int &best_bin) const
+{
+	const uint32_t n_objects = end - start;
+	const float node_sa = surfaceArea(node_bound);
+	if(node_sa <= 0.f) return false;
+	float best_cost = std::numeric_limits<float>::infinity();
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		if(centroid_bound.g_[axis] <= centroid_bound.a_[axis]) continue;
+		Bound bin_bounds[num_bins_];
+		uint32_t bin_counts[num_bins_] = { };
+		for(uint32_t i = start; i < end; ++i)
+		{
+			const int bin = binIndex(build_objects[i].bound_.center(), centroid_bound, axis);
+			bin_bounds[bin] = bin_counts[bin] ? Bound(bin_bounds[bin], build_objects[i].bound_) : build_objects[i].bound_;
+			++bin_counts[bin];
+		}
+		// sweep from the right storing the cost of everything above each split
+		float above_cost[num_bins_];
+		Bound bound_above;
+		uint32_t count_above = 0;
+		for(int i = num_bins_ - 1; i > 0; --i)
+		{
+			if(bin_counts[i]) bound_above = count_above ? Bound(bound_above, bin_bounds[i]) : bin_bounds[i];
+			count_above += bin_counts[i];
+			above_cost[i] = count_above ? count_above * surfaceArea(bound_above) : 0.f;
+		}
+		// sweep from the left evaluating the cost of splitting after bin i
+		Bound bound_below;
+		uint32_t count_below = 0;
+		for(int i = 0; i < num_bins_ - 1; ++i)
+		{
+			if(bin_counts[i]) bound_below = count_below ? Bound(bound_below, bin_bounds[i]) : bin_bounds[i];
+			count_below += bin_counts[i];
+			if(count_below == 0 || count_below == n_objects) continue;
+			const float cost = count_below * surfaceArea(bound_below) + above_cost[i + 1];
+			if(cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = i;
+			}
+		}
+	}
+	return best_cost < max_split_entries_ * n_objects * node_sa;
+}
+
+// ============================================================
+/*!
+	recursively build the top level in depth-first order, each leaf
+	being a group of objects
+	returns: index of the created node
+*/
+
+template<class T>
+uint32_t AcceleratorObjects<T>::buildTree(std::vector<BuildObject> &build_objects, uint32_t start, uint32_t end, int depth)
+{
+	const uint32_t node_index = nodes_.size();
+	nodes_.push_back(BvhNode());
+	Bound node_bound = build_objects[start].bound_;
+	Bound centroid_bound(node_bound.center(), node_bound.center());
+	for(uint32_t i = start + 1; i < end; ++i)
+	{
+		node_bound = Bound(node_bound, build_objects[i].bound_);
+		centroid_bound.include(build_objects[i].bound_.center());
+	}
+	const uint32_t n_objects = end - start;
+	int axis = -1, bin = -1;
+	if(n_objects == 1 || depth >= max_depth_ || !findBestSplit(build_objects, start, end, node_bound, centroid_bound, axis, bin))
+	{
+		if(depth >= max_depth_) ++stats_.depth_limit_reached_;
+		std::vector<uint32_t> group;
+		for(uint32_t i = start; i < end; ++i) group.push_back(build_objects[i].index_);
+		nodes_[node_index].createLeaf(node_bound, groups_.size(), 1);
+		groups_.push_back(std::move(group));
+		++stats_.leaves_;
+		return node_index;
+	}
+	auto first = build_objects.begin() + start, last = build_objects.begin() + end;
+	auto middle = std::partition(first, last, [&](const BuildObject &o) { return binIndex(o.bound_.center(), centroid_bound, axis) <= bin; });
+	if(middle == first || middle == last)
+	{
+		//all centroids ended in the same side due to float rounding, fall back to a median split
+		middle = first + n_objects / 2;
+		std::nth_element(first, middle, last, [axis](const BuildObject &a, const BuildObject &b) { return a.bound_.center()[axis] < b.bound_.center()[axis]; });
+		++stats_.median_splits_;
+	}
+	const uint32_t mid = start + static_cast<uint32_t>(middle - first);
+	++stats_.inodes_;
+	buildTree(build_objects, start, mid, depth + 1);
+	const uint32_t right_child = buildTree(build_objects, mid, end, depth + 1);
+	nodes_[node_index].createInterior(node_bound, axis);
+	nodes_[node_index].setRightChild(right_child);
+	return node_index;
+}
+
+template<class T>
+inline bool AcceleratorObjects<T>::crossBound(const Bound &bound, const Ray &ray, const Vec3 &inv_dir, float dist)
+{
+	float t_min = std::numeric_limits<float>::lowest();
+	float t_max = std::numeric_limits<float>::max();
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		const float t_0 = (bound.a_[axis] - ray.from_[axis]) * inv_dir[axis];
+		const float t_1 = (bound.g_[axis] - ray.from_[axis]) * inv_dir[axis];
+		t_min = std::max(t_min, std::min(t_0, t_1));
+		t_max = std::min(t_max, std::max(t_0, t_1));
+	}
+	t_max *= 1.00001f;
+	return t_min <= t_max && t_max >= 0.f && t_min <= dist;
+}
+
+//============================
+/*! The standard intersect function,
+	returns the closest hit within dist
+*/
+template<class T>
+bool AcceleratorObjects<T>::intersect(const Ray &ray, float dist, T **tr, float &z, IntersectData &data) const
+{
+	z = dist;
+	if(nodes_.empty()) return false;
+	const Vec3 inv_dir = inverseDirection__(ray.dir_);
+	bool hit = false;
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, ray, inv_dir, z))
+		{
+			if(!node.isLeaf())
+			{
+				//visit the near child first, so the far one can be culled by the closest hit found so far
+				if(inv_dir[node.splitAxis()] < 0.f)
+				{
+					stack[stack_size++] = node_index + 1;
+					node_index = node.getRightChild();
+				}
+				else
+				{
+					stack[stack_size++] = node.getRightChild();
+					++node_index;
+				}
+				continue;
+			}
+			T *hit_primitive = nullptr;
+			float hit_z;
+			IntersectData hit_data;
+			if(accelerators_[node.getFirstPrimitive()]->intersect(ray, z, &hit_primitive, hit_z, hit_data))
+			{
+				z = hit_z;
+				data = hit_data;
+				*tr = hit_primitive;
+				hit = true;
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return hit;
+}
+
+template<class T>
+bool AcceleratorObjects<T>::intersectS(const Ray &ray, float dist, T **tr, float shadow_bias) const
+{
+	if(nodes_.empty()) return false;
+	const Vec3 inv_dir = inverseDirection__(ray.dir_);
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, ray, inv_dir, dist))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			if(accelerators_[node.getFirstPrimitive()]->intersectS(ray, dist, tr, shadow_bias)) return true;
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+/*! Transparent shadows: the filter is accumulated over all the groups crossed,
+	which share the "max_depth" budget as if they were in a single accelerator */
+template<class T>
+bool AcceleratorObjects<T>::intersectTs(RenderData &render_data, const Ray &ray, int max_depth, float dist, T **tr, Rgb &filt, float shadow_bias, int &depth, const TriangleObjectInstance *instance) const
+{
+	if(nodes_.empty()) return false;
+	const Vec3 inv_dir = inverseDirection__(ray.dir_);
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, ray, inv_dir, dist))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			if(accelerators_[node.getFirstPrimitive()]->intersectTs(render_data, ray, max_depth, dist, tr, filt, shadow_bias, depth, instance)) return true;
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+/*=============================================================
+	ray packet traversal.
+	The rays of the packet crossing a leaf are gathered in a new
+	packet for the accelerator of its group, limited to their
+	closest hit so far, and its results are merged back.
+=============================================================*/
+
+template<class T>
+inline bool AcceleratorObjects<T>::crossBound(const Bound &bound, const RayPacket &packet, const float *dist, const bool *active, bool *crossed)
+{
+	bool any_crossed = false;
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		float t_min = std::numeric_limits<float>::lowest();
+		float t_max = std::numeric_limits<float>::max();
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			const float t_0 = (bound.a_[axis] - packet.from_[axis][i]) * packet.inv_dir_[axis][i];
+			const float t_1 = (bound.g_[axis] - packet.from_[axis][i]) * packet.inv_dir_[axis][i];
+			t_min = std::max(t_min, std::min(t_0, t_1));
+			t_max = std::min(t_max, std::max(t_0, t_1));
+		}
+		t_max *= 1.00001f;
+		crossed[i] = active[i] && t_min <= t_max && t_max >= 0.f && t_min <= dist[i];
+		any_crossed |= crossed[i];
+	}
+	return any_crossed;
+}
+
+template<class T>
+void AcceleratorObjects<T>::intersect(const RayPacket &packet, T **tr, float *z, IntersectData *data) const
+{
+	bool active[RayPacket::max_size_], crossed[RayPacket::max_size_];
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		active[i] = true;
+		tr[i] = nullptr;
+		z[i] = packet.dist_[i];
+	}
+	if(nodes_.empty()) return;
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	uint32_t node_index = 0;
+	while(true)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, packet, z, active, crossed))
+		{
+			if(!node.isLeaf())
+			{
+				if(packet.dirIsNeg(node.splitAxis()))
+				{
+					stack[stack_size++] = node_index + 1;
+					node_index = node.getRightChild();
+				}
+				else
+				{
+					stack[stack_size++] = node.getRightChild();
+					++node_index;
+				}
+				continue;
+			}
+			RayPacket group_packet;
+			int ray_index[RayPacket::max_size_];
+			for(int i = 0; i < packet.size(); ++i)
+			{
+				if(!crossed[i]) continue;
+				ray_index[group_packet.size()] = i;
+				group_packet.add(packet.ray(i), z[i]);
+			}
+			T *hit_primitive[RayPacket::max_size_];
+			float hit_z[RayPacket::max_size_];
+			IntersectData hit_data[RayPacket::max_size_];
+			accelerators_[node.getFirstPrimitive()]->intersect(group_packet, hit_primitive, hit_z, hit_data);
+			for(int k = 0; k < group_packet.size(); ++k)
+			{
+				if(!hit_primitive[k]) continue;
+				const int i = ray_index[k];
+				tr[i] = hit_primitive[k];
+				z[i] = hit_z[k];
+				data[i] = hit_data[k];
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+}
+
+template<class T>
+void AcceleratorObjects<T>::intersectS(const RayPacket &packet, T **tr, bool *shadowed, float shadow_bias) const
+{
+	bool active[RayPacket::max_size_], crossed[RayPacket::max_size_];
+	for(int i = 0; i < packet.size(); ++i)
+	{
+		active[i] = true;
+		tr[i] = nullptr;
+		shadowed[i] = false;
+	}
+	if(nodes_.empty()) return;
+	uint32_t stack[max_stack_];
+	int stack_size = 0;
+	int n_active = packet.size();
+	uint32_t node_index = 0;
+	while(n_active > 0)
+	{
+		const BvhNode &node = nodes_[node_index];
+		if(crossBound(node.bound_, packet, packet.dist_, active, crossed))
+		{
+			if(!node.isLeaf())
+			{
+				stack[stack_size++] = node.getRightChild();
+				++node_index;
+				continue;
+			}
+			RayPacket group_packet;
+			int ray_index[RayPacket::max_size_];
+			for(int i = 0; i < packet.size(); ++i)
+			{
+				if(!crossed[i]) continue;
+				ray_index[group_packet.size()] = i;
+				group_packet.add(packet.ray(i), packet.dist_[i]);
+			}
+			T *hit_primitive[RayPacket::max_size_];
+			bool hit_shadowed[RayPacket::max_size_];
+			accelerators_[node.getFirstPrimitive()]->intersectS(group_packet, hit_primitive, hit_shadowed, shadow_bias);
+			for(int k = 0; k < group_packet.size(); ++k)
+			{
+				if(!hit_shadowed[k]) continue;
+				const int i = ray_index[k];
+				tr[i] = hit_primitive[k];
+				shadowed[i] = true;
+				active[i] = false; //no more traversal needed for this ray
+				--n_active;
+			}
+		}
+		if(stack_size == 0) break;
+		node_index = stack[--stack_size];
+	}
+}
+
+// explicit instantiation of template:
+template class AcceleratorObjects<Triangle>;
+template class AcceleratorObjects<Primitive>;
+
+END_YAFARAY
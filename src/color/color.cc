@@ -138,9 +138,10 @@ Rgbe::Rgbe(const Rgb &s)
 	{
 		int e;
 		v = std::frexp(v, &e) * 256.f / v;
-		rgbe_[0] = (unsigned char)(s.getR() * v);
-		rgbe_[1] = (unsigned char)(s.getG() * v);
-		rgbe_[2] = (unsigned char)(s.getB() * v);
+		//rounded instead of truncated, so the stored colors are not biased towards darker values
+		rgbe_[0] = (unsigned char)std::min(255.f, s.getR() * v + 0.5f);
+		rgbe_[1] = (unsigned char)std::min(255.f, s.getG() * v + 0.5f);
+		rgbe_[2] = (unsigned char)std::min(255.f, s.getB() * v + 0.5f);
 		rgbe_[3] = (unsigned char)(e + 128);
 	}
 }
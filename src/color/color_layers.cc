@@ -17,33 +17,71 @@
  */
 
 #include "color/color_layers.h"
+#include "common/logger.h"
+#include <cstdlib>
 
 BEGIN_YAFARAY
 
 ColorLayers::ColorLayers(const Layers &layers) : mask_params_(layers.getMaskParams())
 {
+	slots_.fill(-1);
+	items_.reserve(layers.size());
+	default_colors_.reserve(layers.size());
 	for(const auto &layer : layers)
 	{
-		set(layer.first, layer.first);
+		if(layer.first < 0 || layer.first >= Layer::Size) continue;
+		slots_[layer.first] = static_cast<int>(items_.size());
+		items_.push_back(ColorLayer(layer.first));
+		default_colors_.push_back(items_.back().color_);
 	}
 }
 
 void ColorLayers::setDefaultColors()
 {
-	for(auto &item : items_)
+	for(size_t i = 0; i < items_.size(); ++i)
 	{
-		item.second.color_ = Layer::getDefaultColor(item.first);
+		items_[i].color_ = default_colors_[i];
 	}
 }
 
-bool ColorLayers::isDefinedAny(const std::vector<Layer::Type> &types) const
+void ColorLayers::disabledLayerError(const Layer::Type &type)
+{
+	Y_ERROR << "ColorLayers: accessing the layer '" << Layer::getTypeName(type) << "' which is not enabled, exiting..." << YENDL;
+	std::exit(-1);
+}
+
+bool ColorLayers::isDefinedAny(std::initializer_list<Layer::Type> types) const
 {
 	for(const auto &it : types)
 	{
-		if(find(it)) return true;
+		if(getSlot(it) >= 0) return true;
 	}
 	return false;
 }
 
+ColorLayersArea::ColorLayersArea(const Layers &layers)
+{
+	slots_.fill(-1);
+	for(const auto &layer : layers)
+	{
+		if(layer.first < 0 || layer.first >= Layer::Size) continue;
+		slots_[layer.first] = static_cast<int>(layer_types_.size());
+		layer_types_.push_back(layer.first);
+		default_colors_.push_back(Layer::getDefaultColor(layer.first));
+	}
+	colors_.resize(layer_types_.size());
+}
+
+void ColorLayersArea::setArea(int x_0, int y_0, int width, int height)
+{
+	x_0_ = x_0;
+	y_0_ = y_0;
+	width_ = width;
+	height_ = height;
+	for(size_t i = 0; i < colors_.size(); ++i)
+	{
+		colors_[i].assign(static_cast<size_t>(width) * height, default_colors_[i]);
+	}
+}
 
 END_YAFARAY
\ No newline at end of file
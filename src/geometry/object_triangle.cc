@@ -20,6 +20,10 @@
 #include "geometry/triangle.h"
 #include "geometry/uv.h"
 #include "common/logger.h"
+#include "common/sysinfo.h"
+#include <algorithm>
+#include <functional>
+#include <thread>
 
 BEGIN_YAFARAY
 
@@ -105,112 +109,141 @@ bool TriangleObject::smoothMesh(float angle)
 		for(size_t idx = 0; idx < normals_.size(); ++idx) normals_[idx].normalize();
 
 	}
-	else if(angle > 0.1f) // angle dependant smoothing
+	else if(angle > 0.1f) smoothMeshByAngle(angle); // angle dependant smoothing
+	setSmooth(true);
+	return true;
+}
+
+/*! The faces around each vertex are stored in compressed sparse row form: the
+	corners of all the faces (3 * triangle index + vertex number in the triangle)
+	sorted by vertex with a counting sort, and the position of the first corner of
+	each vertex. The vertices are then split in ranges processed by several
+	threads, each one creating the new normals of its vertices in its own list.
+	The lists are appended in the order of the vertices, so the result does not
+	depend on the number of threads */
+void TriangleObject::smoothMeshByAngle(float angle)
+{
+	const float thresh = math::cos(math::degToRad(angle));
+	const uint32_t n_points = points_.size();
+	const uint32_t n_triangles = triangles_.size();
+	const uint32_t n_corners = 3 * n_triangles;
+	int num_threads = 1;
+	if(n_points >= 65536) //not worth starting threads for small meshes
 	{
-		float thresh = math::cos(math::degToRad(angle));
-		std::vector<Vec3> vnormals;
-		std::vector<int> vn_index;
-		// create list of faces that include given vertex
-		std::vector<std::vector<Triangle *>> vface(points_size);
-		std::vector<std::vector<float>> alphas(points_size);
-		for(auto &tri : triangles_)
+		const SysInfo sys_info;
+		num_threads = std::max(1, sys_info.getNumSystemThreads());
+	}
+	auto run_threads = [num_threads](const std::function<void(int)> &work)
+	{
+		std::vector<std::thread> threads;
+		for(int i = 1; i < num_threads; ++i) threads.push_back(std::thread(work, i));
+		work(0);
+		for(auto &t : threads) t.join();
+	};
+	const uint32_t triangles_per_thread = (n_triangles + num_threads - 1) / num_threads;
+	const uint32_t points_per_thread = (n_points + num_threads - 1) / num_threads;
+
+	//angle weight of each corner
+	std::vector<float> alphas(n_corners);
+	run_threads([&](int thread_id)
+	{
+		const uint32_t end = std::min(n_triangles, (thread_id + 1) * triangles_per_thread);
+		for(uint32_t t = thread_id * triangles_per_thread; t < end; ++t)
 		{
+			const std::array<int, 3> tri_id = triangles_[t].getVerticesIndices();
 			Vec3 e_1, e_2;
-			const std::array<int, 3> tri_id = tri.getVerticesIndices();
-
 			prepareEdges__(tri_id, points_, e_1, e_2);
-			alphas[tri_id[0]].push_back(e_1.sinFromVectors(e_2));
-			vface[tri_id[0]].push_back(&tri);
-
+			alphas[3 * t] = e_1.sinFromVectors(e_2);
 			prepareEdges__({tri_id[1], tri_id[0], tri_id[2]}, points_, e_1, e_2);
-			alphas[tri_id[1]].push_back(e_1.sinFromVectors(e_2));
-			vface[tri_id[1]].push_back(&tri);
-
+			alphas[3 * t + 1] = e_1.sinFromVectors(e_2);
 			prepareEdges__({tri_id[2], tri_id[0], tri_id[1]}, points_, e_1, e_2);
-			alphas[tri_id[2]].push_back(e_1.sinFromVectors(e_2));
-			vface[tri_id[2]].push_back(&tri);
+			alphas[3 * t + 2] = e_1.sinFromVectors(e_2);
 		}
-		for(int i = 0; i < (int)vface.size(); ++i)
+	});
+
+	//counting sort of the corners by vertex, keeping the order of the triangles
+	std::vector<uint32_t> vertex_start(n_points + 1, 0);
+	for(const auto &tri : triangles_) for(const int point_id : tri.getVerticesIndices()) ++vertex_start[point_id + 1];
+	for(uint32_t i = 0; i < n_points; ++i) vertex_start[i + 1] += vertex_start[i];
+	std::vector<uint32_t> vertex_corners(n_corners);
+	{
+		std::vector<uint32_t> next_position(vertex_start.begin(), vertex_start.end() - 1);
+		for(uint32_t c = 0; c < n_corners; ++c) vertex_corners[next_position[triangles_[c / 3].getPointId(c % 3)]++] = c;
+	}
+
+	//normal of each corner, as an index in the list of new normals of the thread that processed its vertex
+	std::vector<int> corner_normals(n_corners, -1);
+	std::vector<std::vector<Vec3>> thread_normals(num_threads);
+	run_threads([&](int thread_id)
+	{
+		std::vector<Vec3> &new_normals = thread_normals[thread_id];
+		std::vector<int> vertex_normals; //new normals of the current vertex
+		const uint32_t end = std::min(n_points, (thread_id + 1) * points_per_thread);
+		for(uint32_t i = thread_id * points_per_thread; i < end; ++i)
 		{
-			std::vector<Triangle *> &tris = vface[i];
-			int j = 0;
-			for(auto fi = tris.begin(); fi != tris.end(); ++fi)
+			vertex_normals.clear();
+			for(uint32_t c = vertex_start[i]; c < vertex_start[i + 1]; ++c)
 			{
-				Triangle *f = *fi;
+				const uint32_t corner = vertex_corners[c];
+				const Vec3 face_normal = triangles_[corner / 3].getNormal();
+				Vec3 vnorm = face_normal * alphas[corner];
 				bool smooth = false;
-				// calculate vertex normal for face
-				Vec3 vnorm, fnorm;
-
-				fnorm = f->getNormal();
-				vnorm = fnorm * alphas[i][j];
-				int k = 0;
-				for(auto f_2 = tris.begin(); f_2 != tris.end(); ++f_2)
+				for(uint32_t c_2 = vertex_start[i]; c_2 < vertex_start[i + 1]; ++c_2)
 				{
-					if(**fi == **f_2)
-					{
-						k++;
-						continue;
-					}
-					Vec3 f_2_norm = (*f_2)->getNormal();
-					if((fnorm * f_2_norm) > thresh)
+					const uint32_t corner_2 = vertex_corners[c_2];
+					if(corner_2 / 3 == corner / 3) continue;
+					const Vec3 face_normal_2 = triangles_[corner_2 / 3].getNormal();
+					if((face_normal * face_normal_2) > thresh)
 					{
 						smooth = true;
-						vnorm += f_2_norm * alphas[i][k];
+						vnorm += face_normal_2 * alphas[corner_2];
 					}
-					k++;
 				}
+				if(!smooth) continue;
+				vnorm.normalize();
+				//search for existing normal
 				int n_idx = -1;
-				if(smooth)
-				{
-					vnorm.normalize();
-					//search for existing normal
-					for(unsigned int l = 0; l < vnormals.size(); ++l)
-					{
-						if(vnorm * vnormals[l] > 0.999)
-						{
-							n_idx = vn_index[l];
-							break;
-						}
-					}
-					// create new if none found
-					if(n_idx == -1)
-					{
-						n_idx = normals_.size();
-						vnormals.push_back(vnorm);
-						vn_index.push_back(n_idx);
-						normals_.push_back(vnorm);
-					}
-				}
-				// set vertex normal to idx
-				const std::array<int, 3> tri_p = f->getVerticesIndices();
-				std::array<int, 3> tri_n = f->getNormalsIndices();
-				bool smooth_ok = false;
-				for(int idx = 0; idx < 3; ++idx)
+				for(const int vertex_normal : vertex_normals)
 				{
-					if(tri_p[idx] == i)
+					if(vnorm * new_normals[vertex_normal] > 0.999)
 					{
-						tri_n[i] = n_idx;
-						smooth_ok = true;
+						n_idx = vertex_normal;
 						break;
 					}
 				}
-				if(smooth_ok)
-				{
-					f->setNormalsIndices(tri_n);
-					j++;
-				}
-				else
+				// create new if none found
+				if(n_idx == -1)
 				{
-					Y_ERROR << "Mesh smoothing error!" << YENDL;
-					return false;
+					n_idx = new_normals.size();
+					vertex_normals.push_back(n_idx);
+					new_normals.push_back(vnorm);
 				}
+				corner_normals[corner] = n_idx;
 			}
-			vnormals.clear();
-			vn_index.clear();
 		}
+	});
+
+	std::vector<int> thread_normals_start(num_threads);
+	for(int t = 0; t < num_threads; ++t)
+	{
+		thread_normals_start[t] = normals_.size();
+		normals_.insert(normals_.end(), thread_normals[t].begin(), thread_normals[t].end());
+		std::vector<Vec3>().swap(thread_normals[t]);
 	}
-	setSmooth(true);
-	return true;
+	run_threads([&](int thread_id)
+	{
+		const uint32_t end = std::min(n_triangles, (thread_id + 1) * triangles_per_thread);
+		for(uint32_t t = thread_id * triangles_per_thread; t < end; ++t)
+		{
+			std::array<int, 3> tri_n;
+			for(int idx = 0; idx < 3; ++idx)
+			{
+				const int n_idx = corner_normals[3 * t + idx];
+				tri_n[idx] = (n_idx == -1) ? -1 : thread_normals_start[triangles_[t].getPointId(idx) / points_per_thread] + n_idx;
+			}
+			triangles_[t].setNormalsIndices(tri_n);
+		}
+	});
 }
 
 END_YAFARAY
\ No newline at end of file
@@ -28,15 +28,19 @@ TriangleObjectInstance::TriangleObjectInstance(const TriangleObject *base, Matri
 	triangle_object_ = base;
 	visible_ = true;
 	is_base_object_ = false;
-	triangle_instances_.reserve(triangle_object_->getTriangles().size());
-	for(const auto &triangle : triangle_object_->getTriangles())
-	{
-		triangle_instances_.push_back(TriangleInstance(&triangle, this));
-	}
 }
 
 int TriangleObjectInstance::getPrimitives(const Triangle **prims) const
 {
+	//The triangle instances are only needed when the instance is used as a set of separate primitives (for example by mesh lights)
+	if(triangle_instances_.empty())
+	{
+		triangle_instances_.reserve(triangle_object_->getTriangles().size());
+		for(const auto &triangle : triangle_object_->getTriangles())
+		{
+			triangle_instances_.push_back(TriangleInstance(&triangle, this));
+		}
+	}
 	for(size_t i = 0; i < triangle_instances_.size(); i++) prims[i] = &triangle_instances_[i];
 	return triangle_instances_.size();
 }
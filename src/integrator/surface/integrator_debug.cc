@@ -32,6 +32,7 @@ BEGIN_YAFARAY
 DebugIntegrator::DebugIntegrator(SurfaceProperties dt)
 {
 	debug_type_ = dt;
+	camera_ray_packets_ = true;
 	render_info_ += "Debug integrator: '";
 	switch(dt)
 	{
@@ -73,7 +74,7 @@ Rgba DebugIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addit
 	void *o_udat = render_data.arena_;
 	bool old_include_lights = render_data.include_lights_;
 	//shoot ray into scene
-	if(scene_->intersect(ray, sp))
+	if(intersectCameraRay(render_data, ray, sp))
 	{
 		if(show_pn_)
 		{
@@ -43,6 +43,7 @@ DirectLightIntegrator::DirectLightIntegrator(bool transp_shad, int shadow_depth,
 	use_photon_caustics_ = false;
 	s_depth_ = shadow_depth;
 	r_depth_ = ray_depth;
+	camera_ray_packets_ = true;
 }
 
 bool DirectLightIntegrator::preprocess(const RenderControl &render_control, const RenderView *render_view)
@@ -66,6 +67,7 @@ bool DirectLightIntegrator::preprocess(const RenderControl &render_control, cons
 	}
 
 	lights_ = render_view->getLightsVisible();
+	initLightSampling();
 
 	if(use_photon_caustics_)
 	{
@@ -110,7 +112,7 @@ Rgba DirectLightIntegrator::integrate(RenderData &render_data, DiffRay &ray, int
 
 	// Shoot ray into scene
 
-	if(scene_->intersect(ray, sp)) // If it hits
+	if(intersectCameraRay(render_data, ray, sp)) // If it hits
 	{
 		alignas (16) unsigned char userdata[user_data_size_];
 		render_data.arena_ = static_cast<void *>(userdata);
@@ -225,6 +227,8 @@ Integrator *DirectLightIntegrator::factory(ParamMap &params, const Scene &scene)
 	bool bg_transp = false;
 	bool bg_transp_refract = false;
 	std::string photon_maps_processing_str = "generate";
+	std::string light_sampling_str = "all";
+	int light_tree_samples = 1;
 
 	params.getParam("raydepth", raydepth);
 	params.getParam("transpShad", transp_shad);
@@ -241,6 +245,8 @@ Integrator *DirectLightIntegrator::factory(ParamMap &params, const Scene &scene)
 	params.getParam("bg_transp", bg_transp);
 	params.getParam("bg_transp_refract", bg_transp_refract);
 	params.getParam("photon_maps_processing", photon_maps_processing_str);
+	params.getParam("light_sampling", light_sampling_str);
+	params.getParam("light_tree_samples", light_tree_samples);
 
 	DirectLightIntegrator *inte = new DirectLightIntegrator(transp_shad, shadow_depth, raydepth);
 	// caustic settings
@@ -263,6 +269,10 @@ Integrator *DirectLightIntegrator::factory(ParamMap &params, const Scene &scene)
 	else if(photon_maps_processing_str == "reuse-previous") inte->photon_map_processing_ = PhotonsReuse;
 	else inte->photon_map_processing_ = PhotonsGenerateOnly;
 
+	if(light_sampling_str == "light-tree") inte->light_sampling_ = LightSampling::Tree;
+	else inte->light_sampling_ = LightSampling::All;
+	inte->light_tree_samples_ = std::max(1, light_tree_samples);
+
 	return inte;
 }
 
@@ -20,6 +20,7 @@
 
 #include "integrator/surface/integrator_montecarlo.h"
 #include "geometry/surface.h"
+#include "geometry/ray_packet.h"
 #include "common/layers.h"
 #include "color/color_layers.h"
 #include "common/logger.h"
@@ -52,10 +53,28 @@ Rgb MonteCarloIntegrator::estimateAllDirectLight(RenderData &render_data, const
 
 	Rgb col;
 	unsigned int loffs = 0;
-	for(auto l = lights_.begin(); l != lights_.end(); ++l)
+	if(light_tree_)
 	{
-		col += doLightEstimation(render_data, (*l), sp, wo, loffs, color_layers);
-		loffs++;
+		//Only a few lights are selected with the light tree, each weighted by the inverse of the probability of selecting it
+		Halton hal_2(2);
+		hal_2.setStart(scene_->getImageFilm()->getBaseSamplingOffset() + correlative_sample_number_[render_data.thread_id_] - 1);
+		correlative_sample_number_[render_data.thread_id_] += light_tree_samples_;
+		const Vec3 n = sp.material_->isFlat() ? Vec3(0.f) : sp.n_;
+		for(int i = 0; i < light_tree_samples_; ++i)
+		{
+			float light_pdf;
+			const int light_index = light_tree_->sample(sp.p_, n, hal_2.getNext(), light_pdf);
+			if(light_index >= 0 && light_pdf > 0.f) col += doLightEstimation(render_data, lights_[light_index], sp, wo, light_index + i * lights_.size(), color_layers, 1.f / (light_pdf * light_tree_samples_));
+			loffs++;
+		}
+	}
+	else
+	{
+		for(auto l = lights_.begin(); l != lights_.end(); ++l)
+		{
+			col += doLightEstimation(render_data, (*l), sp, wo, loffs, color_layers);
+			loffs++;
+		}
 	}
 
 	if(layers_used)
@@ -75,14 +94,30 @@ Rgb MonteCarloIntegrator::estimateOneDirectLight(RenderData &render_data, const
 	Halton hal_2(2);
 
 	hal_2.setStart(scene_->getImageFilm()->getBaseSamplingOffset() + correlative_sample_number_[render_data.thread_id_] - 1); //Probably with this change the parameter "n" is no longer necessary, but I will keep it just in case I have to revert back this change!
-	int lnum = std::min((int)(hal_2.getNext() * (float)light_num), light_num - 1);
+	const float s = hal_2.getNext();
 
 	++correlative_sample_number_[render_data.thread_id_];
 
+	if(light_tree_)
+	{
+		float light_pdf;
+		const int light_index = light_tree_->sample(sp.p_, sp.material_->isFlat() ? Vec3(0.f) : sp.n_, s, light_pdf);
+		if(light_index < 0 || light_pdf <= 0.f) return Rgb(0.f);
+		return doLightEstimation(render_data, lights_[light_index], sp, wo, light_index, nullptr, 1.f / light_pdf);
+	}
+
+	int lnum = std::min((int)(s * (float)light_num), light_num - 1);
+
 	return doLightEstimation(render_data, lights_[lnum], sp, wo, lnum) * light_num;
 }
 
-Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *light, const SurfacePoint &sp, const Vec3 &wo, const unsigned int  &loffs, ColorLayers *color_layers) const
+void MonteCarloIntegrator::initLightSampling()
+{
+	if(light_sampling_ == LightSampling::Tree && !lights_.empty()) light_tree_ = std::unique_ptr<LightTree>(new LightTree(lights_));
+	else light_tree_.reset();
+}
+
+Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *light, const SurfacePoint &sp, const Vec3 &wo, const unsigned int  &loffs, ColorLayers *color_layers, float light_weight) const
 {
 	const bool layers_used = render_data.raylevel_ == 0 && color_layers && color_layers->size() > 1;
 
@@ -97,6 +132,7 @@ Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *ligh
 	float mask_obj_index = 0.f, mask_mat_index = 0.f;
 
 	bool cast_shadows = light->castShadows() && material->getReceiveShadows();
+	render_data.shadow_light_ = light; //so the shadow rays towards this light can use its shadow cache
 
 	// handle lights with delta distribution, e.g. point and directional lights
 	if(light->diracLight())
@@ -147,14 +183,15 @@ Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *ligh
 				if(color_layers->find(Layer::ObjIndexMaskShadow) && mask_obj_index == mask_params.obj_index_) col_shadow_obj_mask += Rgb(1.f);
 			}
 		}
+		col *= light_weight;
 		if(layers_used)
 		{
 			if(ColorLayer *color_layer = color_layers->find(Layer::Shadow)) color_layer->color_ += col_shadow;
 			if(ColorLayer *color_layer = color_layers->find(Layer::MatIndexMaskShadow)) color_layer->color_ += col_shadow_mat_mask;
 			if(ColorLayer *color_layer = color_layers->find(Layer::ObjIndexMaskShadow)) color_layer->color_ += col_shadow_obj_mask;
-			if(ColorLayer *color_layer = color_layers->find(Layer::Diffuse)) color_layer->color_ += col_diff_dir;
-			if(ColorLayer *color_layer = color_layers->find(Layer::DiffuseNoShadow)) color_layer->color_ += col_diff_no_shadow;
-			if(ColorLayer *color_layer = color_layers->find(Layer::Glossy)) color_layer->color_ += col_glossy_dir;
+			if(ColorLayer *color_layer = color_layers->find(Layer::Diffuse)) color_layer->color_ += col_diff_dir * light_weight;
+			if(ColorLayer *color_layer = color_layers->find(Layer::DiffuseNoShadow)) color_layer->color_ += col_diff_no_shadow * light_weight;
+			if(ColorLayer *color_layer = color_layers->find(Layer::Glossy)) color_layer->color_ += col_glossy_dir * light_weight;
 			if(ColorLayer *color_layer = color_layers->find(Layer::DebugLightEstimationLightDirac)) color_layer->color_ += col;
 		}
 	}
@@ -165,6 +202,7 @@ Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *ligh
 		int n = (int) ceilf(light->nSamples() * aa_light_sample_multiplier_);
 		if(render_data.ray_division_ > 1) n = std::max(1, n / render_data.ray_division_);
 		const float inv_ns = 1.f / (float)n;
+		const float weighted_inv_ns = inv_ns * light_weight; //the shadow layers are averaged over the lights instead
 		const unsigned int offs = n * render_data.pixel_sample_ + render_data.sampling_offs_ + l_offs;
 		const bool can_intersect = light->canIntersect();
 		Rgb ccol(0.0);
@@ -175,20 +213,57 @@ Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *ligh
 
 		Rgba col_shadow(0.f), col_shadow_obj_mask(0.f), col_shadow_mat_mask(0.f), col_diff_dir(0.f), col_diff_no_shadow(0.f), col_glossy_dir(0.f);
 
-		for(int i = 0; i < n; ++i)
+		//The light samples are generated in groups so their (opaque) shadow rays can be tested together as a ray packet
+		Ray light_rays[RayPacket::max_size_], shadow_rays[RayPacket::max_size_];
+		LSample light_samples[RayPacket::max_size_];
+		bool illuminated[RayPacket::max_size_], shadowed_rays[RayPacket::max_size_];
+		int shadow_ray_index[RayPacket::max_size_];
+		float mask_obj_indices[RayPacket::max_size_], mask_mat_indices[RayPacket::max_size_];
+
+		for(int first = 0; first < n; first += RayPacket::max_size_)
 		{
-			// ...get sample val...
-			ls.s_1_ = hal_2.getNext();
-			ls.s_2_ = hal_3.getNext();
+			const int n_packet = std::min(RayPacket::max_size_, n - first);
+			int n_shadow_rays = 0;
+			for(int k = 0; k < n_packet; ++k)
+			{
+				// ...get sample val...
+				light_samples[k].s_1_ = hal_2.getNext();
+				light_samples[k].s_2_ = hal_3.getNext();
+				light_rays[k].from_ = sp.p_;
+
+				illuminated[k] = light->illumSample(sp, light_samples[k], light_rays[k]);
+				if(!illuminated[k]) continue;
 
-			if(light->illumSample(sp, ls, light_ray))
+				if(scene_->shadow_bias_auto_) light_rays[k].tmin_ = scene_->shadow_bias_ * std::max(1.f, Vec3(sp.p_).length());
+				else light_rays[k].tmin_ = scene_->shadow_bias_;
+
+				if(cast_shadows && !tr_shad_)
+				{
+					shadow_ray_index[k] = n_shadow_rays;
+					shadow_rays[n_shadow_rays] = light_rays[k];
+					++n_shadow_rays;
+				}
+			}
+			//The mask indices are carried through the packet from the previous samples
+			mask_obj_indices[0] = mask_obj_index;
+			mask_mat_indices[0] = mask_mat_index;
+			if(n_shadow_rays > 0) scene_->isShadowed(render_data, shadow_rays, n_shadow_rays, shadowed_rays, mask_obj_indices, mask_mat_indices);
+
+			for(int k = 0; k < n_packet; ++k)
 			{
-				// ...shadowed...
-				if(scene_->shadow_bias_auto_) light_ray.tmin_ = scene_->shadow_bias_ * std::max(1.f, Vec3(sp.p_).length());
-				else light_ray.tmin_ = scene_->shadow_bias_;
+				if(!illuminated[k]) continue;
+				light_ray = light_rays[k];
+				ls = light_samples[k];
 
-				if(cast_shadows) shadowed = (tr_shad_) ? scene_->isShadowed(render_data, light_ray, s_depth_, scol, mask_obj_index, mask_mat_index) : scene_->isShadowed(render_data, light_ray, mask_obj_index, mask_mat_index);
-				else shadowed = false;
+				// ...shadowed...
+				if(!cast_shadows) shadowed = false;
+				else if(tr_shad_) shadowed = scene_->isShadowed(render_data, light_ray, s_depth_, scol, mask_obj_index, mask_mat_index);
+				else
+				{
+					shadowed = shadowed_rays[shadow_ray_index[k]];
+					mask_obj_index = mask_obj_indices[shadow_ray_index[k]];
+					mask_mat_index = mask_mat_indices[shadow_ray_index[k]];
+				}
 
 				if((!shadowed && ls.pdf_ > 1e-6f)  || (layers_used && color_layers->find(Layer::DiffuseNoShadow)))
 				{
@@ -280,17 +355,17 @@ Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *ligh
 			}
 		}
 
-		col += ccol * inv_ns;
+		col += ccol * weighted_inv_ns;
 
 		if(layers_used)
 		{
-			if(ColorLayer *color_layer = color_layers->find(Layer::DebugLightEstimationLightSampling)) color_layer->color_ += ccol * inv_ns;
+			if(ColorLayer *color_layer = color_layers->find(Layer::DebugLightEstimationLightSampling)) color_layer->color_ += ccol * weighted_inv_ns;
 			if(ColorLayer *color_layer = color_layers->find(Layer::Shadow)) color_layer->color_ += col_shadow * inv_ns;
 			if(ColorLayer *color_layer = color_layers->find(Layer::MatIndexMaskShadow)) color_layer->color_ += col_shadow_mat_mask * inv_ns;
 			if(ColorLayer *color_layer = color_layers->find(Layer::ObjIndexMaskShadow)) color_layer->color_ += col_shadow_obj_mask * inv_ns;
-			if(ColorLayer *color_layer = color_layers->find(Layer::Diffuse)) color_layer->color_ += col_diff_dir * inv_ns;
-			if(ColorLayer *color_layer = color_layers->find(Layer::DiffuseNoShadow)) color_layer->color_ += col_diff_no_shadow * inv_ns;
-			if(ColorLayer *color_layer = color_layers->find(Layer::Glossy)) color_layer->color_ += col_glossy_dir * inv_ns;
+			if(ColorLayer *color_layer = color_layers->find(Layer::Diffuse)) color_layer->color_ += col_diff_dir * weighted_inv_ns;
+			if(ColorLayer *color_layer = color_layers->find(Layer::DiffuseNoShadow)) color_layer->color_ += col_diff_no_shadow * weighted_inv_ns;
+			if(ColorLayer *color_layer = color_layers->find(Layer::Glossy)) color_layer->color_ += col_glossy_dir * weighted_inv_ns;
 		}
 
 		if(can_intersect) // sample from BSDF to complete MIS
@@ -360,18 +435,19 @@ Rgb MonteCarloIntegrator::doLightEstimation(RenderData &render_data, Light *ligh
 				}
 			}
 
-			col += ccol_2 * inv_ns;
+			col += ccol_2 * weighted_inv_ns;
 
 			if(layers_used)
 			{
-				if(ColorLayer *color_layer = color_layers->find(Layer::DebugLightEstimationMatSampling)) color_layer->color_ += ccol_2 * inv_ns;
-				if(ColorLayer *color_layer = color_layers->find(Layer::Diffuse)) color_layer->color_ += col_diff_dir * inv_ns;
-				if(ColorLayer *color_layer = color_layers->find(Layer::DiffuseNoShadow)) color_layer->color_ += col_diff_no_shadow * inv_ns;
-				if(ColorLayer *color_layer = color_layers->find(Layer::Glossy)) color_layer->color_ += col_glossy_dir * inv_ns;
+				if(ColorLayer *color_layer = color_layers->find(Layer::DebugLightEstimationMatSampling)) color_layer->color_ += ccol_2 * weighted_inv_ns;
+				if(ColorLayer *color_layer = color_layers->find(Layer::Diffuse)) color_layer->color_ += col_diff_dir * weighted_inv_ns;
+				if(ColorLayer *color_layer = color_layers->find(Layer::DiffuseNoShadow)) color_layer->color_ += col_diff_no_shadow * weighted_inv_ns;
+				if(ColorLayer *color_layer = color_layers->find(Layer::Glossy)) color_layer->color_ += col_glossy_dir * weighted_inv_ns;
 			}
 		}
 	}
 
+	render_data.shadow_light_ = nullptr;
 	return col;
 }
 
@@ -558,6 +634,7 @@ bool MonteCarloIntegrator::createCausticMap(const RenderView *render_view, const
 	}
 
 	session__.caustic_map_->clear();
+	session__.caustic_map_->setCompact(compact_caustic_photons_);
 	session__.caustic_map_->setNumPaths(0);
 	session__.caustic_map_->reserveMemory(n_caus_photons_);
 	session__.caustic_map_->setNumThreadsPkDtree(scene_->getNumThreadsPhotons());
@@ -666,14 +743,12 @@ Rgb MonteCarloIntegrator::estimateCausticPhotons(RenderData &render_data, const
 		const Material *material = sp.material_;
 		Rgb surf_col(0.f);
 		float k = 0.f;
-		const Photon *photon;
 
 		for(int i = 0; i < n_gathered; ++i)
 		{
-			photon = gathered[i].photon_;
-			surf_col = material->eval(render_data, sp, wo, photon->direction(), BsdfFlags::All);
+			surf_col = material->eval(render_data, sp, wo, gathered[i].direction(), BsdfFlags::All);
 			k = sample::kernel(gathered[i].dist_square_, g_radius_square);
-			sum += surf_col * k * photon->color();
+			sum += surf_col * k * gathered[i].color();
 		}
 		sum *= 1.f / (float(session__.caustic_map_->nPaths()));
 	}
@@ -49,6 +49,7 @@ PathIntegrator::PathIntegrator(bool transp_shad, int shadow_depth)
 	n_paths_ = 64;
 	inv_n_paths_ = 1.f / 64.f;
 	no_recursive_ = false;
+	camera_ray_packets_ = true;
 }
 
 bool PathIntegrator::preprocess(const RenderControl &render_control, const RenderView *render_view)
@@ -58,6 +59,7 @@ bool PathIntegrator::preprocess(const RenderControl &render_control, const Rende
 	g_timer__.start("prepass");
 
 	lights_ = render_view->getLightsVisible();
+	initLightSampling();
 
 	set << "Path Tracing  ";
 
@@ -131,7 +133,7 @@ Rgba PathIntegrator::integrate(RenderData &render_data, DiffRay &ray, int additi
 	else alpha = 1.0;
 
 	//shoot ray into scene
-	if(scene_->intersect(ray, sp))
+	if(intersectCameraRay(render_data, ray, sp))
 	{
 		// if camera ray initialize sampling offset:
 		if(render_data.raylevel_ == 0)
@@ -400,6 +402,8 @@ Integrator *PathIntegrator::factory(ParamMap &params, const Scene &scene)
 	bool bg_transp = false;
 	bool bg_transp_refract = false;
 	std::string photon_maps_processing_str = "generate";
+	std::string light_sampling_str = "all";
+	int light_tree_samples = 1;
 
 	params.getParam("raydepth", raydepth);
 	params.getParam("transpShad", transp_shad);
@@ -415,6 +419,8 @@ Integrator *PathIntegrator::factory(ParamMap &params, const Scene &scene)
 	params.getParam("AO_distance", ao_dist);
 	params.getParam("AO_color", ao_col);
 	params.getParam("photon_maps_processing", photon_maps_processing_str);
+	params.getParam("light_sampling", light_sampling_str);
+	params.getParam("light_tree_samples", light_tree_samples);
 
 	PathIntegrator *inte = new PathIntegrator(transp_shad, shadow_depth);
 	if(params.getParam("caustic_type", c_method))
@@ -427,14 +433,17 @@ Integrator *PathIntegrator::factory(ParamMap &params, const Scene &scene)
 		{
 			double c_rad = 0.25;
 			int c_depth = 10, search = 100, photons = 500000;
+			bool compact_photons = false;
 			params.getParam("photons", photons);
 			params.getParam("caustic_mix", search);
 			params.getParam("caustic_depth", c_depth);
 			params.getParam("caustic_radius", c_rad);
+			params.getParam("compact_caustic_photons", compact_photons);
 			inte->n_caus_photons_ = photons;
 			inte->n_caus_search_ = search;
 			inte->caus_depth_ = c_depth;
 			inte->caus_radius_ = c_rad;
+			inte->compact_caustic_photons_ = compact_photons;
 		}
 	}
 	inte->r_depth_ = raydepth;
@@ -457,6 +466,10 @@ Integrator *PathIntegrator::factory(ParamMap &params, const Scene &scene)
 	else if(photon_maps_processing_str == "reuse-previous") inte->photon_map_processing_ = PhotonsReuse;
 	else inte->photon_map_processing_ = PhotonsGenerateOnly;
 
+	if(light_sampling_str == "light-tree") inte->light_sampling_ = LightSampling::Tree;
+	else inte->light_sampling_ = LightSampling::All;
+	inte->light_tree_samples_ = std::max(1, light_tree_samples);
+
 	return inte;
 }
 
@@ -50,9 +50,12 @@ void PhotonIntegrator::preGatherWorker(PreGatherData *gdata, float ds_rad, int n
 	end = gdata->fetched_ = std::min(total, start + 32);
 	gdata->mutx_.unlock();
 
-	FoundPhoton *gathered = new FoundPhoton[n_search];
+	//the radiance points are sorted spatially, so the 32 points fetched each time are gathered together in a batch
+	FoundPhoton *gathered = new FoundPhoton[32 * n_search];
+	Point3 points[32];
+	float radius[32];
+	int n_gathered[32];
 
-	float radius = 0.f;
 	float i_scale = 1.f / ((float)gdata->diffuse_map_->nPaths() * M_PI);
 	float scale = 0.f;
 
@@ -60,23 +63,29 @@ void PhotonIntegrator::preGatherWorker(PreGatherData *gdata, float ds_rad, int n
 	{
 		for(unsigned int n = start; n < end; ++n)
 		{
-			radius = ds_radius_2;//actually the square radius...
-			int n_gathered = gdata->diffuse_map_->gather(gdata->rad_points_[n].pos_, gathered, n_search, radius);
+			points[n - start] = gdata->rad_points_[n].pos_;
+			radius[n - start] = ds_radius_2;//actually the square radius...
+		}
+		gdata->diffuse_map_->gather(points, end - start, gathered, n_gathered, n_search, radius);
+
+		for(unsigned int n = start; n < end; ++n)
+		{
+			const FoundPhoton *point_gathered = gathered + (n - start) * n_search;
 
 			Vec3 rnorm = gdata->rad_points_[n].normal_;
 
 			Rgb sum(0.0);
 
-			if(n_gathered > 0)
+			if(n_gathered[n - start] > 0)
 			{
-				scale = i_scale / radius;
+				scale = i_scale / radius[n - start];
 
-				for(int i = 0; i < n_gathered; ++i)
+				for(int i = 0; i < n_gathered[n - start]; ++i)
 				{
-					Vec3 pdir = gathered[i].photon_->direction();
+					Vec3 pdir = point_gathered[i].direction();
 
-					if(rnorm * pdir > 0.f) sum += gdata->rad_points_[n].refl_ * scale * gathered[i].photon_->color();
-					else sum += gdata->rad_points_[n].transm_ * scale * gathered[i].photon_->color();
+					if(rnorm * pdir > 0.f) sum += gdata->rad_points_[n].refl_ * scale * point_gathered[i].color();
+					else sum += gdata->rad_points_[n].transm_ * scale * point_gathered[i].color();
 				}
 			}
 
@@ -104,6 +113,7 @@ PhotonIntegrator::PhotonIntegrator(unsigned int d_photons, unsigned int c_photon
 	caus_radius_ = c_rad;
 	r_depth_ = 6;
 	max_bounces_ = 5;
+	camera_ray_packets_ = true;
 }
 
 void PhotonIntegrator::diffuseWorker(PhotonMap *diffuse_map, int thread_id, const Scene *scene, const RenderView *render_view, const RenderControl &render_control, unsigned int n_diffuse_photons, const Pdf1D *light_power_d, int num_d_lights, const std::vector<Light *> &tmplights, ProgressBar *pb, int pb_step, unsigned int &total_photons_shot, int max_bounces, bool final_gather, PreGatherData &pgdat)
@@ -291,6 +301,7 @@ bool PhotonIntegrator::preprocess(const RenderControl &render_control, const Ren
 	set << "RayDepth=" << r_depth_ << "  ";
 
 	lights_ = render_view->getLightsVisible();
+	initLightSampling();
 	std::vector<Light *> tmplights;
 
 	if(use_photon_caustics_)
@@ -406,16 +417,19 @@ bool PhotonIntegrator::preprocess(const RenderControl &render_control, const Ren
 	}
 
 	session__.diffuse_map_->clear();
+	session__.diffuse_map_->setCompact(compact_diffuse_photons_);
 	session__.diffuse_map_->setNumPaths(0);
 	session__.diffuse_map_->reserveMemory(n_diffuse_photons_);
 	session__.diffuse_map_->setNumThreadsPkDtree(scene_->getNumThreadsPhotons());
 
 	session__.caustic_map_->clear();
+	session__.caustic_map_->setCompact(compact_caustic_photons_);
 	session__.caustic_map_->setNumPaths(0);
 	session__.caustic_map_->reserveMemory(n_caus_photons_);
 	session__.caustic_map_->setNumThreadsPkDtree(scene_->getNumThreadsPhotons());
 
 	session__.radiance_map_->clear();
+	session__.radiance_map_->setCompact(false);
 	session__.radiance_map_->setNumPaths(0);
 	session__.radiance_map_->setNumThreadsPkDtree(scene_->getNumThreadsPhotons());
 
@@ -633,16 +647,23 @@ bool PhotonIntegrator::preprocess(const RenderControl &render_control, const Ren
 		// == remove too close radiance points ==//
 		kdtree::PointKdTree< RadData > *r_tree = new kdtree::PointKdTree< RadData >(pgdat.rad_points_, "FG Radiance Photon Map", scene_->getNumThreadsPhotons());
 		std::vector< RadData > cleaned;
+		std::vector<bool> keep(pgdat.rad_points_.size(), false);
 		for(unsigned int i = 0; i < pgdat.rad_points_.size(); ++i)
 		{
 			if(pgdat.rad_points_[i].use_)
 			{
-				cleaned.push_back(pgdat.rad_points_[i]);
+				keep[i] = true;
 				EliminatePhoton elim_proc(pgdat.rad_points_[i].normal_);
 				float maxrad = 0.01f * ds_radius_; // 10% of diffuse search radius
 				r_tree->lookup(pgdat.rad_points_[i].pos_, elim_proc, maxrad);
 			}
 		}
+		//the kept points are stored in the order of the tree leaves, so consecutive points are close to each other
+		const uint32_t *leaf_order = r_tree->leafElements();
+		for(unsigned int i = 0; i < pgdat.rad_points_.size(); ++i)
+		{
+			if(keep[leaf_order[i]]) cleaned.push_back(pgdat.rad_points_[leaf_order[i]]);
+		}
 		pgdat.rad_points_.swap(cleaned);
 		// ================ //
 		int n_threads = scene_->getNumThreads();
@@ -791,8 +812,8 @@ Rgb PhotonIntegrator::finalGathering(RenderData &render_data, const SurfacePoint
 				else if(caustic)
 				{
 					Vec3 sf = SurfacePoint::normalFaceForward(hit.ng_, hit.n_, pwo);
-					const Photon *nearest = session__.radiance_map_->findNearest(hit.p_, sf, lookup_rad_);
-					if(nearest) lcol = nearest->color();
+					const FoundPhoton nearest = session__.radiance_map_->findNearest(hit.p_, sf, lookup_rad_);
+					if(nearest.found()) lcol = nearest.color();
 				}
 
 				if(close || caustic)
@@ -851,8 +872,8 @@ Rgb PhotonIntegrator::finalGathering(RenderData &render_data, const SurfacePoint
 			if(mat_bsd_fs.hasAny(BsdfFlags::Diffuse | BsdfFlags::Glossy))
 			{
 				Vec3 sf = SurfacePoint::normalFaceForward(hit.ng_, hit.n_, -pRay.dir_);
-				const Photon *nearest = session__.radiance_map_->findNearest(hit.p_, sf, lookup_rad_);
-				if(nearest) lcol = nearest->color();
+				const FoundPhoton nearest = session__.radiance_map_->findNearest(hit.p_, sf, lookup_rad_);
+				if(nearest.found()) lcol = nearest.color();
 				if(mat_bsd_fs.hasAny(BsdfFlags::Emit)) lcol += p_mat->emit(render_data, hit, -pRay.dir_);
 				path_col += lcol * throughput;
 			}
@@ -879,7 +900,7 @@ Rgba PhotonIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addi
 	if(transp_background_) alpha = 0.0;
 	else alpha = 1.0;
 
-	if(scene_->intersect(ray, sp))
+	if(intersectCameraRay(render_data, ray, sp))
 	{
 		alignas (16) unsigned char userdata[user_data_size_];
 		render_data.arena_ = static_cast<void *>(userdata);
@@ -911,8 +932,8 @@ Rgba PhotonIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addi
 			if(show_map_)
 			{
 				Vec3 n = SurfacePoint::normalFaceForward(sp.ng_, sp.n_, wo);
-				const Photon *nearest = session__.radiance_map_->findNearest(sp.p_, n, lookup_rad_);
-				if(nearest) col += nearest->color();
+				const FoundPhoton nearest = session__.radiance_map_->findNearest(sp.p_, n, lookup_rad_);
+				if(nearest.found()) col += nearest.color();
 			}
 			else
 			{
@@ -921,8 +942,8 @@ Rgba PhotonIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addi
 					if(ColorLayer *color_layer = color_layers->find(Layer::Radiance))
 					{
 						Vec3 n = SurfacePoint::normalFaceForward(sp.ng_, sp.n_, wo);
-						const Photon *nearest = session__.radiance_map_->findNearest(sp.p_, n, lookup_rad_);
-						if(nearest) color_layer->color_ = nearest->color();
+						const FoundPhoton nearest = session__.radiance_map_->findNearest(sp.p_, n, lookup_rad_);
+						if(nearest.found()) color_layer->color_ = nearest.color();
 					}
 				}
 
@@ -955,8 +976,8 @@ Rgba PhotonIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addi
 			if(use_photon_diffuse_ && show_map_)
 			{
 				Vec3 n = SurfacePoint::normalFaceForward(sp.ng_, sp.n_, wo);
-				const Photon *nearest = session__.diffuse_map_->findNearest(sp.p_, n, ds_radius_);
-				if(nearest) col += nearest->color();
+				const FoundPhoton nearest = session__.diffuse_map_->findNearest(sp.p_, n, ds_radius_);
+				if(nearest.found()) col += nearest.color();
 			}
 			else
 			{
@@ -965,8 +986,8 @@ Rgba PhotonIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addi
 					if(ColorLayer *color_layer = color_layers->find(Layer::Radiance))
 					{
 						Vec3 n = SurfacePoint::normalFaceForward(sp.ng_, sp.n_, wo);
-						const Photon *nearest = session__.radiance_map_->findNearest(sp.p_, n, lookup_rad_);
-						if(nearest) color_layer->color_ = nearest->color();
+						const FoundPhoton nearest = session__.radiance_map_->findNearest(sp.p_, n, lookup_rad_);
+						if(nearest.found()) color_layer->color_ = nearest.color();
 					}
 				}
 
@@ -998,10 +1019,10 @@ Rgba PhotonIntegrator::integrate(RenderData &render_data, DiffRay &ray, int addi
 					float scale = 1.f / ((float)session__.diffuse_map_->nPaths() * radius * M_PI);
 					for(int i = 0; i < n_gathered; ++i)
 					{
-						const Vec3 pdir = gathered[i].photon_->direction();
+						const Vec3 pdir = gathered[i].direction();
 						const Rgb surf_col = material->eval(render_data, sp, wo, pdir, BsdfFlags::Diffuse);
 
-						const Rgb col_tmp = surf_col * scale * gathered[i].photon_->color();
+						const Rgb col_tmp = surf_col * scale * gathered[i].color();
 						col += col_tmp;
 						if(layers_used)
 						{
@@ -1105,7 +1126,11 @@ Integrator *PhotonIntegrator::factory(ParamMap &params, const Scene &scene)
 	bool bg_transp_refract = false;
 	bool caustics = true;
 	bool diffuse = true;
+	bool compact_caustic_photons = false;
+	bool compact_diffuse_photons = false;
 	std::string photon_maps_processing_str = "generate";
+	std::string light_sampling_str = "all";
+	int light_tree_samples = 1;
 
 	params.getParam("caustics", caustics);
 	params.getParam("diffuse", diffuse);
@@ -1134,11 +1159,17 @@ Integrator *PhotonIntegrator::factory(ParamMap &params, const Scene &scene)
 	params.getParam("AO_distance", ao_dist);
 	params.getParam("AO_color", ao_col);
 	params.getParam("photon_maps_processing", photon_maps_processing_str);
+	params.getParam("light_sampling", light_sampling_str);
+	params.getParam("light_tree_samples", light_tree_samples);
+	params.getParam("compact_caustic_photons", compact_caustic_photons);
+	params.getParam("compact_diffuse_photons", compact_diffuse_photons);
 
 	PhotonIntegrator *ite = new PhotonIntegrator(num_photons, num_c_photons, transp_shad, shadow_depth, ds_rad, c_rad);
 
 	ite->use_photon_caustics_ = caustics;
 	ite->use_photon_diffuse_ = diffuse;
+	ite->compact_caustic_photons_ = compact_caustic_photons;
+	ite->compact_diffuse_photons_ = compact_diffuse_photons;
 
 	ite->r_depth_ = raydepth;
 	ite->n_diffuse_search_ = search;
@@ -1164,6 +1195,10 @@ Integrator *PhotonIntegrator::factory(ParamMap &params, const Scene &scene)
 	else if(photon_maps_processing_str == "reuse-previous") ite->photon_map_processing_ = PhotonsReuse;
 	else ite->photon_map_processing_ = PhotonsGenerateOnly;
 
+	if(light_sampling_str == "light-tree") ite->light_sampling_ = LightSampling::Tree;
+	else ite->light_sampling_ = LightSampling::All;
+	ite->light_tree_samples_ = std::max(1, light_tree_samples);
+
 	return ite;
 }
 
@@ -53,16 +53,6 @@ SppmIntegrator::SppmIntegrator(unsigned int d_photons, int passnum, bool transp_
 	s_depth_ = shadow_depth;
 	tr_shad_ = transp_shad;
 	b_hashgrid_ = false;
-
-	hal_1_.setBase(2);
-	hal_2_.setBase(3);
-	hal_3_.setBase(5);
-	hal_4_.setBase(7);
-
-	hal_1_.setStart(0);
-	hal_2_.setStart(0);
-	hal_3_.setStart(0);
-	hal_4_.setStart(0);
 }
 
 bool SppmIntegrator::preprocess(const RenderControl &render_control, const RenderView *render_view)
@@ -297,9 +287,9 @@ bool SppmIntegrator::renderTile(RenderArea &a, const RenderView *render_view, co
 				color.a_ = g_info.constant_randiance_.a_; //the alpha value is hold in the constantRadiance variable
 				color_layers(Layer::Combined).color_ = color;
 
-				for(auto &it : color_layers)
+				for(auto &color_layer : color_layers)
 				{
-					switch(it.first)
+					switch(color_layer.layer_type_)
 					{
 						case Layer::ObjIndexMask:
 						case Layer::ObjIndexMaskShadow:
@@ -307,47 +297,47 @@ bool SppmIntegrator::renderTile(RenderArea &a, const RenderView *render_view, co
 						case Layer::MatIndexMask:
 						case Layer::MatIndexMaskShadow:
 						case Layer::MatIndexMaskAll:
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
-							it.second.color_.clampRgb01();
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
+							color_layer.color_.clampRgb01();
 							if(mask_params.invert_)
 							{
-								it.second.color_ = Rgba(1.f) - it.second.color_;
+								color_layer.color_ = Rgba(1.f) - color_layer.color_;
 							}
 							if(!mask_params.only_)
 							{
 								Rgba col_combined = color_layers(Layer::Combined).color_;
 								col_combined.a_ = 1.f;
-								it.second.color_ *= col_combined;
+								color_layer.color_ *= col_combined;
 							}
 							break;
 						case Layer::ZDepthAbs:
-							if(c_ray.tmax_ < 0.f) it.second.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
-							else it.second.color_ = Rgb(c_ray.tmax_);
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
+							if(c_ray.tmax_ < 0.f) color_layer.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
+							else color_layer.color_ = Rgb(c_ray.tmax_);
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
 							break;
 						case Layer::ZDepthNorm:
-							if(c_ray.tmax_ < 0.f) it.second.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
-							else it.second.color_ = Rgb(1.f - (c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
+							if(c_ray.tmax_ < 0.f) color_layer.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
+							else color_layer.color_ = Rgb(1.f - (c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
 							break;
 						case Layer::Mist:
-							if(c_ray.tmax_ < 0.f) it.second.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
-							else it.second.color_ = Rgb((c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
+							if(c_ray.tmax_ < 0.f) color_layer.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
+							else color_layer.color_ = Rgb((c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
 							break;
 						case Layer::Indirect:
-							it.second.color_ = col_indirect;
-							it.second.color_.a_ = g_info.constant_randiance_.a_;
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
+							color_layer.color_ = col_indirect;
+							color_layer.color_.a_ = g_info.constant_randiance_.a_;
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
 							break;
 						default:
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
 							break;
 					}
 				}
@@ -391,6 +381,7 @@ void SppmIntegrator::photonWorker(PhotonMap *diffuse_map, PhotonMap *caustic_map
 	float inv_diff_photons = 1.f / (float)n_photons;
 
 	unsigned int nd_photon_stored = 0;
+	const uint64_t first_photon_index = totaln_photons_; //photons shot in the previous passes
 	//	unsigned int ncPhotonStored = 0;
 
 	while(!done)
@@ -400,14 +391,12 @@ void SppmIntegrator::photonWorker(PhotonMap *diffuse_map, PhotonMap *caustic_map
 		render_data.chromatic_ = true;
 		render_data.wavelength_ = scrHalton__(5, haltoncurr);
 
-		// Tried LD, get bad and strange results for some stategy.
-		{
-			std::lock_guard<std::mutex> lock_halton(mutex_);
-			s_1 = hal_1_.getNext();
-			s_2 = hal_2_.getNext();
-			s_3 = hal_3_.getNext();
-			s_4 = hal_4_.getNext();
-		}
+		// The emission samples are the Halton sequences of bases 2, 3, 5 and 7 addressed by the index of the photon among all the photons shot in all the passes, so each pass uses new samples and the threads do not share any state
+		const unsigned int photon_index = static_cast<unsigned int>(first_photon_index + haltoncurr);
+		s_1 = scrHalton__(1, photon_index);
+		s_2 = scrHalton__(2, photon_index);
+		s_3 = scrHalton__(3, photon_index);
+		s_4 = scrHalton__(4, photon_index);
 
 		s_l = float(haltoncurr) * inv_diff_photons; // Does sL also need more random for each pass?
 		int light_num = light_power_d->dSample(s_l, &light_num_pdf);
@@ -468,11 +457,7 @@ void SppmIntegrator::photonWorker(PhotonMap *diffuse_map, PhotonMap *caustic_map
 			{
 				Photon np(wi, sp.p_, pcol);// pcol used here
 
-				if(b_hashgrid_) photon_grid_.pushPhoton(np);
-				else
-				{
-					local_diffuse_photons.push_back(np);
-				}
+				local_diffuse_photons.push_back(np);
 				nd_photon_stored++;
 			}
 			// add caustic photon
@@ -480,11 +465,7 @@ void SppmIntegrator::photonWorker(PhotonMap *diffuse_map, PhotonMap *caustic_map
 			{
 				Photon np(wi, sp.p_, pcol);// pcol used here
 
-				if(b_hashgrid_) photon_grid_.pushPhoton(np);
-				else
-				{
-					local_caustic_photons.push_back(np);
-				}
+				local_caustic_photons.push_back(np);
 				nd_photon_stored++;
 			}
 
@@ -533,8 +514,16 @@ void SppmIntegrator::photonWorker(PhotonMap *diffuse_map, PhotonMap *caustic_map
 	}
 	diffuse_map->mutx_.lock();
 	caustic_map->mutx_.lock();
-	diffuse_map->appendVector(local_diffuse_photons, curr);
-	caustic_map->appendVector(local_caustic_photons, curr);
+	if(b_hashgrid_)
+	{
+		photon_grid_.appendVector(local_diffuse_photons);
+		caustic_grid_.appendVector(local_caustic_photons);
+	}
+	else
+	{
+		diffuse_map->appendVector(local_diffuse_photons, curr);
+		caustic_map->appendVector(local_caustic_photons, curr);
+	}
 	total_photons_shot += curr;
 	caustic_map->mutx_.unlock();
 	diffuse_map->mutx_.unlock();
@@ -549,15 +538,21 @@ void SppmIntegrator::prePass(int samples, int offset, bool adaptive, const Rende
 
 	Y_INFO << getName() << ": Starting Photon tracing pass..." << YENDL;
 
-	if(b_hashgrid_) photon_grid_.clear();
+	if(b_hashgrid_)
+	{
+		photon_grid_.clear();
+		caustic_grid_.clear();
+	}
 	else
 	{
 		session__.diffuse_map_->clear();
+		session__.diffuse_map_->setCompact(compact_diffuse_photons_);
 		session__.diffuse_map_->setNumPaths(0);
 		session__.diffuse_map_->reserveMemory(n_photons_);
 		session__.diffuse_map_->setNumThreadsPkDtree(scene_->getNumThreadsPhotons());
 
 		session__.caustic_map_->clear();
+		session__.caustic_map_->setCompact(compact_caustic_photons_);
 		session__.caustic_map_->setNumPaths(0);
 		session__.caustic_map_->reserveMemory(n_photons_);
 		session__.caustic_map_->setNumThreadsPkDtree(scene_->getNumThreadsPhotons());
@@ -647,16 +642,17 @@ void SppmIntegrator::prePass(int samples, int offset, bool adaptive, const Rende
 
 	totaln_photons_ +=  n_photons_;	// accumulate the total photon number, not using nPath for the case of hashgrid.
 
-	Y_VERBOSE << getName() << ": Stored photons: " << session__.diffuse_map_->nPhotons() + session__.caustic_map_->nPhotons() << YENDL;
-
 	if(b_hashgrid_)
 	{
+		Y_VERBOSE << getName() << ": Stored photons: " << photon_grid_.nPhotons() + caustic_grid_.nPhotons() << YENDL;
 		Y_INFO << getName() << ": Building photons hashgrid:" << YENDL;
-		photon_grid_.updateGrid();
+		photon_grid_.updateGrid(n_threads);
+		caustic_grid_.updateGrid(n_threads);
 		Y_VERBOSE << getName() << ": Done." << YENDL;
 	}
 	else
 	{
+		Y_VERBOSE << getName() << ": Stored photons: " << session__.diffuse_map_->nPhotons() + session__.caustic_map_->nPhotons() << YENDL;
 		if(session__.diffuse_map_->nPhotons() > 0)
 		{
 			Y_INFO << getName() << ": Building diffuse photons kd-tree:" << YENDL;
@@ -781,40 +777,64 @@ GatherInfo SppmIntegrator::traceGatherRay(yafaray4::RenderData &render_data, yaf
 		int n_gathered = 0;
 		float radius_2 = hp.radius_2_;
 
-		if(b_hashgrid_)
-			n_gathered = photon_grid_.gather(sp.p_, gathered, n_max_gather__, radius_2); // disable now
-		else
+		if(b_hashgrid_) n_gathered = photon_grid_.gather(sp.p_, gathered, n_max_gather__, radius_2);
+		else if(session__.diffuse_map_->nPhotons() > 0) // this is needed to avoid a runtime error.
 		{
-			if(session__.diffuse_map_->nPhotons() > 0) // this is needed to avoid a runtime error.
+			n_gathered = session__.diffuse_map_->gather(sp.p_, gathered, n_max_gather__, radius_2); //we always collected all the photon inside the radius
+		}
+
+		if(n_gathered > 0)
+		{
+			if(n_gathered > n_max__)
+			{
+				n_max__ = n_gathered;
+				Y_DEBUG << "maximum Photons: " << n_max__ << ", radius2: " << radius_2 << "\n";
+				if(n_max__ == 10) for(int j = 0; j < n_gathered; ++j) Y_DEBUG << "col:" << gathered[j].color() << "\n";
+			}
+			for(int i = 0; i < n_gathered; ++i)
 			{
-				n_gathered = session__.diffuse_map_->gather(sp.p_, gathered, n_max_gather__, radius_2); //we always collected all the photon inside the radius
+				////test if the photon is in the ellipsoid
+				//vector3d_t scale  = sp.P - gathered[i].photon->pos;
+				//vector3d_t temp;
+				//temp.x = scale VDOT sp.NU;
+				//temp.y = scale VDOT sp.NV;
+				//temp.z = scale VDOT sp.N;
+
+				//double inv_radi = 1 / sqrt(radius2);
+				//temp.x  *= inv_radi; temp.y *= inv_radi; temp.z *=  1. / (2.f * scene->rayMinDist);
+				//if(temp.lengthSqr() > 1.)continue;
+
+				g_info.photon_count_++;
+				Vec3 pdir = gathered[i].direction();
+				Rgb surf_col = material->eval(render_data, sp, wo, pdir, BsdfFlags::Diffuse); // seems could speed up using rho, (something pbrt made)
+				g_info.photon_flux_ += surf_col * gathered[i].color();// * std::abs(sp.N*pdir); //< wrong!?
+				//Rgb  flux= surfCol * gathered[i].photon->color();// * std::abs(sp.N*pdir); //< wrong!?
+
+				////start refine here
+				//double ALPHA = 0.7;
+				//double g = (hp.accPhotonCount*ALPHA+ALPHA) / (hp.accPhotonCount*ALPHA+1.0);
+				//hp.radius2 *= g;
+				//hp.accPhotonCount++;
+				//hp.accPhotonFlux=((Rgb)hp.accPhotonFlux+flux)*g;
 			}
+		}
+
+		// gather caustics photons
+		if(bsdfs.hasAny(BsdfFlags::Diffuse) && (b_hashgrid_ ? caustic_grid_.nPhotons() > 0 : session__.caustic_map_->ready()))
+		{
 
+			radius_2 = hp.radius_2_; //reset radius2 & nGathered
+			if(b_hashgrid_) n_gathered = caustic_grid_.gather(sp.p_, gathered, n_max_gather__, radius_2);
+			else n_gathered = session__.caustic_map_->gather(sp.p_, gathered, n_max_gather__, radius_2);
 			if(n_gathered > 0)
 			{
-				if(n_gathered > n_max__)
-				{
-					n_max__ = n_gathered;
-					Y_DEBUG << "maximum Photons: " << n_max__ << ", radius2: " << radius_2 << "\n";
-					if(n_max__ == 10) for(int j = 0; j < n_gathered; ++j) Y_DEBUG << "col:" << gathered[j].photon_->color() << "\n";
-				}
+				Rgb surf_col(0.f);
 				for(int i = 0; i < n_gathered; ++i)
 				{
-					////test if the photon is in the ellipsoid
-					//vector3d_t scale  = sp.P - gathered[i].photon->pos;
-					//vector3d_t temp;
-					//temp.x = scale VDOT sp.NU;
-					//temp.y = scale VDOT sp.NV;
-					//temp.z = scale VDOT sp.N;
-
-					//double inv_radi = 1 / sqrt(radius2);
-					//temp.x  *= inv_radi; temp.y *= inv_radi; temp.z *=  1. / (2.f * scene->rayMinDist);
-					//if(temp.lengthSqr() > 1.)continue;
-
+					Vec3 pdir = gathered[i].direction();
 					g_info.photon_count_++;
-					Vec3 pdir = gathered[i].photon_->direction();
-					Rgb surf_col = material->eval(render_data, sp, wo, pdir, BsdfFlags::Diffuse); // seems could speed up using rho, (something pbrt made)
-					g_info.photon_flux_ += surf_col * gathered[i].photon_->color();// * std::abs(sp.N*pdir); //< wrong!?
+					surf_col = material->eval(render_data, sp, wo, pdir, BsdfFlags::All); // seems could speed up using rho, (something pbrt made)
+					g_info.photon_flux_ += surf_col * gathered[i].color();// * std::abs(sp.N*pdir); //< wrong!?//gInfo.photonFlux += colorPasses.probe_add(PASS_INT_DIFFUSE_INDIRECT, surfCol * gathered[i].photon->color(), state.raylevel == 0);// * std::abs(sp.N*pdir); //< wrong!?
 					//Rgb  flux= surfCol * gathered[i].photon->color();// * std::abs(sp.N*pdir); //< wrong!?
 
 					////start refine here
@@ -825,33 +845,6 @@ GatherInfo SppmIntegrator::traceGatherRay(yafaray4::RenderData &render_data, yaf
 					//hp.accPhotonFlux=((Rgb)hp.accPhotonFlux+flux)*g;
 				}
 			}
-
-			// gather caustics photons
-			if(bsdfs.hasAny(BsdfFlags::Diffuse) && session__.caustic_map_->ready())
-			{
-
-				radius_2 = hp.radius_2_; //reset radius2 & nGathered
-				n_gathered = session__.caustic_map_->gather(sp.p_, gathered, n_max_gather__, radius_2);
-				if(n_gathered > 0)
-				{
-					Rgb surf_col(0.f);
-					for(int i = 0; i < n_gathered; ++i)
-					{
-						Vec3 pdir = gathered[i].photon_->direction();
-						g_info.photon_count_++;
-						surf_col = material->eval(render_data, sp, wo, pdir, BsdfFlags::All); // seems could speed up using rho, (something pbrt made)
-						g_info.photon_flux_ += surf_col * gathered[i].photon_->color();// * std::abs(sp.N*pdir); //< wrong!?//gInfo.photonFlux += colorPasses.probe_add(PASS_INT_DIFFUSE_INDIRECT, surfCol * gathered[i].photon->color(), state.raylevel == 0);// * std::abs(sp.N*pdir); //< wrong!?
-						//Rgb  flux= surfCol * gathered[i].photon->color();// * std::abs(sp.N*pdir); //< wrong!?
-
-						////start refine here
-						//double ALPHA = 0.7;
-						//double g = (hp.accPhotonCount*ALPHA+ALPHA) / (hp.accPhotonCount*ALPHA+1.0);
-						//hp.radius2 *= g;
-						//hp.accPhotonCount++;
-						//hp.accPhotonFlux=((Rgb)hp.accPhotonFlux+flux)*g;
-					}
-				}
-			}
 		}
 		delete [] gathered;
 
@@ -1254,7 +1247,11 @@ void SppmIntegrator::initializePpm(const RenderView *render_view)
 		hit_points_.push_back(hp);
 	}
 
-	if(b_hashgrid_) photon_grid_.setParm(initial_radius * 2.f, n_photons_, b_box);
+	if(b_hashgrid_)
+	{
+		photon_grid_.setParm(initial_radius * 2.f, n_photons_, b_box);
+		caustic_grid_.setParm(initial_radius * 2.f, n_photons_, b_box);
+	}
 
 }
 
@@ -1262,6 +1259,8 @@ Integrator *SppmIntegrator::factory(ParamMap &params, const Scene &scene)
 {
 	bool transp_shad = false;
 	bool pm_ire = false;
+	bool hash_grid = false;
+	bool compact_photons = false;
 	int shadow_depth = 5; //may used when integrate Direct Light
 	int raydepth = 5;
 	int pass_num = 1000;
@@ -1288,6 +1287,8 @@ Integrator *SppmIntegrator::factory(ParamMap &params, const Scene &scene)
 	params.getParam("photonRadius", ds_rad);
 	params.getParam("searchNum", search_num);
 	params.getParam("pmIRE", pm_ire);
+	params.getParam("hashGrid", hash_grid);
+	params.getParam("compactPhotons", compact_photons);
 
 	params.getParam("bg_transp", bg_transp);
 	params.getParam("bg_transp_refract", bg_transp_refract);
@@ -1304,6 +1305,9 @@ Integrator *SppmIntegrator::factory(ParamMap &params, const Scene &scene)
 	ite->ds_radius_ = ds_rad; // under tests enable now
 	ite->n_search_ = search_num;
 	ite->pm_ire_ = pm_ire;
+	ite->b_hashgrid_ = hash_grid;
+	ite->compact_caustic_photons_ = compact_photons;
+	ite->compact_diffuse_photons_ = compact_photons;
 	// Background settings
 	ite->transp_background_ = bg_transp;
 	ite->transp_refracted_background_ = bg_transp_refract;
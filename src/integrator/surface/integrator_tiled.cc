@@ -40,6 +40,7 @@
 #include "sampler/sample.h"
 #include "color/color_layers.h"
 #include "render/render_data.h"
+#include "geometry/ray_packet.h"
 
 BEGIN_YAFARAY
 
@@ -50,15 +51,23 @@ void TiledIntegrator::renderWorker(TiledIntegrator *integrator, const Scene *sce
 {
 	RenderArea a;
 
-	while(image_film_->nextArea(a))
+	while(image_film_->nextArea(thread_id, a))
 	{
 		if(render_control.aborted()) break;
+		{
+			std::unique_lock<std::mutex> lk(control->m_);
+			control->started_areas_.push_back(a);
+		}
+		control->c_.notify_one();
+
 		integrator->renderTile(a, render_view, render_control, samples, offset, adaptive, thread_id, aa_pass);
+		image_film_->mergeArea(a);
 
-		std::unique_lock<std::mutex> lk(control->m_);
-		control->areas_.push_back(a);
+		{
+			std::unique_lock<std::mutex> lk(control->m_);
+			control->areas_.push_back(a);
+		}
 		control->c_.notify_one();
-
 	}
 	std::unique_lock<std::mutex> lk(control->m_);
 	++(control->finished_threads_);
@@ -114,6 +123,7 @@ bool TiledIntegrator::render(ImageFilm *image_film, RenderControl &render_contro
 	else aa_settings << " AA thr=" << aa_noise_params_.threshold_;
 
 	aa_settings << " var.edge=" << aa_noise_params_.variance_edge_size_ << " var.pix=" << aa_noise_params_.variance_pixels_ << " clamp=" << aa_noise_params_.clamp_samples_ << " ind.clamp=" << aa_noise_params_.clamp_indirect_;
+	if(aa_noise_params_.resample_mode_ == AaNoiseParams::ResampleMode::Convergence) aa_settings << " conv.target=" << aa_noise_params_.convergence_target_;
 
 	aa_noise_info_ += aa_settings.str();
 
@@ -144,6 +154,7 @@ bool TiledIntegrator::render(ImageFilm *image_film, RenderControl &render_contro
 	Y_VERBOSE << "AA_variance_pixels: " << aa_noise_params_.variance_pixels_ << YENDL;
 	Y_VERBOSE << "AA_clamp_samples: " << aa_noise_params_.clamp_samples_ << YENDL;
 	Y_VERBOSE << "AA_clamp_indirect: " << aa_noise_params_.clamp_indirect_ << YENDL;
+	if(aa_noise_params_.resample_mode_ == AaNoiseParams::ResampleMode::Convergence) Y_VERBOSE << "AA_resample_mode: convergence, target relative error: " << aa_noise_params_.convergence_target_ << YENDL;
 	Y_PARAMS << "Max. " << aa_noise_params_.samples_ + std::max(0, aa_noise_params_.passes_ - 1) * aa_noise_params_.inc_samples_ << " total samples" << YENDL;
 
 	pass_string << "Rendering pass 1 of " << std::max(1, aa_noise_params_.passes_) << "...";
@@ -224,11 +235,18 @@ bool TiledIntegrator::render(ImageFilm *image_film, RenderControl &render_contro
 		if(resampled_pixels < aa_resampled_floor_pixels)
 		{
 			float aa_variation_ratio = std::min(8.f, ((float) aa_resampled_floor_pixels / resampled_pixels)); //This allows the variation for the new pass in the AA threshold and AA samples to depend, with a certain maximum per pass, on the ratio between how many pixeles were resampled and the target floor, to get a faster approach for noise removal.
-			aa_noise_params_.threshold_ *= (1.f - 0.1f * aa_variation_ratio);
-
-			Y_VERBOSE << getName() << ": Resampled pixels (" << resampled_pixels << ") below the floor (" << aa_resampled_floor_pixels << "): new AA Threshold (-" << aa_variation_ratio * 0.1f * 100.f << "%) for next pass = " << aa_noise_params_.threshold_ << YENDL;
-
-			if(aa_noise_params_.threshold_ > 0.f) aa_threshold_changed = true;
+			if(aa_noise_params_.resample_mode_ == AaNoiseParams::ResampleMode::Convergence)
+			{
+				aa_noise_params_.convergence_target_ *= (1.f - 0.1f * aa_variation_ratio);
+				Y_VERBOSE << getName() << ": Resampled pixels (" << resampled_pixels << ") below the floor (" << aa_resampled_floor_pixels << "): new AA convergence target (-" << aa_variation_ratio * 0.1f * 100.f << "%) for next pass = " << aa_noise_params_.convergence_target_ << YENDL;
+				if(aa_noise_params_.convergence_target_ > 0.f) aa_threshold_changed = true;
+			}
+			else
+			{
+				aa_noise_params_.threshold_ *= (1.f - 0.1f * aa_variation_ratio);
+				Y_VERBOSE << getName() << ": Resampled pixels (" << resampled_pixels << ") below the floor (" << aa_resampled_floor_pixels << "): new AA Threshold (-" << aa_variation_ratio * 0.1f * 100.f << "%) for next pass = " << aa_noise_params_.threshold_ << YENDL;
+				if(aa_noise_params_.threshold_ > 0.f) aa_threshold_changed = true;
+			}
 		}
 	}
 	max_depth_ = 0.f;
@@ -244,7 +262,7 @@ bool TiledIntegrator::renderPass(const RenderView *render_view, int samples, int
 {
 	Y_DEBUG << "Sampling: samples=" << samples << " Offset=" << offset << " Base Offset=" << + image_film_->getBaseSamplingOffset() << "  AA_pass_number=" << aa_pass_number << YENDL;
 
-	prePass(samples, (offset + image_film_->getBaseSamplingOffset()), adaptive, render_control, nullptr);
+	prePass(samples, (offset + image_film_->getBaseSamplingOffset()), adaptive, render_control, render_view);
 
 	int nthreads = scene_->getNumThreads();
 
@@ -259,15 +277,22 @@ bool TiledIntegrator::renderPass(const RenderView *render_view, int samples, int
 		threads.push_back(std::thread(&TiledIntegrator::renderWorker, this, this, scene_, render_view, std::ref(render_control), &tc, i, samples, (offset + image_film_->getBaseSamplingOffset()), adaptive, aa_pass_number));
 	}
 
+	//The areas are output with the lock released, so the render threads never wait for the outputs when reporting their progress
+	std::vector<RenderArea> started_areas, finished_areas;
 	std::unique_lock<std::mutex> lk(tc.m_);
-	while(tc.finished_threads_ < nthreads)
+	while(true)
 	{
-		tc.c_.wait(lk);
-		for(size_t i = 0; i < tc.areas_.size(); ++i)
-		{
-			image_film_->finishArea(render_view, render_control, tc.areas_[i]);
-		}
-		tc.areas_.clear();
+		tc.c_.wait(lk, [&tc, nthreads] { return !tc.started_areas_.empty() || !tc.areas_.empty() || tc.finished_threads_ >= nthreads; });
+		const bool all_finished = tc.finished_threads_ >= nthreads;
+		started_areas.swap(tc.started_areas_);
+		finished_areas.swap(tc.areas_);
+		lk.unlock();
+		for(const auto &area : started_areas) image_film_->highlightArea(area);
+		for(auto &area : finished_areas) image_film_->finishArea(render_view, render_control, area);
+		started_areas.clear();
+		finished_areas.clear();
+		if(all_finished) break;
+		lk.lock();
 	}
 
 	for(auto &t : threads) t.join();	//join all threads (although they probably have exited already, but not necessarily):
@@ -280,7 +305,6 @@ bool TiledIntegrator::renderTile(RenderArea &a, const RenderView *render_view, c
 	int x;
 	const Camera *camera = render_view->getCamera();
 	x = camera->resX();
-	DiffRay c_ray;
 	Ray d_ray;
 	float dx = 0.5, dy = 0.5, d_1 = 1.0 / (float)n_samples;
 	float lens_u = 0.5f, lens_v = 0.5f;
@@ -313,6 +337,95 @@ bool TiledIntegrator::renderTile(RenderArea &a, const RenderView *render_view, c
 	int film_cx_0 = image_film_->getCx0();
 	int film_cy_0 = image_film_->getCy0();
 
+	//The camera rays of up to RayPacket::max_size_ consecutive samples are generated first, so they can be intersected
+	//together as a ray packet when the integrator supports it. Then they are integrated one by one in the same order.
+	CameraSample camera_samples[RayPacket::max_size_];
+	DiffRay camera_rays[RayPacket::max_size_];
+	SurfacePoint camera_rays_sp[RayPacket::max_size_];
+	bool camera_rays_hit[RayPacket::max_size_];
+	int n_camera_samples = 0, n_camera_rays = 0;
+
+	auto integrate_camera_samples = [&]()
+	{
+		if(camera_ray_packets_) scene_->intersect(camera_rays, n_camera_rays, camera_rays_sp, camera_rays_hit);
+		for(int s = 0; s < n_camera_samples; ++s)
+		{
+			const CameraSample &camera_sample = camera_samples[s];
+			color_layers.setDefaultColors();
+			rstate.setDefaults();
+			rstate.pixel_number_ = x * camera_sample.y_ + camera_sample.x_;
+			rstate.sampling_offs_ = camera_sample.sampling_offs_;
+			rstate.pixel_sample_ = camera_sample.pixel_sample_;
+			rstate.time_ = camera_sample.time_;
+			const float wt = camera_sample.wt_;
+
+			if(camera_sample.ray_index_ >= 0)
+			{
+				DiffRay &c_ray = camera_rays[camera_sample.ray_index_];
+				if(camera_ray_packets_)
+				{
+					rstate.camera_ray_intersected_ = true;
+					rstate.camera_ray_sp_ = camera_rays_hit[camera_sample.ray_index_] ? &camera_rays_sp[camera_sample.ray_index_] : nullptr;
+				}
+				color_layers(Layer::Combined).color_ = integrate(rstate, c_ray, 0, &color_layers, nullptr);
+				rstate.camera_ray_intersected_ = false;
+
+				for(auto &color_layer : color_layers)
+				{
+					switch(color_layer.layer_type_)
+					{
+						case Layer::ObjIndexMask:
+						case Layer::ObjIndexMaskShadow:
+						case Layer::ObjIndexMaskAll:
+						case Layer::MatIndexMask:
+						case Layer::MatIndexMaskShadow:
+						case Layer::MatIndexMaskAll:
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
+							color_layer.color_.clampRgb01();
+							if(mask_params.invert_)
+							{
+								color_layer.color_ = Rgba(1.f) - color_layer.color_;
+							}
+							if(!mask_params.only_)
+							{
+								Rgba col_combined = color_layers(Layer::Combined).color_;
+								col_combined.a_ = 1.f;
+								color_layer.color_ *= col_combined;
+							}
+							break;
+						case Layer::ZDepthAbs:
+							if(c_ray.tmax_ < 0.f) color_layer.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
+							else color_layer.color_ = Rgb(c_ray.tmax_);
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
+							break;
+						case Layer::ZDepthNorm:
+							if(c_ray.tmax_ < 0.f) color_layer.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
+							else color_layer.color_ = Rgb(1.f - (c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
+							break;
+						case Layer::Mist:
+							if(c_ray.tmax_ < 0.f) color_layer.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
+							else color_layer.color_ = Rgb((c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
+							break;
+						default:
+							color_layer.color_ *= wt;
+							if(color_layer.color_.a_ > 1.f) color_layer.color_.a_ = 1.f;
+							break;
+					}
+				}
+			}
+
+			image_film_->addSample(camera_sample.x_, camera_sample.y_, camera_sample.dx_, camera_sample.dy_, &a, camera_sample.sample_, aa_pass_number, inv_aa_max_possible_samples, &color_layers);
+		}
+		n_camera_samples = 0;
+		n_camera_rays = 0;
+	};
+
 	for(int i = a.y_; i < end_y; ++i)
 	{
 		for(int j = a.x_; j < end_x; ++j)
@@ -354,8 +467,6 @@ bool TiledIntegrator::renderTile(RenderArea &a, const RenderView *render_view, c
 
 			for(int sample = 0; sample < n_samples_adjusted; ++sample)
 			{
-				color_layers.setDefaultColors();
-				rstate.setDefaults();
 				rstate.pixel_sample_ = pass_offs + sample;
 				rstate.time_ = math::addMod1((float) sample * d_1, toff); //(0.5+(float)sample)*d1;
 
@@ -377,13 +488,26 @@ bool TiledIntegrator::renderTile(RenderArea &a, const RenderView *render_view, c
 					lens_u = hal_u.getNext();
 					lens_v = hal_v.getNext();
 				}
+				CameraSample &camera_sample = camera_samples[n_camera_samples++];
+				camera_sample.x_ = j;
+				camera_sample.y_ = i;
+				camera_sample.sample_ = sample;
+				camera_sample.dx_ = dx;
+				camera_sample.dy_ = dy;
+				camera_sample.pixel_sample_ = rstate.pixel_sample_;
+				camera_sample.sampling_offs_ = rstate.sampling_offs_;
+				camera_sample.time_ = rstate.time_;
+				camera_sample.ray_index_ = -1;
+				DiffRay &c_ray = camera_rays[n_camera_rays];
 				c_ray = camera->shootRay(j + dx, i + dy, lens_u, lens_v, wt);
+				camera_sample.wt_ = wt;
 
 				if(wt == 0.0)
 				{
-					image_film_->addSample(j, i, dx, dy, &a, sample, aa_pass_number, inv_aa_max_possible_samples, &color_layers);
+					if(n_camera_samples == RayPacket::max_size_) integrate_camera_samples();
 					continue;
 				}
+				camera_sample.ray_index_ = n_camera_rays++;
 				if(diff_rays_enabled_)
 				{
 					//setup ray differentials
@@ -398,61 +522,20 @@ bool TiledIntegrator::renderTile(RenderArea &a, const RenderView *render_view, c
 
 				c_ray.time_ = rstate.time_;
 
-				color_layers(Layer::Combined).color_ = integrate(rstate, c_ray, 0, &color_layers, nullptr);
-
-				for(auto &it : color_layers)
-				{
-					switch(it.first)
-					{
-						case Layer::ObjIndexMask:
-						case Layer::ObjIndexMaskShadow:
-						case Layer::ObjIndexMaskAll:
-						case Layer::MatIndexMask:
-						case Layer::MatIndexMaskShadow:
-						case Layer::MatIndexMaskAll:
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
-							it.second.color_.clampRgb01();
-							if(mask_params.invert_)
-							{
-								it.second.color_ = Rgba(1.f) - it.second.color_;
-							}
-							if(!mask_params.only_)
-							{
-								Rgba col_combined = color_layers(Layer::Combined).color_;
-								col_combined.a_ = 1.f;
-								it.second.color_ *= col_combined;
-							}
-							break;
-						case Layer::ZDepthAbs:
-							if(c_ray.tmax_ < 0.f) it.second.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
-							else it.second.color_ = Rgb(c_ray.tmax_);
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
-							break;
-						case Layer::ZDepthNorm:
-							if(c_ray.tmax_ < 0.f) it.second.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
-							else it.second.color_ = Rgb(1.f - (c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
-							break;
-						case Layer::Mist:
-							if(c_ray.tmax_ < 0.f) it.second.color_ = Rgba(0.f, 0.f); // Show background as fully transparent
-							else it.second.color_ = Rgb((c_ray.tmax_ - min_depth_) * max_depth_); // Distance normalization
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
-							break;
-						default:
-							it.second.color_ *= wt;
-							if(it.second.color_.a_ > 1.f) it.second.color_.a_ = 1.f;
-							break;
-					}
-				}
-
-				image_film_->addSample(j, i, dx, dy, &a, sample, aa_pass_number, inv_aa_max_possible_samples, &color_layers);
+				if(n_camera_samples == RayPacket::max_size_) integrate_camera_samples();
 			}
 		}
 	}
+	integrate_camera_samples();
+	return true;
+}
+
+bool TiledIntegrator::intersectCameraRay(RenderData &render_data, const DiffRay &ray, SurfacePoint &sp) const
+{
+	if(!render_data.camera_ray_intersected_) return scene_->intersect(ray, sp);
+	render_data.camera_ray_intersected_ = false;
+	if(!render_data.camera_ray_sp_) return false;
+	sp = *render_data.camera_ray_sp_;
 	return true;
 }
 
@@ -19,6 +19,7 @@
  */
 
 #include "light/light_area.h"
+#include "light/light_tree.h"
 #include "geometry/surface.h"
 #include "geometry/object_geom.h"
 #include "common/param.h"
@@ -63,6 +64,16 @@ void AreaLight::init(Scene &scene)
 
 Rgb AreaLight::totalEnergy() const { return color_ * area_; }
 
+bool AreaLight::emissionBounds(LightBounds &bounds) const
+{
+	Bound bound(corner_, corner_);
+	bound.include(c_2_);
+	bound.include(c_3_);
+	bound.include(c_4_);
+	bounds = LightBounds(bound, normal_, 0.f, M_PI_2, totalEnergy().energy());
+	return true;
+}
+
 bool AreaLight::illumSample(const SurfacePoint &sp, LSample &s, Ray &wi) const
 {
 	if(photonOnly()) return false;
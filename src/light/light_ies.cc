@@ -19,6 +19,7 @@
  */
 
 #include "light/light_ies.h"
+#include "light/light_tree.h"
 #include "geometry/surface.h"
 #include "sampler/sample.h"
 #include "light/light_ies_data.h"
@@ -60,6 +61,12 @@ void IesLight::getAngles(float &u, float &v, const Vec3 &dir, const float &costh
 	v = (costheta >= 1.f) ? 0.f : math::radToDeg(math::acos(costheta));
 }
 
+bool IesLight::emissionBounds(LightBounds &bounds) const
+{
+	bounds = LightBounds(Bound(position_, position_), dir_, math::acos(cos_end_), 0.f, totalEnergy().energy());
+	return true;
+}
+
 bool IesLight::illuminate(const SurfacePoint &sp, Rgb &col, Ray &wi) const
 {
 	if(photonOnly()) return false;
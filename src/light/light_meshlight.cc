@@ -21,6 +21,7 @@
 #include <limits>
 
 #include "light/light_meshlight.h"
+#include "light/light_tree.h"
 #include "background/background.h"
 #include "texture/texture.h"
 #include "common/param.h"
@@ -119,6 +120,15 @@ void MeshLight::sampleSurface(Point3 &p, Vec3 &n, float s_1, float s_2) const
 
 Rgb MeshLight::totalEnergy() const { return (double_sided_ ? 2.f * color_ * area_ : color_ * area_); }
 
+bool MeshLight::emissionBounds(LightBounds &bounds) const
+{
+	if(!tris_ || n_tris_ == 0) return false;
+	Bound bound = tris_[0]->getBound();
+	for(int i = 1; i < n_tris_; ++i) bound = Bound(bound, tris_[i]->getBound());
+	bounds = LightBounds(bound, Vec3(0.f, 0.f, 1.f), M_PI, M_PI_2, totalEnergy().energy());
+	return true;
+}
+
 bool MeshLight::illumSample(const SurfacePoint &sp, LSample &s, Ray &wi) const
 {
 	if(photonOnly()) return false;
@@ -19,6 +19,7 @@
  */
 
 #include "light/light_point.h"
+#include "light/light_tree.h"
 #include "geometry/surface.h"
 #include "sampler/sample.h"
 #include "geometry/ray.h"
@@ -35,6 +36,12 @@ PointLight::PointLight(const Point3 &pos, const Rgb &col, float inte, bool b_lig
 	intensity_ = color_.energy();
 }
 
+bool PointLight::emissionBounds(LightBounds &bounds) const
+{
+	bounds = LightBounds(Bound(position_, position_), Vec3(0.f, 0.f, 1.f), M_PI, M_PI_2, totalEnergy().energy());
+	return true;
+}
+
 bool PointLight::illuminate(const SurfacePoint &sp, Rgb &col, Ray &wi) const
 {
 	if(photonOnly()) return false;
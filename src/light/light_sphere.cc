@@ -19,6 +19,7 @@
  */
 
 #include "light/light_sphere.h"
+#include "light/light_tree.h"
 #include "geometry/surface.h"
 #include "geometry/object_geom.h"
 #include "common/param.h"
@@ -66,6 +67,13 @@ inline bool sphereIntersect__(const Ray &ray, const Point3 &c, float r_2, float
 	return true;
 }
 
+bool SphereLight::emissionBounds(LightBounds &bounds) const
+{
+	const Vec3 radius(radius_, radius_, radius_);
+	bounds = LightBounds(Bound(center_ - radius, center_ + radius), Vec3(0.f, 0.f, 1.f), M_PI, M_PI_2, totalEnergy().energy());
+	return true;
+}
+
 bool SphereLight::illumSample(const SurfacePoint &sp, LSample &s, Ray &wi) const
 {
 	if(photonOnly()) return false;
@@ -19,6 +19,7 @@
  */
 
 #include "light/light_spot.h"
+#include "light/light_tree.h"
 #include "geometry/surface.h"
 #include "geometry/ray.h"
 #include "sampler/sample.h"
@@ -79,6 +80,14 @@ Rgb SpotLight::totalEnergy() const
 	return color_ * math::mult_pi_by_2 * (1.f - 0.5f * (cos_start_ + cos_end_));
 }
 
+bool SpotLight::emissionBounds(LightBounds &bounds) const
+{
+	//with soft shadows the light can also be hit by the rays sampled from the materials, so its emission is not bounded to the cone
+	if(soft_shadows_) bounds = LightBounds(Bound(position_, position_), dir_, M_PI, M_PI_2, totalEnergy().energy());
+	else bounds = LightBounds(Bound(position_, position_), dir_, math::acos(cos_end_), 0.f, totalEnergy().energy());
+	return true;
+}
+
 bool SpotLight::illuminate(const SurfacePoint &sp, Rgb &col, Ray &wi) const
 {
 	if(photonOnly()) return false;
@@ -0,0 +1,237 @@
+/****************************************************************************
+ *      This is part of the libYafaRay package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "light/light_tree.h"
+#include "light/light.h"
+#include "common/logger.h"
+#include <algorithm>
+#include <limits>
+
+BEGIN_YAFARAY
+
+static constexpr float one_minus_epsilon__ = 0.99999994f; //!< largest float below 1, to keep the remapped random numbers in [0, 1)
+
+/*! Union of the cones of directions of two bounds: the smallest cone that contains
+	both, rotating the axis of the first one towards the axis of the second one */
+LightBounds::LightBounds(const LightBounds &a, const LightBounds &b) : bound_(a.bound_, b.bound_), theta_e_(std::max(a.theta_e_, b.theta_e_)), power_(a.power_ + b.power_)
+{
+	const float theta_d = math::acos(a.axis_ * b.axis_);
+	if(std::min(theta_d + b.theta_o_, static_cast<float>(M_PI)) <= a.theta_o_)
+	{
+		axis_ = a.axis_;
+		theta_o_ = a.theta_o_;
+		return;
+	}
+	if(std::min(theta_d + a.theta_o_, static_cast<float>(M_PI)) <= b.theta_o_)
+	{
+		axis_ = b.axis_;
+		theta_o_ = b.theta_o_;
+		return;
+	}
+	theta_o_ = 0.5f * (a.theta_o_ + theta_d + b.theta_o_);
+	Vec3 rotation_axis = a.axis_ ^ b.axis_;
+	if(theta_o_ >= M_PI || rotation_axis.lengthSqr() < 1.0e-12f)
+	{
+		axis_ = a.axis_;
+		theta_o_ = M_PI;
+		return;
+	}
+	rotation_axis.normalize();
+	const float theta_r = theta_o_ - a.theta_o_;
+	axis_ = a.axis_ * std::cos(theta_r) + (rotation_axis ^ a.axis_) * std::sin(theta_r);
+	axis_.normalize();
+}
+
+/*! Power over the squared distance, reduced by the smallest angles the point can
+	be away from the cone of emission and from its surface normal, taking into
+	account the angle subtended by the bounding sphere of the emitters */
+float LightBounds::importance(const Point3 &p, const Vec3 &n) const
+{
+	if(power_ <= 0.f) return 0.f;
+	Vec3 dir = p - bound_.center();
+	const float dist_2 = dir.lengthSqr();
+	const float radius_2 = 0.25f * Vec3(bound_.g_ - bound_.a_).lengthSqr();
+	const float theta_u = (dist_2 <= radius_2) ? M_PI : math::asin(math::sqrt(radius_2 / dist_2));
+	float cos_theta = 1.f;
+	float cos_i = 1.f;
+	if(dist_2 > 0.f)
+	{
+		dir *= 1.f / math::sqrt(dist_2);
+		cos_theta = axis_ * dir;
+		cos_i = std::abs(n * dir);
+	}
+	const float theta_p = std::max(0.f, math::acos(cos_theta) - theta_o_ - theta_u);
+	if(theta_p > theta_e_) return 0.f;
+	//The distance is only clamped to a small fraction of the radius: clamping it to the whole radius makes the nodes containing the point look as important as their distant siblings
+	float importance = power_ * std::max(0.f, std::cos(theta_p)) / std::max({dist_2, radius_2 / 256.f, 1.0e-12f});
+	if(n.x_ != 0.f || n.y_ != 0.f || n.z_ != 0.f) importance *= std::max(0.f, std::cos(std::max(0.f, math::acos(cos_i) - theta_u)));
+	return importance;
+}
+
+/*! Power times the solid angle of the emission, times the surface area of the bound, with a
+	penalty for splitting the thin sides of the bound. */
+float LightBounds::cost(int axis) const
+{
+	const float theta_w = std::min(theta_o_ + theta_e_, static_cast<float>(M_PI));
+	const float cos_theta_o = std::cos(theta_o_);
+	const float sin_theta_o = std::sin(theta_o_);
+	const float m_omega = 2.f * M_PI * (1.f - cos_theta_o) + M_PI_2 * (2.f * theta_w * sin_theta_o - std::cos(theta_o_ - 2.f * theta_w) - 2.f * theta_o_ * sin_theta_o + cos_theta_o);
+	const Vec3 diagonal = bound_.g_ - bound_.a_;
+	const float surface_area = 2.f * (diagonal.x_ * diagonal.y_ + diagonal.y_ * diagonal.z_ + diagonal.z_ * diagonal.x_);
+	const float max_side = std::max({diagonal.x_, diagonal.y_, diagonal.z_});
+	const float k_r = (diagonal[axis] > 0.f) ? max_side / diagonal[axis] : 1.f;
+	return power_ * m_omega * k_r * surface_area;
+}
+
+LightTree::LightTree(const std::vector<Light *> &lights)
+{
+	std::vector<BuildLight> build_lights;
+	for(int i = 0; i < static_cast<int>(lights.size()); ++i)
+	{
+		LightBounds bounds;
+		if(lights[i]->emissionBounds(bounds)) build_lights.push_back({bounds, i});
+		else infinite_lights_.push_back(i);
+	}
+	if(!build_lights.empty())
+	{
+		nodes_.reserve(2 * build_lights.size() - 1);
+		buildTree(build_lights, 0, build_lights.size());
+	}
+	Y_VERBOSE << "LightTree: " << build_lights.size() << " lights in the tree, " << infinite_lights_.size() << " infinite lights" << YENDL;
+}
+
+/*! The lights are split with the bucketed surface area orientation heuristic,
+	so the lights close in space and with similar directions of emission are
+	grouped together */
+uint32_t LightTree::buildTree(std::vector<BuildLight> &build_lights, int start, int end)
+{
+	const uint32_t node_index = nodes_.size();
+	nodes_.push_back(Node());
+	if(end - start == 1)
+	{
+		nodes_[node_index].bounds_ = build_lights[start].bounds_;
+		nodes_[node_index].light_ = build_lights[start].light_;
+		return node_index;
+	}
+	Bound centroid_bound(build_lights[start].bounds_.bound_.center(), build_lights[start].bounds_.bound_.center());
+	for(int i = start + 1; i < end; ++i) centroid_bound.include(build_lights[i].bounds_.bound_.center());
+
+	bool split_found = false;
+	float min_cost = std::numeric_limits<float>::max();
+	int min_cost_axis = 0, min_cost_bucket = 0;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		const float axis_min = centroid_bound.a_[axis];
+		const float axis_length = centroid_bound.g_[axis] - axis_min;
+		if(axis_length <= 0.f) continue;
+		LightBounds buckets[num_buckets_];
+		bool bucket_used[num_buckets_] = { };
+		for(int i = start; i < end; ++i)
+		{
+			const int bucket = std::min(static_cast<int>(num_buckets_ * (build_lights[i].bounds_.bound_.center()[axis] - axis_min) / axis_length), num_buckets_ - 1);
+			buckets[bucket] = bucket_used[bucket] ? LightBounds(buckets[bucket], build_lights[i].bounds_) : build_lights[i].bounds_;
+			bucket_used[bucket] = true;
+		}
+		for(int split = 0; split < num_buckets_ - 1; ++split)
+		{
+			LightBounds below, above;
+			bool below_used = false, above_used = false;
+			for(int b = 0; b <= split; ++b)
+			{
+				if(!bucket_used[b]) continue;
+				below = below_used ? LightBounds(below, buckets[b]) : buckets[b];
+				below_used = true;
+			}
+			for(int b = split + 1; b < num_buckets_; ++b)
+			{
+				if(!bucket_used[b]) continue;
+				above = above_used ? LightBounds(above, buckets[b]) : buckets[b];
+				above_used = true;
+			}
+			if(!below_used || !above_used) continue;
+			const float cost = below.cost(axis) + above.cost(axis);
+			if(cost < min_cost)
+			{
+				min_cost = cost;
+				min_cost_axis = axis;
+				min_cost_bucket = split;
+				split_found = true;
+			}
+		}
+	}
+	int mid = start + (end - start) / 2;
+	if(split_found)
+	{
+		const float axis_min = centroid_bound.a_[min_cost_axis];
+		const float axis_length = centroid_bound.g_[min_cost_axis] - axis_min;
+		mid = std::partition(build_lights.begin() + start, build_lights.begin() + end, [&](const BuildLight &build_light)
+		{
+			return std::min(static_cast<int>(num_buckets_ * (build_light.bounds_.bound_.center()[min_cost_axis] - axis_min) / axis_length), num_buckets_ - 1) <= min_cost_bucket;
+		}) - build_lights.begin();
+	}
+	if(mid <= start || mid >= end) mid = start + (end - start) / 2; //the heuristic could not separate the lights
+
+	buildTree(build_lights, start, mid);
+	const uint32_t second_child = buildTree(build_lights, mid, end);
+	nodes_[node_index].bounds_ = LightBounds(nodes_[node_index + 1].bounds_, nodes_[second_child].bounds_);
+	nodes_[node_index].second_child_ = second_child;
+	return node_index;
+}
+
+int LightTree::sample(const Point3 &p, const Vec3 &n, float s, float &pdf) const
+{
+	pdf = 1.f;
+	const int num_infinite = infinite_lights_.size();
+	if(num_infinite > 0)
+	{
+		const float p_infinite = nodes_.empty() ? 1.f : num_infinite / (num_infinite + 1.f);
+		if(s < p_infinite)
+		{
+			pdf = p_infinite / num_infinite;
+			return infinite_lights_[std::min(static_cast<int>(s / p_infinite * num_infinite), num_infinite - 1)];
+		}
+		s = std::min((s - p_infinite) / (1.f - p_infinite), one_minus_epsilon__);
+		pdf = 1.f - p_infinite;
+	}
+	if(nodes_.empty()) return -1;
+	uint32_t node_index = 0;
+	if(nodes_[0].light_ >= 0 && nodes_[0].bounds_.importance(p, n) <= 0.f) return -1;
+	while(nodes_[node_index].light_ < 0)
+	{
+		const uint32_t second_child = nodes_[node_index].second_child_;
+		const float importance_first = nodes_[node_index + 1].bounds_.importance(p, n);
+		const float importance_second = nodes_[second_child].bounds_.importance(p, n);
+		if(importance_first <= 0.f && importance_second <= 0.f) return -1;
+		const float p_first = importance_first / (importance_first + importance_second);
+		if(s < p_first)
+		{
+			s = std::min(s / p_first, one_minus_epsilon__);
+			pdf *= p_first;
+			++node_index;
+		}
+		else
+		{
+			s = std::min((s - p_first) / (1.f - p_first), one_minus_epsilon__);
+			pdf *= 1.f - p_first;
+			node_index = second_child;
+		}
+	}
+	return nodes_[node_index].light_;
+}
+
+END_YAFARAY
@@ -66,7 +66,7 @@ bool ColorOutput::putPixel(int x, int y, const ColorLayers &color_layers)
 {
 	for(const auto &color_layer : color_layers)
 	{
-		const ColorLayer preprocessed_color_layer = preProcessColor(color_layer.second);
+		const ColorLayer preprocessed_color_layer = preProcessColor(color_layer);
 		putPixel(x, y, preprocessed_color_layer);
 	}
 	return true;
@@ -86,6 +86,71 @@ ColorLayer ColorOutput::preProcessColor(const ColorLayer &color_layer)
 	return result;
 }
 
+bool ColorOutput::putArea(const ColorLayersArea &color_layers_area)
+{
+	const int width = color_layers_area.getWidth();
+	const int x_0 = color_layers_area.getX0();
+	const int y_0 = color_layers_area.getY0();
+	std::vector<Rgba> row(width);
+	for(size_t index = 0; index < color_layers_area.size(); ++index)
+	{
+		const Layer::Type layer_type = color_layers_area.getLayerType(index);
+		for(int y = y_0; y < y_0 + color_layers_area.getHeight(); ++y)
+		{
+			preProcessColors(layer_type, color_layers_area.getRow(index, y), row.data(), width);
+			putRow(x_0, y, width, layer_type, row.data());
+		}
+	}
+	return true;
+}
+
+bool ColorOutput::putRow(int x, int y, int n_pixels, const Layer::Type &layer_type, const Rgba *colors)
+{
+	ColorLayer color_layer(layer_type);
+	for(int i = 0; i < n_pixels; ++i)
+	{
+		color_layer.color_ = colors[i];
+		putPixel(x + i, y, color_layer);
+	}
+	return true;
+}
+
+/*! The color space is checked once per span and each conversion is a separate loop
+	without branches between pixels, so the compiler can vectorize them */
+void ColorOutput::preProcessColors(const Layer::Type &layer_type, const Rgba *colors, Rgba *result, int n_pixels) const
+{
+	for(int i = 0; i < n_pixels; ++i)
+	{
+		result[i] = colors[i];
+		result[i].r_ = std::max(result[i].r_, 0.f);
+		result[i].g_ = std::max(result[i].g_, 0.f);
+		result[i].b_ = std::max(result[i].b_, 0.f);
+	}
+	if(Layer::applyColorSpace(layer_type))
+	{
+		if(color_space_ == Srgb)
+		{
+			for(int i = 0; i < n_pixels; ++i)
+			{
+				result[i].r_ = result[i].sRgbFromLinearRgb(result[i].r_);
+				result[i].g_ = result[i].sRgbFromLinearRgb(result[i].g_);
+				result[i].b_ = result[i].sRgbFromLinearRgb(result[i].b_);
+			}
+		}
+		else if(color_space_ == XyzD65 || (color_space_ == RawManualGamma && gamma_ != 1.f))
+		{
+			for(int i = 0; i < n_pixels; ++i) result[i].colorSpaceFromLinearRgb(color_space_, gamma_);
+		}
+	}
+	if(alpha_premultiply_)
+	{
+		for(int i = 0; i < n_pixels; ++i) result[i].alphaPremultiply();
+	}
+
+	//To make sure we don't have any weird Alpha values outside the range [0.f, +1.f]
+	for(int i = 0; i < n_pixels; ++i) result[i].a_ = std::min(std::max(result[i].a_, 0.f), 1.f);
+}
+
 std::string ColorOutput::printBadge(const RenderControl &render_control) const
 {
 	return badge_.print(printDenoiseParams(), render_control);
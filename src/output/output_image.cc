@@ -72,6 +72,16 @@ ImageOutput::ImageOutput(const std::string &image_path, int border_x, int border
 
 ImageOutput::~ImageOutput()
 {
+	if(writer_thread_.joinable())
+	{
+		waitForPendingWrites();
+		{
+			std::lock_guard<std::mutex> lock(writer_mutex_);
+			writer_exit_ = true;
+		}
+		writer_condition_.notify_all();
+		writer_thread_.join();
+	}
 	clearImageLayers();
 }
 
@@ -88,6 +98,7 @@ void ImageOutput::clearImageLayers()
 void ImageOutput::init(int width, int height, const Layers *layers, const std::map<std::string, RenderView *> *render_views)
 {
 	ColorOutput::init(width, height, layers, render_views);
+	waitForPendingWrites();
 	clearImageLayers();
 	image_layers_ = new ImageLayers();
 
@@ -112,8 +123,21 @@ bool ImageOutput::putPixel(int x, int y, const ColorLayer &color_layer)
 	else return false;
 }
 
+bool ImageOutput::putRow(int x, int y, int n_pixels, const Layer::Type &layer_type, const Rgba *colors)
+{
+	if(!image_layers_) return false;
+	ImageLayer *image_layer = image_layers_->find(layer_type);
+	if(!image_layer) return true;
+	for(int i = 0; i < n_pixels; ++i) image_layer->image_->setColor(x + i + border_x_, y + border_y_, colors[i]);
+	return true;
+}
+
 void ImageOutput::flush(const RenderControl &render_control)
 {
+	//Autosaves are written in the background from snapshots of the images. The final images are written right away, after any pending autosave so they are not overwritten by it
+	const bool write_async = render_control.inProgress();
+	if(!write_async) waitForPendingWrites();
+
 	Path path(image_path_);
 	std::string directory = path.getDirectory();
 	std::string base_name = path.getBaseName();
@@ -123,22 +147,26 @@ void ImageOutput::flush(const RenderControl &render_control)
 
 	ParamMap params;
 	params["type"] = ext;
-	Format *format = Format::factory(params);
-	
+	std::shared_ptr<Format> format(Format::factory(params));
+	std::vector<ImageFile> image_files;
+	std::string multi_channel_filename;
+	ImageLayers *multi_channel_image_layers = nullptr;
+	bool multi_channel_owned = false;
+
 	if(format)
 	{
 		if(multi_layer_ && format->supportsMultiLayer())
 		{
 			if(view_name == current_render_view_->getName())
 			{
-				saveImageFile(image_path_, Layer::Combined, format, render_control); //This should not be necessary but Blender API seems to be limited and the API "load_from_file" function does not work (yet) with multilayered images, so I have to generate this extra combined pass file so it's displayed in the Blender window.
+				image_files.push_back(prepareImageFile(image_path_, Layer::Combined, render_control, write_async)); //This should not be necessary but Blender API seems to be limited and the API "load_from_file" function does not work (yet) with multilayered images, so I have to generate this extra combined pass file so it's displayed in the Blender window.
 			}
 
 			if(!directory.empty()) directory += "/";
-			const std::string fname_pass = directory + base_name + " (" + "multilayer" + ")." + ext;
-			saveImageFileMultiChannel(fname_pass, format, render_control);
+			multi_channel_filename = directory + base_name + " (" + "multilayer" + ")." + ext;
+			multi_channel_image_layers = prepareImageLayersMultiChannel(render_control, write_async, multi_channel_owned);
 
-			logger__.setImagePath(fname_pass); //to show the image in the HTML log output
+			logger__.setImagePath(multi_channel_filename); //to show the image in the HTML log output
 		}
 		else
 		{
@@ -149,7 +177,7 @@ void ImageOutput::flush(const RenderControl &render_control)
 				const std::string exported_image_name = image_layer.second.layer_.getExportedImageName();
 				if(layer_type == Layer::Combined)
 				{
-					saveImageFile(image_path_, layer_type, format, render_control); //default imagehandler filename, when not using views nor passes and for reloading into Blender
+					image_files.push_back(prepareImageFile(image_path_, layer_type, render_control, write_async)); //default imagehandler filename, when not using views nor passes and for reloading into Blender
 					logger__.setImagePath(image_path_); //to show the image in the HTML log output
 				}
 
@@ -159,11 +187,26 @@ void ImageOutput::flush(const RenderControl &render_control)
 					std::string fname_pass = directory + base_name + " [" + layer_type_name;
 					if(!exported_image_name.empty()) fname_pass += " - " + exported_image_name;
 					fname_pass += "]." + ext;
-					saveImageFile(fname_pass, layer_type, format, render_control);
+					image_files.push_back(prepareImageFile(fname_pass, layer_type, render_control, write_async));
 				}
 			}
 		}
-		delete format;
+
+		const auto write = [this, format, image_files, multi_channel_filename, multi_channel_image_layers, multi_channel_owned]()
+		{
+			for(const auto &image_file : image_files) writeImageFile(image_file, format.get());
+			if(multi_channel_image_layers)
+			{
+				format->saveToFileMultiChannel(multi_channel_filename, multi_channel_image_layers);
+				if(multi_channel_owned)
+				{
+					for(auto &it : *multi_channel_image_layers) delete it.second.image_;
+					delete multi_channel_image_layers;
+				}
+			}
+		};
+		if(write_async) enqueueWrite(write);
+		else write();
 	}
 	if(save_log_txt_)
 	{
@@ -182,7 +225,9 @@ void ImageOutput::flush(const RenderControl &render_control)
 	}
 }
 
-void ImageOutput::saveImageFile(const std::string &filename, const Layer::Type &layer_type, Format *format, const RenderControl &render_control)
+/*! Gets the image of a layer ready to be written: composed with the badge if needed, or
+	copied if "copy_image" so the rendering can go on updating the original meanwhile */
+ImageOutput::ImageFile ImageOutput::prepareImageFile(const std::string &filename, const Layer::Type &layer_type, const RenderControl &render_control, bool copy_image) const
 {
 	if(render_control.inProgress()) Y_INFO << name_ << ": Autosaving partial render (" << math::roundFloatPrecision(render_control.currentPassPercent(), 0.01) << "% of pass " << render_control.currentPass() << " of " << render_control.totalPasses() << ") file as \"" << filename << "\"...  " << printDenoiseParams() << YENDL;
 	else Y_INFO << name_ << ": Saving file as \"" << filename << "\"...  " << printDenoiseParams() << YENDL;
@@ -192,22 +237,59 @@ void ImageOutput::saveImageFile(const std::string &filename, const Layer::Type &
 	if(!image)
 	{
 		Y_WARNING << name_ << ": Image does not exist (it is null) and could not be saved." << YENDL;
-		return;
+		return {filename, nullptr, false};
+	}
+
+	if(badge_.getPosition() != Badge::Position::None)
+	{
+		const Image *badge_image = generateBadgeImage(render_control);
+		Image::Position badge_image_position = Image::Position::Bottom;
+		if(badge_.getPosition() == Badge::Position::Top) badge_image_position = Image::Position::Top;
+		const Image *image_badge = Image::getComposedImage(image, badge_image, badge_image_position);
+		delete badge_image;
+		if(!image_badge) Y_WARNING << name_ << ": Image could not be composed with badge and could not be saved." << YENDL;
+		return {filename, image_badge, true};
 	}
+	else if(copy_image) return {filename, new Image(*image), true};
+	else return {filename, image, false};
+}
 
+ImageLayers *ImageOutput::prepareImageLayersMultiChannel(const RenderControl &render_control, bool copy_images, bool &owned) const
+{
+	owned = false;
 	if(badge_.getPosition() != Badge::Position::None)
 	{
 		const Image *badge_image = generateBadgeImage(render_control);
 		Image::Position badge_image_position = Image::Position::Bottom;
 		if(badge_.getPosition() == Badge::Position::Top) badge_image_position = Image::Position::Top;
-		image = Image::getComposedImage(image, badge_image, badge_image_position);
+		ImageLayers *image_layers_badge = new ImageLayers();
+		for(const auto &image_layer : *image_layers_)
+		{
+			Image *image_layer_badge = Image::getComposedImage(image_layer.second.image_, badge_image, badge_image_position);
+			image_layers_badge->set(image_layer.first, {image_layer_badge, image_layer.second.layer_});
+		}
 		delete badge_image;
-		if(!image)
+		owned = true;
+		return image_layers_badge;
+	}
+	else if(copy_images)
+	{
+		ImageLayers *image_layers_copy = new ImageLayers();
+		for(const auto &image_layer : *image_layers_)
 		{
-			Y_WARNING << name_ << ": Image could not be composed with badge and could not be saved." << YENDL;
-			return;
+			image_layers_copy->set(image_layer.first, {new Image(*image_layer.second.image_), image_layer.second.layer_});
 		}
+		owned = true;
+		return image_layers_copy;
 	}
+	else return image_layers_;
+}
+
+void ImageOutput::writeImageFile(const ImageFile &image_file, Format *format) const
+{
+	const std::string &filename = image_file.name_;
+	const Image *image = image_file.image_;
+	if(!image) return;
 
 	if(denoiseEnabled())
 	{
@@ -247,26 +329,42 @@ void ImageOutput::saveImageFile(const std::string &filename, const Layer::Type &
 		}
 		else format->saveAlphaChannelOnlyToFile(filename, image);
 	}
-	if(image != (*image_layers_)(layer_type).image_) delete image; //only delete the image if it's a postprocessed copy and not the original
+	if(image_file.owned_) delete image; //only delete the image if it's a postprocessed copy and not the original
 }
 
-void ImageOutput::saveImageFileMultiChannel(const std::string &filename, Format *format, const RenderControl &render_control)
+//! Queues a write for the background thread, waiting first if the queue is full to keep the memory used by the snapshots bounded
+void ImageOutput::enqueueWrite(const std::function<void()> &write)
 {
-	if(badge_.getPosition() != Badge::Position::None)
+	std::unique_lock<std::mutex> lock(writer_mutex_);
+	if(!writer_thread_.joinable()) writer_thread_ = std::thread(&ImageOutput::writerWorker, this);
+	writer_condition_.wait(lock, [this] { return pending_writes_.size() < max_pending_writes_; });
+	pending_writes_.push_back(write);
+	writer_condition_.notify_all();
+}
+
+void ImageOutput::waitForPendingWrites()
+{
+	std::unique_lock<std::mutex> lock(writer_mutex_);
+	writer_condition_.wait(lock, [this] { return pending_writes_.empty() && !writing_; });
+}
+
+void ImageOutput::writerWorker()
+{
+	std::unique_lock<std::mutex> lock(writer_mutex_);
+	while(true)
 	{
-		const Image *badge_image = generateBadgeImage(render_control);
-		Image::Position badge_image_position = Image::Position::Bottom;
-		if(badge_.getPosition() == Badge::Position::Top) badge_image_position = Image::Position::Top;
-		ImageLayers image_layers_badge;
-		for(const auto &image_layer : *image_layers_)
-		{
-			Image *image_layer_badge = Image::getComposedImage(image_layer.second.image_, badge_image, badge_image_position);
-			image_layers_badge.set(image_layer.first, {image_layer_badge, image_layer.second.layer_});
-		}
-		delete badge_image;
-		format->saveToFileMultiChannel(filename, &image_layers_badge);
+		writer_condition_.wait(lock, [this] { return writer_exit_ || !pending_writes_.empty(); });
+		if(pending_writes_.empty()) break;
+		const std::function<void()> write = pending_writes_.front();
+		pending_writes_.pop_front();
+		writing_ = true;
+		writer_condition_.notify_all();
+		lock.unlock();
+		write();
+		lock.lock();
+		writing_ = false;
+		writer_condition_.notify_all();
 	}
-	else format->saveToFileMultiChannel(filename, image_layers_);
 }
 
 std::string ImageOutput::printDenoiseParams() const
@@ -55,6 +55,19 @@ bool MemoryInputOutput::putPixel(int x, int y, const ColorLayer &color_layer)
 	return true;
 }
 
+bool MemoryInputOutput::putRow(int x, int y, int n_pixels, const Layer::Type &layer_type, const Rgba *colors)
+{
+	float *row_mem = image_mem_ + (x + width_ * y) * 4;
+	for(int i = 0; i < n_pixels; ++i)
+	{
+		row_mem[i * 4 + 0] = colors[i].r_;
+		row_mem[i * 4 + 1] = colors[i].g_;
+		row_mem[i * 4 + 2] = colors[i].b_;
+		row_mem[i * 4 + 3] = colors[i].a_;
+	}
+	return true;
+}
+
 void MemoryInputOutput::flush(const RenderControl &render_control) { }
 
 END_YAFARAY
@@ -17,7 +17,10 @@
  */
 
 #include "photon/hashgrid.h"
-#include "photon/photon.h"
+#include "common/logger.h"
+#include <algorithm>
+#include <thread>
+#include <functional>
 
 BEGIN_YAFARAY
 
@@ -29,73 +32,135 @@ HashGrid::HashGrid(double cell_size, unsigned int grid_size, yafaray4::Bound b_b
 
 void HashGrid::setParm(double cell_size, unsigned int grid_size, Bound b_box)
 {
-	cell_size = cell_size;
+	cell_size_ = cell_size;
 	inv_cell_size_ = 1. / cell_size;
 	grid_size_ = grid_size;
 	bounding_box_ = b_box;
+	cell_start_.clear();
 }
 
 void HashGrid::clear()
 {
 	photons_.clear();
+	cell_start_.clear();
 }
 
-void HashGrid::pushPhoton(Photon &p)
+void HashGrid::pushPhoton(const Photon &p)
 {
 	photons_.push_back(p);
 }
 
+void HashGrid::appendVector(const std::vector<Photon> &photons)
+{
+	std::lock_guard<std::mutex> lock(mutx_);
+	photons_.insert(photons_.end(), photons.begin(), photons.end());
+}
 
-void HashGrid::updateGrid()
+inline unsigned int HashGrid::cellHash(const Point3 &p) const
 {
+	const Point3 hashindex = (p - bounding_box_.a_) * inv_cell_size_;
+	return hash(abs(int(hashindex.x_)), abs(int(hashindex.y_)), abs(int(hashindex.z_)));
+}
 
-	if(!hash_grid_)
+/*! Counting sort of the photons by cell. Each thread owns a contiguous
+	range of cells: first each thread counts the photons of its part of the
+	photons going to the range of each thread, and moves their indices to
+	be grouped by range. Then each thread sorts the photons of its range by
+	cell, so the work is proportional to the photons plus the cells and
+	does not grow with the number of threads. The result does not depend on
+	the number of threads, as the photons of each cell keep the order they
+	were added */
+void HashGrid::updateGrid(int num_threads)
+{
+	if(grid_size_ == 0) return;
+	const size_t n_photons = photons_.size();
+	if(n_photons < 65536) num_threads = 1; //not worth starting threads
+	num_threads = std::max(1, num_threads);
+
+	unsorted_photons_.swap(photons_);
+	photons_.resize(n_photons);
+	photon_cells_.resize(n_photons);
+	range_photons_.resize(n_photons);
+	cell_positions_.resize(grid_size_);
+	cell_start_.resize(grid_size_ + 1);
+
+	auto run_threads = [num_threads](const std::function<void(int)> &work)
+	{
+		std::vector<std::thread> threads;
+		for(int i = 1; i < num_threads; ++i) threads.push_back(std::thread(work, i));
+		work(0);
+		for(auto &t : threads) t.join();
+	};
+	const size_t photons_per_thread = (n_photons + num_threads - 1) / num_threads;
+	const unsigned int cells_per_thread = (grid_size_ + num_threads - 1) / num_threads;
+	//photons going to the range of cells of each thread found by each thread, then their write positions
+	std::vector<unsigned int> thread_range_counts(static_cast<size_t>(num_threads) * num_threads, 0);
+
+	run_threads([&](int thread_id)
 	{
-		hash_grid_ = new std::list<Photon *> *[grid_size_];
+		unsigned int *counts = &thread_range_counts[static_cast<size_t>(thread_id) * num_threads];
+		const size_t end = std::min(n_photons, (thread_id + 1) * photons_per_thread);
+		for(size_t i = thread_id * photons_per_thread; i < end; ++i)
+		{
+			photon_cells_[i] = cellHash(unsorted_photons_[i].pos_);
+			++counts[photon_cells_[i] / cells_per_thread];
+		}
+	});
 
-		for(unsigned int i = 0; i < grid_size_; ++i)
-			hash_grid_[i] = nullptr;
-	}
-	else
+	std::vector<unsigned int> range_start(num_threads + 1, 0);
+	unsigned int position = 0;
+	for(int r = 0; r < num_threads; ++r)
 	{
-		for(unsigned int i = 0; i < grid_size_; ++i)
+		range_start[r] = position;
+		for(int t = 0; t < num_threads; ++t)
 		{
-			if(hash_grid_[i])
-			{
-				//delete hashGrid[i];
-				hash_grid_[i]->clear(); // fix me! too many time consumed here
-				//hashGrid[i] = nullptr;
-			}
+			unsigned int &count = thread_range_counts[static_cast<size_t>(t) * num_threads + r];
+			const unsigned int thread_photons = count;
+			count = position;
+			position += thread_photons;
 		}
 	}
+	range_start[num_threads] = n_photons;
 
-	//travel the vector to build the Grid
-	for(auto itr = photons_.begin(); itr != photons_.end(); ++itr)
+	run_threads([&](int thread_id)
 	{
-		Point3 hashindex  = ((*itr).pos_ - bounding_box_.a_) * inv_cell_size_;
-
-		int ix = abs(int(hashindex.x_));
-		int iy = abs(int(hashindex.y_));
-		int iz = abs(int(hashindex.z_));
+		unsigned int *positions = &thread_range_counts[static_cast<size_t>(thread_id) * num_threads];
+		const size_t end = std::min(n_photons, (thread_id + 1) * photons_per_thread);
+		for(size_t i = thread_id * photons_per_thread; i < end; ++i) range_photons_[positions[photon_cells_[i] / cells_per_thread]++] = i;
+	});
 
-		unsigned int index = hash(ix, iy, iz);
-
-		if(hash_grid_[index] == nullptr)
-			hash_grid_[index] = new std::list<Photon *>();
+	std::vector<unsigned int> range_unused(num_threads, 0);
+	run_threads([&](int thread_id)
+	{
+		const unsigned int first_cell = std::min(grid_size_, thread_id * cells_per_thread);
+		const unsigned int end_cell = std::min(grid_size_, (thread_id + 1) * cells_per_thread);
+		std::fill(cell_positions_.begin() + first_cell, cell_positions_.begin() + end_cell, 0);
+		for(unsigned int j = range_start[thread_id]; j < range_start[thread_id + 1]; ++j) ++cell_positions_[photon_cells_[range_photons_[j]]];
+		unsigned int position = range_start[thread_id];
+		for(unsigned int c = first_cell; c < end_cell; ++c)
+		{
+			const unsigned int cell_photons = cell_positions_[c];
+			if(cell_photons == 0) ++range_unused[thread_id];
+			cell_start_[c] = cell_positions_[c] = position;
+			position += cell_photons;
+		}
+		for(unsigned int j = range_start[thread_id]; j < range_start[thread_id + 1]; ++j)
+		{
+			const unsigned int photon = range_photons_[j];
+			photons_[cell_positions_[photon_cells_[photon]]++] = unsorted_photons_[photon];
+		}
+	});
+	cell_start_[grid_size_] = n_photons;
 
-		hash_grid_[index]->push_front(&(*itr));
-	}
 	unsigned int notused = 0;
-	for(unsigned int i = 0; i < grid_size_; ++i)
-	{
-		if(!hash_grid_[i] || hash_grid_[i]->size() == 0) notused++;
-	}
-	Y_VERBOSE << "HashGrid: there are " << notused << " enties not used!" << std::endl;
+	for(const auto &unused : range_unused) notused += unused;
+	Y_VERBOSE << "HashGrid: there are " << notused << " enties not used!" << YENDL;
 }
 
-unsigned int HashGrid::gather(const Point3 &p, FoundPhoton *found, unsigned int k, float sq_radius)
+unsigned int HashGrid::gather(const Point3 &p, FoundPhoton *found, unsigned int k, float sq_radius) const
 {
 	unsigned int count = 0;
+	if(cell_start_.empty()) return count;
 	float radius = math::sqrt(sq_radius);
 
 	Point3 rad(radius, radius, radius);
@@ -108,15 +173,13 @@ unsigned int HashGrid::gather(const Point3 &p, FoundPhoton *found, unsigned int
 		{
 			for(int ix = abs(int(b_min.x_)); ix <= abs(int(b_max.x_)); ix++)
 			{
-				int hv = hash(ix, iy, iz);
-
-				if(hash_grid_[hv] == nullptr) continue;
-
-				for(auto itr = hash_grid_[hv]->begin(); itr != hash_grid_[hv]->end(); ++itr)
+				const unsigned int hv = hash(ix, iy, iz);
+				for(unsigned int i = cell_start_[hv]; i < cell_start_[hv + 1]; ++i)
 				{
-					if(((*itr)->pos_ - p).lengthSqr() < sq_radius)
+					if((photons_[i].pos_ - p).lengthSqr() < sq_radius)
 					{
-						found[count++] = FoundPhoton((*itr), sq_radius);
+						found[count++] = FoundPhoton(&photons_[i], sq_radius);
+						if(count == k) return count; //the found array is full
 					}
 				}
 			}
@@ -125,4 +188,4 @@ unsigned int HashGrid::gather(const Point3 &p, FoundPhoton *found, unsigned int
 	return count;
 }
 
-END_YAFARAY
\ No newline at end of file
+END_YAFARAY
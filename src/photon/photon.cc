@@ -18,17 +18,51 @@
 
 #include "photon/photon.h"
 #include "common/file.h"
+#include <cstring>
 
 BEGIN_YAFARAY
 
-PhotonGather::PhotonGather(uint32_t mp, const Point3 &p): p_(p)
+// ============================================================
+/*!
+	Octahedral direction encoding: the direction is projected on
+	the octahedron |x| + |y| + |z| = 1, whose lower half is folded
+	over the upper half, and the resulting square is quantized
+	with 16 bits per coordinate
+*/
+
+inline float signNotZero__(float v) { return v >= 0.f ? 1.f : -1.f; }
+
+uint32_t CompactPhoton::encodeDirection(const Vec3 &dir)
+{
+	const float inv_norm = 1.f / (std::abs(dir.x_) + std::abs(dir.y_) + std::abs(dir.z_));
+	float u = dir.x_ * inv_norm;
+	float v = dir.y_ * inv_norm;
+	if(dir.z_ < 0.f)
+	{
+		const float u_folded = (1.f - std::abs(v)) * signNotZero__(u);
+		v = (1.f - std::abs(u)) * signNotZero__(v);
+		u = u_folded;
+	}
+	const uint32_t u_quantized = static_cast<uint32_t>(math::roundToInt((u * 0.5f + 0.5f) * 65535.f));
+	const uint32_t v_quantized = static_cast<uint32_t>(math::roundToInt((v * 0.5f + 0.5f) * 65535.f));
+	return u_quantized | (v_quantized << 16);
+}
+
+Vec3 CompactPhoton::decodeDirection(uint32_t oct)
 {
-	photons_ = 0;
-	n_lookup_ = mp;
-	found_photons_ = 0;
+	const float u = static_cast<float>(oct & 0xFFFF) * (2.f / 65535.f) - 1.f;
+	const float v = static_cast<float>(oct >> 16) * (2.f / 65535.f) - 1.f;
+	Vec3 dir(u, v, 1.f - std::abs(u) - std::abs(v));
+	if(dir.z_ < 0.f)
+	{
+		dir.x_ = (1.f - std::abs(v)) * signNotZero__(u);
+		dir.y_ = (1.f - std::abs(u)) * signNotZero__(v);
+	}
+	return dir.normalize();
 }
 
-void PhotonGather::operator()(const Photon *photon, float dist_2, float &max_dist_squared) const
+template <class T>
+void PhotonGather::operator()(const T *photon, float dist_2, float &max_dist_squared) const
 {
 	// Do usual photon heap management
 	if(found_photons_ < n_lookup_)
@@ -43,18 +77,171 @@ void PhotonGather::operator()(const Photon *photon, float dist_2, float &max_dis
 	}
 	else
 	{
-		// Remove most distant photon from heap and add new photon
-		std::pop_heap(&photons_[0], &photons_[n_lookup_]);
-		photons_[n_lookup_ - 1] = FoundPhoton(photon, dist_2);
-		std::push_heap(&photons_[0], &photons_[n_lookup_]);
+		// Replace the most distant photon at the top of the heap with the new photon, which is closer, and sift it down
+		uint32_t parent = 0;
+		uint32_t child = 1;
+		while(child < n_lookup_)
+		{
+			if(child + 1 < n_lookup_ && photons_[child] < photons_[child + 1]) ++child;
+			if(!(dist_2 < photons_[child].dist_square_)) break;
+			photons_[parent] = photons_[child];
+			parent = child;
+			child = 2 * parent + 1;
+		}
+		photons_[parent] = FoundPhoton(photon, dist_2);
 		max_dist_squared = photons_[0].dist_square_;
 	}
 }
 
+// ============================================================
+/*!
+	Photon map files store the photons and the nodes of their
+	built kd-tree as contiguous arrays, so a loaded map is used
+	directly from the read-only mapped file without reading the
+	photons one by one or building the tree again. The data is
+	stored in the native byte order, the header allows rejecting
+	files written with a different layout.
+*/
+
+struct PhotonMapFileHeader
+{
+	char magic_[8];
+	uint32_t version_;
+	uint32_t header_size_;
+	uint32_t photon_layout_; //!< 0: Photon, 1: CompactPhoton
+	uint32_t photon_size_;
+	uint32_t node_size_;
+	uint32_t n_photons_;
+	uint32_t n_nodes_;
+	uint32_t bucket_size_; //!< maximum number of photons in the kd-tree leaves
+	int32_t paths_;
+	float search_radius_;
+};
+
+static constexpr char photon_map_file_magic__[8] = {'Y', 'A', 'F', 'P', 'H', 'M', 'A', 'P'};
+static constexpr uint32_t photon_map_file_version__ = 2;
+
+//! Creates a tree using the photons, nodes and leaf arrays of a mapped file, if the file contains them with the layout of this build
+template <class T>
+static kdtree::PointKdTree<T> *mappedTree__(const MappedFile &file, const PhotonMapFileHeader &header)
+{
+	const uint64_t n_photons = header.n_photons_;
+	if(header.photon_size_ != sizeof(T) || header.node_size_ != sizeof(kdtree::KdNode<T>) || header.bucket_size_ != kdtree::PointKdTree<T>::bucket_size_
+	   || file.size() != sizeof(PhotonMapFileHeader) + n_photons * sizeof(T) + header.n_nodes_ * sizeof(kdtree::KdNode<T>) + n_photons * (sizeof(uint32_t) + 3 * sizeof(float))) return nullptr;
+	const T *photons = reinterpret_cast<const T *>(file.data() + sizeof(PhotonMapFileHeader));
+	const kdtree::KdNode<T> *nodes = reinterpret_cast<const kdtree::KdNode<T> *>(photons + n_photons);
+	const uint32_t *leaf_elements = reinterpret_cast<const uint32_t *>(nodes + header.n_nodes_);
+	const float *leaf_positions = reinterpret_cast<const float *>(leaf_elements + n_photons);
+	if(!kdtree::PointKdTree<T>::validTree(nodes, header.n_nodes_, leaf_elements, header.n_photons_)) return nullptr;
+	return new kdtree::PointKdTree<T>(photons, header.n_photons_, nodes, header.n_nodes_, leaf_elements, leaf_positions);
+}
+
+template <class T>
+static bool appendTree__(File &file, const kdtree::PointKdTree<T> *tree)
+{
+	if(!tree) return true;
+	return file.append(reinterpret_cast<const char *>(tree->elements()), tree->nElements() * sizeof(T))
+		   && file.append(reinterpret_cast<const char *>(tree->nodes()), tree->nNodes() * sizeof(kdtree::KdNode<T>))
+		   && file.append(reinterpret_cast<const char *>(tree->leafElements()), tree->nElements() * sizeof(uint32_t))
+		   && file.append(reinterpret_cast<const char *>(tree->leafPositions()), 3 * tree->nElements() * sizeof(float));
+}
+
+int PhotonMap::nPhotons() const
+{
+	if(compact_) return compact_tree_ ? compact_tree_->nElements() : compact_photons_.size();
+	else return tree_ ? tree_->nElements() : photons_.size();
+}
+
+void PhotonMap::pushPhoton(Photon &p)
+{
+	if(compact_) compact_photons_.push_back(p);
+	else photons_.push_back(p);
+	updated_ = false;
+}
+
+void PhotonMap::swapVector(std::vector<Photon> &vec)
+{
+	if(compact_) compact_photons_.assign(vec.begin(), vec.end());
+	else photons_.swap(vec);
+	updated_ = false;
+}
+
+void PhotonMap::appendVector(std::vector<Photon> &vec, unsigned int curr)
+{
+	if(compact_) compact_photons_.insert(std::end(compact_photons_), std::begin(vec), std::end(vec));
+	else photons_.insert(std::end(photons_), std::begin(vec), std::end(vec));
+	updated_ = false;
+	paths_ += curr;
+}
+
+void PhotonMap::reserveMemory(size_t num_photons)
+{
+	if(compact_) compact_photons_.reserve(num_photons);
+	else photons_.reserve(num_photons);
+}
+
+void PhotonMap::clear()
+{
+	photons_.clear();
+	compact_photons_.clear();
+	delete tree_;
+	tree_ = nullptr;
+	delete compact_tree_;
+	compact_tree_ = nullptr;
+	delete mapped_file_; //after the trees, which could be using the mapped photons and nodes
+	mapped_file_ = nullptr;
+	updated_ = false;
+}
+
 bool PhotonMap::load(const std::string &filename)
 {
 	clear();
 
+	if(!File::exists(filename, true))
+	{
+		Y_WARNING << "PhotonMap file '" << filename << "' not found, aborting load operation";
+		return false;
+	}
+	auto *file = new MappedFile(filename);
+	if(!file->isMapped() || file->size() < sizeof(photon_map_file_magic__) || std::memcmp(file->data(), photon_map_file_magic__, sizeof(photon_map_file_magic__)) != 0)
+	{
+		delete file;
+		return loadLegacy(filename);
+	}
+	PhotonMapFileHeader header;
+	bool valid = file->size() >= sizeof(PhotonMapFileHeader);
+	if(valid)
+	{
+		std::memcpy(&header, file->data(), sizeof(PhotonMapFileHeader));
+		valid = header.version_ == photon_map_file_version__ && header.header_size_ == sizeof(PhotonMapFileHeader) && header.photon_layout_ <= 1;
+	}
+	if(valid && header.n_photons_ == 0) valid = file->size() == sizeof(PhotonMapFileHeader);
+	else if(valid)
+	{
+		if(header.photon_layout_ == 1) valid = (compact_tree_ = mappedTree__<CompactPhoton>(*file, header));
+		else valid = (tree_ = mappedTree__<Photon>(*file, header));
+	}
+	if(!valid)
+	{
+		Y_WARNING << "PhotonMap file '" << filename << "' is not a valid YafaRay photon map or was saved with a different version or platform" << YENDL;
+		delete file;
+		return false;
+	}
+	compact_ = (header.photon_layout_ == 1);
+	paths_ = header.paths_;
+	search_radius_ = header.search_radius_;
+	if(header.n_photons_ > 0)
+	{
+		mapped_file_ = file;
+		updated_ = true;
+	}
+	else delete file;
+	return true;
+}
+
+//! Loads the photon maps saved by older versions, which only contain the photons and need building the tree again
+bool PhotonMap::loadLegacy(const std::string &filename)
+{
 	File file(filename);
 	if(!file.open("rb"))
 	{
@@ -88,88 +275,85 @@ bool PhotonMap::load(const std::string &filename)
 	}
 	file.close();
 
+	compact_ = false;
 	updateTree();
 	return true;
 }
 
 bool PhotonMap::save(const std::string &filename) const
 {
-	File file(filename);
-	file.open("wb");
-	file.append(std::string("YAF_PHOTONMAPv1"));
-	file.append(name_);
-	file.append<int>(paths_);
-	file.append<float>(search_radius_);
-	file.append<int>(threads_pkd_tree_);
-	file.append<unsigned int>((unsigned int) photons_.size());
-	for(const auto &p : photons_)
+	PhotonMapFileHeader header;
+	std::memset(&header, 0, sizeof(PhotonMapFileHeader));
+	std::memcpy(header.magic_, photon_map_file_magic__, sizeof(photon_map_file_magic__));
+	header.version_ = photon_map_file_version__;
+	header.header_size_ = sizeof(PhotonMapFileHeader);
+	header.photon_layout_ = compact_ ? 1 : 0;
+	header.photon_size_ = compact_ ? sizeof(CompactPhoton) : sizeof(Photon);
+	header.node_size_ = compact_ ? sizeof(kdtree::KdNode<CompactPhoton>) : sizeof(kdtree::KdNode<Photon>);
+	header.bucket_size_ = compact_ ? kdtree::PointKdTree<CompactPhoton>::bucket_size_ : kdtree::PointKdTree<Photon>::bucket_size_;
+	if(updated_)
 	{
-		file.append<float>(p.pos_.x_);
-		file.append<float>(p.pos_.y_);
-		file.append<float>(p.pos_.z_);
-		file.append<float>(p.c_.r_);
-		file.append<float>(p.c_.g_);
-		file.append<float>(p.c_.b_);
+		header.n_photons_ = compact_ ? compact_tree_->nElements() : tree_->nElements();
+		header.n_nodes_ = compact_ ? compact_tree_->nNodes() : tree_->nNodes();
 	}
-	file.close();
-	return true;
+	header.paths_ = paths_;
+	header.search_radius_ = search_radius_;
+	//written through a temporary file, so an interrupted save never leaves an incomplete map that could be loaded later
+	const std::string tmp_filename = filename + ".tmp";
+	File file(tmp_filename);
+	if(!file.open("wb")) return false;
+	bool result = file.append(reinterpret_cast<const char *>(&header), sizeof(PhotonMapFileHeader));
+	if(updated_) result &= compact_ ? appendTree__(file, compact_tree_) : appendTree__(file, tree_);
+	result &= file.close() == 0;
+	if(result) result = File::rename(tmp_filename, filename, true, true);
+	else File::remove(tmp_filename, true);
+	return result;
 }
 
 void PhotonMap::updateTree()
 {
-	if(tree_) delete tree_;
-	if(photons_.size() > 0)
-	{
-		tree_ = new kdtree::PointKdTree<Photon>(photons_, name_, threads_pkd_tree_);
-		updated_ = true;
-	}
-	else tree_ = 0;
+	delete tree_;
+	tree_ = nullptr;
+	delete compact_tree_;
+	compact_tree_ = nullptr;
+	if(compact_ && compact_photons_.size() > 0) compact_tree_ = new kdtree::PointKdTree<CompactPhoton>(compact_photons_, name_, threads_pkd_tree_);
+	else if(!compact_ && photons_.size() > 0) tree_ = new kdtree::PointKdTree<Photon>(photons_, name_, threads_pkd_tree_);
+	updated_ = (tree_ || compact_tree_);
 }
 
 int PhotonMap::gather(const Point3 &p, FoundPhoton *found, unsigned int k, float &sq_radius) const
 {
-	PhotonGather proc(k, p);
-	proc.photons_ = found;
-	tree_->lookup(p, proc, sq_radius);
+	PhotonGather proc(k, found);
+	if(compact_) compact_tree_->lookup(p, proc, sq_radius);
+	else tree_->lookup(p, proc, sq_radius);
 	return proc.found_photons_;
 }
 
-const Photon *PhotonMap::findNearest(const Point3 &p, const Vec3 &n, float dist) const
-{
-	NearestPhoton proc(p, n);
-	//float dist=std::numeric_limits<float>::infinity(); //really bad idea...
-	tree_->lookup(p, proc, dist);
-	return proc.nearest_;
-}
-
-#ifdef SMALL_PHOTONS
-DirConverter dirconverter__;
-
-DirConverter::DirConverter()
+void PhotonMap::gather(const Point3 *points, uint32_t n_points, FoundPhoton *found, int *n_found, unsigned int k, float *sq_radius) const
 {
-	for(int i = 0; i < 255; ++i)
+	constexpr uint32_t max_batch_size = 32;
+	for(uint32_t batch_start = 0; batch_start < n_points; batch_start += max_batch_size)
 	{
-		float angle = (float)i * c_inv_255_ratio_;
-		costheta_[i] = math::cos(angle);
-		sintheta_[i] = math::sin(angle);
-	}
-	for(int i = 0; i < 256; ++i)
-	{
-		float angle = (float)i * c_inv_256_ratio_;
-		cosphi_[i] = math::cos(angle);
-		sinphi_[i] = math::sin(angle);
+		const uint32_t batch_size = std::min(max_batch_size, n_points - batch_start);
+		PhotonGather procs[max_batch_size];
+		for(uint32_t i = 0; i < batch_size; ++i)
+		{
+			procs[i].n_lookup_ = k;
+			procs[i].photons_ = found + (batch_start + i) * k;
+		}
+		if(compact_) compact_tree_->lookup(points + batch_start, procs, sq_radius + batch_start, batch_size);
+		else tree_->lookup(points + batch_start, procs, sq_radius + batch_start, batch_size);
+		for(uint32_t i = 0; i < batch_size; ++i) n_found[batch_start + i] = procs[i].found_photons_;
 	}
 }
 
-std::pair<unsigned char, unsigned char> DirConverter::convert(const Vec3 &dir) {
-	int t = (int)(math::acos(dir.z_) * c_255_ratio_);
-	int p = (int)(atan2(dir.y_, dir.x_) * c_256_ratio_);
-	if(t > 254) t = 254;
-	else if(t < 0) t = 0;
-	if(p > 255) p = 255;
-	else if(p < 0) p += 256;
-	return std::pair<unsigned char, unsigned char>(t, p);
+FoundPhoton PhotonMap::findNearest(const Point3 &p, const Vec3 &n, float dist) const
+{
+	NearestPhoton proc(p, n);
+	//float dist=std::numeric_limits<float>::infinity(); //really bad idea...
+	if(compact_) compact_tree_->lookup(p, proc, dist);
+	else tree_->lookup(p, proc, dist);
+	return proc.nearest_;
 }
-#endif // SMALL_PHOTONS
 
 END_YAFARAY
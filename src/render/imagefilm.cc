@@ -33,11 +33,17 @@
 #include "color/color_layers.h"
 #include "math/filter.h"
 #include "math/interpolation.h"
+#include <atomic>
+#include <cstring>
 
 #ifdef HAVE_OPENCV
 #include <opencv2/photo/photo.hpp>
 #endif
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 BEGIN_YAFARAY
 
 static constexpr int filter_table_size__ = 16;
@@ -75,6 +81,7 @@ ImageFilm *ImageFilm::factory(const ParamMap &params, Scene *scene)
 	params.getParam("images_autosave_interval_seconds", images_autosave_params.interval_seconds_);
 	params.getParam("film_load_save_mode", film_load_save_mode_str);
 	params.getParam("film_load_save_path", film_load_save.path_);
+	params.getParam("film_save_compression", film_load_save.compression_);
 	params.getParam("film_autosave_interval_type", film_autosave_interval_type_str);
 	params.getParam("film_autosave_interval_passes", film_load_save.auto_save_.interval_passes_);
 	params.getParam("film_autosave_interval_seconds", film_load_save.auto_save_.interval_seconds_);
@@ -170,6 +177,7 @@ ImageFilm::ImageFilm (int width, int height, int xstart, int ystart, int num_thr
 	}
 
 	table_scale_ = 0.9999 * filter_table_size__ / filterw_;
+	density_rows_mutexes_ = std::unique_ptr<std::mutex[]>(new std::mutex[(height_ + density_rows_per_mutex_ - 1) / density_rows_per_mutex_]);
 	area_cnt_ = 0;
 
 	progress_bar_ = new ConsoleProgressBar(80);
@@ -186,6 +194,7 @@ ImageFilm::~ImageFilm()
 {
 	for(auto &it : image_layers_) delete(it.second.image_);
 	if(density_image_) delete density_image_;
+	if(moments_) delete moments_;
 	delete[] filter_table_;
 	if(splitter_) delete splitter_;
 	if(progress_bar_) delete progress_bar_; //remove when pbar no longer created by imageFilm_t!!
@@ -206,10 +215,13 @@ void ImageFilm::init(RenderControl &render_control, int num_passes)
 		else density_image_->clear();
 	}
 
+	// Clear the brightness moments of the pixels
+	if(moments_) moments_->clear();
+
 	// Setup the bucket splitter
 	if(split_)
 	{
-		next_area_ = 0;
+		if(splitter_) delete splitter_;
 		splitter_ = new ImageSplitter(width_, height_, cx_0_, cy_0_, tile_size_, tiles_order_, num_threads_);
 		area_cnt_ = splitter_->size();
 	}
@@ -219,6 +231,7 @@ void ImageFilm::init(RenderControl &render_control, int num_passes)
 	render_control.setCurrentPassPercent(progress_bar_->getPercent());
 
 	abort_ = false;
+	area_taken_ = false;
 	completed_cnt_ = 0;
 	n_pass_ = 1;
 	n_passes_ = num_passes;
@@ -241,9 +254,8 @@ void ImageFilm::init(RenderControl &render_control, int num_passes)
 
 int ImageFilm::nextPass(const RenderView *render_view, RenderControl &render_control, bool adaptive_aa, std::string integrator_name, bool skip_nrender_layer)
 {
-	splitter_mutex_.lock();
-	next_area_ = 0;
-	splitter_mutex_.unlock();
+	if(splitter_) splitter_->resetQueues();
+	area_taken_ = false;
 	n_pass_++;
 	images_auto_save_params_.pass_counter_++;
 	film_load_save_.auto_save_.pass_counter_++;
@@ -273,153 +285,75 @@ int ImageFilm::nextPass(const RenderView *render_view, RenderControl &render_con
 
 	Image *sampling_factor_image_pass = image_layers_(Layer::DebugSamplingFactor).image_;
 
-	if(n_pass_ == 0) flags_.fill(true);
-	else flags_.fill(false);
 	ColorLayers color_layers(layers_);
-	int variance_half_edge = aa_noise_params_.variance_edge_size_ / 2;
-
-	float aa_thresh_scaled = aa_noise_params_.threshold_;
 
 	int n_resample = 0;
 
-	if(adaptive_aa && aa_noise_params_.threshold_ > 0.f)
+	const bool convergence_resampling = convergenceResampling();
+
+	if(adaptive_aa && (convergence_resampling || aa_noise_params_.threshold_ > 0.f))
 	{
-		for(int y = 0; y < height_ - 1; ++y)
-		{
-			for(int x = 0; x < width_ - 1; ++x)
-			{
-				flags_.set(x, y, false);
-			}
-		}
+		g_timer__.addEvent("aaNoiseDetection");
+		g_timer__.start("aaNoiseDetection");
 
-		for(int y = 0; y < height_ - 1; ++y)
+		int num_threads = 1;
+		if(convergence_resampling) n_resample = detectUnconvergedPixels();
+		else
 		{
-			for(int x = 0; x < width_ - 1; ++x)
+			//The image is processed in bands of columns, which are contiguous in the image buffers. Each band only writes its own flags, so the bands can be processed by several threads at the same time
+			const int num_bands = (width_ + aa_noise_band_width_ - 1) / aa_noise_band_width_;
+			std::atomic<int> next_band {0};
+			std::atomic<int> n_flagged {0};
+			auto detect_bands = [&]()
 			{
-				//We will only consider the Combined Pass (pass 0) for the AA additional sampling calculations.
-				const float weight = weights_(x, y).getFloat();
-				if(weight <= 0.f) flags_.set(x, y, true);	//If after reloading ImageFiles there are pixels that were not yet rendered at all, make sure they are marked to be rendered in the next AA pass
-
-				float mat_sample_factor = 1.f;
-				if(sampling_factor_image_pass)
+				AaNoiseBandData band_data;
+				int band_flagged = 0;
+				for(int band = next_band++; band < num_bands; band = next_band++)
 				{
-					mat_sample_factor = (weight == 0.f) ? 0.f : sampling_factor_image_pass->getFloat(x, y) / weight;
-					if(!background_resampling_ && mat_sample_factor == 0.f) continue;
+					const int x_0 = band * aa_noise_band_width_;
+					band_flagged += detectAaNoise(x_0, std::min(width_, x_0 + aa_noise_band_width_), band_data);
 				}
+				n_flagged += band_flagged;
+			};
+			num_threads = std::max(1, std::min(num_threads_, num_bands));
+			std::vector<std::thread> threads;
+			for(int i = 1; i < num_threads; ++i) threads.push_back(std::thread(detect_bands));
+			detect_bands();
+			for(auto &t : threads) t.join();
+			n_resample = n_flagged;
+		}
 
-				Rgba pix_col = image_layers_(Layer::Combined).image_->getColor(x, y).normalized(weight);
-				float pix_col_bri = pix_col.abscol2Bri();
-
-				if(aa_noise_params_.dark_detection_type_ == AaNoiseParams::DarkDetectionType::Linear && aa_noise_params_.dark_threshold_factor_ > 0.f)
-				{
-					if(aa_noise_params_.dark_threshold_factor_ > 0.f) aa_thresh_scaled = aa_noise_params_.threshold_ * ((1.f - aa_noise_params_.dark_threshold_factor_) + (pix_col_bri * aa_noise_params_.dark_threshold_factor_));
-				}
-				else if(aa_noise_params_.dark_detection_type_ == AaNoiseParams::DarkDetectionType::Curve)
-				{
-					aa_thresh_scaled = darkThresholdCurveInterpolate(pix_col_bri);
-				}
+		g_timer__.stop("aaNoiseDetection");
+		Y_VERBOSE << "imageFilm: AA noise detection for pass " << n_pass_ << " took " << g_timer__.getTime("aaNoiseDetection") << "s (" << num_threads << " threads)" << YENDL;
 
-				if(pix_col.colorDifference(image_layers_(Layer::Combined).image_->getColor(x + 1, y).normalized(weights_(x + 1, y).getFloat()), aa_noise_params_.detect_color_noise_) >= aa_thresh_scaled)
-				{
-					flags_.set(x, y, true); flags_.set(x + 1, y, true);
-				}
-				if(pix_col.colorDifference(image_layers_(Layer::Combined).image_->getColor(x, y + 1).normalized(weights_(x, y + 1).getFloat()), aa_noise_params_.detect_color_noise_) >= aa_thresh_scaled)
-				{
-					flags_.set(x, y, true); flags_.set(x, y + 1, true);
-				}
-				if(pix_col.colorDifference(image_layers_(Layer::Combined).image_->getColor(x + 1, y + 1).normalized(weights_(x + 1, y + 1).getFloat()), aa_noise_params_.detect_color_noise_) >= aa_thresh_scaled)
-				{
-					flags_.set(x, y, true); flags_.set(x + 1, y + 1, true);
-				}
-				if(x > 0 && pix_col.colorDifference(image_layers_(Layer::Combined).image_->getColor(x - 1, y + 1).normalized(weights_(x - 1, y + 1).getFloat()), aa_noise_params_.detect_color_noise_) >= aa_thresh_scaled)
-				{
-					flags_.set(x, y, true); flags_.set(x - 1, y + 1, true);
-				}
-
-				if(aa_noise_params_.variance_pixels_ > 0)
+		if(session__.isInteractive() && show_mask_)
+		{
+			for(int y = 0; y < height_; ++y)
+			{
+				for(int x = 0; x < width_; ++x)
 				{
-					int variance_x = 0, variance_y = 0;//, pixelcount = 0;
-
-					//float window_accum = 0.f, window_avg = 0.f;
-
-					for(int xd = -variance_half_edge; xd < variance_half_edge - 1 ; ++xd)
+					if(!flags_.get(x, y)) continue;
+					float mat_sample_factor = 1.f;
+					const float weight = weights_(x, y).getFloat();
+					if(sampling_factor_image_pass)
 					{
-						int xi = x + xd;
-						if(xi < 0) xi = 0;
-						else if(xi >= width_ - 1) xi = width_ - 2;
-
-						Rgba cx_0 = image_layers_(Layer::Combined).image_->getColor(xi, y).normalized(weights_(xi, y).getFloat());
-						Rgba cx_1 = image_layers_(Layer::Combined).image_->getColor(xi + 1, y).normalized(weights_(xi + 1, y).getFloat());
-
-						if(cx_0.colorDifference(cx_1, aa_noise_params_.detect_color_noise_) >= aa_thresh_scaled) ++variance_x;
+						mat_sample_factor = (weight == 0.f) ? 0.f : sampling_factor_image_pass->getFloat(x, y) / weight;
+						if(!background_resampling_ && mat_sample_factor == 0.f) continue;
 					}
 
-					for(int yd = -variance_half_edge; yd < variance_half_edge - 1 ; ++yd)
+					for(const auto &it : image_layers_)
 					{
-						int yi = y + yd;
-						if(yi < 0) yi = 0;
-						else if(yi >= height_ - 1) yi = height_ - 2;
-
-						Rgba cy_0 = image_layers_(Layer::Combined).image_->getColor(x, yi).normalized(weights_(x, yi).getFloat());
-						Rgba cy_1 = image_layers_(Layer::Combined).image_->getColor(x, yi + 1).normalized(weights_(x, yi + 1).getFloat());
+						Rgb pix = it.second.image_->getColor(x, y).normalized(weight);
+						float pix_col_bri = pix.abscol2Bri();
 
-						if(cy_0.colorDifference(cy_1, aa_noise_params_.detect_color_noise_) >= aa_thresh_scaled) ++variance_y;
+						if(pix.r_ < pix.g_ && pix.r_ < pix.b_)
+							color_layers(it.first).color_.set(0.7f, pix_col_bri, mat_sample_factor > 1.f ? 0.7f : pix_col_bri, 1.f);
+						else
+							color_layers(it.first).color_.set(pix_col_bri, 0.7f, mat_sample_factor > 1.f ? 0.7f : pix_col_bri, 1.f);
 					}
-
-					if(variance_x + variance_y >= aa_noise_params_.variance_pixels_)
-					{
-						for(int xd = -variance_half_edge; xd < variance_half_edge; ++xd)
-						{
-							for(int yd = -variance_half_edge; yd < variance_half_edge; ++yd)
-							{
-								int xi = x + xd;
-								if(xi < 0) xi = 0;
-								else if(xi >= width_) xi = width_ - 1;
-
-								int yi = y + yd;
-								if(yi < 0) yi = 0;
-								else if(yi >= height_) yi = height_ - 1;
-
-								flags_.set(xi, yi, true);
-							}
-						}
-					}
-				}
-			}
-		}
-
-		for(int y = 0; y < height_; ++y)
-		{
-			for(int x = 0; x < width_; ++x)
-			{
-				if(flags_.get(x, y))
-				{
-					++n_resample;
-
-					if(session__.isInteractive() && show_mask_)
+					for(auto &output : outputs_)
 					{
-						float mat_sample_factor = 1.f;
-						const float weight = weights_(x, y).getFloat();
-						if(sampling_factor_image_pass)
-						{
-							mat_sample_factor = (weight == 0.f) ? 0.f : sampling_factor_image_pass->getFloat(x, y) / weight;
-							if(!background_resampling_ && mat_sample_factor == 0.f) continue;
-						}
-
-						for(const auto &it : image_layers_)
-						{
-							Rgb pix = it.second.image_->getColor(x, y).normalized(weight);
-							float pix_col_bri = pix.abscol2Bri();
-
-							if(pix.r_ < pix.g_ && pix.r_ < pix.b_)
-								color_layers(it.first).color_.set(0.7f, pix_col_bri, mat_sample_factor > 1.f ? 0.7f : pix_col_bri, 1.f);
-							else
-								color_layers(it.first).color_.set(pix_col_bri, 0.7f, mat_sample_factor > 1.f ? 0.7f : pix_col_bri, 1.f);
-						}
-						for(auto &output : outputs_)
-						{
-							if(output.second && !output.second->isImageOutput()) output.second->putPixel(x, y, color_layers);
-						}
+						if(output.second && !output.second->isImageOutput()) output.second->putPixel(x, y, color_layers);
 					}
 				}
 			}
@@ -427,6 +361,7 @@ int ImageFilm::nextPass(const RenderView *render_view, RenderControl &render_con
 	}
 	else
 	{
+		flags_.fill(n_pass_ == 0);
 		n_resample = height_ * width_;
 	}
 
@@ -455,7 +390,14 @@ int ImageFilm::nextPass(const RenderView *render_view, RenderControl &render_con
 	return n_resample;
 }
 
-bool ImageFilm::nextArea(RenderArea &a)
+void ImageFilm::setAaNoiseParams(const AaNoiseParams &aa_noise_params)
+{
+	aa_noise_params_ = aa_noise_params;
+	//The moments are only needed to estimate the convergence of the pixels, and they must be collected since the first sample
+	if(aa_noise_params_.resample_mode_ == AaNoiseParams::ResampleMode::Convergence && !moments_) moments_ = new MomentsBuffer_t(width_, height_);
+}
+
+bool ImageFilm::nextArea(int thread_id, RenderArea &a)
 {
 	if(abort_) return false;
 
@@ -463,34 +405,19 @@ bool ImageFilm::nextArea(RenderArea &a)
 
 	if(split_)
 	{
-		int n;
-		splitter_mutex_.lock();
-		n = next_area_++;
-		splitter_mutex_.unlock();
-
-		if(splitter_->getArea(n, a))
+		if(splitter_->nextArea(thread_id, a))
 		{
 			a.sx_0_ = a.x_ + ifilterw;
 			a.sx_1_ = a.x_ + a.w_ - ifilterw;
 			a.sy_0_ = a.y_ + ifilterw;
 			a.sy_1_ = a.y_ + a.h_ - ifilterw;
-
-			if(session__.isInteractive())
-			{
-				out_mutex_.lock();
-				int end_x = a.x_ + a.w_, end_y = a.y_ + a.h_;
-				for(auto &output : outputs_)
-				{
-					if(output.second && !output.second->isImageOutput()) output.second->highlightArea(a.x_, a.y_, end_x, end_y);
-				}
-				out_mutex_.unlock();
-			}
+			initAreaSamples(a);
 			return true;
 		}
 	}
 	else
 	{
-		if(area_cnt_) return false;
+		if(area_taken_.exchange(true)) return false;
 		a.x_ = cx_0_;
 		a.y_ = cy_0_;
 		a.w_ = width_;
@@ -499,19 +426,71 @@ bool ImageFilm::nextArea(RenderArea &a)
 		a.sx_1_ = a.x_ + a.w_ - ifilterw;
 		a.sy_0_ = a.y_ + ifilterw;
 		a.sy_1_ = a.y_ + a.h_ - ifilterw;
-		++area_cnt_;
+		initAreaSamples(a);
 		return true;
 	}
 	return false;
 }
 
+void ImageFilm::initAreaSamples(RenderArea &a) const
+{
+	//The filter of the samples taken in the area can reach up to ceil(filterw_) pixels beyond it
+	const int border = (int) ceil(filterw_) + 1;
+	AreaSamples &samples = a.samples_;
+	samples.x_0_ = std::max(cx_0_, a.x_ - border);
+	samples.y_0_ = std::max(cy_0_, a.y_ - border);
+	samples.w_ = std::min(cx_1_, a.x_ + a.w_ + border) - samples.x_0_;
+	samples.h_ = std::min(cy_1_, a.y_ + a.h_ + border) - samples.y_0_;
+	samples.stride_ = 1 + 4 * static_cast<int>(image_layers_.size());
+	samples.data_.assign(samples.w_ * samples.h_ * samples.stride_, 0.f);
+	if(moments_) samples.moments_.assign(samples.w_ * samples.h_, PixelMoments());
+	else samples.moments_.clear();
+}
+
+void ImageFilm::mergeArea(RenderArea &a)
+{
+	AreaSamples &samples = a.samples_;
+	if(samples.data_.empty()) return;
+	image_mutex_.lock();
+	for(int j = 0; j < samples.h_; ++j)
+	{
+		for(int i = 0; i < samples.w_; ++i)
+		{
+			const float *pixel = &samples.data_[(j * samples.w_ + i) * samples.stride_];
+			if(pixel[0] == 0.f) continue; //no sample reached this pixel
+			const int x = samples.x_0_ + i - cx_0_, y = samples.y_0_ + j - cy_0_;
+			weights_(x, y).setFloat(weights_(x, y).getFloat() + pixel[0]);
+			const float *layer_color = pixel + 1;
+			for(auto &it : image_layers_)
+			{
+				it.second.image_->setColor(x, y, it.second.image_->getColor(x, y) + Rgba(layer_color[0], layer_color[1], layer_color[2], layer_color[3]));
+				layer_color += 4;
+			}
+			if(moments_) (*moments_)(x, y).merge(samples.moments_[j * samples.w_ + i]);
+		}
+	}
+	image_mutex_.unlock();
+	samples.data_.clear(); //keeps the memory for the next area of the thread
+}
+
+void ImageFilm::highlightArea(const RenderArea &a)
+{
+	if(!split_ || !session__.isInteractive()) return;
+	out_mutex_.lock();
+	int end_x = a.x_ + a.w_, end_y = a.y_ + a.h_;
+	for(auto &output : outputs_)
+	{
+		if(output.second && !output.second->isImageOutput()) output.second->highlightArea(a.x_, a.y_, end_x, end_y);
+	}
+	out_mutex_.unlock();
+}
+
 void ImageFilm::finishArea(const RenderView *render_view, RenderControl &render_control, RenderArea &a)
 {
 	out_mutex_.lock();
+	const int start_x = a.x_ - cx_0_, start_y = a.y_ - cy_0_;
 	int end_x = a.x_ + a.w_ - cx_0_, end_y = a.y_ + a.h_ - cy_0_;
 
-	ColorLayers color_layers(layers_);
-
 	if(layers_.isDefined(Layer::DebugFacesEdges))
 	{
 		generateDebugFacesEdges(a.x_ - cx_0_, end_x, a.y_ - cy_0_, end_y, true);
@@ -522,41 +501,43 @@ void ImageFilm::finishArea(const RenderView *render_view, RenderControl &render_
 		generateToonAndDebugObjectEdges(a.x_ - cx_0_, end_x, a.y_ - cy_0_, end_y, true);
 	}
 
-	for(int j = a.y_ - cy_0_; j < end_y; ++j)
+	//The area is handed to the outputs layer by layer in row spans, instead of pixel by pixel
+	ColorLayersArea color_layers_area(layers_);
+	color_layers_area.setArea(start_x, start_y, end_x - start_x, end_y - start_y);
+	for(const auto &it : image_layers_)
 	{
-		for(int i = a.x_ - cx_0_; i < end_x; ++i)
+		const Layer::Type layer_type = it.first;
+		const int slot = color_layers_area.getSlot(layer_type);
+		if(slot < 0) continue;
+		const bool ceil_color = (layer_type == Layer::ObjIndexAbs ||
+								 layer_type == Layer::ObjIndexAutoAbs ||
+								 layer_type == Layer::MatIndexAbs ||
+								 layer_type == Layer::MatIndexAutoAbs);
+		for(int j = start_y; j < end_y; ++j)
 		{
-			const float weight = weights_(i, j).getFloat();
-			for(const auto &it : image_layers_)
+			Rgba *row = color_layers_area.getRow(slot, j) - start_x;
+			for(int i = start_x; i < end_x; ++i)
 			{
-				const Layer::Type layer_type = it.first;
+				const float weight = weights_(i, j).getFloat();
 				if(layer_type == Layer::AaSamples)
 				{
-					color_layers(layer_type).color_ = weight;
-				}
-				else if(layer_type == Layer::ObjIndexAbs ||
-						layer_type == Layer::ObjIndexAutoAbs ||
-						layer_type == Layer::MatIndexAbs ||
-						layer_type == Layer::MatIndexAutoAbs
-						)
-				{
-					color_layers(layer_type).color_ = it.second.image_->getColor(i, j).normalized(weight);
-					color_layers(layer_type).color_.ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
+					row[i] = weight;
 				}
 				else
 				{
-					color_layers(layer_type).color_ = it.second.image_->getColor(i, j).normalized(weight);
-				}
-			}
-			for(auto &output : outputs_)
-			{
-				if(output.second && !output.second->isImageOutput())
-				{
-					if(!output.second->putPixel(i, j, color_layers)) abort_ = true;
+					row[i] = it.second.image_->getColor(i, j).normalized(weight);
+					if(ceil_color) row[i].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
 				}
 			}
 		}
 	}
+	for(auto &output : outputs_)
+	{
+		if(output.second && !output.second->isImageOutput())
+		{
+			if(!output.second->putArea(color_layers_area)) abort_ = true;
+		}
+	}
 
 	if(session__.isInteractive())
 	{
@@ -628,41 +609,35 @@ void ImageFilm::flush(const RenderView *render_view, const RenderControl &render
 		generateToonAndDebugObjectEdges(0, width_, 0, height_, false);
 	}
 
-	ColorLayers color_layers(layers);
+	//The image is handed to the outputs one row at a time, layer by layer, instead of pixel by pixel
+	ColorLayersArea color_layers_area(layers);
 	for(int j = 0; j < height_; j++)
 	{
-		for(int i = 0; i < width_; i++)
+		color_layers_area.setArea(0, j, width_, 1);
+		for(const auto &it : image_layers_)
 		{
-			const float weight = weights_(i, j).getFloat();
-			for(const auto &it : image_layers_)
+			const Layer::Type layer_type = it.first;
+			const int slot = color_layers_area.getSlot(layer_type);
+			if(slot < 0) continue;
+			const bool ceil_color = (layer_type == Layer::ObjIndexAbs ||
+									 layer_type == Layer::ObjIndexAutoAbs ||
+									 layer_type == Layer::MatIndexAbs ||
+									 layer_type == Layer::MatIndexAutoAbs);
+			const bool regular_color = ceil_color || layer_type == Layer::AaSamples || (flags & RegularImage);
+			const bool add_density = estimate_density_ && (flags & Densityimage) && layer_type == Layer::Combined && density_factor > 0.f;
+			Rgba *row = color_layers_area.getRow(slot, j);
+			for(int i = 0; i < width_; i++)
 			{
-				const Layer::Type layer_type = it.first;
-				if(layer_type == Layer::AaSamples)
-				{
-					color_layers(layer_type).color_ = it.second.image_->getColor(i, j).normalized(weight);
-				}
-				else if(layer_type == Layer::ObjIndexAbs ||
-						layer_type == Layer::ObjIndexAutoAbs ||
-						layer_type == Layer::MatIndexAbs ||
-						layer_type == Layer::MatIndexAutoAbs
-						)
-				{
-					color_layers(layer_type).color_ = it.second.image_->getColor(i, j).normalized(weight);
-					color_layers(layer_type).color_.ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
-				}
-				else
-				{
-					if(flags & RegularImage) color_layers(layer_type).color_ = it.second.image_->getColor(i, j).normalized(weight);
-					else color_layers(layer_type).color_ = Rgba(0.f);
-				}
-
-				if(estimate_density_ && (flags & Densityimage) && layer_type == Layer::Combined && density_factor > 0.f) color_layers(layer_type).color_ += Rgba((*density_image_)(i, j) * density_factor, 0.f);
+				if(regular_color) row[i] = it.second.image_->getColor(i, j).normalized(weights_(i, j).getFloat());
+				else row[i] = Rgba(0.f);
+				if(ceil_color) row[i].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
+				if(add_density) row[i] += Rgba((*density_image_)(i, j) * density_factor, 0.f);
 			}
+		}
 
-			for(auto &output : outputs_)
-			{
-				if(output.second) output.second->putPixel(i, j, color_layers);
-			}
+		for(auto &output : outputs_)
+		{
+			if(output.second) output.second->putArea(color_layers_area);
 		}
 	}
 
@@ -711,13 +686,18 @@ void ImageFilm::flush(const RenderView *render_view, const RenderControl &render
 
 bool ImageFilm::doMoreSamples(int x, int y) const
 {
-	return aa_noise_params_.threshold_ <= 0.f || flags_.get(x - cx_0_, y - cy_0_);
+	if(aa_noise_params_.threshold_ <= 0.f && !convergenceResampling()) return true;
+	return flags_.get(x - cx_0_, y - cy_0_);
 }
 
 /* CAUTION! Implemantation of this function needs to be thread safe for samples that
 	contribute to pixels outside the area a AND pixels that might get
-	contributions from outside area a! (yes, really!) */
-void ImageFilm::addSample(int x, int y, float dx, float dy, const RenderArea *a, int num_sample, int aa_pass_number, float inv_aa_max_possible_samples, ColorLayers *color_layers)
+	contributions from outside area a! (yes, really!)
+	The samples of an area are accumulated without locking in the buffer of the
+	area, which belongs to its render thread, and added to the image film at once
+	in mergeArea. Only samples without area, or reaching outside its buffer,
+	are added directly to the image film under the lock. */
+void ImageFilm::addSample(int x, int y, float dx, float dy, RenderArea *a, int num_sample, int aa_pass_number, float inv_aa_max_possible_samples, ColorLayers *color_layers)
 {
 	int dx_0, dx_1, dy_0, dy_1, x_0, x_1, y_0, y_1;
 
@@ -750,6 +730,59 @@ void ImageFilm::addSample(int x, int y, float dx, float dy, const RenderArea *a,
 	x_0 = x + dx_0; x_1 = x + dx_1;
 	y_0 = y + dy_0; y_1 = y + dy_1;
 
+	//Brightness of the sample for the convergence estimation. The absolute filter weights are used for it, as the moments need positive weights
+	float sample_brightness = 0.f;
+	if(moments_ && color_layers)
+	{
+		const ColorLayer *combined_layer = color_layers->find(Layer::Combined);
+		if(combined_layer)
+		{
+			Rgba col = combined_layer->color_;
+			col.clampProportionalRgb(aa_noise_params_.clamp_samples_);
+			sample_brightness = col.col2Bri();
+		}
+	}
+
+	if(a && !a->samples_.data_.empty() && x_0 >= a->samples_.x_0_ && x_1 < a->samples_.x_0_ + a->samples_.w_ && y_0 >= a->samples_.y_0_ && y_1 < a->samples_.y_0_ + a->samples_.h_)
+	{
+		AreaSamples &samples = a->samples_;
+		for(int j = y_0; j <= y_1; ++j)
+		{
+			for(int i = x_0; i <= x_1; ++i)
+			{
+				const int offset = y_index[j - y_0] * filter_table_size__ + x_index[i - x_0];
+				samples.data_[((j - samples.y_0_) * samples.w_ + i - samples.x_0_) * samples.stride_] += filter_table_[offset];
+				if(moments_) samples.moments_[(j - samples.y_0_) * samples.w_ + i - samples.x_0_].addSample(sample_brightness, std::abs(filter_table_[offset]));
+			}
+		}
+		//Each layer color is clamped only once per sample, and then spread over the filter footprint
+		int layer_offset = 1;
+		for(const auto &it : image_layers_)
+		{
+			const ColorLayer *color_layer = color_layers ? color_layers->find(it.first) : nullptr;
+			if(color_layer)
+			{
+				Rgba col = color_layer->color_;
+				col.clampProportionalRgb(aa_noise_params_.clamp_samples_);
+				for(int j = y_0; j <= y_1; ++j)
+				{
+					for(int i = x_0; i <= x_1; ++i)
+					{
+						const int offset = y_index[j - y_0] * filter_table_size__ + x_index[i - x_0];
+						const float filter_wt = filter_table_[offset];
+						float *layer_color = &samples.data_[((j - samples.y_0_) * samples.w_ + i - samples.x_0_) * samples.stride_ + layer_offset];
+						layer_color[0] += col.r_ * filter_wt;
+						layer_color[1] += col.g_ * filter_wt;
+						layer_color[2] += col.b_ * filter_wt;
+						layer_color[3] += col.a_ * filter_wt;
+					}
+				}
+			}
+			layer_offset += 4;
+		}
+		return;
+	}
+
 	image_mutex_.lock();
 
 	for(int j = y_0; j <= y_1; ++j)
@@ -760,11 +793,13 @@ void ImageFilm::addSample(int x, int y, float dx, float dy, const RenderArea *a,
 			const int offset = y_index[j - y_0] * filter_table_size__ + x_index[i - x_0];
 			const float filter_wt = filter_table_[offset];
 			weights_(i - cx_0_, j - cy_0_).setFloat(weights_(i - cx_0_, j - cy_0_).getFloat() + filter_wt);
+			if(moments_) (*moments_)(i - cx_0_, j - cy_0_).addSample(sample_brightness, std::abs(filter_wt));
 
 			// update pixel values with filtered sample contribution
 			for(auto &it : image_layers_)
 			{
-				Rgba col = color_layers ? (*color_layers)(it.first).color_ : 0.f;
+				const ColorLayer *color_layer = color_layers ? color_layers->find(it.first) : nullptr;
+				Rgba col = color_layer ? color_layer->color_ : 0.f;
 
 				col.clampProportionalRgb(aa_noise_params_.clamp_samples_);
 
@@ -809,7 +844,8 @@ void ImageFilm::addDensitySample(const Rgb &c, int x, int y, float dx, float dy,
 	x_0 = x + dx_0; x_1 = x + dx_1;
 	y_0 = y + dy_0; y_1 = y + dy_1;
 
-	density_image_mutex_.lock();
+	const int first_mutex = (y_0 - cy_0_) / density_rows_per_mutex_, last_mutex = (y_1 - cy_0_) / density_rows_per_mutex_;
+	for(int m = first_mutex; m <= last_mutex; ++m) density_rows_mutexes_[m].lock();
 
 	for(int j = y_0; j <= y_1; ++j)
 	{
@@ -822,9 +858,9 @@ void ImageFilm::addDensitySample(const Rgb &c, int x, int y, float dx, float dy,
 		}
 	}
 
-	++num_density_samples_;
+	for(int m = last_mutex; m >= first_mutex; --m) density_rows_mutexes_[m].unlock();
 
-	density_image_mutex_.unlock();
+	++num_density_samples_;
 }
 
 void ImageFilm::setDensityEstimation(bool enable)
@@ -847,6 +883,214 @@ void ImageFilm::setProgressBar(ProgressBar *pb)
 	progress_bar_ = pb;
 }
 
+/*! Flags the pixels of the columns [x_0, x_1) that need more samples in the next adaptive AA pass.
+	The normalized colors of the band and of the columns around it reached by the neighbour and
+	variance comparisons are read once into the structure of arrays buffers in "data", so the color
+	differences are calculated in simple loops along the columns that the compiler can vectorize.
+	The pixels are compared in the same way as in previous versions: each pixel (x, y) is compared
+	with the pixels at its right, below and in both lower diagonals using its own threshold, and both
+	pixels are flagged when they differ. Here that is turned around, so each band only writes its
+	own flags, gathering the comparisons made by its neighbours.
+	\return the number of pixels flagged in the band */
+int ImageFilm::detectAaNoise(int x_0, int x_1, AaNoiseBandData &data)
+{
+	enum : unsigned char { Self = 1, Right = 2, Down = 4, DownRight = 8, DownLeft = 16, Variance = 32 };
+	const int height = height_;
+	const int half_edge = aa_noise_params_.variance_pixels_ > 0 ? aa_noise_params_.variance_edge_size_ / 2 : 0;
+	const int border = std::max(1, half_edge);
+	//Pixels that are compared with their neighbours. The last row and column are only compared from their neighbours
+	const int sx_0 = std::max(0, x_0 - border), sx_1 = std::min(width_ - 1, x_1 + border);
+	//Columns whose colors are needed by those comparisons
+	const int nx_0 = std::max(0, x_0 - 2 * border), nx_1 = std::min(width_, x_1 + 2 * border);
+	const int n_cols = nx_1 - nx_0;
+	const size_t n_pixels = static_cast<size_t>(n_cols) * height;
+	const bool color_noise = aa_noise_params_.detect_color_noise_;
+
+	data.bri_.resize(n_pixels);
+	data.threshold_.resize(n_pixels);
+	data.diff_x_.resize(n_pixels);
+	data.diff_y_.resize(n_pixels);
+	if(color_noise) for(auto &channel : data.rgba_) channel.resize(n_pixels);
+	data.sources_.assign(n_pixels, 0);
+	data.variance_.assign(n_pixels, 0);
+	data.count_.resize(height + 1);
+
+	const Image *combined_image = image_layers_(Layer::Combined).image_;
+	const Image *sampling_factor_image = image_layers_(Layer::DebugSamplingFactor).image_;
+
+	for(int lx = 0; lx < n_cols; ++lx)
+	{
+		const int x = nx_0 + lx;
+		const size_t col = static_cast<size_t>(lx) * height;
+		for(int y = 0; y < height; ++y)
+		{
+			//We will only consider the Combined Pass (pass 0) for the AA additional sampling calculations.
+			const Rgba pix_col = combined_image->getColor(x, y).normalized(weights_(x, y).getFloat());
+			data.bri_[col + y] = pix_col.col2Bri();
+			if(color_noise)
+			{
+				data.rgba_[0][col + y] = pix_col.r_;
+				data.rgba_[1][col + y] = pix_col.g_;
+				data.rgba_[2][col + y] = pix_col.b_;
+				data.rgba_[3][col + y] = pix_col.a_;
+			}
+			float aa_thresh_scaled = aa_noise_params_.threshold_;
+			if(aa_noise_params_.dark_detection_type_ == AaNoiseParams::DarkDetectionType::Linear && aa_noise_params_.dark_threshold_factor_ > 0.f)
+			{
+				aa_thresh_scaled = aa_noise_params_.threshold_ * ((1.f - aa_noise_params_.dark_threshold_factor_) + (pix_col.abscol2Bri() * aa_noise_params_.dark_threshold_factor_));
+			}
+			else if(aa_noise_params_.dark_detection_type_ == AaNoiseParams::DarkDetectionType::Curve)
+			{
+				aa_thresh_scaled = darkThresholdCurveInterpolate(pix_col.abscol2Bri());
+			}
+			data.threshold_[col + y] = aa_thresh_scaled;
+		}
+	}
+
+	//Same as Rgba::colorDifference, on the buffers
+	auto color_difference = [&data, color_noise](size_t i, size_t j)
+	{
+		float color_difference = std::abs(data.bri_[j] - data.bri_[i]);
+		if(color_noise)
+		{
+			for(const auto &channel : data.rgba_) color_difference = std::max(color_difference, std::abs(channel[j] - channel[i]));
+		}
+		return color_difference;
+	};
+
+	for(int lx = 0; lx < n_cols; ++lx)
+	{
+		const size_t col = static_cast<size_t>(lx) * height;
+		if(lx < n_cols - 1) for(int y = 0; y < height; ++y) data.diff_x_[col + y] = color_difference(col + y, col + height + y);
+		for(int y = 0; y < height - 1; ++y) data.diff_y_[col + y] = color_difference(col + y, col + y + 1);
+	}
+
+	for(int x = sx_0; x < sx_1; ++x)
+	{
+		const int lx = x - nx_0;
+		const size_t col = static_cast<size_t>(lx) * height;
+		const float *threshold = &data.threshold_[col];
+		unsigned char *sources = &data.sources_[col];
+		for(int y = 0; y < height - 1; ++y)
+		{
+			unsigned char flags = 0;
+			if(data.diff_x_[col + y] >= threshold[y]) flags |= Self | Right;
+			if(data.diff_y_[col + y] >= threshold[y]) flags |= Self | Down;
+			if(color_difference(col + y, col + height + y + 1) >= threshold[y]) flags |= Self | DownRight;
+			if(x > 0 && color_difference(col + y, col - height + y + 1) >= threshold[y]) flags |= Self | DownLeft;
+			sources[y] = flags;
+		}
+		if(half_edge > 0)
+		{
+			int *count = data.count_.data();
+			for(int y = 0; y < height - 1; ++y) count[y] = 0;
+			for(int xd = -half_edge; xd < half_edge - 1; ++xd)
+			{
+				const int xi = std::min(std::max(x + xd, 0), width_ - 2);
+				const float *diff_x = &data.diff_x_[static_cast<size_t>(xi - nx_0) * height];
+				for(int y = 0; y < height - 1; ++y) count[y] += (diff_x[y] >= threshold[y]);
+			}
+			const float *diff_y = &data.diff_y_[col];
+			for(int yd = -half_edge; yd < half_edge - 1; ++yd)
+			{
+				for(int y = 0; y < height - 1; ++y) count[y] += (diff_y[std::min(std::max(y + yd, 0), height - 2)] >= threshold[y]);
+			}
+			for(int y = 0; y < height - 1; ++y) if(count[y] >= aa_noise_params_.variance_pixels_) sources[y] |= Variance;
+		}
+		if(sampling_factor_image && !background_resampling_)
+		{
+			for(int y = 0; y < height - 1; ++y)
+			{
+				const float weight = weights_(x, y).getFloat();
+				const float mat_sample_factor = (weight == 0.f) ? 0.f : sampling_factor_image->getFloat(x, y) / weight;
+				if(mat_sample_factor == 0.f) sources[y] = 0;
+			}
+		}
+	}
+
+	if(half_edge > 0)
+	{
+		//The pixels that exceed the variance flag the window [-half_edge, half_edge) around them, first dilated along the columns
+		int *count = data.count_.data();
+		for(int x = sx_0; x < sx_1; ++x)
+		{
+			const size_t col = static_cast<size_t>(x - nx_0) * height;
+			count[0] = 0;
+			for(int y = 0; y < height; ++y) count[y + 1] = count[y] + ((data.sources_[col + y] & Variance) ? 1 : 0);
+			for(int y = 0; y < height; ++y) data.variance_[col + y] = count[std::min(height, y + half_edge + 1)] > count[std::max(0, y - half_edge + 1)];
+		}
+	}
+
+	int n_flagged = 0;
+	for(int x = x_0; x < x_1; ++x)
+	{
+		const int lx = x - nx_0;
+		const size_t col = static_cast<size_t>(lx) * height;
+		const unsigned char *sources = &data.sources_[col];
+		for(int y = 0; y < height; ++y)
+		{
+			bool flag;
+			if(x < width_ - 1 && y < height - 1) flag = weights_(x, y).getFloat() <= 0.f; //If after reloading ImageFiles there are pixels that were not yet rendered at all, make sure they are marked to be rendered in the next AA pass
+			else flag = (n_pass_ == 0);
+			flag = flag || (sources[y] & Self);
+			if(x > 0) flag = flag || (sources[y - height] & Right);
+			if(y > 0)
+			{
+				flag = flag || (sources[y - 1] & Down);
+				if(x > 0) flag = flag || (sources[y - 1 - height] & DownRight);
+				if(x < width_ - 1) flag = flag || (sources[y - 1 + height] & DownLeft);
+			}
+			if(half_edge > 0 && !flag)
+			{
+				for(int sx = std::max(sx_0, x - half_edge + 1); sx <= std::min(sx_1 - 1, x + half_edge) && !flag; ++sx) flag = data.variance_[static_cast<size_t>(sx - nx_0) * height + y];
+			}
+			flags_.set(x, y, flag);
+			if(flag) ++n_flagged;
+		}
+	}
+	return n_flagged;
+}
+
+/*! Flags the pixels whose estimated relative error is above the convergence target,
+	from the moments of the brightness of their samples. Pixels with too few samples to
+	estimate their error, such as the pixels of films loaded from disk, are always flagged.
+	With few samples, a pixel in a noisy region can have all its samples equal by chance
+	and look converged, so the neighbours of the unconverged pixels are flagged as well.
+	\return the number of pixels flagged */
+int ImageFilm::detectUnconvergedPixels()
+{
+	const Image *sampling_factor_image = image_layers_(Layer::DebugSamplingFactor).image_;
+	for(int x = 0; x < width_; ++x)
+	{
+		for(int y = 0; y < height_; ++y)
+		{
+			flags_.set(x, y, weights_(x, y).getFloat() <= 0.f || (*moments_)(x, y).relativeError(convergence_min_brightness_) > aa_noise_params_.convergence_target_);
+		}
+	}
+	const FlagsBuffer_t unconverged = flags_;
+	int n_flagged = 0;
+	for(int x = 0; x < width_; ++x)
+	{
+		for(int y = 0; y < height_; ++y)
+		{
+			const float weight = weights_(x, y).getFloat();
+			bool flag = false;
+			for(int nx = std::max(0, x - 1); nx <= std::min(width_ - 1, x + 1) && !flag; ++nx)
+			{
+				for(int ny = std::max(0, y - 1); ny <= std::min(height_ - 1, y + 1) && !flag; ++ny) flag = unconverged.get(nx, ny);
+			}
+			if(flag && weight > 0.f && sampling_factor_image && !background_resampling_)
+			{
+				const float mat_sample_factor = sampling_factor_image->getFloat(x, y) / weight;
+				if(mat_sample_factor == 0.f) flag = false;
+			}
+			flags_.set(x, y, flag);
+			if(flag) ++n_flagged;
+		}
+	}
+	return n_flagged;
+}
+
 float ImageFilm::darkThresholdCurveInterpolate(float pixel_brightness)
 {
 	if(pixel_brightness <= 0.10f) return 0.0001f;
@@ -865,6 +1109,87 @@ float ImageFilm::darkThresholdCurveInterpolate(float pixel_brightness)
 	else return 0.1000f;
 }
 
+/*! ImageFilm files: the header and the types of the layers are followed by the film in
+	chunks of "chunk_rows_" rows. Each chunk holds the weights of its rows followed by
+	the Rgba colors of each layer, all as floats, and it is preceded by its size in the
+	file. As each chunk has everything about its rows, the files can be merged chunk by
+	chunk with bounded memory. With compression, the bytes of the floats of each chunk
+	are split in four planes before compressing them with deflate, as the exponent
+	bytes of the neighbouring pixels are very similar and compress much better together.
+	The older "YAF_FILMv4_0_0" files can still be loaded, see imageFilmLoad. */
+
+struct FilmFileHeader
+{
+	char magic_[8];
+	uint32_t version_;
+	uint32_t header_size_;
+	uint32_t computer_node_;
+	uint32_t base_sampling_offset_;
+	uint32_t sampling_offset_;
+	int32_t width_;
+	int32_t height_;
+	int32_t cx_0_;
+	int32_t cx_1_;
+	int32_t cy_0_;
+	int32_t cy_1_;
+	uint32_t n_layers_;
+	uint32_t chunk_rows_;
+	uint32_t compression_; //!< 0: none, 1: deflate of the byte planes
+};
+
+static constexpr char film_file_magic__[8] = {'Y', 'A', 'F', 'F', 'I', 'L', 'M', '5'};
+static constexpr uint32_t film_file_version__ = 1;
+static constexpr size_t film_chunk_floats__ = 1 << 18; //!< approximate size of the chunks, 1MB
+
+static bool compressFilmChunk__(const std::vector<float> &chunk, std::vector<char> &stored)
+{
+#ifdef HAVE_ZLIB
+	const size_t n_floats = chunk.size();
+	std::vector<unsigned char> planes(n_floats * sizeof(float));
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(chunk.data());
+	for(size_t i = 0; i < n_floats; ++i)
+	{
+		for(size_t b = 0; b < sizeof(float); ++b) planes[b * n_floats + i] = bytes[i * sizeof(float) + b];
+	}
+	uLongf stored_size = compressBound(planes.size());
+	stored.resize(stored_size);
+	if(compress2(reinterpret_cast<Bytef *>(stored.data()), &stored_size, planes.data(), planes.size(), 1) != Z_OK) return false;
+	stored.resize(stored_size);
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool decompressFilmChunk__(const std::vector<char> &stored, std::vector<float> &chunk)
+{
+#ifdef HAVE_ZLIB
+	const size_t n_floats = chunk.size();
+	std::vector<unsigned char> planes(n_floats * sizeof(float));
+	uLongf planes_size = planes.size();
+	if(uncompress(planes.data(), &planes_size, reinterpret_cast<const Bytef *>(stored.data()), stored.size()) != Z_OK || planes_size != planes.size()) return false;
+	unsigned char *bytes = reinterpret_cast<unsigned char *>(chunk.data());
+	for(size_t i = 0; i < n_floats; ++i)
+	{
+		for(size_t b = 0; b < sizeof(float); ++b) bytes[i * sizeof(float) + b] = planes[b * n_floats + i];
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+//! True if the file starts with the magic of the chunked film files
+static bool isChunkedFilmFile__(const std::string &filename)
+{
+	File file(filename);
+	if(!file.open("rb")) return false;
+	char magic[sizeof(film_file_magic__)];
+	const bool result = file.read(magic, sizeof(magic)) && std::memcmp(magic, film_file_magic__, sizeof(magic)) == 0;
+	file.close();
+	return result;
+}
+
 std::string ImageFilm::getFilmPath() const
 {
 	std::string film_path = film_load_save_.path_;
@@ -875,6 +1200,7 @@ std::string ImageFilm::getFilmPath() const
 	return film_path;
 }
 
+//! Loads an older "YAF_FILMv4_0_0" film file, with all the values stored one by one
 bool ImageFilm::imageFilmLoad(const std::string &filename)
 {
 	Y_INFO << "imageFilm: Loading film from: \"" << filename << YENDL;
@@ -984,6 +1310,106 @@ bool ImageFilm::imageFilmLoad(const std::string &filename)
 	return true;
 }
 
+bool ImageFilm::imageFilmAdd(const std::string &filename, std::mutex *rows_mutexes, unsigned int &sampling_offset, unsigned int &base_sampling_offset)
+{
+	Y_INFO << "imageFilm: Loading film from: \"" << filename << YENDL;
+
+	File file(filename);
+	if(!file.open("rb"))
+	{
+		Y_WARNING << "imageFilm file '" << filename << "' not found, aborting load operation" << YENDL;
+		return false;
+	}
+	FilmFileHeader header;
+	bool valid = file.read(reinterpret_cast<char *>(&header), sizeof(FilmFileHeader)) && std::memcmp(header.magic_, film_file_magic__, sizeof(film_file_magic__)) == 0 && header.version_ == film_file_version__ && header.header_size_ == sizeof(FilmFileHeader) && header.chunk_rows_ > 0 && header.compression_ <= 1;
+	if(!valid)
+	{
+		Y_WARNING << "imageFilm file '" << filename << "' is not a valid YafaRay film file or was saved with a different version" << YENDL;
+		file.close();
+		return false;
+	}
+	if(header.width_ != width_ || header.height_ != height_ || header.cx_0_ != cx_0_ || header.cx_1_ != cx_1_ || header.cy_0_ != cy_0_ || header.cy_1_ != cy_1_)
+	{
+		Y_WARNING << "imageFilm: loading/reusing film check failed. Image size and borders, expected=" << width_ << "x" << height_ << " [" << cx_0_ << "," << cx_1_ << "]x[" << cy_0_ << "," << cy_1_ << "], in reused/loaded film=" << header.width_ << "x" << header.height_ << " [" << header.cx_0_ << "," << header.cx_1_ << "]x[" << header.cy_0_ << "," << header.cy_1_ << "]" << YENDL;
+		file.close();
+		return false;
+	}
+	valid = header.n_layers_ == image_layers_.size();
+	for(const auto &it : image_layers_)
+	{
+		int32_t layer_type;
+		if(!valid || !file.read<int32_t>(layer_type) || layer_type != static_cast<int32_t>(it.first)) valid = false;
+	}
+	if(!valid)
+	{
+		Y_WARNING << "imageFilm: loading/reusing film check failed. Image layers are different, expected " << image_layers_.size() << " layers, in reused/loaded film=" << header.n_layers_ << " layers" << YENDL;
+		file.close();
+		return false;
+	}
+#ifndef HAVE_ZLIB
+	if(header.compression_ != 0)
+	{
+		Y_WARNING << "imageFilm file '" << filename << "' is compressed, but libYafaRay was built without ZLib support" << YENDL;
+		file.close();
+		return false;
+	}
+#endif
+
+	//Each chunk has the weights and colors of all the layers for its rows, so if a chunk cannot be read the rows already added are still consistent, only missing the samples of the rest of this film
+	const int n_values = 1 + 4 * header.n_layers_;
+	std::vector<float> chunk;
+	std::vector<char> stored;
+	for(int y_0 = 0; y_0 < height_; y_0 += header.chunk_rows_)
+	{
+		const int y_1 = std::min(height_, y_0 + static_cast<int>(header.chunk_rows_));
+		chunk.resize(static_cast<size_t>(y_1 - y_0) * width_ * n_values);
+		const size_t chunk_size = chunk.size() * sizeof(float);
+		uint64_t stored_size;
+		valid = file.read<uint64_t>(stored_size) && stored_size <= 2 * chunk_size + 1024;
+		if(valid && header.compression_ == 0) valid = stored_size == chunk_size && file.read(reinterpret_cast<char *>(chunk.data()), chunk_size);
+		else if(valid)
+		{
+			stored.resize(stored_size);
+			valid = file.read(stored.data(), stored_size) && decompressFilmChunk__(stored, chunk);
+		}
+		if(!valid)
+		{
+			Y_WARNING << "imageFilm file '" << filename << "' is incomplete or damaged, only " << y_0 << " of its " << height_ << " rows could be loaded" << YENDL;
+			file.close();
+			return false;
+		}
+
+		const int mutex_0 = y_0 / film_rows_per_mutex_;
+		const int mutex_1 = (y_1 - 1) / film_rows_per_mutex_;
+		for(int m = mutex_0; m <= mutex_1; ++m) rows_mutexes[m].lock();
+		const float *values = chunk.data();
+		for(int y = y_0; y < y_1; ++y)
+		{
+			for(int x = 0; x < width_; ++x)
+			{
+				weights_(x, y).setFloat(weights_(x, y).getFloat() + *values++);
+			}
+		}
+		for(auto &it : image_layers_)
+		{
+			Image *image = it.second.image_;
+			for(int y = y_0; y < y_1; ++y)
+			{
+				for(int x = 0; x < width_; ++x)
+				{
+					image->setColor(x, y, image->getColor(x, y) + Rgba(values[0], values[1], values[2], values[3]));
+					values += 4;
+				}
+			}
+		}
+		for(int m = mutex_0; m <= mutex_1; ++m) rows_mutexes[m].unlock();
+	}
+	file.close();
+	sampling_offset = header.sampling_offset_;
+	base_sampling_offset = header.base_sampling_offset_;
+	return true;
+}
+
 void ImageFilm::imageFilmLoadAllInFolder(RenderControl &render_control)
 {
 	std::stringstream pass_string;
@@ -1026,8 +1452,45 @@ void ImageFilm::imageFilmLoadAllInFolder(RenderControl &render_control)
 	}
 
 	std::sort(film_file_paths_list.begin(), film_file_paths_list.end());
-	bool any_film_loaded = false;
+	std::vector<std::string> chunked_film_file_paths_list;
+	std::vector<std::string> legacy_film_file_paths_list;
 	for(const auto &film_file : film_file_paths_list)
+	{
+		if(isChunkedFilmFile__(film_file)) chunked_film_file_paths_list.push_back(film_file);
+		else legacy_film_file_paths_list.push_back(film_file);
+	}
+
+	//The chunked film files are added by several threads at the same time, each one streaming a different file chunk by chunk, so only one chunk per thread is kept in memory
+	const int num_files = static_cast<int>(chunked_film_file_paths_list.size());
+	std::unique_ptr<std::mutex[]> rows_mutexes(new std::mutex[(height_ + film_rows_per_mutex_ - 1) / film_rows_per_mutex_]);
+	std::mutex merge_mutex;
+	std::atomic<int> next_file {0};
+	bool any_film_loaded = false;
+	auto add_films = [&]()
+	{
+		for(int index = next_file++; index < num_files; index = next_file++)
+		{
+			const std::string &film_file = chunked_film_file_paths_list[index];
+			unsigned int loaded_sampling_offset, loaded_base_sampling_offset;
+			if(!imageFilmAdd(film_file, rows_mutexes.get(), loaded_sampling_offset, loaded_base_sampling_offset))
+			{
+				Y_WARNING << "ImageFilm: Could not load film file '" << film_file << "'" << YENDL;
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(merge_mutex);
+			any_film_loaded = true;
+			if(sampling_offset_ < loaded_sampling_offset) sampling_offset_ = loaded_sampling_offset;
+			if(base_sampling_offset_ < loaded_base_sampling_offset) base_sampling_offset_ = loaded_base_sampling_offset;
+			Y_VERBOSE << "ImageFilm: loaded film '" << film_file << "'" << YENDL;
+		}
+	};
+	const int num_threads = std::max(1, std::min(num_threads_, num_files));
+	std::vector<std::thread> threads;
+	for(int i = 1; i < num_threads; ++i) threads.push_back(std::thread(add_films));
+	add_films();
+	for(auto &t : threads) t.join();
+
+	for(const auto &film_file : legacy_film_file_paths_list)
 	{
 		ImageFilm *loaded_film = new ImageFilm(width_, height_, cx_0_, cy_0_, num_threads_, render_control, layers_, outputs_, 1.0, FilterType::Box);
 		if(!loaded_film->imageFilmLoad(film_file))
@@ -1087,21 +1550,6 @@ bool ImageFilm::imageFilmSave()
 		progress_bar_->setTag(pass_string.str().c_str());
 	}
 
-	const std::string film_path = getFilmPath();
-	File file(film_path);
-	file.open("wb");
-	file.append(std::string("YAF_FILMv4_0_0"));
-	file.append<unsigned int>(computer_node_);
-	file.append<unsigned int>(base_sampling_offset_);
-	file.append<unsigned int>(sampling_offset_);
-	file.append<int>(width_);
-	file.append<int>(height_);
-	file.append<int>(cx_0_);
-	file.append<int>(cx_1_);
-	file.append<int>(cy_0_);
-	file.append<int>(cy_1_);
-	file.append<int>((int) image_layers_.size());
-
 	const int weights_w = weights_.getWidth();
 	if(weights_w != width_)
 	{
@@ -1114,44 +1562,91 @@ bool ImageFilm::imageFilmSave()
 		Y_WARNING << "ImageFilm saving problems, film weights height " << height_ << " different from internal 2D image height " << weights_h << YENDL;
 		result_ok = false;
 	}
-	for(int y = 0; y < height_; ++y)
+	for(const auto &img : image_layers_)
 	{
-		for(int x = 0; x < width_; ++x)
+		const int img_w = img.second.image_->getWidth();
+		const int img_h = img.second.image_->getHeight();
+		if(img_w != width_ || img_h != height_)
 		{
-			file.append<float>(weights_(x, y).getFloat());
+			Y_WARNING << "ImageFilm saving problems, film size " << width_ << "x" << height_ << " different from internal 2D image size " << img_w << "x" << img_h << YENDL;
+			result_ok = false;
 		}
 	}
 
+	bool compression = film_load_save_.compression_;
+#ifndef HAVE_ZLIB
+	if(compression) Y_WARNING << "ImageFilm: libYafaRay was built without ZLib support, saving the film file without compression" << YENDL;
+	compression = false;
+#endif
+	const int n_values = 1 + 4 * static_cast<int>(image_layers_.size());
+	FilmFileHeader header;
+	std::memset(&header, 0, sizeof(FilmFileHeader));
+	std::memcpy(header.magic_, film_file_magic__, sizeof(film_file_magic__));
+	header.version_ = film_file_version__;
+	header.header_size_ = sizeof(FilmFileHeader);
+	header.computer_node_ = computer_node_;
+	header.base_sampling_offset_ = base_sampling_offset_;
+	header.sampling_offset_ = sampling_offset_;
+	header.width_ = width_;
+	header.height_ = height_;
+	header.cx_0_ = cx_0_;
+	header.cx_1_ = cx_1_;
+	header.cy_0_ = cy_0_;
+	header.cy_1_ = cy_1_;
+	header.n_layers_ = image_layers_.size();
+	header.chunk_rows_ = std::max(1, static_cast<int>(film_chunk_floats__ / (static_cast<size_t>(width_) * n_values)));
+	header.compression_ = compression ? 1 : 0;
+
+	//written through a temporary file, so an interrupted save never leaves an incomplete film that could be loaded later
+	const std::string film_path = getFilmPath();
+	const std::string tmp_film_path = film_path + ".tmp";
+	File file(tmp_film_path);
+	if(result_ok) result_ok = file.open("wb") && file.append(reinterpret_cast<const char *>(&header), sizeof(FilmFileHeader));
 	for(const auto &img : image_layers_)
 	{
-		const int img_w = img.second.image_->getWidth();
-		if(img_w != width_)
-		{
-			Y_WARNING << "ImageFilm saving problems, film width " << width_ << " different from internal 2D image width " << img_w << YENDL;
-			result_ok = false;
-			break;
-		}
-		const int img_h = img.second.image_->getHeight();
-		if(img_h != height_)
+		if(result_ok) result_ok = file.append<int32_t>(static_cast<int32_t>(img.first));
+	}
+
+	std::vector<float> chunk;
+	std::vector<char> stored;
+	for(int y_0 = 0; result_ok && y_0 < height_; y_0 += header.chunk_rows_)
+	{
+		const int y_1 = std::min(height_, y_0 + static_cast<int>(header.chunk_rows_));
+		chunk.resize(static_cast<size_t>(y_1 - y_0) * width_ * n_values);
+		float *values = chunk.data();
+		for(int y = y_0; y < y_1; ++y)
 		{
-			Y_WARNING << "ImageFilm saving problems, film height " << height_ << " different from internal 2D image height " << img_h << YENDL;
-			result_ok = false;
-			break;
+			for(int x = 0; x < width_; ++x) *values++ = weights_(x, y).getFloat();
 		}
-		for(int y = 0; y < height_; ++y)
+		for(const auto &img : image_layers_)
 		{
-			for(int x = 0; x < width_; ++x)
+			for(int y = y_0; y < y_1; ++y)
 			{
-				const Rgba &col = img.second.image_->getColor(x, y);
-				file.append<float>(col.r_);
-				file.append<float>(col.g_);
-				file.append<float>(col.b_);
-				file.append<float>(col.a_);
+				for(int x = 0; x < width_; ++x)
+				{
+					const Rgba col = img.second.image_->getColor(x, y);
+					values[0] = col.r_;
+					values[1] = col.g_;
+					values[2] = col.b_;
+					values[3] = col.a_;
+					values += 4;
+				}
 			}
 		}
+		if(compression)
+		{
+			result_ok = compressFilmChunk__(chunk, stored) && file.append<uint64_t>(stored.size()) && file.append(stored.data(), stored.size());
+		}
+		else result_ok = file.append<uint64_t>(chunk.size() * sizeof(float)) && file.append(reinterpret_cast<const char *>(chunk.data()), chunk.size() * sizeof(float));
+	}
+	result_ok &= file.close() == 0;
+	if(result_ok) result_ok = File::rename(tmp_film_path, film_path, true, true);
+	else
+	{
+		Y_WARNING << "ImageFilm: error saving the film file '" << film_path << "'" << YENDL;
+		File::remove(tmp_film_path, true);
 	}
 
-	file.close();
 	if(progress_bar_) progress_bar_->setTag(old_tag);
 	return result_ok;
 }
@@ -1350,9 +1845,9 @@ void ImageFilm::generateToonAndDebugObjectEdges(int xstart, int width, int ystar
 
 #else   //If not built with OpenCV, these functions will do nothing
 
-void ImageFilm::generateToonAndDebugObjectEdges(int num_view, int idx_pass, int xstart, int width, int ystart, int height, bool drawborder, ColorOutput *out_1, int out_1_displacement, ColorOutput *out_2, int out_2_displacement) { }
+void ImageFilm::generateToonAndDebugObjectEdges(int xstart, int width, int ystart, int height, bool drawborder) { }
 
-void ImageFilm::generateDebugFacesEdges(int num_view, int idx_pass, int xstart, int width, int ystart, int height, bool drawborder, ColorOutput *out_1, int out_1_displacement, ColorOutput *out_2, int out_2_displacement) { }
+void ImageFilm::generateDebugFacesEdges(int xstart, int width, int ystart, int height, bool drawborder) { }
 
 #endif
 
@@ -103,6 +103,72 @@ ImageSplitter::ImageSplitter(int w, int h, int x_0, int y_0, int bsize, TilesOrd
 	}
 
 	regions_.insert(regions_.end(), regions_subdivided.begin(), regions_subdivided.end());
+
+	//The areas are dealt in turns, so all the threads progress through the tiles order at the same pace and the smaller subdivided tiles end up at the back of every queue, where they are stolen first
+	num_queues_ = std::max(1, nthreads);
+	queues_ = std::unique_ptr<TileQueue[]>(new TileQueue[num_queues_]);
+	for(int rn = 0; rn < static_cast<int>(regions_.size()); ++rn) queues_[rn % num_queues_].regions_.push_back(rn);
+	resetQueues();
+}
+
+void ImageSplitter::resetQueues()
+{
+	for(int i = 0; i < num_queues_; ++i) queues_[i].range_.store(packRange(0, queues_[i].regions_.size()));
+}
+
+bool ImageSplitter::popFront(TileQueue &queue, int &region_index)
+{
+	uint64_t range = queue.range_.load(std::memory_order_relaxed);
+	while(rangeFront(range) < rangeBack(range))
+	{
+		if(queue.range_.compare_exchange_weak(range, packRange(rangeFront(range) + 1, rangeBack(range))))
+		{
+			region_index = queue.regions_[rangeFront(range)];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ImageSplitter::popBack(TileQueue &queue, int &region_index)
+{
+	uint64_t range = queue.range_.load(std::memory_order_relaxed);
+	while(rangeFront(range) < rangeBack(range))
+	{
+		if(queue.range_.compare_exchange_weak(range, packRange(rangeFront(range), rangeBack(range) - 1)))
+		{
+			region_index = queue.regions_[rangeBack(range) - 1];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ImageSplitter::nextArea(int thread_id, RenderArea &area)
+{
+	if(num_queues_ == 0) return false;
+	const int own_queue = thread_id % num_queues_;
+	int region_index = -1;
+	bool found = popFront(queues_[own_queue], region_index);
+	while(!found)
+	{
+		//Steal from the thread with most areas left. The areas stolen are the last ones of its queue, which are the smallest and the furthest from the ones it is rendering
+		int victim = -1;
+		uint32_t victim_left = 0;
+		for(int i = 0; i < num_queues_; ++i)
+		{
+			const uint64_t range = queues_[i].range_.load(std::memory_order_relaxed);
+			const uint32_t left = rangeFront(range) < rangeBack(range) ? rangeBack(range) - rangeFront(range) : 0;
+			if(left > victim_left)
+			{
+				victim = i;
+				victim_left = left;
+			}
+		}
+		if(victim < 0) return false;
+		found = popBack(queues_[victim], region_index);
+	}
+	return getArea(region_index, area);
 }
 
 bool ImageSplitter::getArea(int n, RenderArea &area)
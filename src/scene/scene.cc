@@ -151,6 +151,22 @@ void Scene::setNumThreadsPhotons(int threads_photons)
 	Y_PARAMS << "Using for Photon Mapping [" << nthreads_photons_ << "] Threads." << YENDL;
 }
 
+void Scene::setAcceleratorType(const std::string &accelerator_type)
+{
+	if(accelerator_type == accelerator_type_) return;
+	accelerator_type_ = accelerator_type;
+	creation_state_.changes_ |= CreationState::Flags::CGeom;
+	Y_PARAMS << "Using ray intersection accelerator '" << accelerator_type_ << "'" << YENDL;
+}
+
+void Scene::setAcceleratorCacheDir(const std::string &cache_dir, int cache_max_size)
+{
+	if(cache_dir == accelerator_cache_dir_ && cache_max_size == accelerator_cache_max_size_) return;
+	accelerator_cache_dir_ = cache_dir;
+	accelerator_cache_max_size_ = cache_max_size;
+	if(!accelerator_cache_dir_.empty()) Y_PARAMS << "Using ray intersection accelerator cache directory '" << accelerator_cache_dir_ << "' (max size: " << (accelerator_cache_max_size_ > 0 ? std::to_string(accelerator_cache_max_size_) + "MB" : "unlimited") << ")" << YENDL;
+}
+
 void Scene::setBackground(Background *bg)
 {
 	background_ = bg;
@@ -535,6 +551,7 @@ bool Scene::setupScene(Scene &scene, const ParamMap &params, ProgressBar *pb)
 	Y_DEBUG PRTEXT(**Scene::setupScene) PREND; params.printDebug();
 	std::string name;
 	std::string aa_dark_detection_type_string = "none";
+	std::string aa_resample_mode_string = "color_difference";
 	AaNoiseParams aa_noise_params;
 	int nthreads = -1, nthreads_photons = -1;
 	bool adv_auto_shadow_bias_enabled = true;
@@ -544,6 +561,9 @@ bool Scene::setupScene(Scene &scene, const ParamMap &params, ProgressBar *pb)
 	int adv_base_sampling_offset = 0;
 	int adv_computer_node = 0;
 	bool background_resampling = true;  //If false, the background will not be resampled in subsequent adaptative AA passes
+	std::string accelerator_type = accelerator_type_;
+	std::string accelerator_cache_dir = accelerator_cache_dir_;
+	int accelerator_cache_max_size = accelerator_cache_max_size_;
 
 	if(!params.getParam("integrator_name", name))
 	{
@@ -597,8 +617,13 @@ bool Scene::setupScene(Scene &scene, const ParamMap &params, ProgressBar *pb)
 	params.getParam("AA_variance_pixels", aa_noise_params.variance_pixels_);
 	params.getParam("AA_clamp_samples", aa_noise_params.clamp_samples_);
 	params.getParam("AA_clamp_indirect", aa_noise_params.clamp_indirect_);
+	params.getParam("AA_resample_mode", aa_resample_mode_string);
+	params.getParam("AA_convergence_target", aa_noise_params.convergence_target_);
 	params.getParam("threads", nthreads); // number of threads, -1 = auto detection
 	params.getParam("background_resampling", background_resampling);
+	params.getParam("scene_accelerator", accelerator_type);
+	params.getParam("scene_accelerator_cache_dir", accelerator_cache_dir);
+	params.getParam("scene_accelerator_cache_max_size", accelerator_cache_max_size); //in MB, 0 for no limit
 
 	nthreads_photons = nthreads;	//if no "threads_photons" parameter exists, make "nthreads_photons" equal to render threads
 
@@ -630,11 +655,16 @@ bool Scene::setupScene(Scene &scene, const ParamMap &params, ProgressBar *pb)
 	else if(aa_dark_detection_type_string == "curve") aa_noise_params.dark_detection_type_ = AaNoiseParams::DarkDetectionType::Curve;
 	else aa_noise_params.dark_detection_type_ = AaNoiseParams::DarkDetectionType::None;
 
+	if(aa_resample_mode_string == "convergence") aa_noise_params.resample_mode_ = AaNoiseParams::ResampleMode::Convergence;
+	else aa_noise_params.resample_mode_ = AaNoiseParams::ResampleMode::ColorDifference;
+
 	scene.setSurfIntegrator(static_cast<SurfaceIntegrator *>(integrator));
 	scene.setVolIntegrator(static_cast<VolumeIntegrator *>(volume_integrator));
 	scene.setAntialiasing(aa_noise_params);
 	scene.setNumThreads(nthreads);
 	scene.setNumThreadsPhotons(nthreads_photons);
+	scene.setAcceleratorType(accelerator_type);
+	scene.setAcceleratorCacheDir(accelerator_cache_dir, accelerator_cache_max_size);
 	if(background) scene.setBackground(background);
 	scene.shadow_bias_auto_ = adv_auto_shadow_bias_enabled;
 	scene.shadow_bias_ = adv_shadow_bias_value;
@@ -706,7 +736,7 @@ void Scene::defineLayer(const Layer::Type &layer_type, const Image::Type &image_
 void Scene::defineBasicLayers()
 {
 	//by default we will have an external/internal Combined layer
-	if(!layers_.isDefined(Layer::Combined)) defineLayer(Layer::Combined, Image::Type::ColorAlpha, Image::Type::ColorAlpha);
+	if(!layers_.find(Layer::Combined)) defineLayer(Layer::Combined, Image::Type::ColorAlpha, Image::Type::ColorAlpha);
 
 	//This auxiliary layer will always be needed for material-specific number of samples calculation
 	if(!layers_.isDefined(Layer::DebugSamplingFactor)) defineLayer(Layer::DebugSamplingFactor, Image::Type::Gray);
@@ -20,6 +20,8 @@
 #include "scene/scene_yafaray.h"
 #include "common/logger.h"
 #include "accelerator/accelerator_kdtree.h"
+#include "accelerator/accelerator_instances.h"
+#include "accelerator/accelerator_objects.h"
 #include "common/param.h"
 #include "light/light.h"
 #include "material/material.h"
@@ -40,6 +42,7 @@
 #include "geometry/primitive_triangle.h"
 #include "geometry/primitive_triangle_bspline_time.h"
 #include "geometry/surface.h"
+#include "geometry/ray_packet.h"
 
 BEGIN_YAFARAY
 
@@ -83,8 +86,7 @@ YafaRayScene::~YafaRayScene()
 
 void YafaRayScene::clearGeometry()
 {
-	if(tree_) { delete tree_; tree_ = nullptr; }
-	if(vtree_) { delete vtree_; vtree_ = nullptr; }
+	clearAccelerators();
 	for(auto &m : meshes_)
 	{
 		if(m.second.type_ == trim__) { delete m.second.obj_; m.second.obj_ = nullptr; }
@@ -109,6 +111,7 @@ bool YafaRayScene::startCurveMesh(const std::string &name, int vertices, int obj
 	n_obj.type_ = ptype;
 	creation_state_.stack_.push_front(CreationState::Object);
 	creation_state_.changes_ |= CreationState::Flags::CGeom;
+	tree_changed_ = true;
 	geometry_creation_state_.orco_ = false;
 	geometry_creation_state_.cur_obj_ = &n_obj;
 	return true;
@@ -250,6 +253,8 @@ bool YafaRayScene::startTriMesh(const std::string &name, int vertices, int trian
 	int ptype = type & 0xFF;
 	if(ptype != trim__ && type != vtrim__ && type != mtrim__) return false;
 
+	//New base objects only get their own tree when they are instanced, but replacing any existing mesh changes the main tree
+	if(!(type & basemesh__) || meshes_.find(name) != meshes_.end()) tree_changed_ = true;
 	auto &n_obj = meshes_[name];
 
 	switch(ptype)
@@ -467,6 +472,8 @@ ObjectGeometric *YafaRayScene::createObject(const std::string &name, ParamMap &p
        if(object)
        {
                objects_[name] = object;
+               tree_changed_ = true;
+               creation_state_.changes_ |= CreationState::Flags::CGeom;
                INFO_VERBOSE_SUCCESS(name, type);
                return object;
        }
@@ -497,45 +504,170 @@ ObjectGeometric *YafaRayScene::getObject(const std::string &name) const
 	return nullptr;
 }
 
+/*! World space bound of an instance, from the object space bound of its base object */
+inline Bound instanceBound__(const Bound &base_bound, const Matrix4 &obj_to_world)
+{
+	const Point3 corners[2] = { base_bound.a_, base_bound.g_ };
+	const Point3 p_0 = obj_to_world * base_bound.a_;
+	Bound bound(p_0, p_0);
+	for(int i = 1; i < 8; ++i)
+	{
+		bound.include(obj_to_world * Point3(corners[i & 1].x_, corners[(i >> 1) & 1].y_, corners[(i >> 2) & 1].z_));
+	}
+	return bound;
+}
+
+/*! World space bound of the primitives of an object */
+template<class T>
+static Bound objectBound__(const ObjectGeometric *object)
+{
+	std::vector<const T *> primitives(object->numPrimitives());
+	object->getPrimitives(primitives.data());
+	Bound bound = primitives.front()->getBound();
+	for(size_t i = 1; i < primitives.size(); ++i) bound = Bound(bound, primitives[i]->getBound());
+	return bound;
+}
+
+/*! Builds the top level over the objects. The objects are grouped as decided by
+	the top level, and each group will share an accelerator. The bounds of the objects
+	are kept across updates, only the bounds of the new objects are computed */
+template<class T>
+static AcceleratorObjects<T> *buildObjectsTree__(const std::vector<const ObjectGeometric *> &objects, std::map<const ObjectGeometric *, Bound> &object_bounds, std::vector<ObjectGroup_t> &groups)
+{
+	std::map<const ObjectGeometric *, Bound> used_object_bounds;
+	std::vector<Bound> bounds;
+	for(const ObjectGeometric *object : objects)
+	{
+		auto object_bound = object_bounds.find(object);
+		bounds.push_back((object_bound != object_bounds.end()) ? object_bound->second : objectBound__<T>(object));
+		used_object_bounds[object] = bounds.back();
+	}
+	object_bounds.swap(used_object_bounds);
+	if(objects.empty()) return nullptr;
+	AcceleratorObjects<T> *objects_tree = new AcceleratorObjects<T>(bounds);
+	for(const auto &object_indices : objects_tree->getGroups())
+	{
+		ObjectGroup_t group;
+		for(const uint32_t index : object_indices) group.push_back(objects[index]);
+		std::sort(group.begin(), group.end());
+		groups.push_back(group);
+	}
+	return objects_tree;
+}
+
+/*! Updates the object space accelerators of the groups of objects, which are kept across
+	geometry updates. Only the groups without an accelerator yet are built, and the trees
+	of the groups no longer used are freed.
+	\return true if any tree was built or freed */
+template<class T>
+static bool updateObjectTrees__(const std::vector<ObjectGroup_t> &groups, std::map<ObjectGroup_t, Accelerator<T> *> &trees, ParamMap &params)
+{
+	std::map<ObjectGroup_t, Accelerator<T> *> used_trees;
+	int n_kept = 0, n_built = 0;
+	for(const auto &group : groups)
+	{
+		if(used_trees.find(group) != used_trees.end()) continue;
+		auto tree = trees.find(group);
+		if(tree != trees.end())
+		{
+			used_trees[group] = tree->second;
+			trees.erase(tree);
+			++n_kept;
+			continue;
+		}
+		int n_primitives = 0;
+		for(const ObjectGeometric *object : group) n_primitives += object->numPrimitives();
+		std::vector<const T *> primitives(n_primitives);
+		const T **insert = primitives.data();
+		for(const ObjectGeometric *object : group) insert += object->getPrimitives(insert);
+		params["num_primitives"] = n_primitives;
+		Accelerator<T> *group_tree = Accelerator<T>::factory(primitives.data(), params);
+		if(!group_tree) continue;
+		used_trees[group] = group_tree;
+		++n_built;
+	}
+	//Trees of groups no longer used
+	const size_t n_freed = trees.size();
+	for(auto &tree : trees) delete tree.second;
+	trees.swap(used_trees);
+	Y_INFO << "Scene: Object trees: " << n_kept << " reused, " << n_built << " built, " << n_freed << " freed" << YENDL;
+	return n_built > 0 || n_freed > 0;
+}
+
+/*! Gives the top level the accelerator of each of its groups of objects
+	\return false if any of them could not be built */
+template<class T>
+static bool setGroupAccelerators__(AcceleratorObjects<T> *objects_tree, const std::vector<ObjectGroup_t> &groups, const std::map<ObjectGroup_t, Accelerator<T> *> &trees)
+{
+	for(size_t i = 0; i < groups.size(); ++i)
+	{
+		auto tree = trees.find(groups[i]);
+		if(tree == trees.end()) return false;
+		objects_tree->setGroupAccelerator(i, tree->second);
+	}
+	return true;
+}
+
+template<class T>
+static void freeObjectTrees__(std::map<ObjectGroup_t, Accelerator<T> *> &trees)
+{
+	for(auto &tree : trees) delete tree.second;
+	trees.clear();
+}
+
 bool YafaRayScene::updateGeometry()
 {
-	if(tree_) delete tree_;
-	if(vtree_) delete vtree_;
-	tree_ = nullptr, vtree_ = nullptr;
-	int nprims = 0;
+	if(accelerator_type_ != built_accelerator_type_)
+	{
+		//The acceleration data of another accelerator type cannot be reused
+		clearAccelerators();
+		built_accelerator_type_ = accelerator_type_;
+	}
+	if(!tree_changed_ && !instances_changed_ && (tree_ || vtree_ || instances_tree_))
+	{
+		Y_INFO << "Scene: No changes in the scene geometry, reusing its accelerators" << YENDL;
+		return true;
+	}
+	ParamMap params;
+	params["type"] = accelerator_type_;
+	params["depth"] = -1;
+	params["leaf_size"] = (accelerator_type_ == "bvh") ? 4 : 1; //each accelerator with its own default leaf size
+	params["cost_ratio"] = 0.8f;
+	params["empty_bonus"] = 0.33f;
+	params["num_threads"] = nthreads_;
+	params["cache_dir"] = accelerator_cache_dir_;
+	params["cache_max_size"] = accelerator_cache_max_size_;
 	if(mode_ == 0)
 	{
+		if(vtree_) { delete vtree_; vtree_ = nullptr; }
+		freeObjectTrees__(primitive_trees_);
+		//Each group of meshes and each instanced base object has its own tree. The instances are not added
+		//to the main top level, but to a two-level accelerator sharing the tree of each base object
+		std::vector<const ObjectGeometric *> mesh_objects;
+		std::vector<ObjectGroup_t> groups;
 		for(const auto &m : meshes_)
 		{
-			if(!m.second.obj_->isVisible()) continue;
-			if(m.second.obj_->isBaseObject()) continue;
-
-			if(m.second.type_ == trim__) nprims += m.second.obj_->numPrimitives();
-		}
-		if(nprims > 0)
-		{
-			const Triangle **tris = new const Triangle *[nprims];
-			const Triangle **insert = tris;
-			for(const auto &m : meshes_)
+			if(m.second.type_ != trim__ || !m.second.obj_->isVisible()) continue;
+			const TriangleObjectInstance *instance = dynamic_cast<const TriangleObjectInstance *>(m.second.obj_);
+			if(instance)
 			{
-				if(!m.second.obj_->isVisible()) continue;
-				if(m.second.obj_->isBaseObject()) continue;
-
-				if(m.second.type_ == trim__) insert += m.second.obj_->getPrimitives(insert);
+				if(!instance->getBaseTriangleObject()->getTriangles().empty()) groups.push_back(ObjectGroup_t(1, instance->getBaseTriangleObject()));
 			}
-
-			ParamMap params;
-			params["type"] = std::string("kdtree"); //Do not remove the std::string(), entering directly a string literal can be confused with bool until C++17 new string literals
-			params["num_primitives"] = nprims;
-			params["depth"] = -1;
-			params["leaf_size"] = 1;
-			params["cost_ratio"] = 0.8f;
-			params["empty_bonus"] = 0.33f;
-
-			tree_ = Accelerator<Triangle>::factory(tris, params);
-
-			delete [] tris;
-			scene_bound_ = tree_->getBound();
+			else if(!m.second.obj_->isBaseObject() && m.second.obj_->numPrimitives() > 0) mesh_objects.push_back(m.second.obj_);
+		}
+		if(tree_) { delete tree_; tree_ = nullptr; }
+		std::vector<ObjectGroup_t> mesh_groups;
+		AcceleratorObjects<Triangle> *meshes_tree = buildObjectsTree__<Triangle>(mesh_objects, object_bounds_, mesh_groups);
+		groups.insert(groups.end(), mesh_groups.begin(), mesh_groups.end());
+		updateObjectTrees__(groups, triangle_trees_, params);
+		if(meshes_tree && !setGroupAccelerators__(meshes_tree, mesh_groups, triangle_trees_)) { delete meshes_tree; meshes_tree = nullptr; }
+		tree_ = meshes_tree;
+		updateInstances();
+
+		if(tree_ || instances_tree_)
+		{
+			if(tree_ && instances_tree_) scene_bound_ = Bound(tree_->getBound(), instances_tree_->getBound());
+			else scene_bound_ = tree_ ? tree_->getBound() : instances_tree_->getBound();
 			Y_VERBOSE << "Scene: New scene bound is:" <<
 					  "(" << scene_bound_.a_.x_ << ", " << scene_bound_.a_.y_ << ", " << scene_bound_.a_.z_ << "), (" <<
 					  scene_bound_.g_.x_ << ", " << scene_bound_.g_.y_ << ", " << scene_bound_.g_.z_ << ")" << YENDL;
@@ -549,39 +681,28 @@ bool YafaRayScene::updateGeometry()
 	}
 	else
 	{
+		if(tree_) { delete tree_; tree_ = nullptr; }
+		if(instances_tree_) { delete instances_tree_; instances_tree_ = nullptr; }
+		freeObjectTrees__(triangle_trees_);
+		std::vector<const ObjectGeometric *> objects;
 		for(const auto &m : meshes_)
 		{
-			if(m.second.type_ != trim__) nprims += m.second.mobj_->numPrimitives();
+			if(m.second.type_ != trim__ && m.second.mobj_->numPrimitives() > 0) objects.push_back(m.second.mobj_);
 		}
 		// include all non-mesh objects; eventually make a common map...
 		for(const auto &o : objects_)
 		{
-			nprims += o.second->numPrimitives();
+			if(o.second->numPrimitives() > 0) objects.push_back(o.second);
 		}
-		if(nprims > 0)
-		{
-			const Primitive **tris = new const Primitive *[nprims];
-			const Primitive **insert = tris;
-			for(const auto &m : meshes_)
-			{
-				if(m.second.type_ != trim__) insert += m.second.mobj_->getPrimitives(insert);
-			}
-			for(const auto &o : objects_)
-			{
-				insert += o.second->getPrimitives(insert);
-			}
-
-			ParamMap params;
-			params["type"] = std::string("kdtree"); //Do not remove the std::string(), entering directly a string literal can be confused with bool until C++17 new string literals
-			params["num_primitives"] = nprims;
-			params["depth"] = -1;
-			params["leaf_size"] = 1;
-			params["cost_ratio"] = 0.8f;
-			params["empty_bonus"] = 0.33f;
-
-			vtree_ = Accelerator<Primitive>::factory(tris, params);
+		if(vtree_) { delete vtree_; vtree_ = nullptr; }
+		std::vector<ObjectGroup_t> groups;
+		AcceleratorObjects<Primitive> *objects_tree = buildObjectsTree__<Primitive>(objects, object_bounds_, groups);
+		updateObjectTrees__(groups, primitive_trees_, params);
+		if(objects_tree && !setGroupAccelerators__(objects_tree, groups, primitive_trees_)) { delete objects_tree; objects_tree = nullptr; }
+		vtree_ = objects_tree;
 
-			delete [] tris;
+		if(vtree_)
+		{
 			scene_bound_ = vtree_->getBound();
 			Y_VERBOSE << "Scene: New scene bound is:" << YENDL <<
 					  "(" << scene_bound_.a_.x_ << ", " << scene_bound_.a_.y_ << ", " << scene_bound_.a_.z_ << "), (" <<
@@ -595,6 +716,60 @@ bool YafaRayScene::updateGeometry()
 		}
 		else Y_ERROR << "Scene: Scene is empty..." << YENDL;
 	}
+	tree_changed_ = false;
+	instances_changed_ = false;
+	return true;
+}
+
+/*! Rebuilds the top level of the instances accelerator over the object space
+	trees of their base objects, updated before with the trees of the meshes */
+void YafaRayScene::updateInstances()
+{
+	if(instances_tree_) { delete instances_tree_; instances_tree_ = nullptr; }
+	std::vector<AcceleratorInstance> instances;
+	for(const auto &m : meshes_)
+	{
+		if(m.second.type_ != trim__) continue;
+		const TriangleObjectInstance *instance = dynamic_cast<const TriangleObjectInstance *>(m.second.obj_);
+		if(!instance || !instance->isVisible()) continue;
+		auto base_tree = triangle_trees_.find(ObjectGroup_t(1, instance->getBaseTriangleObject()));
+		if(base_tree == triangle_trees_.end()) continue;
+		Matrix4 world_to_obj = instance->getObjToWorldMatrix();
+		world_to_obj.inverse();
+		instances.push_back({instance, base_tree->second, world_to_obj, instanceBound__(base_tree->second->getBound(), instance->getObjToWorldMatrix())});
+	}
+	if(!instances.empty()) instances_tree_ = new AcceleratorInstances(std::move(instances));
+}
+
+void YafaRayScene::clearAccelerators()
+{
+	if(tree_) { delete tree_; tree_ = nullptr; }
+	if(vtree_) { delete vtree_; vtree_ = nullptr; }
+	if(instances_tree_) { delete instances_tree_; instances_tree_ = nullptr; }
+	freeObjectTrees__(triangle_trees_);
+	freeObjectTrees__(primitive_trees_);
+	object_bounds_.clear();
+	tree_changed_ = true;
+	instances_changed_ = true;
+}
+
+/*! Closest hit in the object instances within dist, in triangle-only mode. The surface
+	point is computed with a temporary triangle instance, so the triangles of the base
+	objects don't need to be duplicated for each instance */
+bool YafaRayScene::intersectInstances(const Ray &ray, float dist, SurfacePoint &sp, float &z) const
+{
+	if(!instances_tree_) return false;
+	Triangle *hitt = nullptr;
+	const TriangleObjectInstance *instance = nullptr;
+	float instance_z;
+	IntersectData data;
+	if(!instances_tree_->intersect(ray, dist, &hitt, &instance, instance_z, data)) return false;
+	z = instance_z;
+	const Point3 h = ray.from_ + z * ray.dir_;
+	const TriangleInstance triangle_instance(hitt, instance);
+	triangle_instance.getSurface(sp, h, data);
+	sp.origin_ = hitt;
+	sp.data_ = data;
 	return true;
 }
 
@@ -607,14 +782,18 @@ bool YafaRayScene::intersect(const Ray &ray, SurfacePoint &sp) const
 	// intersect with tree:
 	if(mode_ == 0)
 	{
-		if(!tree_) return false;
 		Triangle *hitt = nullptr;
-		if(!tree_->intersect(ray, dis, &hitt, z, data)) { return false; }
-		Point3 h = ray.from_ + z * ray.dir_;
-		hitt->getSurface(sp, h, data);
-		sp.origin_ = hitt;
-		sp.data_ = data;
-		sp.ray_ = nullptr;
+		const bool hit = tree_ && tree_->intersect(ray, dis, &hitt, z, data);
+		if(intersectInstances(ray, hit ? z : dis, sp, z)) sp.ray_ = nullptr;
+		else if(hit)
+		{
+			Point3 h = ray.from_ + z * ray.dir_;
+			hitt->getSurface(sp, h, data);
+			sp.origin_ = hitt;
+			sp.data_ = data;
+			sp.ray_ = nullptr;
+		}
+		else return false;
 	}
 	else
 	{
@@ -640,14 +819,18 @@ bool YafaRayScene::intersect(const DiffRay &ray, SurfacePoint &sp) const
 	// intersect with tree:
 	if(mode_ == 0)
 	{
-		if(!tree_) return false;
 		Triangle *hitt = nullptr;
-		if(!tree_->intersect(ray, dis, &hitt, z, data)) { return false; }
-		Point3 h = ray.from_ + z * ray.dir_;
-		hitt->getSurface(sp, h, data);
-		sp.origin_ = hitt;
-		sp.data_ = data;
-		sp.ray_ = &ray;
+		const bool hit = tree_ && tree_->intersect(ray, dis, &hitt, z, data);
+		if(intersectInstances(ray, hit ? z : dis, sp, z)) sp.ray_ = &ray;
+		else if(hit)
+		{
+			Point3 h = ray.from_ + z * ray.dir_;
+			hitt->getSurface(sp, h, data);
+			sp.origin_ = hitt;
+			sp.data_ = data;
+			sp.ray_ = &ray;
+		}
+		else return false;
 	}
 	else
 	{
@@ -664,6 +847,183 @@ bool YafaRayScene::intersect(const DiffRay &ray, SurfacePoint &sp) const
 	return true;
 }
 
+void YafaRayScene::intersect(const DiffRay *rays, int n_rays, SurfacePoint *sp, bool *hit) const
+{
+	RayPacket packet;
+	Triangle *hitt[RayPacket::max_size_];
+	Primitive *hitprim[RayPacket::max_size_];
+	float z[RayPacket::max_size_];
+	IntersectData data[RayPacket::max_size_];
+	for(int first = 0; first < n_rays; first += RayPacket::max_size_)
+	{
+		packet.clear();
+		for(int i = first; i < n_rays && !packet.full(); ++i)
+		{
+			if(rays[i].tmax_ < 0) packet.add(rays[i], std::numeric_limits<float>::infinity());
+			else packet.add(rays[i], rays[i].tmax_);
+		}
+		// intersect with tree:
+		if(mode_ == 0)
+		{
+			if(tree_) tree_->intersect(packet, hitt, z, data);
+			for(int i = 0; i < packet.size(); ++i)
+			{
+				const DiffRay &ray = rays[first + i];
+				hit[first + i] = tree_ && hitt[i];
+				if(intersectInstances(ray, hit[first + i] ? z[i] : packet.dist_[i], sp[first + i], z[i]))
+				{
+					hit[first + i] = true;
+					sp[first + i].ray_ = &ray;
+					ray.tmax_ = z[i];
+					continue;
+				}
+				if(!hit[first + i]) continue;
+				Point3 h = ray.from_ + z[i] * ray.dir_;
+				hitt[i]->getSurface(sp[first + i], h, data[i]);
+				sp[first + i].origin_ = hitt[i];
+				sp[first + i].data_ = data[i];
+				sp[first + i].ray_ = &ray;
+				ray.tmax_ = z[i];
+			}
+		}
+		else
+		{
+			if(vtree_) vtree_->intersect(packet, hitprim, z, data);
+			for(int i = 0; i < packet.size(); ++i)
+			{
+				const DiffRay &ray = rays[first + i];
+				hit[first + i] = vtree_ && hitprim[i];
+				if(!hit[first + i]) continue;
+				Point3 h = ray.from_ + z[i] * ray.dir_;
+				hitprim[i]->getSurface(sp[first + i], h, data[i]);
+				sp[first + i].origin_ = hitprim[i];
+				sp[first + i].data_ = data[i];
+				sp[first + i].ray_ = &ray;
+				ray.tmax_ = z[i];
+			}
+		}
+	}
+}
+
+/*! Shadow test which first checks the primitive that occluded the previous
+	shadow ray towards the same light (if any), skipping the traversal of the
+	accelerator when it still occludes this ray */
+template<class T>
+inline bool intersectSCached__(const Accelerator<T> &accelerator, const Ray &ray, float dist, T **tr, float shadow_bias, T **last_occluder)
+{
+	if(last_occluder && *last_occluder && Accelerator<T>::primitiveOccludes(**last_occluder, ray, dist))
+	{
+		*tr = *last_occluder;
+		return true;
+	}
+	const bool shadowed = accelerator.intersectS(ray, dist, tr, shadow_bias);
+	if(shadowed && last_occluder) *last_occluder = *tr;
+	return shadowed;
+}
+
+/*! Same for up to RayPacket::max_size_ rays: only the rays not occluded by the last occluder are traversed, as a ray packet */
+template<class T>
+inline void intersectSCached__(const Accelerator<T> &accelerator, const Ray *rays, const float *dist, int n_rays, bool *shadowed, T **tr, float shadow_bias, T **last_occluder)
+{
+	RayPacket packet;
+	int packet_rays[RayPacket::max_size_];
+	for(int i = 0; i < n_rays; ++i)
+	{
+		if(last_occluder && *last_occluder && Accelerator<T>::primitiveOccludes(**last_occluder, rays[i], dist[i]))
+		{
+			shadowed[i] = true;
+			tr[i] = *last_occluder;
+		}
+		else
+		{
+			packet_rays[packet.size()] = i;
+			packet.add(rays[i], dist[i]);
+		}
+	}
+	if(packet.empty()) return;
+	T *packet_tr[RayPacket::max_size_];
+	bool packet_shadowed[RayPacket::max_size_];
+	accelerator.intersectS(packet, packet_tr, packet_shadowed, shadow_bias);
+	for(int j = 0; j < packet.size(); ++j)
+	{
+		const int i = packet_rays[j];
+		shadowed[i] = packet_shadowed[j];
+		tr[i] = packet_tr[j];
+		if(shadowed[i] && last_occluder) *last_occluder = tr[i];
+	}
+}
+
+void YafaRayScene::isShadowed(RenderData &render_data, const Ray *rays, int n_rays, bool *shadowed, float *obj_index, float *mat_index) const
+{
+	Ray srays[RayPacket::max_size_];
+	float dist[RayPacket::max_size_];
+	Triangle *hitt[RayPacket::max_size_];
+	const TriangleObjectInstance *instance[RayPacket::max_size_];
+	Primitive *hitprim[RayPacket::max_size_];
+	ShadowCache *shadow_cache = render_data.shadow_light_ ? &render_data.shadow_cache_[render_data.shadow_light_] : nullptr;
+	//The indices of the last occluder found are carried from each ray to the next ones, as when testing the rays one at a time
+	float last_obj_index = obj_index[0], last_mat_index = mat_index[0];
+	for(int first = 0; first < n_rays; first += RayPacket::max_size_)
+	{
+		const int n_packet = std::min(RayPacket::max_size_, n_rays - first);
+		for(int i = 0; i < n_packet; ++i)
+		{
+			const Ray &ray = rays[first + i];
+			Ray &sray = srays[i];
+			sray = ray;
+			sray.from_ += sray.dir_ * sray.tmin_;
+			sray.time_ = render_data.time_;
+			if(ray.tmax_ < 0) dist[i] = std::numeric_limits<float>::infinity();
+			else dist[i] = sray.tmax_ - 2 * sray.tmin_;
+		}
+		if(mode_ == 0)
+		{
+			for(int i = 0; i < n_packet; ++i)
+			{
+				shadowed[first + i] = false;
+				hitt[i] = nullptr;
+				instance[i] = nullptr;
+			}
+			if(tree_) intersectSCached__(*tree_, srays, dist, n_packet, &shadowed[first], hitt, shadow_bias_, shadow_cache ? &shadow_cache->triangle_ : nullptr);
+			for(int i = 0; i < n_packet; ++i)
+			{
+				if(!shadowed[first + i] && instances_tree_) shadowed[first + i] = instances_tree_->intersectS(srays[i], dist[i], &hitt[i], &instance[i], shadow_bias_);
+				if(hitt[i])
+				{
+					const TriangleObject *mesh = instance[i] ? instance[i] : hitt[i]->getMesh();
+					if(mesh) last_obj_index = mesh->getAbsObjectIndex();	//Object index of the object casting the shadow
+					if(hitt[i]->getMaterial()) last_mat_index = hitt[i]->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
+				}
+				obj_index[first + i] = last_obj_index;
+				mat_index[first + i] = last_mat_index;
+			}
+		}
+		else
+		{
+			if(!vtree_)
+			{
+				for(int i = 0; i < n_packet; ++i)
+				{
+					shadowed[first + i] = false;
+					obj_index[first + i] = last_obj_index;
+					mat_index[first + i] = last_mat_index;
+				}
+				continue;
+			}
+			intersectSCached__(*vtree_, srays, dist, n_packet, &shadowed[first], hitprim, shadow_bias_, shadow_cache ? &shadow_cache->primitive_ : nullptr);
+			for(int i = 0; i < n_packet; ++i)
+			{
+				if(hitprim[i])
+				{
+					if(hitprim[i]->getMaterial()) last_mat_index = hitprim[i]->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
+				}
+				obj_index[first + i] = last_obj_index;
+				mat_index[first + i] = last_mat_index;
+			}
+		}
+	}
+}
+
 bool YafaRayScene::isShadowed(RenderData &render_data, const Ray &ray, float &obj_index, float &mat_index) const
 {
 
@@ -673,14 +1033,18 @@ bool YafaRayScene::isShadowed(RenderData &render_data, const Ray &ray, float &ob
 	float dis;
 	if(ray.tmax_ < 0) dis = std::numeric_limits<float>::infinity();
 	else  dis = sray.tmax_ - 2 * sray.tmin_;
+	ShadowCache *shadow_cache = render_data.shadow_light_ ? &render_data.shadow_cache_[render_data.shadow_light_] : nullptr;
 	if(mode_ == 0)
 	{
 		Triangle *hitt = nullptr;
-		if(!tree_) return false;
-		bool shadowed = tree_->intersectS(sray, dis, &hitt, shadow_bias_);
+		const TriangleObjectInstance *instance = nullptr;
+		if(!tree_ && !instances_tree_) return false;
+		bool shadowed = tree_ && intersectSCached__(*tree_, sray, dis, &hitt, shadow_bias_, shadow_cache ? &shadow_cache->triangle_ : nullptr);
+		if(!shadowed && instances_tree_) shadowed = instances_tree_->intersectS(sray, dis, &hitt, &instance, shadow_bias_);
 		if(hitt)
 		{
-			if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+			const TriangleObject *mesh = instance ? instance : hitt->getMesh();
+			if(mesh) obj_index = mesh->getAbsObjectIndex();	//Object index of the object casting the shadow
 			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
 		}
 		return shadowed;
@@ -689,7 +1053,7 @@ bool YafaRayScene::isShadowed(RenderData &render_data, const Ray &ray, float &ob
 	{
 		Primitive *hitt = nullptr;
 		if(!vtree_) return false;
-		bool shadowed = vtree_->intersectS(sray, dis, &hitt, shadow_bias_);
+		bool shadowed = intersectSCached__(*vtree_, sray, dis, &hitt, shadow_bias_, shadow_cache ? &shadow_cache->primitive_ : nullptr);
 		if(hitt)
 		{
 			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
@@ -713,14 +1077,15 @@ bool YafaRayScene::isShadowed(RenderData &render_data, const Ray &ray, int max_d
 	if(mode_ == 0)
 	{
 		Triangle *hitt = nullptr;
-		if(tree_)
+		const TriangleObjectInstance *instance = nullptr;
+		int depth = 0;
+		if(tree_) isect = tree_->intersectTs(render_data, sray, max_depth, dis, &hitt, filt, shadow_bias_, depth, nullptr);
+		if(!isect && instances_tree_) isect = instances_tree_->intersectTs(render_data, sray, max_depth, dis, &hitt, &instance, filt, shadow_bias_, depth);
+		if(hitt)
 		{
-			isect = tree_->intersectTs(render_data, sray, max_depth, dis, &hitt, filt, shadow_bias_);
-			if(hitt)
-			{
-				if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
-				if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
-			}
+			const TriangleObject *mesh = instance ? instance : hitt->getMesh();
+			if(mesh) obj_index = mesh->getAbsObjectIndex();	//Object index of the object casting the shadow
+			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
 		}
 	}
 	else
@@ -760,6 +1125,8 @@ bool YafaRayScene::addInstance(const std::string &base_object_name, const Matrix
 		ObjData &base = meshes_[base_object_name];
 		Y_DEBUG << "  " PRTEXT(Instance:) PR(instance_name) PR(base_object_name) PREND;
 		od.obj_ = new TriangleObjectInstance(base.obj_, obj_to_world);
+		instances_changed_ = true;
+		creation_state_.changes_ |= CreationState::Flags::CGeom;
 		return true;
 	}
 	else
@@ -20,6 +20,7 @@
  */
 
 #include "texture/texture_image.h"
+#include "image/image_buffers.h"
 #include "common/session.h"
 #include "common/string.h"
 #include "common/param.h"
@@ -36,38 +37,93 @@ BEGIN_YAFARAY
 
 float *ImageTexture::ewa_weight_lut_ = nullptr;
 
-ImageTexture::ImageTexture(Image &&image)
+template <class T> static inline Rgba texelColor__(const T &texel) { return texel.getColor(); }
+static inline Rgba texelColor__(const Rgb &texel) { return texel; }
+
+/*! The texels are copied to a tiled buffer of the pixel type of the image, and
+	the interpolation functions are bound to that type here, once, so the texel
+	fetches do not need to check the image type and optimization */
+ImageTexture::ImageTexture(const Image &image) : width_(image.getWidth()), height_(image.getHeight())
+{
+	switch(image.getType())
+	{
+		case Image::Type::ColorAlphaWeight: setTexels<Pixel>(image); break;
+		case Image::Type::ColorAlpha:
+			switch(image.getOptimization())
+			{
+				default:
+				case Image::Optimization::None: setTexels<RgbAlpha>(image); break;
+				case Image::Optimization::Optimized: setTexels<Rgba1010108>(image); break;
+				case Image::Optimization::Compressed: setTexels<Rgba7773>(image); break;
+			}
+			break;
+		case Image::Type::Color:
+			switch(image.getOptimization())
+			{
+				default:
+				case Image::Optimization::None: setTexels<Rgb>(image); break;
+				case Image::Optimization::Optimized: setTexels<Rgb101010>(image); break;
+				case Image::Optimization::Compressed: setTexels<Rgb565>(image); break;
+			}
+			break;
+		case Image::Type::GrayWeight: setTexels<PixelGray>(image); break;
+		case Image::Type::GrayAlpha: setTexels<GrayAlpha>(image); break;
+		case Image::Type::GrayAlphaWeight: setTexels<PixelGrayAlpha>(image); break;
+		case Image::Type::Gray:
+			switch(image.getOptimization())
+			{
+				default:
+				case Image::Optimization::None: setTexels<Gray>(image); break;
+				case Image::Optimization::Optimized:
+				case Image::Optimization::Compressed: setTexels<Gray8>(image); break;
+			}
+			break;
+		default: setTexels<RgbAlpha>(image); break; //image without buffer, all the texels are black
+	}
+}
+
+template <class T>
+void ImageTexture::setTexels(const Image &image)
 {
-	images_.emplace_back(image);
+	std::shared_ptr<TiledImageBuffer2D<T>> texels = std::make_shared<TiledImageBuffer2D<T>>(width_, height_);
+	const ImageBuffer2D<T> *buffer = static_cast<const ImageBuffer2D<T> *>(image.getBuffer());
+	if(buffer)
+	{
+		for(int x = 0; x < width_; ++x) for(int y = 0; y < height_; ++y) (*texels)(x, y) = (*buffer)(x, y);
+	}
+	texels_.push_back(texels);
+	interpolate_image_ = &ImageTexture::interpolateImage<T>;
+	generate_mipmaps_ = &ImageTexture::generateMipMaps<T>;
 }
 
 void ImageTexture::resolution(int &x, int &y, int &z) const
 {
-	x = images_.at(0).getWidth();
-	y = images_.at(0).getHeight();
+	x = width_;
+	y = height_;
 	z = 0;
 }
 
+template <class T>
 Rgba ImageTexture::interpolateImage(const Point3 &p, const MipMapParams *mipmap_params) const
 {
-	if(mipmap_params && mipmap_params->force_image_level_ > 0.f) return mipMapsTrilinearInterpolation(p, mipmap_params);
+	if(mipmap_params && mipmap_params->force_image_level_ > 0.f) return mipMapsTrilinearInterpolation<T>(p, mipmap_params);
 
 	Rgba interpolated_color(0.f);
 
 	switch(interpolation_type_)
 	{
-		case InterpolationType::None: interpolated_color = noInterpolation(p); break;
-		case InterpolationType::Bicubic: interpolated_color = bicubicInterpolation(p); break;
+		case InterpolationType::None: interpolated_color = noInterpolation<T>(p); break;
+		case InterpolationType::Bicubic: interpolated_color = bicubicInterpolation<T>(p); break;
 		case InterpolationType::Trilinear:
-			if(mipmap_params) interpolated_color = mipMapsTrilinearInterpolation(p, mipmap_params);
-			else interpolated_color = bilinearInterpolation(p);
+			if(mipmap_params) interpolated_color = mipMapsTrilinearInterpolation<T>(p, mipmap_params);
+			else interpolated_color = bilinearInterpolation<T>(p);
 			break;
 		case InterpolationType::Ewa:
-			if(mipmap_params) interpolated_color = mipMapsEwaInterpolation(p, ewa_max_anisotropy_, mipmap_params);
-			else interpolated_color = bilinearInterpolation(p);
+			if(mipmap_params) interpolated_color = mipMapsEwaInterpolation<T>(p, ewa_max_anisotropy_, mipmap_params);
+			else interpolated_color = bilinearInterpolation<T>(p);
 			break;
 		default: //By default use Bilinear
-		case InterpolationType::Bilinear: interpolated_color = bilinearInterpolation(p); break;
+		case InterpolationType::Bilinear: interpolated_color = bilinearInterpolation<T>(p); break;
 	}
 	return interpolated_color;
 }
@@ -78,7 +134,7 @@ Rgba ImageTexture::getColor(const Point3 &p, const MipMapParams *mipmap_params)
 	Rgba ret(0.f);
 	const bool outside = doMapping(p_1);
 	if(outside) return ret;
-	ret = interpolateImage(p_1, mipmap_params);
+	ret = (this->*interpolate_image_)(p_1, mipmap_params);
 	return applyAdjustments(ret);
 }
 
@@ -239,10 +295,12 @@ void ImageTexture::findTextureInterpolationCoordinates(int &coord_0, int &coord_
 	}
 }
 
+template <class T>
 Rgba ImageTexture::noInterpolation(const Point3 &p, int mipmap_level) const
 {
-	const int resx = images_.at(mipmap_level).getWidth();
-	const int resy = images_.at(mipmap_level).getHeight();
+	const TiledImageBuffer2D<T> &texels = getTexels<T>(mipmap_level);
+	const int resx = texels.getWidth();
+	const int resy = texels.getHeight();
 
 	const float xf = (static_cast<float>(resx) * (p.x_ - floor(p.x_)));
 	const float yf = (static_cast<float>(resy) * (p.y_ - floor(p.y_)));
@@ -251,13 +309,15 @@ Rgba ImageTexture::noInterpolation(const Point3 &p, int mipmap_level) const
 	float dx, dy;
 	findTextureInterpolationCoordinates(x_0, x_1, x_2, x_3, dx, xf, resx, tex_clip_mode_ == ClipMode::Repeat, mirror_x_);
 	findTextureInterpolationCoordinates(y_0, y_1, y_2, y_3, dy, yf, resy, tex_clip_mode_ == ClipMode::Repeat, mirror_y_);
-	return images_.at(mipmap_level).getColor(x_1, y_1);
+	return texelColor__(texels(x_1, y_1));
 }
 
+template <class T>
 Rgba ImageTexture::bilinearInterpolation(const Point3 &p, int mipmap_level) const
 {
-	const int resx = images_.at(mipmap_level).getWidth();
-	const int resy = images_.at(mipmap_level).getHeight();
+	const TiledImageBuffer2D<T> &texels = getTexels<T>(mipmap_level);
+	const int resx = texels.getWidth();
+	const int resy = texels.getHeight();
 
 	const float xf = (static_cast<float>(resx) * (p.x_ - floor(p.x_))) - 0.5f;
 	const float yf = (static_cast<float>(resy) * (p.y_ - floor(p.y_))) - 0.5f;
@@ -267,10 +327,10 @@ Rgba ImageTexture::bilinearInterpolation(const Point3 &p, int mipmap_level) cons
 	findTextureInterpolationCoordinates(x_0, x_1, x_2, x_3, dx, xf, resx, tex_clip_mode_ == ClipMode::Repeat, mirror_x_);
 	findTextureInterpolationCoordinates(y_0, y_1, y_2, y_3, dy, yf, resy, tex_clip_mode_ == ClipMode::Repeat, mirror_y_);
 
-	const Rgba c_11 = images_.at(mipmap_level).getColor(x_1, y_1);
-	const Rgba c_21 = images_.at(mipmap_level).getColor(x_2, y_1);
-	const Rgba c_12 = images_.at(mipmap_level).getColor(x_1, y_2);
-	const Rgba c_22 = images_.at(mipmap_level).getColor(x_2, y_2);
+	const Rgba c_11 = texelColor__(texels(x_1, y_1));
+	const Rgba c_21 = texelColor__(texels(x_2, y_1));
+	const Rgba c_12 = texelColor__(texels(x_1, y_2));
+	const Rgba c_22 = texelColor__(texels(x_2, y_2));
 
 	const float w_11 = (1 - dx) * (1 - dy);
 	const float w_12 = (1 - dx) * dy;
@@ -280,10 +340,12 @@ Rgba ImageTexture::bilinearInterpolation(const Point3 &p, int mipmap_level) cons
 	return (w_11 * c_11) + (w_12 * c_12) + (w_21 * c_21) + (w_22 * c_22);
 }
 
+template <class T>
 Rgba ImageTexture::bicubicInterpolation(const Point3 &p, int mipmap_level) const
 {
-	const int resx = images_.at(mipmap_level).getWidth();
-	const int resy = images_.at(mipmap_level).getHeight();
+	const TiledImageBuffer2D<T> &texels = getTexels<T>(mipmap_level);
+	const int resx = texels.getWidth();
+	const int resy = texels.getHeight();
 
 	const float xf = (static_cast<float>(resx) * (p.x_ - floor(p.x_))) - 0.5f;
 	const float yf = (static_cast<float>(resy) * (p.y_ - floor(p.y_))) - 0.5f;
@@ -293,25 +355,25 @@ Rgba ImageTexture::bicubicInterpolation(const Point3 &p, int mipmap_level) const
 	findTextureInterpolationCoordinates(x_0, x_1, x_2, x_3, dx, xf, resx, tex_clip_mode_ == ClipMode::Repeat, mirror_x_);
 	findTextureInterpolationCoordinates(y_0, y_1, y_2, y_3, dy, yf, resy, tex_clip_mode_ == ClipMode::Repeat, mirror_y_);
 
-	const Rgba c_00 = images_.at(mipmap_level).getColor(x_0, y_0);
-	const Rgba c_01 = images_.at(mipmap_level).getColor(x_0, y_1);
-	const Rgba c_02 = images_.at(mipmap_level).getColor(x_0, y_2);
-	const Rgba c_03 = images_.at(mipmap_level).getColor(x_0, y_3);
+	const Rgba c_00 = texelColor__(texels(x_0, y_0));
+	const Rgba c_01 = texelColor__(texels(x_0, y_1));
+	const Rgba c_02 = texelColor__(texels(x_0, y_2));
+	const Rgba c_03 = texelColor__(texels(x_0, y_3));
 
-	const Rgba c_10 = images_.at(mipmap_level).getColor(x_1, y_0);
-	const Rgba c_11 = images_.at(mipmap_level).getColor(x_1, y_1);
-	const Rgba c_12 = images_.at(mipmap_level).getColor(x_1, y_2);
-	const Rgba c_13 = images_.at(mipmap_level).getColor(x_1, y_3);
+	const Rgba c_10 = texelColor__(texels(x_1, y_0));
+	const Rgba c_11 = texelColor__(texels(x_1, y_1));
+	const Rgba c_12 = texelColor__(texels(x_1, y_2));
+	const Rgba c_13 = texelColor__(texels(x_1, y_3));
 
-	const Rgba c_20 = images_.at(mipmap_level).getColor(x_2, y_0);
-	const Rgba c_21 = images_.at(mipmap_level).getColor(x_2, y_1);
-	const Rgba c_22 = images_.at(mipmap_level).getColor(x_2, y_2);
-	const Rgba c_23 = images_.at(mipmap_level).getColor(x_2, y_3);
+	const Rgba c_20 = texelColor__(texels(x_2, y_0));
+	const Rgba c_21 = texelColor__(texels(x_2, y_1));
+	const Rgba c_22 = texelColor__(texels(x_2, y_2));
+	const Rgba c_23 = texelColor__(texels(x_2, y_3));
 
-	const Rgba c_30 = images_.at(mipmap_level).getColor(x_3, y_0);
-	const Rgba c_31 = images_.at(mipmap_level).getColor(x_3, y_1);
-	const Rgba c_32 = images_.at(mipmap_level).getColor(x_3, y_2);
-	const Rgba c_33 = images_.at(mipmap_level).getColor(x_3, y_3);
+	const Rgba c_30 = texelColor__(texels(x_3, y_0));
+	const Rgba c_31 = texelColor__(texels(x_3, y_1));
+	const Rgba c_32 = texelColor__(texels(x_3, y_2));
+	const Rgba c_33 = texelColor__(texels(x_3, y_3));
 
 	const Rgba cy_0 = math::cubicInterpolate(c_00, c_10, c_20, c_30, dx);
 	const Rgba cy_1 = math::cubicInterpolate(c_01, c_11, c_21, c_31, dx);
@@ -321,24 +383,25 @@ Rgba ImageTexture::bicubicInterpolation(const Point3 &p, int mipmap_level) const
 	return math::cubicInterpolate(cy_0, cy_1, cy_2, cy_3, dy);
 }
 
+template <class T>
 Rgba ImageTexture::mipMapsTrilinearInterpolation(const Point3 &p, const MipMapParams *mipmap_params) const
 {
-	const float ds = std::max(std::abs(mipmap_params->ds_dx_), std::abs(mipmap_params->ds_dy_)) * images_.at(0).getWidth();
-	const float dt = std::max(std::abs(mipmap_params->dt_dx_), std::abs(mipmap_params->dt_dy_)) * images_.at(0).getHeight();
+	const float ds = std::max(std::abs(mipmap_params->ds_dx_), std::abs(mipmap_params->ds_dy_)) * width_;
+	const float dt = std::max(std::abs(mipmap_params->dt_dx_), std::abs(mipmap_params->dt_dy_)) * height_;
 	float mipmap_level = 0.5f * math::log2(ds * ds + dt * dt);
 
-	if(mipmap_params->force_image_level_ > 0.f) mipmap_level = mipmap_params->force_image_level_ * static_cast<float>(images_.size() - 1);
+	if(mipmap_params->force_image_level_ > 0.f) mipmap_level = mipmap_params->force_image_level_ * static_cast<float>(texels_.size() - 1);
 
 	mipmap_level += trilinear_level_bias_;
 
-	mipmap_level = std::min(std::max(0.f, mipmap_level), static_cast<float>(images_.size() - 1));
+	mipmap_level = std::min(std::max(0.f, mipmap_level), static_cast<float>(texels_.size() - 1));
 
 	const int mipmap_level_a = static_cast<int>(floor(mipmap_level));
 	const int mipmap_level_b = static_cast<int>(ceil(mipmap_level));
 	const float mipmap_level_delta = mipmap_level - static_cast<float>(mipmap_level_a);
 
-	Rgba col = bilinearInterpolation(p, mipmap_level_a);
-	const Rgba col_b = bilinearInterpolation(p, mipmap_level_b);
+	Rgba col = bilinearInterpolation<T>(p, mipmap_level_a);
+	const Rgba col_b = bilinearInterpolation<T>(p, mipmap_level_b);
 
 	col.blend(col_b, mipmap_level_delta);
 	return col;
@@ -346,6 +409,7 @@ Rgba ImageTexture::mipMapsTrilinearInterpolation(const Point3 &p, const MipMapPa
 
 //All EWA interpolation/calculation code has been adapted from PBRT v2 (https://github.com/mmp/pbrt-v2). see LICENSES file
 
+template <class T>
 Rgba ImageTexture::mipMapsEwaInterpolation(const Point3 &p, float max_anisotropy, const MipMapParams *mipmap_params) const
 {
 	float ds_0 = std::abs(mipmap_params->ds_dx_);
@@ -370,34 +434,34 @@ Rgba ImageTexture::mipMapsEwaInterpolation(const Point3 &p, float max_anisotropy
 		minor_length *= scale;
 	}
 
-	if(minor_length <= 0.f) return bilinearInterpolation(p);
+	if(minor_length <= 0.f) return bilinearInterpolation<T>(p);
 
-	float mipmap_level = static_cast<float>(images_.size() - 1) - 1.f + math::log2(minor_length);
-	mipmap_level = std::min(std::max(0.f, mipmap_level), static_cast<float>(images_.size() - 1));
+	float mipmap_level = static_cast<float>(texels_.size() - 1) - 1.f + math::log2(minor_length);
+	mipmap_level = std::min(std::max(0.f, mipmap_level), static_cast<float>(texels_.size() - 1));
 
 	const int mipmap_level_a = static_cast<int>(floor(mipmap_level));
 	const int mipmap_level_b = static_cast<int>(ceil(mipmap_level));
 	const float mipmap_level_delta = mipmap_level - static_cast<float>(mipmap_level_a);
 
-	Rgba col = ewaEllipticCalculation(p, ds_0, dt_0, ds_1, dt_1, mipmap_level_a);
-	const Rgba col_b = ewaEllipticCalculation(p, ds_0, dt_0, ds_1, dt_1, mipmap_level_b);
+	Rgba col = ewaEllipticCalculation<T>(p, ds_0, dt_0, ds_1, dt_1, mipmap_level_a);
+	const Rgba col_b = ewaEllipticCalculation<T>(p, ds_0, dt_0, ds_1, dt_1, mipmap_level_b);
 
 	col.blend(col_b, mipmap_level_delta);
 
 	return col;
 }
 
+template <class T>
 Rgba ImageTexture::ewaEllipticCalculation(const Point3 &p, float ds_0, float dt_0, float ds_1, float dt_1, int mipmap_level) const
 {
-	if(mipmap_level >= static_cast<float>(images_.size() - 1))
+	if(mipmap_level >= static_cast<float>(texels_.size() - 1))
 	{
-		const int resx = images_.at(0).getWidth();
-		const int resy = images_.at(0).getHeight();
-		return images_.at(images_.size() - 1).getColor(math::mod(static_cast<int>(p.x_), resx), math::mod(static_cast<int>(p.y_), resy));
+		return texelColor__(getTexels<T>(texels_.size() - 1)(math::mod(static_cast<int>(p.x_), width_), math::mod(static_cast<int>(p.y_), height_)));
 	}
 
-	const int resx = images_.at(mipmap_level).getWidth();
-	const int resy = images_.at(mipmap_level).getHeight();
+	const TiledImageBuffer2D<T> &texels = getTexels<T>(mipmap_level);
+	const int resx = texels.getWidth();
+	const int resy = texels.getHeight();
 
 	const float xf = (static_cast<float>(resx) * (p.x_ - floor(p.x_))) - 0.5f;
 	const float yf = (static_cast<float>(resy) * (p.y_ - floor(p.y_))) - 0.5f;
@@ -440,7 +504,7 @@ Rgba ImageTexture::ewaEllipticCalculation(const Point3 &p, float ds_0, float dt_
 				const float weight = ewa_weight_lut_[std::min(static_cast<int>(floorf(r_2 * ewa_weight_lut_size_)), ewa_weight_lut_size_ - 1)];
 				const int ismod = math::mod(is, resx);
 				const int itmod = math::mod(it, resy);
-				sum_col += images_.at(mipmap_level).getColor(ismod, itmod) * weight;
+				sum_col += texelColor__(texels(ismod, itmod)) * weight;
 				sum_wts += weight;
 			}
 		}
@@ -465,15 +529,21 @@ void ImageTexture::generateEwaLookupTable()
 	}
 }
 
+#ifdef HAVE_OPENCV
+template <class T> static inline void setTexelColor__(T &texel, const Rgba &col) { texel.setColor(col); }
+static inline void setTexelColor__(Rgb &texel, const Rgba &col) { texel = col; }
+#endif
+
+template <class T>
 void ImageTexture::generateMipMaps()
 {
-	if(images_.empty()) return;
+	if(texels_.empty()) return;
 
 #ifdef HAVE_OPENCV
 	int img_index = 0;
 	//bool blur_seamless = true;
-	int w = images_.at(0).getWidth();
-	int h = images_.at(0).getHeight();
+	int w = width_;
+	int h = height_;
 
 	Y_VERBOSE << "Format: generating mipmaps for texture of resolution [" << w << " x " << h << "]" << YENDL;
 
@@ -484,7 +554,7 @@ void ImageTexture::generateMipMaps()
 	{
 		for(int i = 0; i < w; ++i)
 		{
-			Rgba color = images_[img_index].getColor(i, j);
+			Rgba color = texelColor__(getTexels<T>(img_index)(i, j));
 			a_vec(j, i)[0] = color.getR();
 			a_vec(j, i)[1] = color.getG();
 			a_vec(j, i)[2] = color.getB();
@@ -498,7 +568,7 @@ void ImageTexture::generateMipMaps()
 		int w_2 = (w + 1) / 2;
 		int h_2 = (h + 1) / 2;
 		++img_index;
-		images_.emplace_back(Image{w_2, h_2, images_[img_index - 1].getType(), images_[img_index - 1].getOptimization()});
+		std::shared_ptr<TiledImageBuffer2D<T>> mipmap = std::make_shared<TiledImageBuffer2D<T>>(w_2, h_2);
 
 		const cv::Mat b(h_2, w_2, CV_32FC4);
 		const cv::Mat_<cv::Vec4f> b_vec = b;
@@ -513,9 +583,10 @@ void ImageTexture::generateMipMaps()
 				tmp_col.g_ = b_vec(j, i)[1];
 				tmp_col.b_ = b_vec(j, i)[2];
 				tmp_col.a_ = b_vec(j, i)[3];
-				images_[img_index].setColor(i, j, tmp_col);
+				setTexelColor__((*mipmap)(i, j), tmp_col);
 			}
 		}
+		texels_.push_back(mipmap);
 		w = w_2;
 		h = h_2;
 		Y_DEBUG << "Format: generated mipmap " << img_index << " [" << w_2 << " x " << h_2 << "]" << YENDL;
@@ -595,7 +666,8 @@ Texture *ImageTexture::factory(ParamMap &params, const Scene &scene)
 		return nullptr;
 	}
 
-	ImageTexture *tex = new ImageTexture(static_cast<Image &&>(*image));
+	ImageTexture *tex = new ImageTexture(*image);
+	delete image;
 	if(!tex) //FIXME: this will never be true, replace by exception handling??
 	{
 		Y_ERROR << "ImageTexture: Couldn't create image texture." << YENDL;